@@ -19,23 +19,32 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <hiredis.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 #include "anet.h"
 #include "cluster.h"
+#include "crc16.h"
 #include "zmalloc.h"
 #include "logger.h"
 #include "config.h"
 #include "proxy.h"
+#include "atomicvar.h"
+#include "endianconv.h"
+
+#define CLUSTER_DISCOVERY_TIMEOUT       5000 /* ms */
+#define UNUSED(V) ((void) V)
 
-#define CLUSTER_NODE_KEEPALIVE_INTERVAL 15
+#define CLUSTER_SNAPSHOT_MAGIC          "RCPT"
+#define CLUSTER_SNAPSHOT_VERSION        1
+#define CLUSTER_SNAPSHOT_NODE_REPLICA   (1 << 0)
+
+uint64_t siphash(const uint8_t *in, const size_t inlen, const uint8_t *k);
 #define CLUSTER_PRINT_REPLY_ERROR(n, err) \
     proxyLogErr("Node %s:%d replied with error:\n%s\n", \
                 n->ip, n->port, err);
 
-uint16_t crc16(const char *buf, int len);
-
 /* -----------------------------------------------------------------------------
  * Key space handling
  * -------------------------------------------------------------------------- */
@@ -45,26 +54,37 @@ uint16_t crc16(const char *buf, int len);
  *
  * However if the key contains the {...} pattern, only the part between
  * { and } is hashed. This may be useful in the future to force certain
- * keys to be in the same node (assuming no resharding is in progress). */
-static unsigned int clusterKeyHashSlot(char *key, int keylen) {
-    int s, e; /* start-end indexes of { and } */
+ * keys to be in the same node (assuming no resharding is in progress).
+ *
+ * This function returns the part of the key that must be hashed, storing
+ * its length into 'hashlen'. */
+static char *clusterKeyHashPart(char *key, int keylen, int *hashlen) {
+    char *s, *e; /* start-end pointers of { and } */
 
-    for (s = 0; s < keylen; s++)
-        if (key[s] == '{') break;
+    /* memchr() is usually vectorized by the C library, so it's faster than
+     * scanning the key byte by byte. */
+    s = memchr(key, '{', keylen);
+    *hashlen = keylen;
 
     /* No '{' ? Hash the whole key. This is the base case. */
-    if (s == keylen) return crc16(key,keylen) & 0x3FFF;
+    if (s == NULL) return key;
 
     /* '{' found? Check if we have the corresponding '}'. */
-    for (e = s+1; e < keylen; e++)
-        if (key[e] == '}') break;
+    e = memchr(s+1, '}', keylen - (s - key) - 1);
 
     /* No '}' or nothing between {} ? Hash the whole key. */
-    if (e == keylen || e == s+1) return crc16(key,keylen) & 0x3FFF;
+    if (e == NULL || e == s+1) return key;
 
     /* If we are here there is both a { and a } on its right. Hash
      * what is in the middle between { and }. */
-    return crc16(key+s+1,e-s-1) & 0x3FFF;
+    *hashlen = e-s-1;
+    return s+1;
+}
+
+unsigned int clusterKeyHashSlot(char *key, int keylen) {
+    int hashlen;
+    char *hashpart = clusterKeyHashPart(key, keylen, &hashlen);
+    return crc16(hashpart, hashlen) & 0x3FFF;
 }
 
 static redisClusterConnection *createClusterConnection(void) {
@@ -72,6 +92,13 @@ static redisClusterConnection *createClusterConnection(void) {
     if (conn == NULL) return NULL;
     conn->context = NULL;
     conn->has_read_handler = 0;
+    conn->node = NULL;
+    conn->is_private = 0;
+    conn->owner = NULL;
+    conn->private_connections = NULL;
+    conn->connecting = NULL;
+    conn->handshake_pending = 0;
+    conn->connect_time = 0;
     conn->requests_pending = listCreate();
     if (conn->requests_pending == NULL) {
         zfree(conn);
@@ -91,6 +118,15 @@ static void freeClusterConnection(redisClusterConnection *conn) {
     freeRequestList(conn->requests_to_send);
     redisContext *ctx = conn->context;
     if (ctx != NULL) redisFree(ctx);
+    if (conn->connecting != NULL) redisFree(conn->connecting);
+    if (conn->private_connections != NULL) {
+        listIter li;
+        listNode *ln;
+        listRewind(conn->private_connections, &li);
+        while ((ln = listNext(&li)))
+            freeClusterConnection(ln->value);
+        listRelease(conn->private_connections);
+    }
     zfree(conn);
 }
 
@@ -113,6 +149,21 @@ static int clusterCheckRedisReply(clusterNode *n, redisReply *r, char **err) {
     return 1;
 }
 
+#define CLUSTER_RETIRED_NODE        1
+#define CLUSTER_RETIRED_NODES_LIST  2
+#define CLUSTER_RETIRED_SLOTS_MAP   3
+#define CLUSTER_RETIRED_REPLICAS    4
+#define CLUSTER_RETIRED_OTHER       5
+
+typedef struct clusterRetiredObject {
+    int type;
+    void *ptr;
+    void (*free_method)(void *ptr); /* Only used by CLUSTER_RETIRED_OTHER */
+    uint64_t epoch; /* Epoch starting from which the object is unreachable */
+} clusterRetiredObject;
+
+static void freeClusterNode(clusterNode *node);
+
 redisCluster *createCluster(int numthreads) {
     redisCluster *cluster = zcalloc(sizeof(*cluster));
     if (!cluster) return NULL;
@@ -122,15 +173,270 @@ redisCluster *createCluster(int numthreads) {
         zfree(cluster);
         return NULL;
     }
-    cluster->slots_map = raxNew();
-    if (cluster->slots_map == NULL) {
+    cluster->slots_map = NULL;
+    cluster->retired = listCreate();
+    cluster->thread_epochs = zcalloc(numthreads * sizeof(uint64_t));
+    if (cluster->retired == NULL || cluster->thread_epochs == NULL) {
+        if (cluster->retired) listRelease(cluster->retired);
+        if (cluster->thread_epochs) zfree(cluster->thread_epochs);
         listRelease(cluster->nodes);
         zfree(cluster);
         return NULL;
     }
+    pthread_mutex_init(&(cluster->retired_lock), NULL);
+    cluster->retired_nodes_count = 0;
+    cluster->epoch = 0;
+    cluster->refresh_requested = 0;
     return cluster;
 }
 
+/* Create a new slots map. If 'from' is not NULL, the new map will be a copy
+ * of it, so that it can be modified and then published in place of the
+ * original one. */
+clusterSlotsMap *createClusterSlotsMap(clusterSlotsMap *from) {
+    clusterSlotsMap *map = NULL;
+    if (from != NULL) {
+        map = zmalloc(sizeof(*map));
+        if (map != NULL) memcpy(map, from, sizeof(*map));
+    } else map = zcalloc(sizeof(*map));
+    if (map != NULL) {
+        map->masters = NULL;
+        map->masters_count = 0;
+    }
+    return map;
+}
+
+static void freeClusterSlotsMap(clusterSlotsMap *map) {
+    if (map == NULL) return;
+    if (map->masters != NULL) zfree(map->masters);
+    zfree(map);
+}
+
+/* Fill the masters array of the map with the nodes owning slots, in the
+ * order of their first slot, so that threads can pick a master without
+ * scanning the whole map. */
+static void clusterMapMasters(clusterSlotsMap *map) {
+    clusterNode *last = NULL;
+    int size = 0, slot, i;
+    if (map->masters != NULL) zfree(map->masters);
+    map->masters = NULL;
+    map->masters_count = 0;
+    for (slot = 0; slot < CLUSTER_SLOTS; slot++) {
+        clusterNode *node = map->nodes[slot];
+        if (node == NULL || node == last) continue;
+        last = node;
+        for (i = 0; i < map->masters_count; i++)
+            if (map->masters[i] == node) break;
+        if (i < map->masters_count) continue;
+        if (map->masters_count == size) {
+            size = (size ? size * 2 : 8);
+            map->masters = zrealloc(map->masters,
+                                    size * sizeof(clusterNode *));
+        }
+        map->masters[map->masters_count++] = node;
+    }
+}
+
+/* Add an object to the retired ones. The object will be freed as soon
+ * as every thread will have seen the epoch following the current one.
+ * Must be called with the retired_lock held. */
+static void clusterRetireObject(redisCluster *cluster, int type, void *ptr) {
+    clusterRetiredObject *obj = zmalloc(sizeof(*obj));
+    obj->type = type;
+    obj->ptr = ptr;
+    obj->free_method = NULL;
+    obj->epoch = cluster->epoch + 1;
+    listAddNodeTail(cluster->retired, obj);
+    if (type == CLUSTER_RETIRED_NODE) cluster->retired_nodes_count++;
+}
+
+static void freeRetiredObject(redisCluster *cluster,
+                              clusterRetiredObject *obj)
+{
+    if (obj->type == CLUSTER_RETIRED_NODE) {
+        freeClusterNode(obj->ptr);
+        cluster->retired_nodes_count--;
+    } else if (obj->type == CLUSTER_RETIRED_NODES_LIST) listRelease(obj->ptr);
+    else if (obj->type == CLUSTER_RETIRED_SLOTS_MAP)
+        freeClusterSlotsMap(obj->ptr);
+    else if (obj->type == CLUSTER_RETIRED_REPLICAS) zfree(obj->ptr);
+    else if (obj->type == CLUSTER_RETIRED_OTHER) obj->free_method(obj->ptr);
+    zfree(obj);
+}
+
+static int clusterNodeIsReplicaOf(clusterNode *node, clusterNode *master) {
+    return (node->is_replica && node->replicate != NULL &&
+            master->name != NULL && sdscmp(node->replicate, master->name) == 0);
+}
+
+/* Rebuild the replicas array of every master listed in 'nodes', using only
+ * the replicas that are not failing. Arrays that changed are replaced and
+ * the old ones retired. Must be called with the retired_lock held. */
+static void clusterUpdateReplicas(redisCluster *cluster, list *nodes) {
+    listIter li, ri;
+    listNode *ln, *rn;
+    listRewind(nodes, &li);
+    while ((ln = listNext(&li))) {
+        clusterNode *master = ln->value;
+        clusterReplicas *old = master->replicas, *replicas = NULL;
+        int count = 0, total = 0;
+        if (!master->is_replica) {
+            listRewind(nodes, &ri);
+            while ((rn = listNext(&ri))) {
+                clusterNode *node = rn->value;
+                if (clusterNodeIsReplicaOf(node, master)) {
+                    total++;
+                    if (!(node->flags & CLUSTER_NODE_FAIL)) count++;
+                }
+            }
+        }
+        master->replicas_count = total;
+        if (count > 0) {
+            replicas = zmalloc(sizeof(*replicas) +
+                               count * sizeof(clusterNode *));
+            replicas->count = 0;
+            listRewind(nodes, &ri);
+            while ((rn = listNext(&ri))) {
+                clusterNode *node = rn->value;
+                if (clusterNodeIsReplicaOf(node, master) &&
+                    !(node->flags & CLUSTER_NODE_FAIL))
+                    replicas->nodes[replicas->count++] = node;
+            }
+        }
+        if (old != NULL && replicas != NULL && old->count == count &&
+            memcmp(old->nodes, replicas->nodes,
+                   count * sizeof(clusterNode *)) == 0)
+        {
+            zfree(replicas);
+            continue;
+        }
+        if (old == NULL && replicas == NULL) continue;
+        master->replicas = replicas;
+        if (old != NULL)
+            clusterRetireObject(cluster, CLUSTER_RETIRED_REPLICAS, old);
+    }
+}
+
+/* Atomically replace the slots map and, if 'nodes' is not NULL, the nodes
+ * list of the cluster. The replaced objects and the nodes listed in
+ * 'removed' (if any) are retired, since threads can still be using them.
+ * Must be called with the retired_lock held. */
+static void clusterPublishTopology(redisCluster *cluster, list *nodes,
+                                   clusterSlotsMap *map, list *removed)
+{
+    clusterSlotsMap *old_map = cluster->slots_map;
+    list *old_nodes = cluster->nodes;
+    listIter li;
+    listNode *ln;
+    if (removed != NULL) {
+        /* Flag the nodes before publishing the new topology, so that
+         * remapSlot cannot put them back in the new map. */
+        listRewind(removed, &li);
+        while ((ln = listNext(&li))) {
+            clusterNode *node = ln->value;
+            node->retired = 1;
+            clusterRetireObject(cluster, CLUSTER_RETIRED_NODE, node);
+        }
+    }
+    if (nodes != NULL) clusterUpdateReplicas(cluster, nodes);
+    clusterMapMasters(map);
+    map->version = (old_map != NULL ? old_map->version + 1 : 1);
+    if (nodes != NULL) cluster->nodes = nodes;
+    cluster->slots_map = map;
+    if (old_map != NULL)
+        clusterRetireObject(cluster, CLUSTER_RETIRED_SLOTS_MAP, old_map);
+    if (nodes != NULL && old_nodes != NULL)
+        clusterRetireObject(cluster, CLUSTER_RETIRED_NODES_LIST, old_nodes);
+    cluster->epoch++;
+}
+
+/* Atomically replace the cluster's current slots map with 'map'. Threads
+ * that already fetched the old map can safely keep using it, since it gets
+ * only retired here. */
+void publishClusterSlotsMap(redisCluster *cluster, clusterSlotsMap *map) {
+    pthread_mutex_lock(&(cluster->retired_lock));
+    clusterPublishTopology(cluster, NULL, map, NULL);
+    pthread_mutex_unlock(&(cluster->retired_lock));
+}
+
+/* Retire an object that is not part of the topology but that is read by
+ * the threads in the same way (ie. the commands index): it will be freed
+ * by calling free_method() once no thread can reach it anymore. */
+void retireClusterObject(redisCluster *cluster, void *ptr,
+                         void (*free_method)(void *ptr))
+{
+    pthread_mutex_lock(&(cluster->retired_lock));
+    clusterRetireObject(cluster, CLUSTER_RETIRED_OTHER, ptr);
+    clusterRetiredObject *obj = listLast(cluster->retired)->value;
+    obj->free_method = free_method;
+    cluster->epoch++;
+    pthread_mutex_unlock(&(cluster->retired_lock));
+}
+
+/* Called by every thread when it's not using any topology object, that is
+ * before going to sleep. The first time the thread sees a new epoch, it
+ * detaches itself from the nodes retired in the meantime, and then it
+ * records the epoch, allowing the main thread to free the objects retired
+ * before it. */
+void clusterThreadQuiescentState(redisCluster *cluster, int thread_id) {
+    uint64_t epoch = cluster->epoch, seen = cluster->thread_epochs[thread_id];
+    if (seen == epoch) return;
+    pthread_mutex_lock(&(cluster->retired_lock));
+    listIter li;
+    listNode *ln;
+    listRewind(cluster->retired, &li);
+    while ((ln = listNext(&li))) {
+        clusterRetiredObject *obj = ln->value;
+        if (obj->type == CLUSTER_RETIRED_NODE && obj->epoch > seen)
+            onClusterNodeRetired(obj->ptr, thread_id);
+    }
+    epoch = cluster->epoch;
+    pthread_mutex_unlock(&(cluster->retired_lock));
+    cluster->thread_epochs[thread_id] = epoch;
+}
+
+/* Free the retired objects that cannot be reached by any thread anymore.
+ * Called periodically by the main thread. */
+void freeRetiredClusterObjects(redisCluster *cluster) {
+    uint64_t min_epoch = cluster->epoch;
+    int i;
+    for (i = 0; i < cluster->numthreads; i++) {
+        uint64_t epoch = cluster->thread_epochs[i];
+        if (epoch < min_epoch) min_epoch = epoch;
+    }
+    pthread_mutex_lock(&(cluster->retired_lock));
+    listIter li;
+    listNode *ln;
+    listRewind(cluster->retired, &li);
+    while ((ln = listNext(&li))) {
+        clusterRetiredObject *obj = ln->value;
+        if (obj->epoch > min_epoch) continue;
+        freeRetiredObject(cluster, obj);
+        listDelNode(cluster->retired, ln);
+    }
+    pthread_mutex_unlock(&(cluster->retired_lock));
+}
+
+/* Store into 'nodes' a newly allocated array containing the retired nodes
+ * that have not been freed yet and return their number. The nodes cannot
+ * be freed until the calling thread goes through a quiescent state. */
+int getRetiredClusterNodes(redisCluster *cluster, clusterNode ***nodes) {
+    int count = 0;
+    *nodes = NULL;
+    if (cluster->retired_nodes_count == 0) return 0;
+    pthread_mutex_lock(&(cluster->retired_lock));
+    *nodes = zmalloc(cluster->retired_nodes_count * sizeof(clusterNode *));
+    listIter li;
+    listNode *ln;
+    listRewind(cluster->retired, &li);
+    while ((ln = listNext(&li))) {
+        clusterRetiredObject *obj = ln->value;
+        if (obj->type == CLUSTER_RETIRED_NODE) (*nodes)[count++] = obj->ptr;
+    }
+    pthread_mutex_unlock(&(cluster->retired_lock));
+    return count;
+}
+
 static void freeClusterNode(clusterNode *node) {
     if (node == NULL) return;
     int i;
@@ -146,6 +452,7 @@ static void freeClusterNode(clusterNode *node) {
     if (node->ip) sdsfree(node->ip);
     if (node->name) sdsfree(node->name);
     if (node->replicate) sdsfree(node->replicate);
+    if (node->replicas) zfree(node->replicas);
     if (node->migrating != NULL) {
         for (i = 0; i < node->migrating_count; i++) sdsfree(node->migrating[i]);
         zfree(node->migrating);
@@ -154,7 +461,6 @@ static void freeClusterNode(clusterNode *node) {
         for (i = 0; i < node->importing_count; i++) sdsfree(node->importing[i]);
         zfree(node->importing);
     }
-    zfree(node->slots);
     zfree(node);
 }
 
@@ -171,12 +477,22 @@ static void freeClusterNodes(redisCluster *cluster) {
 }
 
 void freeCluster(redisCluster *cluster) {
-    raxFree(cluster->slots_map);
+    freeClusterSlotsMap(cluster->slots_map);
+    listIter li;
+    listNode *ln;
+    listRewind(cluster->retired, &li);
+    while ((ln = listNext(&li)))
+        freeRetiredObject(cluster, ln->value);
+    listRelease(cluster->retired);
+    pthread_mutex_destroy(&(cluster->retired_lock));
+    zfree(cluster->thread_epochs);
     freeClusterNodes(cluster);
     zfree(cluster);
 }
 
-static clusterNode *createClusterNode(char *ip, int port, redisCluster *c) {
+/* Allocate a node without its per-thread connections: this is enough for
+ * nodes that are just used to hold the info parsed from CLUSTER NODES. */
+static clusterNode *allocClusterNode(char *ip, int port, redisCluster *c) {
     clusterNode *node = zcalloc(sizeof(*node));
     if (!node) return NULL;
     node->cluster = c;
@@ -186,27 +502,33 @@ static clusterNode *createClusterNode(char *ip, int port, redisCluster *c) {
     node->flags = 0;
     node->replicate = NULL;
     node->replicas_count = 0;
-    node->slots = zmalloc(CLUSTER_SLOTS * sizeof(int));
+    node->replicas = NULL;
+    node->config_epoch = 0;
     node->slots_count = 0;
     node->migrating = NULL;
     node->importing = NULL;
     node->migrating_count = 0;
     node->importing_count = 0;
+    node->connections = NULL;
+    node->retired = 0;
+    return node;
+}
+
+static int clusterNodeCreateConnections(clusterNode *node) {
+    redisCluster *c = node->cluster;
     node->connections =
         zcalloc(c->numthreads * sizeof(redisClusterConnection *));
-    if (node->connections == NULL) {
-        freeClusterNode(node);
-        return NULL;
-    }
+    if (node->connections == NULL) return 0;
     int i = 0;
     for(; i < c->numthreads; i++) {
-        node->connections[i] = createClusterConnection();
-        if (node->connections[i] == NULL) {
-            freeClusterNode(node);
-            return NULL;
-        }
+        redisClusterConnection *conn = createClusterConnection();
+        if (conn == NULL) return 0;
+        node->connections[i] = conn;
+        conn->node = node;
+        conn->private_connections = listCreate();
+        if (conn->private_connections == NULL) return 0;
     }
-    return node;
+    return 1;
 }
 
 redisContext *getClusterNodeContext(clusterNode *node, int thread_id) {
@@ -217,22 +539,24 @@ redisContext *getClusterNodeContext(clusterNode *node, int thread_id) {
     return conn->context;
 }
 
-redisContext *clusterNodeConnect(clusterNode *node, int thread_id) {
-    redisContext *ctx = getClusterNodeContext(node, thread_id);
-    if (ctx) {
-        onClusterNodeDisconnection(node, thread_id);
-        redisFree(ctx);
-        ctx = NULL;
-    }
+/* Open a new connection to the node, authenticating it and enabling the
+ * reads on replicas. The connection and the commands are blocking, so they
+ * time out after CLUSTER_NODE_CONNECT_TIMEOUT milliseconds, in order not to
+ * stall the thread on an unreachable node. Return NULL on errors. */
+static redisContext *connectToNode(clusterNode *node) {
     proxyLogDebug("Connecting to node %s:%d\n", node->ip, node->port);
-    ctx = redisConnect(node->ip, node->port);
-    if (ctx->err) {
+    struct timeval timeout = {CLUSTER_NODE_CONNECT_TIMEOUT / 1000,
+                              (CLUSTER_NODE_CONNECT_TIMEOUT % 1000) * 1000};
+    redisContext *ctx = redisConnectWithTimeout(node->ip, node->port,
+                                                timeout);
+    if (ctx == NULL || ctx->err) {
         proxyLogErr("Could not connect to Redis at %s:%d: %s\n",
-                    node->ip, node->port, ctx->errstr);
-        redisFree(ctx);
-        node->connections[thread_id]->context = NULL;
+                    node->ip, node->port,
+                    (ctx ? ctx->errstr : "out of memory"));
+        if (ctx) redisFree(ctx);
         return NULL;
     }
+    redisSetTimeout(ctx, timeout);
     /* Set aggressive KEEP_ALIVE socket option in the Redis context socket
      * in order to prevent timeouts caused by the execution of long
      * commands. At the same time this improves the detection of real
@@ -246,10 +570,41 @@ redisContext *clusterNodeConnect(clusterNode *node, int thread_id) {
             proxyLogErr("Failed to authenticate to %s:%d\n", node->ip,
                         node->port);
             redisFree(ctx);
-            node->connections[thread_id]->context = NULL;
             return NULL;
         }
     }
+    /* Replicas only serve the reads routed to them by the proxy if the
+     * connection is in READONLY mode. */
+    if (node->is_replica) {
+        redisReply *reply = redisCommand(ctx, "READONLY");
+        int ok = clusterCheckRedisReply(node, reply, NULL);
+        if (reply != NULL) freeReplyObject(reply);
+        if (!ok) {
+            proxyLogErr("Failed to send READONLY to %s:%d\n", node->ip,
+                        node->port);
+            redisFree(ctx);
+            return NULL;
+        }
+    }
+    /* The proxy reads replies straight from the reader's buffer, so drop
+     * the replies already consumed by the commands above. */
+    sdsrange(ctx->reader->buf, ctx->reader->pos, -1);
+    ctx->reader->pos = 0;
+    ctx->reader->len = sdslen(ctx->reader->buf);
+    return ctx;
+}
+
+redisContext *clusterNodeConnect(clusterNode *node, int thread_id) {
+    redisContext *ctx = getClusterNodeContext(node, thread_id);
+    /* A connection still being established gets replaced too. */
+    if (ctx || node->connections[thread_id]->connecting)
+        onClusterNodeDisconnection(node, thread_id);
+    if (ctx) {
+        redisFree(ctx);
+        node->connections[thread_id]->context = NULL;
+        node->connections[thread_id]->has_read_handler = 0;
+    }
+    ctx = connectToNode(node);
     node->connections[thread_id]->context = ctx;
     return ctx;
 }
@@ -267,232 +622,900 @@ void clusterNodeDisconnect(clusterNode *node, int thread_id) {
     onClusterNodeDisconnection(node, thread_id);
     redisFree(ctx);
     node->connections[thread_id]->context = NULL;
+    node->connections[thread_id]->has_read_handler = 0;
 }
 
-/* Map to slot into the cluster's radix tree map after converting the slot
- * to bigendian. */
-void mapSlot(redisCluster *cluster, int slot, clusterNode *node) {
-    uint32_t slot_be = htonl(slot);
-    raxInsert(cluster->slots_map, (unsigned char *) &slot_be,
-              sizeof(slot_be), node, NULL);
+/* Open a private connection of the thread to the node, adding it to the
+ * thread's private connections of the node. Return NULL on errors. */
+redisClusterConnection *clusterNodeConnectPrivate(clusterNode *node,
+                                                  int thread_id)
+{
+    redisClusterConnection *shared = node->connections[thread_id];
+    redisClusterConnection *conn = createClusterConnection();
+    if (conn == NULL) return NULL;
+    conn->node = node;
+    conn->is_private = 1;
+    conn->context = connectToNode(node);
+    if (conn->context == NULL ||
+        listAddNodeTail(shared->private_connections, conn) == NULL)
+    {
+        freeClusterConnection(conn);
+        return NULL;
+    }
+    return conn;
 }
 
-int clusterNodeLoadInfo(redisCluster *cluster, clusterNode *node, list *friends,
-                        redisContext *ctx)
+/* Close and free a private connection. Its requests must have been
+ * already handled by the caller. */
+void clusterNodeDisconnectPrivate(redisClusterConnection *conn,
+                                  int thread_id)
 {
-    int success = 1, free_ctx = 0;
-    redisReply *reply =  NULL;
-    if (ctx == NULL) {
-        ctx = redisConnect(node->ip, node->port);
-        if (ctx->err) {
-            fprintf(stderr, "Could not connect to Redis at %s:%d: %s\n",
-                    node->ip, node->port, ctx->errstr);
-            redisFree(ctx);
-            return 0;
+    redisClusterConnection *shared = conn->node->connections[thread_id];
+    listNode *ln = listSearchKey(shared->private_connections, conn);
+    if (ln != NULL) listDelNode(shared->private_connections, ln);
+    freeClusterConnection(conn);
+}
+
+/* Slot ownership bitmap of the nodes. */
+
+void clusterNodeAddSlot(clusterNode *node, int slot) {
+    if (slot < 0 || slot >= CLUSTER_SLOTS) return;
+    unsigned char bit = 1 << (slot & 7);
+    if (node->slots[slot >> 3] & bit) return;
+    node->slots[slot >> 3] |= bit;
+    node->slots_count++;
+}
+
+int clusterNodeOwnsSlot(clusterNode *node, int slot) {
+    if (slot < 0 || slot >= CLUSTER_SLOTS) return 0;
+    return (node->slots[slot >> 3] & (1 << (slot & 7))) != 0;
+}
+
+/* Store into 'ranges' a newly allocated array containing the slot ranges
+ * owned by the node as pairs of start and stop slots (both inclusive).
+ * Return the number of ranges. The bitmap is scanned a 64 bits word at
+ * a time, so that empty or completely owned areas are skipped quickly. */
+int clusterNodeGetSlotRanges(clusterNode *node, int **ranges) {
+    int count = 0, size = 0, start = -1, slot = 0;
+    *ranges = NULL;
+    while (slot <= CLUSTER_SLOTS) {
+        int owned = 0;
+        if (slot < CLUSTER_SLOTS) {
+            if ((slot & 63) == 0) {
+                uint64_t word;
+                memcpy(&word, node->slots + (slot >> 3), sizeof(word));
+                if ((word == 0 && start < 0) ||
+                    (word == UINT64_MAX && start >= 0)) {
+                    slot += 64;
+                    continue;
+                }
+            }
+            owned = clusterNodeOwnsSlot(node, slot);
+        }
+        if (owned && start < 0) start = slot;
+        else if (!owned && start >= 0) {
+            if (count == size) {
+                size = (size ? size * 2 : 8);
+                *ranges = zrealloc(*ranges, size * 2 * sizeof(int));
+            }
+            (*ranges)[count * 2] = start;
+            (*ranges)[(count * 2) + 1] = slot - 1;
+            count++;
+            start = -1;
         }
-        free_ctx = 1;
+        slot++;
     }
-    reply = redisCommand(ctx, "CLUSTER NODES");
-    success = (reply != NULL);
-    if (!success) goto cleanup;
-    success = (reply->type != REDIS_REPLY_ERROR);
-    if (!success) {
-        fprintf(stderr, "Failed to retrieve cluster configuration.\n");
-        fprintf(stderr, "Cluster node %s:%d replied with error:\n%s\n",
-                node->ip, node->port, reply->str);
-        goto cleanup;
+    return count;
+}
+
+static void mapSlot(clusterSlotsMap *map, int slot, clusterNode *node) {
+    if (slot < 0 || slot >= CLUSTER_SLOTS) return;
+    map->nodes[slot] = node;
+}
+
+/* Parse a single line of the CLUSTER NODES output and return a new node
+ * (without connections) containing the parsed info, or NULL if the line
+ * is invalid. If 'myself' is not NULL, it's set to 1 when the line
+ * describes the node that generated the output. Migrating and importing
+ * slots are only listed in this line. */
+static clusterNode *parseClusterNodesLine(redisCluster *cluster, char *line,
+                                          int *myself)
+{
+    char *name = NULL, *addr = NULL, *flags = NULL, *master_id = NULL,
+         *config_epoch = NULL, *p;
+    int i = 0;
+    while ((p = strchr(line, ' ')) != NULL) {
+        *p = '\0';
+        char *token = line;
+        line = p + 1;
+        switch(i++){
+        case 0: name = token; break;
+        case 1: addr = token; break;
+        case 2: flags = token; break;
+        case 3: master_id = token; break;
+        case 6: config_epoch = token; break;
+        }
+        if (i == 8) break; // Slots
+    }
+    if (!flags) {
+        proxyLogErr("Invalid CLUSTER NODES reply: missing flags.\n");
+        return NULL;
     }
-    char *lines = reply->str, *p, *line;
-    while ((p = strstr(lines, "\n")) != NULL) {
+    if (addr == NULL) {
+        proxyLogErr("Invalid CLUSTER NODES reply: missing addr.\n");
+        return NULL;
+    }
+    if (myself) *myself = (strstr(flags, "myself") != NULL);
+    char *ip = "";
+    int port = 0;
+    char *paddr = strrchr(addr, ':');
+    if (paddr != NULL) {
+        *paddr = '\0';
+        ip = addr;
+        addr = paddr + 1;
+        /* If internal bus is specified, then just drop it. */
+        if ((paddr = strchr(addr, '@')) != NULL) *paddr = '\0';
+        port = atoi(addr);
+    }
+    clusterNode *node = allocClusterNode(ip, port, cluster);
+    if (node == NULL) return NULL;
+    if (name != NULL) node->name = sdsnew(name);
+    node->is_replica = (strstr(flags, "slave") != NULL ||
+                       (master_id != NULL && master_id[0] != '-'));
+    if (node->is_replica && master_id != NULL && master_id[0] != '-')
+        node->replicate = sdsnew(master_id);
+    if (strstr(flags, "fail") != NULL) node->flags |= CLUSTER_NODE_FAIL;
+    if (config_epoch != NULL)
+        node->config_epoch = strtoull(config_epoch, NULL, 10);
+    if (i < 8) return node;
+    int remaining = strlen(line);
+    while (remaining > 0) {
+        p = strchr(line, ' ');
+        if (p == NULL) p = line + remaining;
+        remaining -= (p - line);
+
+        char *slotsdef = line;
         *p = '\0';
-        line = lines;
-        lines = p + 1;
-        char *name = NULL, *addr = NULL, *flags = NULL, *master_id = NULL;
-        int i = 0;
-        while ((p = strchr(line, ' ')) != NULL) {
-            *p = '\0';
-            char *token = line;
+        if (remaining) {
             line = p + 1;
-            switch(i++){
-            case 0: name = token; break;
-            case 1: addr = token; break;
-            case 2: flags = token; break;
-            case 3: master_id = token; break;
+            remaining--;
+        } else line = p;
+        char *dash = NULL;
+        if (slotsdef[0] == '[') {
+            slotsdef++;
+            if ((p = strstr(slotsdef, "->-"))) { // Migrating
+                *p = '\0';
+                p += 3;
+                char *closing_bracket = strchr(p, ']');
+                if (closing_bracket) *closing_bracket = '\0';
+                sds slot = sdsnew(slotsdef);
+                sds dst = sdsnew(p);
+                node->migrating_count += 2;
+                node->migrating =
+                    zrealloc(node->migrating,
+                        (node->migrating_count * sizeof(sds)));
+                node->migrating[node->migrating_count - 2] = slot;
+                node->migrating[node->migrating_count - 1] = dst;
+            }  else if ((p = strstr(slotsdef, "-<-"))) {//Importing
+                *p = '\0';
+                p += 3;
+                char *closing_bracket = strchr(p, ']');
+                if (closing_bracket) *closing_bracket = '\0';
+                sds slot = sdsnew(slotsdef);
+                sds src = sdsnew(p);
+                node->importing_count += 2;
+                node->importing = zrealloc(node->importing,
+                    (node->importing_count * sizeof(sds)));
+                node->importing[node->importing_count - 2] = slot;
+                node->importing[node->importing_count - 1] = src;
             }
-            if (i == 8) break; // Slots
+        } else if ((dash = strchr(slotsdef, '-')) != NULL) {
+            p = dash;
+            int start, stop;
+            *p = '\0';
+            start = atoi(slotsdef);
+            stop = atoi(p + 1);
+            while (start <= stop) clusterNodeAddSlot(node, start++);
+        } else if (p > slotsdef) {
+            clusterNodeAddSlot(node, atoi(slotsdef));
         }
-        if (!flags) {
-            fprintf(stderr, "Invalid CLUSTER NODES reply: missing flags.\n");
-            success = 0;
-            goto cleanup;
+    }
+    return node;
+}
+
+static void freeSdsArray(sds *array, int count) {
+    int i;
+    if (array == NULL) return;
+    for (i = 0; i < count; i++) sdsfree(array[i]);
+    zfree(array);
+}
+
+/* Replace the migrating and importing slots of the node with the ones
+ * parsed from the node's own line of CLUSTER NODES. */
+static void clusterNodeUpdateMigrationInfo(clusterNode *node,
+                                           clusterNode *info)
+{
+    freeSdsArray(node->migrating, node->migrating_count);
+    freeSdsArray(node->importing, node->importing_count);
+    node->migrating = info->migrating;
+    node->migrating_count = info->migrating_count;
+    node->importing = info->importing;
+    node->importing_count = info->importing_count;
+    info->migrating = info->importing = NULL;
+    info->migrating_count = info->importing_count = 0;
+}
+
+/* Return 1 if the node described by 'info' is a master while 'node' is a
+ * replica, or vice versa. */
+static int clusterNodeRoleChanged(clusterNode *node, clusterNode *info) {
+    return node->is_replica != info->is_replica;
+}
+
+/* Update a node with the info parsed from CLUSTER NODES ('info' is left
+ * empty and can be then freed). Only the fields that the threads don't
+ * read are updated, so the node must have the same role of 'info' (see
+ * clusterNodeRoleChanged). Return 1 if the master, the flags or the owned
+ * slots of the node changed, 0 otherwise. */
+static int clusterNodeUpdateInfo(clusterNode *node, clusterNode *info) {
+    int changed = (node->flags != info->flags ||
+                   node->slots_count != info->slots_count ||
+                   memcmp(node->slots, info->slots, sizeof(node->slots)));
+    if (!changed && (node->replicate == NULL) != (info->replicate == NULL))
+        changed = 1;
+    if (!changed && node->replicate != NULL &&
+        sdscmp(node->replicate, info->replicate) != 0) changed = 1;
+    if (node->name == NULL) {
+        node->name = info->name;
+        info->name = NULL;
+    }
+    if (node->replicate) sdsfree(node->replicate);
+    node->replicate = info->replicate;
+    info->replicate = NULL;
+    node->flags = info->flags;
+    node->config_epoch = info->config_epoch;
+    memcpy(node->slots, info->slots, sizeof(node->slots));
+    node->slots_count = info->slots_count;
+    /* Migrating and importing slots are only reported by the node itself,
+     * so keep the current ones if the info was fetched from another node. */
+    if (info->migrating != NULL || info->importing != NULL)
+        clusterNodeUpdateMigrationInfo(node, info);
+    return changed;
+}
+
+/* Map all the slots owned by the node into the slots map. */
+static void clusterNodeMapSlots(clusterNode *node, clusterSlotsMap *map) {
+    int slot;
+    if (node->slots_count == 0) return;
+    for (slot = 0; slot < CLUSTER_SLOTS; slot++) {
+        if (clusterNodeOwnsSlot(node, slot)) mapSlot(map, slot, node);
+    }
+}
+
+static clusterNode *searchNodeByName(list *nodes, sds name) {
+    listIter li;
+    listNode *ln;
+    if (name == NULL) return NULL;
+    listRewind(nodes, &li);
+    while ((ln = listNext(&li))) {
+        clusterNode *node = ln->value;
+        if (node->name && sdscmp(node->name, name) == 0) return node;
+    }
+    return NULL;
+}
+
+/* Fill the migration table of 'map', whose slots must be already mapped,
+ * using the migrating and importing slots reported by the nodes listed in
+ * 'nodes'. A slot is considered migrating only if it's still owned by the
+ * source node. Since every node reports only its own migrations and not all
+ * the nodes are queried at every refresh, the importing nodes learned from
+ * ASK redirections are taken from 'current' (if not NULL) when the nodes
+ * involved didn't change. */
+static void clusterMapMigrations(list *nodes, clusterSlotsMap *map,
+                                 clusterSlotsMap *current)
+{
+    listIter li;
+    listNode *ln;
+    int i, slot;
+    memset(map->importing, 0, sizeof(map->importing));
+    if (current != NULL) {
+        for (slot = 0; slot < CLUSTER_SLOTS; slot++) {
+            clusterNode *importing = current->importing[slot];
+            if (importing == NULL || importing->retired ||
+                current->nodes[slot] != map->nodes[slot]) continue;
+            if (listSearchKey(nodes, importing) == NULL) continue;
+            map->importing[slot] = importing;
+        }
+    }
+    listRewind(nodes, &li);
+    while ((ln = listNext(&li))) {
+        clusterNode *node = ln->value;
+        for (i = 0; i < node->migrating_count; i += 2) {
+            slot = atoi(node->migrating[i]);
+            if (slot < 0 || slot >= CLUSTER_SLOTS) continue;
+            clusterNode *dst = searchNodeByName(nodes, node->migrating[i + 1]);
+            if (dst != NULL && map->nodes[slot] == node)
+                map->importing[slot] = dst;
         }
-        if (addr == NULL) {
-            fprintf(stderr, "Invalid CLUSTER NODES reply: missing addr.\n");
+        for (i = 0; i < node->importing_count; i += 2) {
+            slot = atoi(node->importing[i]);
+            if (slot < 0 || slot >= CLUSTER_SLOTS) continue;
+            clusterNode *src = searchNodeByName(nodes, node->importing[i + 1]);
+            if (src != NULL && map->nodes[slot] == src)
+                map->importing[slot] = node;
+        }
+    }
+}
+
+/* Update the cluster's topology using the output of CLUSTER NODES fetched
+ * from any node of the cluster ('from_ip' is the IP address of the queried
+ * node, if known). The new topology is diffed against the
+ * current one: nodes having the same name and address are kept (with all
+ * their connections), new nodes are added and missing nodes are retired.
+ * If something changed, a new nodes list and a new slots map are built and
+ * published atomically, and 'changed' is set to 1.
+ * This must be called only by the main thread. Return 1 on success, 0 if
+ * the reply could not be parsed. */
+int updateClusterConfiguration(redisCluster *cluster, char *nodes_reply,
+                               char *from_ip, int *changed)
+{
+    int success = 1, updated = 0;
+    list *parsed = listCreate(), *nodes = listCreate(), *removed = listCreate();
+    list *current = cluster->nodes;
+    clusterSlotsMap *map = createClusterSlotsMap(NULL);
+    char *lines = nodes_reply, *p, *line;
+    listIter li;
+    listNode *ln;
+    *changed = 0;
+    while ((p = strchr(lines, '\n')) != NULL) {
+        *p = '\0';
+        line = lines;
+        lines = p + 1;
+        if (*line == '\0') continue;
+        clusterNode *info = parseClusterNodesLine(cluster, line, NULL);
+        if (info == NULL) {
             success = 0;
             goto cleanup;
         }
-        int myself = (strstr(flags, "myself") != NULL);
-        char *ip = NULL;
-        int port = 0;
-        char *paddr = strchr(addr, ':');
-        if (paddr != NULL) {
-            *paddr = '\0';
-            ip = addr;
-            addr = paddr + 1;
-            /* If internal bus is specified, then just drop it. */
-            if ((paddr = strchr(addr, '@')) != NULL) *paddr = '\0';
-            port = atoi(addr);
+        /* Skip nodes without address (ie. during handshake). */
+        if (info->port == 0 || info->name == NULL) {
+            freeClusterNode(info);
+            continue;
         }
-        if (myself) {
-            if (node->ip == NULL && ip != NULL) {
-                node->ip = ip;
-                node->port = port;
-            }
+        /* Old Redis versions can omit the IP of the queried node. */
+        if (sdslen(info->ip) == 0 && from_ip != NULL)
+            info->ip = sdscat(info->ip, from_ip);
+        listAddNodeTail(parsed, info);
+    }
+    if (listLength(parsed) == 0) {
+        proxyLogErr("Invalid CLUSTER NODES reply: no nodes.\n");
+        success = 0;
+        goto cleanup;
+    }
+    listRewind(parsed, &li);
+    while ((ln = listNext(&li))) {
+        clusterNode *info = ln->value;
+        clusterNode *node = searchNodeByName(current, info->name);
+        if (node != NULL && (node->port != info->port ||
+                             strcmp(node->ip, info->ip) != 0)) node = NULL;
+        /* The threads read the role of the nodes, so a node whose role
+         * changed is replaced by a new one, while the old one is retired
+         * like the removed nodes. */
+        int replaced = (node != NULL && clusterNodeRoleChanged(node, info));
+        if (replaced) {
+            proxyLogInfo("Cluster node %s:%d is now a %s\n", node->ip,
+                         node->port, info->is_replica ? "replica" : "master");
+            node = NULL;
+        }
+        if (node != NULL) {
+            if (clusterNodeUpdateInfo(node, info)) updated = 1;
         } else {
-            if (friends == NULL) continue;
-            clusterNode *friend = createClusterNode(ip, port, cluster);
-            if (friend == NULL) {
+            if (!clusterNodeCreateConnections(info)) {
                 success = 0;
                 goto cleanup;
             }
-            listAddNodeTail(friends, friend);
-            continue;
-        }
-        if (name != NULL && node->name == NULL) node->name = sdsnew(name);
-        node->is_replica = (strstr(flags, "slave") != NULL ||
-                           (master_id != NULL && master_id[0] != '-'));
-        if (i == 8) {
-            int remaining = strlen(line);
-            while (remaining > 0) {
-                p = strchr(line, ' ');
-                if (p == NULL) p = line + remaining;
-                remaining -= (p - line);
-
-                char *slotsdef = line;
-                *p = '\0';
-                if (remaining) {
-                    line = p + 1;
-                    remaining--;
-                } else line = p;
-                char *dash = NULL;
-                if (slotsdef[0] == '[') {
-                    slotsdef++;
-                    if ((p = strstr(slotsdef, "->-"))) { // Migrating
-                        *p = '\0';
-                        p += 3;
-                        char *closing_bracket = strchr(p, ']');
-                        if (closing_bracket) *closing_bracket = '\0';
-                        sds slot = sdsnew(slotsdef);
-                        sds dst = sdsnew(p);
-                        node->migrating_count += 2;
-                        node->migrating =
-                            zrealloc(node->migrating,
-                                (node->migrating_count * sizeof(sds)));
-                        node->migrating[node->migrating_count - 2] =
-                            slot;
-                        node->migrating[node->migrating_count - 1] =
-                            dst;
-                    }  else if ((p = strstr(slotsdef, "-<-"))) {//Importing
-                        *p = '\0';
-                        p += 3;
-                        char *closing_bracket = strchr(p, ']');
-                        if (closing_bracket) *closing_bracket = '\0';
-                        sds slot = sdsnew(slotsdef);
-                        sds src = sdsnew(p);
-                        node->importing_count += 2;
-                        node->importing = zrealloc(node->importing,
-                            (node->importing_count * sizeof(sds)));
-                        node->importing[node->importing_count - 2] =
-                            slot;
-                        node->importing[node->importing_count - 1] =
-                            src;
-                    }
-                } else if ((dash = strchr(slotsdef, '-')) != NULL) {
-                    p = dash;
-                    int start, stop;
-                    *p = '\0';
-                    start = atoi(slotsdef);
-                    stop = atoi(p + 1);
-                    mapSlot(cluster, start, node);
-                    mapSlot(cluster, stop, node);
-                    while (start <= stop) {
-                        int slot = start++;
-                        node->slots[node->slots_count++] = slot;
-                    }
-                } else if (p > slotsdef) {
-                    int slot = atoi(slotsdef);
-                    node->slots[node->slots_count++] = slot;
-                    mapSlot(cluster, slot, node);
-                }
+            node = info;
+            ln->value = NULL;
+            updated = 1;
+            /* Don't log all the nodes while loading the first topology. */
+            if (listLength(current) > 0 && !replaced) {
+                proxyLogInfo("Cluster node %s:%d (%s) added\n", node->ip,
+                             node->port,
+                             node->is_replica ? "replica" : "master");
             }
         }
+        listAddNodeTail(nodes, node);
+        clusterNodeMapSlots(node, map);
+    }
+    listRewind(current, &li);
+    while ((ln = listNext(&li))) {
+        clusterNode *node = ln->value;
+        if (listSearchKey(nodes, node) != NULL) continue;
+        clusterNode *replacement = searchNodeByName(nodes, node->name);
+        if (replacement == NULL || replacement->port != node->port ||
+            strcmp(replacement->ip, node->ip) != 0)
+            proxyLogInfo("Cluster node %s:%d removed\n", node->ip,
+                         node->port);
+        listAddNodeTail(removed, node);
+        updated = 1;
     }
+    clusterSlotsMap *current_map = cluster->slots_map;
+    clusterMapMigrations(nodes, map, current_map);
+    if (!updated && current_map != NULL &&
+        memcmp(current_map->nodes, map->nodes, sizeof(map->nodes)) == 0 &&
+        memcmp(current_map->importing, map->importing,
+               sizeof(map->importing)) == 0)
+        goto cleanup;
+    pthread_mutex_lock(&(cluster->retired_lock));
+    clusterPublishTopology(cluster, nodes, map, removed);
+    pthread_mutex_unlock(&(cluster->retired_lock));
+    nodes = NULL;
+    map = NULL;
+    *changed = 1;
 cleanup:
-    if (free_ctx) redisFree(ctx);
-    freeReplyObject(reply);
+    listRewind(parsed, &li);
+    while ((ln = listNext(&li))) {
+        if (ln->value != NULL) freeClusterNode(ln->value);
+    }
+    listRelease(parsed);
+    if (nodes) {
+        /* The list has not been published, so free the new nodes. */
+        listRewind(nodes, &li);
+        while ((ln = listNext(&li))) {
+            if (listSearchKey(current, ln->value) == NULL)
+                freeClusterNode(ln->value);
+        }
+        listRelease(nodes);
+    }
+    listRelease(removed);
+    freeClusterSlotsMap(map);
     return success;
 }
 
+/* State of the connection used to verify a node during the discovery. */
+typedef struct clusterDiscoveryLink {
+    clusterNode *node;
+    redisContext *ctx;
+    int auth_pending;
+    int *pending;   /* Number of links still waiting for a reply. */
+} clusterDiscoveryLink;
+
+static void closeDiscoveryLink(aeEventLoop *el, clusterDiscoveryLink *link) {
+    if (link->ctx == NULL) return;
+    aeDeleteFileEvent(el, link->ctx->fd, AE_READABLE | AE_WRITABLE);
+    redisFree(link->ctx);
+    link->ctx = NULL;
+    (*link->pending)--;
+}
+
+/* Compare the node's own view of its slots with the one of the entry node
+ * and take the migrating and importing slots, since they're only reported
+ * by the node itself. */
+static void verifyDiscoveredNode(clusterNode *node, char *nodes_reply) {
+    char *lines = nodes_reply, *p, *line;
+    while ((p = strchr(lines, '\n')) != NULL) {
+        *p = '\0';
+        line = lines;
+        lines = p + 1;
+        int myself = 0;
+        clusterNode *info = parseClusterNodesLine(node->cluster, line,
+                                                  &myself);
+        if (info == NULL) break;
+        if (myself) {
+            if (info->is_replica != node->is_replica ||
+                memcmp(info->slots, node->slots, sizeof(node->slots)))
+            {
+                proxyLogWarn("Node %s:%d has a different configuration, "
+                             "it will be refreshed soon\n",
+                             node->ip, node->port);
+                node->cluster->refresh_requested = 1;
+            }
+            clusterNodeUpdateMigrationInfo(node, info);
+            freeClusterNode(info);
+            break;
+        }
+        freeClusterNode(info);
+    }
+}
+
+static void readDiscoveryReply(aeEventLoop *el, int fd, void *privdata,
+                               int mask)
+{
+    UNUSED(fd);
+    UNUSED(mask);
+    clusterDiscoveryLink *link = privdata;
+    clusterNode *node = link->node;
+    redisContext *ctx = link->ctx;
+    void *_reply = NULL;
+    if (redisBufferRead(ctx) != REDIS_OK) {
+        proxyLogWarn("Could not connect to Redis at %s:%d: %s\n",
+                     node->ip, node->port, ctx->errstr);
+        closeDiscoveryLink(el, link);
+        return;
+    }
+    while (link->ctx != NULL &&
+           redisReaderGetReply(ctx->reader, &_reply) == REDIS_OK)
+    {
+        redisReply *reply = _reply;
+        if (reply == NULL) return;
+        if (reply->type == REDIS_REPLY_ERROR) {
+            CLUSTER_PRINT_REPLY_ERROR(node, reply->str);
+            closeDiscoveryLink(el, link);
+        } else if (link->auth_pending) {
+            link->auth_pending = 0;
+        } else {
+            if (reply->type == REDIS_REPLY_STRING)
+                verifyDiscoveredNode(node, reply->str);
+            closeDiscoveryLink(el, link);
+        }
+        freeReplyObject(reply);
+    }
+    if (link->ctx != NULL) closeDiscoveryLink(el, link);
+}
+
+static void writeDiscoveryQuery(aeEventLoop *el, int fd, void *privdata,
+                                int mask)
+{
+    UNUSED(mask);
+    clusterDiscoveryLink *link = privdata;
+    int done = 0;
+    if (redisBufferWrite(link->ctx, &done) != REDIS_OK) {
+        proxyLogWarn("Could not connect to Redis at %s:%d: %s\n",
+                     link->node->ip, link->node->port, link->ctx->errstr);
+        closeDiscoveryLink(el, link);
+        return;
+    }
+    if (!done) return;
+    aeDeleteFileEvent(el, fd, AE_WRITABLE);
+    if (aeCreateFileEvent(el, fd, AE_READABLE, readDiscoveryReply, link) ==
+        AE_ERR) closeDiscoveryLink(el, link);
+}
+
+static int discoveryTimeout(aeEventLoop *el, long long id, void *privdata) {
+    UNUSED(id);
+    int *timedout = privdata;
+    *timedout = 1;
+    aeStop(el);
+    return AE_NOMORE;
+}
+
+/* Query all the nodes of the topology, but 'entry', concurrently using a
+ * temporary event loop, in order to verify their configuration. Nodes that
+ * don't reply within 'timeout' milliseconds are just reported. */
+static void verifyClusterConfiguration(redisCluster *cluster,
+                                       clusterNode *entry, long long timeout)
+{
+    list *nodes = cluster->nodes;
+    int count = listLength(nodes), pending = 0, timedout = 0, i = 0;
+    clusterDiscoveryLink *links = zcalloc(count * sizeof(*links));
+    /* Just a few descriptors are already open during the startup. */
+    aeEventLoop *el = aeCreateEventLoop(128 + (count * 2));
+    listIter li;
+    listNode *ln;
+    listRewind(nodes, &li);
+    while ((ln = listNext(&li))) {
+        clusterNode *node = ln->value;
+        clusterDiscoveryLink *link = links + (i++);
+        link->node = node;
+        link->pending = &pending;
+        if (node == entry) continue;
+        redisContext *ctx = redisConnectNonBlock(node->ip, node->port);
+        if (ctx == NULL || ctx->err) {
+            proxyLogWarn("Could not connect to Redis at %s:%d: %s\n",
+                         node->ip, node->port,
+                         (ctx ? ctx->errstr : "out of memory"));
+            if (ctx) redisFree(ctx);
+            continue;
+        }
+        link->ctx = ctx;
+        link->auth_pending = (config.auth != NULL);
+        if (config.auth) redisAppendCommand(ctx, "AUTH %s", config.auth);
+        redisAppendCommand(ctx, "CLUSTER NODES");
+        pending++;
+        if (aeCreateFileEvent(el, ctx->fd, AE_WRITABLE, writeDiscoveryQuery,
+                              link) == AE_ERR) closeDiscoveryLink(el, link);
+    }
+    if (pending > 0) aeCreateTimeEvent(el, timeout, discoveryTimeout,
+                                       &timedout, NULL);
+    while (pending > 0 && !timedout) aeProcessEvents(el, AE_ALL_EVENTS);
+    for (i = 0; i < count; i++) {
+        clusterDiscoveryLink *link = links + i;
+        if (link->ctx == NULL) continue;
+        proxyLogWarn("Node %s:%d did not reply in time\n",
+                     link->node->ip, link->node->port);
+        closeDiscoveryLink(el, link);
+    }
+    aeDeleteEventLoop(el);
+    zfree(links);
+}
+
+/* Fetch the cluster's configuration at startup. The whole topology is built
+ * from the CLUSTER NODES output of the entry node, then all the other nodes
+ * are queried concurrently in order to verify it, within a global deadline
+ * of CLUSTER_DISCOVERY_TIMEOUT milliseconds. */
 int fetchClusterConfiguration(redisCluster *cluster, char *ip, int port,
                               char *hostsocket)
 {
     printf("Fetching cluster configuration...\n");
-    int success = 1;
+    int success = 1, changed = 0;
     redisContext *ctx = NULL;
-    list *friends = NULL;
+    redisReply *reply = NULL;
+    struct timeval timeout = {CLUSTER_DISCOVERY_TIMEOUT / 1000,
+                              (CLUSTER_DISCOVERY_TIMEOUT % 1000) * 1000};
     if (hostsocket == NULL)
-        ctx = redisConnect(ip, port);
+        ctx = redisConnectWithTimeout(ip, port, timeout);
     else
-        ctx = redisConnectUnix(hostsocket);
-    if (ctx->err) {
+        ctx = redisConnectUnixWithTimeout(hostsocket, timeout);
+    if (ctx == NULL || ctx->err) {
         fprintf(stderr, "Could not connect to Redis at ");
         if (hostsocket == NULL)
-            fprintf(stderr,"%s:%d: %s\n", ip, port, ctx->errstr);
-        else fprintf(stderr,"%s: %s\n", hostsocket, ctx->errstr);
-        redisFree(ctx);
-        return 0;
+            fprintf(stderr,"%s:%d: %s\n", ip, port,
+                    (ctx ? ctx->errstr : "out of memory"));
+        else fprintf(stderr,"%s: %s\n", hostsocket,
+                     (ctx ? ctx->errstr : "out of memory"));
+        success = 0;
+        goto cleanup;
     }
-    clusterNode *firstNode = createClusterNode(ip, port, cluster);
-    if (!firstNode) {success = 0; goto cleanup;}
-    listAddNodeTail(cluster->nodes, firstNode);
-    friends = listCreate();
-    success = (friends != NULL);
-    if (!success) goto cleanup;
-    success = clusterNodeLoadInfo(cluster, firstNode, friends, ctx);
+    redisSetTimeout(ctx, timeout);
+    if (config.auth) {
+        reply = redisCommand(ctx, "AUTH %s", config.auth);
+        success = (reply != NULL && reply->type != REDIS_REPLY_ERROR);
+        if (reply != NULL) freeReplyObject(reply);
+        reply = NULL;
+        if (!success) {
+            fprintf(stderr, "Failed to authenticate to the cluster\n");
+            goto cleanup;
+        }
+    }
+    reply = redisCommand(ctx, "CLUSTER NODES");
+    success = (reply != NULL && reply->type == REDIS_REPLY_STRING);
+    if (!success) {
+        fprintf(stderr, "Failed to retrieve cluster configuration.\n");
+        if (reply != NULL && reply->type == REDIS_REPLY_ERROR)
+            fprintf(stderr, "Cluster node replied with error:\n%s\n",
+                    reply->str);
+        else if (reply == NULL) fprintf(stderr, "%s\n", ctx->errstr);
+        goto cleanup;
+    }
+    success = updateClusterConfiguration(cluster, reply->str, ip, &changed);
     if (!success) goto cleanup;
+    clusterNode *entry = NULL;
+    if (hostsocket == NULL) entry = searchNodeByAddress(cluster, ip, port);
+    verifyClusterConfiguration(cluster, entry, CLUSTER_DISCOVERY_TIMEOUT);
+    /* The other nodes reported their own migrating and importing slots. */
+    clusterSlotsMap *map = createClusterSlotsMap(cluster->slots_map);
+    clusterMapMigrations(cluster->nodes, map, NULL);
+    if (memcmp(map->importing, cluster->slots_map->importing,
+               sizeof(map->importing)) != 0)
+        publishClusterSlotsMap(cluster, map);
+    else freeClusterSlotsMap(map);
+cleanup:
+    if (ctx) redisFree(ctx);
+    if (reply) freeReplyObject(reply);
+    if (!success) freeCluster(cluster);
+    return success;
+}
+
+/* -----------------------------------------------------------------------------
+ * Topology snapshot
+ *
+ * The last known topology can be saved into a small binary file, so that
+ * a restarted proxy can start serving requests immediately, while the
+ * topology gets verified against the live cluster in background.
+ * Every integer is stored in little endian byte order. The format is:
+ *
+ *   "RCPT" | version (u32) | epoch (u64) | nodes count (u32) | nodes...
+ *   | checksum (u64, SipHash of all the previous bytes)
+ *
+ * where every node is:
+ *
+ *   name | ip | port (u32) | flags (u8) | master name | config epoch (u64)
+ *   | ranges count (u32) | ranges as start (u16) and stop (u16) slots
+ *
+ * and every string is stored as its length (u16) followed by its bytes.
+ * -------------------------------------------------------------------------- */
+
+static const uint8_t clusterSnapshotKey[16] = {0};
+
+static sds snapshotAppendInt(sds buf, uint64_t value, int size) {
+    unsigned char bytes[8];
+    int i;
+    for (i = 0; i < size; i++) bytes[i] = (value >> (i * 8)) & 0xff;
+    return sdscatlen(buf, bytes, size);
+}
+
+static sds snapshotAppendString(sds buf, char *str) {
+    size_t len = (str ? strlen(str) : 0);
+    buf = snapshotAppendInt(buf, len, 2);
+    return sdscatlen(buf, str, len);
+}
+
+typedef struct clusterSnapshotReader {
+    unsigned char *p;
+    unsigned char *end;
+} clusterSnapshotReader;
+
+static int snapshotReadInt(clusterSnapshotReader *r, uint64_t *value,
+                           int size)
+{
+    int i;
+    if (r->end - r->p < size) return 0;
+    *value = 0;
+    for (i = 0; i < size; i++) *value |= ((uint64_t) r->p[i]) << (i * 8);
+    r->p += size;
+    return 1;
+}
+
+static int snapshotReadString(clusterSnapshotReader *r, sds *str) {
+    uint64_t len;
+    if (!snapshotReadInt(r, &len, 2) || r->end - r->p < (long) len) return 0;
+    *str = sdsnewlen(r->p, len);
+    r->p += len;
+    return 1;
+}
+
+/* Save the current topology into 'filename'. The snapshot is written into
+ * a temporary file that is then renamed, so that a crash never leaves a
+ * truncated snapshot. Return 1 on success, 0 on failure. */
+int saveClusterSnapshot(redisCluster *cluster, char *filename) {
+    list *nodes = cluster->nodes;
+    uint64_t epoch = 0;
     listIter li;
     listNode *ln;
-    listRewind(friends, &li);
+    listRewind(nodes, &li);
     while ((ln = listNext(&li))) {
-        clusterNode *friend = ln->value;
-        success = clusterNodeLoadInfo(cluster, friend, NULL, NULL);
-        if (!success) {
-            listDelNode(friends, ln);
-            freeClusterNode(friend);
+        clusterNode *node = ln->value;
+        if (node->config_epoch > epoch) epoch = node->config_epoch;
+    }
+    sds buf = sdsnew(CLUSTER_SNAPSHOT_MAGIC);
+    buf = snapshotAppendInt(buf, CLUSTER_SNAPSHOT_VERSION, 4);
+    buf = snapshotAppendInt(buf, epoch, 8);
+    buf = snapshotAppendInt(buf, listLength(nodes), 4);
+    listRewind(nodes, &li);
+    while ((ln = listNext(&li))) {
+        clusterNode *node = ln->value;
+        int *ranges = NULL, count, i;
+        buf = snapshotAppendString(buf, node->name);
+        buf = snapshotAppendString(buf, node->ip);
+        buf = snapshotAppendInt(buf, node->port, 4);
+        buf = snapshotAppendInt(buf, (node->is_replica ?
+                                      CLUSTER_SNAPSHOT_NODE_REPLICA : 0), 1);
+        buf = snapshotAppendString(buf, node->replicate);
+        buf = snapshotAppendInt(buf, node->config_epoch, 8);
+        count = clusterNodeGetSlotRanges(node, &ranges);
+        buf = snapshotAppendInt(buf, count, 4);
+        for (i = 0; i < count * 2; i++)
+            buf = snapshotAppendInt(buf, ranges[i], 2);
+        zfree(ranges);
+    }
+    uint64_t checksum = siphash((uint8_t *) buf, sdslen(buf),
+                                clusterSnapshotKey);
+    buf = snapshotAppendInt(buf, checksum, 8);
+    sds tmpfile = sdscatprintf(sdsempty(), "%s.tmp-%d", filename,
+                               (int) getpid());
+    int success = 0;
+    int fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1) {
+        success = (write(fd, buf, sdslen(buf)) == (ssize_t) sdslen(buf) &&
+                   fsync(fd) == 0);
+        success = (close(fd) == 0 && success);
+        if (success) success = (rename(tmpfile, filename) == 0);
+        if (!success) unlink(tmpfile);
+    }
+    if (!success) {
+        proxyLogWarn("Failed to save the cluster snapshot to %s: %s\n",
+                     filename, strerror(errno));
+    } else {
+        proxyLogDebug("Cluster snapshot saved to %s\n", filename);
+    }
+    sdsfree(tmpfile);
+    sdsfree(buf);
+    return success;
+}
+
+/* Load the topology saved into 'filename' and publish it. Nothing is
+ * changed if the file is missing or invalid. Return 1 on success, 0 on
+ * failure. */
+int loadClusterSnapshot(redisCluster *cluster, char *filename) {
+    int success = 0;
+    char *errmsg = "invalid snapshot";
+    sds buf = sdsempty();
+    list *nodes = listCreate();
+    clusterSlotsMap *map = createClusterSlotsMap(NULL);
+    clusterSnapshotReader r;
+    uint64_t value = 0, count = 0, epoch = 0, checksum = 0, i;
+    listIter li;
+    listNode *ln;
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        errmsg = strerror(errno);
+        goto cleanup;
+    }
+    char chunk[4096];
+    size_t nread;
+    while ((nread = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+        buf = sdscatlen(buf, chunk, nread);
+    fclose(fp);
+    size_t len = sdslen(buf);
+    if (len < 28 || memcmp(buf, CLUSTER_SNAPSHOT_MAGIC, 4) != 0) goto cleanup;
+    r.p = (unsigned char *) buf + len - 8;
+    r.end = (unsigned char *) buf + len;
+    snapshotReadInt(&r, &checksum, 8);
+    if (checksum != siphash((uint8_t *) buf, len - 8, clusterSnapshotKey)) {
+        errmsg = "wrong checksum";
+        goto cleanup;
+    }
+    r.p = (unsigned char *) buf + 4;
+    r.end = (unsigned char *) buf + len - 8;
+    snapshotReadInt(&r, &value, 4);
+    if (value != CLUSTER_SNAPSHOT_VERSION) {
+        errmsg = "unsupported version";
+        goto cleanup;
+    }
+    if (!snapshotReadInt(&r, &epoch, 8) || !snapshotReadInt(&r, &count, 4))
+        goto cleanup;
+    for (i = 0; i < count; i++) {
+        sds name = NULL, ip = NULL, replicate = NULL;
+        uint64_t port, flags, config_epoch, ranges, j;
+        int ok = (snapshotReadString(&r, &name) &&
+                  snapshotReadString(&r, &ip) &&
+                  snapshotReadInt(&r, &port, 4) &&
+                  snapshotReadInt(&r, &flags, 1) &&
+                  snapshotReadString(&r, &replicate) &&
+                  snapshotReadInt(&r, &config_epoch, 8) &&
+                  snapshotReadInt(&r, &ranges, 4));
+        clusterNode *node = NULL;
+        if (ok) node = allocClusterNode(ip, port, cluster);
+        if (ip) sdsfree(ip);
+        if (node == NULL) {
+            if (name) sdsfree(name);
+            if (replicate) sdsfree(replicate);
             goto cleanup;
         }
-        listAddNodeTail(cluster->nodes, friend);
+        node->name = name;
+        if (sdslen(replicate) > 0) node->replicate = replicate;
+        else sdsfree(replicate);
+        node->is_replica = (flags & CLUSTER_SNAPSHOT_NODE_REPLICA) != 0;
+        node->config_epoch = config_epoch;
+        listAddNodeTail(nodes, node);
+        for (j = 0; j < ranges; j++) {
+            uint64_t start, stop;
+            if (!snapshotReadInt(&r, &start, 2) ||
+                !snapshotReadInt(&r, &stop, 2)) goto cleanup;
+            while (start <= stop) clusterNodeAddSlot(node, start++);
+        }
+        if (!clusterNodeCreateConnections(node)) goto cleanup;
+        clusterNodeMapSlots(node, map);
     }
+    if (r.p != r.end || count == 0) goto cleanup;
+    pthread_mutex_lock(&(cluster->retired_lock));
+    clusterPublishTopology(cluster, nodes, map, NULL);
+    pthread_mutex_unlock(&(cluster->retired_lock));
+    nodes = NULL;
+    map = NULL;
+    success = 1;
+    proxyLogDebug("Loaded cluster snapshot with epoch %llu\n", epoch);
 cleanup:
-    redisFree(ctx);
-    if (friends) listRelease(friends);
-    if (!success) freeCluster(cluster);
+    if (!success) {
+        proxyLogWarn("Could not load the cluster snapshot from %s: %s\n",
+                     filename, errmsg);
+    }
+    if (nodes != NULL) {
+        listRewind(nodes, &li);
+        while ((ln = listNext(&li))) freeClusterNode(ln->value);
+        listRelease(nodes);
+    }
+    freeClusterSlotsMap(map);
+    sdsfree(buf);
     return success;
 }
 
+/* Lookup the node owning the slot into the current slots map. No lock is
+ * needed: after being published, the single-slot entries of the map are
+ * only ever replaced atomically (see remapSlot). */
 clusterNode *searchNodeBySlot(redisCluster *cluster, int slot) {
-    clusterNode *node = NULL;
-    raxIterator iter;
-    raxStart(&iter, cluster->slots_map);
-    int slot_be = htonl(slot);
-    if (!raxSeek(&iter, ">=", (unsigned char*) &slot_be, sizeof(slot_be))) {
-        proxyLogErr("Failed to seek cluster node into slots map.\n");
-        raxStop(&iter);
-        return NULL;
-    }
-    if (raxNext(&iter)) node = (clusterNode *) iter.data;
-    raxStop(&iter);
-    return node;
+    clusterSlotsMap *map = cluster->slots_map;
+    if (map == NULL || slot < 0 || slot >= CLUSTER_SLOTS) return NULL;
+    return map->nodes[slot];
 }
 
 clusterNode *getNodeByKey(redisCluster *cluster, char *key, int keylen,
@@ -505,15 +1528,374 @@ clusterNode *getNodeByKey(redisCluster *cluster, char *key, int keylen,
     return node;
 }
 
+/* Return the node owning every slot between 'start' and 'stop' (both
+ * inclusive) or NULL if the slots are owned by different nodes or if
+ * some of them are not mapped. */
+clusterNode *searchNodeBySlotRange(redisCluster *cluster, int start,
+                                   int stop)
+{
+    clusterSlotsMap *map = cluster->slots_map;
+    if (map == NULL || start < 0 || stop >= CLUSTER_SLOTS || start > stop)
+        return NULL;
+    clusterNode *node = map->nodes[start];
+    int slot;
+    for (slot = start + 1; slot <= stop && node != NULL; slot++)
+        if (map->nodes[slot] != node) node = NULL;
+    return node;
+}
+
+clusterNode *searchNodeByAddress(redisCluster *cluster, char *ip, int port) {
+    listIter li;
+    listNode *ln;
+    listRewind(cluster->nodes, &li);
+    while ((ln = listNext(&li))) {
+        clusterNode *node = ln->value;
+        if (node->port == port && node->ip && strcmp(node->ip, ip) == 0)
+            return node;
+    }
+    return NULL;
+}
+
+/* Atomically assign a single slot of the current slots map to 'node'.
+ * Threads reading the map concurrently will see either the old or the
+ * new node. */
+void remapSlot(redisCluster *cluster, int slot, clusterNode *node) {
+    clusterSlotsMap *map = cluster->slots_map;
+    if (map == NULL || slot < 0 || slot >= CLUSTER_SLOTS) return;
+    /* Nodes are flagged as retired before the publication of the map that
+     * doesn't contain them anymore, so they can't leak into that map. */
+    if (node->retired) return;
+    atomicSet(map->nodes[slot], node);
+    /* The slot is not being migrated anymore (or it's not migrating to
+     * the node we knew). */
+    atomicSet(map->importing[slot], NULL);
+}
+
+/* Return the node the slot is being migrated to, or NULL if the slot is
+ * not migrating. */
+clusterNode *getSlotImportingNode(redisCluster *cluster, int slot) {
+    clusterSlotsMap *map = cluster->slots_map;
+    if (map == NULL || slot < 0 || slot >= CLUSTER_SLOTS) return NULL;
+    return map->importing[slot];
+}
+
+/* Atomically record into the current slots map that the slot is being
+ * migrated to 'node', as learned by an ASK redirection. */
+void setSlotImportingNode(redisCluster *cluster, int slot, clusterNode *node) {
+    clusterSlotsMap *map = cluster->slots_map;
+    if (map == NULL || slot < 0 || slot >= CLUSTER_SLOTS) return;
+    if (node->retired || map->importing[slot] == node) return;
+    atomicSet(map->importing[slot], node);
+}
+
+/* Batch version of getNodeByKey: compute the slot and the node of every
+ * key of a request in a single pass. Keys are the arguments at the
+ * indexes contained in 'keys', whose positions inside 'buffer' are
+ * described by 'offsets' and 'lengths' (the same arrays used by
+ * clientRequest). Slots and nodes are stored respectively into 'slots'
+ * and 'nodes', that must have room for 'numkeys' elements.
+ * CRCs are computed by crc16Multi, so that the hashing of different keys
+ * can overlap. All the keys are looked up in the same slots map.
+ * Return 1 if every key is mapped to a node, 0 otherwise. */
+int getNodesByKeys(redisCluster *cluster, char *buffer, int *offsets,
+                   int *lengths, int *keys, int numkeys, int *slots,
+                   clusterNode **nodes)
+{
+    const char *parts_buf[CLUSTER_KEYS_BATCH_SIZE];
+    int lens_buf[CLUSTER_KEYS_BATCH_SIZE];
+    uint16_t crcs_buf[CLUSTER_KEYS_BATCH_SIZE];
+    clusterSlotsMap *map = cluster->slots_map;
+    int i, j, mapped = 1;
+    for (i = 0; i < numkeys; i += CLUSTER_KEYS_BATCH_SIZE) {
+        int count = numkeys - i;
+        if (count > CLUSTER_KEYS_BATCH_SIZE) count = CLUSTER_KEYS_BATCH_SIZE;
+        for (j = 0; j < count; j++) {
+            int argidx = keys[i + j];
+            parts_buf[j] = clusterKeyHashPart(buffer + offsets[argidx],
+                                              lengths[argidx], lens_buf + j);
+        }
+        crc16Multi(parts_buf, lens_buf, crcs_buf, count);
+        for (j = 0; j < count; j++) {
+            int slot = crcs_buf[j] & 0x3FFF;
+            clusterNode *node = (map != NULL ? map->nodes[slot] : NULL);
+            slots[i + j] = slot;
+            nodes[i + j] = node;
+            if (node == NULL) mapped = 0;
+        }
+    }
+    return mapped;
+}
+
 clusterNode *getFirstMappedNode(redisCluster *cluster) {
+    clusterSlotsMap *map = cluster->slots_map;
+    int slot;
+    if (map == NULL) return NULL;
+    for (slot = 0; slot < CLUSTER_SLOTS; slot++)
+        if (map->nodes[slot] != NULL) return map->nodes[slot];
+    return NULL;
+}
+
+/* Return the master at position 'index' (modulo their number) among the
+ * masters owning slots, so that requests that can be served by any master
+ * can be spread across all of them. */
+clusterNode *getMappedNodeAt(redisCluster *cluster, unsigned int index) {
+    clusterSlotsMap *map = cluster->slots_map;
+    if (map == NULL || map->masters_count == 0) return NULL;
+    return map->masters[index % map->masters_count];
+}
+
+/* Store into 'nodes' (allocated by the function, to be freed by the caller)
+ * the masters owning slots, sorted by their first slot. Returns the number
+ * of masters. */
+int getMappedNodes(redisCluster *cluster, clusterNode ***nodes) {
+    clusterSlotsMap *map = cluster->slots_map;
+    *nodes = NULL;
+    if (map == NULL || map->masters_count == 0) return 0;
+    size_t size = map->masters_count * sizeof(clusterNode *);
+    *nodes = zmalloc(size);
+    memcpy(*nodes, map->masters, size);
+    return map->masters_count;
+}
+
+#ifdef REDIS_TEST
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include "rax.h"
+
+#define CLUSTER_TEST_LOOKUPS 10000000
+
+static long long clusterTestUstime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long) tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+/* Lookup through a radix tree keyed by big-endian slots containing only the
+ * first and last slot of every range, like the slots map used to be. */
+static clusterNode *clusterTestRaxLookup(rax *slots_map, int slot) {
     clusterNode *node = NULL;
     raxIterator iter;
-    raxStart(&iter, cluster->slots_map);
-    if (!raxSeek(&iter, "^", NULL, 0)) {
-        raxStop(&iter);
-        return NULL;
-    }
-    if (raxNext(&iter)) node = (clusterNode *) iter.data;
+    raxStart(&iter, slots_map);
+    uint32_t slot_be = htonl(slot);
+    if (raxSeek(&iter, ">=", (unsigned char*) &slot_be, sizeof(slot_be)) &&
+        raxNext(&iter)) node = (clusterNode *) iter.data;
     raxStop(&iter);
     return node;
 }
+
+static int clusterTestSlotsLookup(int masters, int *slots) {
+    redisCluster *cluster = createCluster(1);
+    clusterSlotsMap *map = createClusterSlotsMap(NULL);
+    rax *legacy = raxNew();
+    clusterNode **nodes = zcalloc(masters * sizeof(clusterNode *));
+    int i, errors = 0;
+    for (i = 0; i < masters; i++) {
+        int start = (CLUSTER_SLOTS * i) / masters,
+            stop = ((CLUSTER_SLOTS * (i + 1)) / masters) - 1, slot;
+        uint32_t start_be = htonl(start), stop_be = htonl(stop);
+        nodes[i] = zcalloc(sizeof(clusterNode));
+        raxInsert(legacy, (unsigned char *) &start_be, sizeof(start_be),
+                  nodes[i], NULL);
+        raxInsert(legacy, (unsigned char *) &stop_be, sizeof(stop_be),
+                  nodes[i], NULL);
+        for (slot = start; slot <= stop; slot++) mapSlot(map, slot, nodes[i]);
+    }
+    publishClusterSlotsMap(cluster, map);
+    for (i = 0; i < CLUSTER_SLOTS; i++) {
+        if (clusterTestRaxLookup(legacy, i) != searchNodeBySlot(cluster, i))
+            errors++;
+    }
+    uintptr_t checksum = 0;
+    long long start = clusterTestUstime();
+    for (i = 0; i < CLUSTER_TEST_LOOKUPS; i++)
+        checksum += (uintptr_t) clusterTestRaxLookup(legacy, slots[i]);
+    long long rax_elapsed = clusterTestUstime() - start;
+    start = clusterTestUstime();
+    for (i = 0; i < CLUSTER_TEST_LOOKUPS; i++)
+        checksum -= (uintptr_t) searchNodeBySlot(cluster, slots[i]);
+    long long map_elapsed = clusterTestUstime() - start;
+    printf("%d masters: rax %.2f ns/lookup, slots map %.2f ns/lookup "
+           "(%s)\n", masters,
+           (double) rax_elapsed * 1000 / CLUSTER_TEST_LOOKUPS,
+           (double) map_elapsed * 1000 / CLUSTER_TEST_LOOKUPS,
+           (checksum == 0 && errors == 0 ? "OK" : "MISMATCH"));
+    for (i = 0; i < masters; i++) zfree(nodes[i]);
+    zfree(nodes);
+    raxFree(legacy);
+    freeCluster(cluster);
+    return errors + (checksum != 0);
+}
+
+/* Compare getNodeByKey called for every key and getNodesByKeys on
+ * requests with 10 to 1000 keys of 100 bytes. */
+static int clusterTestNodesByKeys(void) {
+    redisCluster *cluster = createCluster(1);
+    clusterSlotsMap *map = createClusterSlotsMap(NULL);
+    clusterNode *nodes[3];
+    int i, numkeys, errors = 0, keylen = 100, maxkeys = 1000;
+    for (i = 0; i < 3; i++) nodes[i] = zcalloc(sizeof(clusterNode));
+    for (i = 0; i < CLUSTER_SLOTS; i++)
+        mapSlot(map, i, nodes[(i * 3) / CLUSTER_SLOTS]);
+    publishClusterSlotsMap(cluster, map);
+    char *buffer = zmalloc(maxkeys * (keylen + 1));
+    int *offsets = zmalloc(maxkeys * sizeof(int)),
+        *lengths = zmalloc(maxkeys * sizeof(int)),
+        *keys = zmalloc(maxkeys * sizeof(int)),
+        *slots = zmalloc(maxkeys * sizeof(int));
+    clusterNode **keynodes = zmalloc(maxkeys * sizeof(clusterNode *));
+    for (i = 0; i < maxkeys; i++) {
+        char *key = buffer + (i * (keylen + 1));
+        int j;
+        for (j = 0; j < keylen; j++) key[j] = 'a' + (rand() % 26);
+        key[keylen] = '\n';
+        offsets[i] = key - buffer;
+        lengths[i] = keylen;
+        keys[i] = i;
+    }
+    for (numkeys = 10; numkeys <= maxkeys; numkeys *= 10) {
+        int iterations = 1000000 / numkeys, n;
+        long long start = clusterTestUstime();
+        for (n = 0; n < iterations; n++) {
+            for (i = 0; i < numkeys; i++) {
+                keynodes[i] = getNodeByKey(cluster, buffer + offsets[i],
+                                           lengths[i], slots + i);
+            }
+        }
+        long long single = clusterTestUstime() - start;
+        start = clusterTestUstime();
+        for (n = 0; n < iterations; n++) {
+            getNodesByKeys(cluster, buffer, offsets, lengths, keys, numkeys,
+                           slots, keynodes);
+        }
+        long long batch = clusterTestUstime() - start;
+        for (i = 0; i < numkeys; i++) {
+            int slot = clusterKeyHashSlot(buffer + offsets[i], lengths[i]);
+            if (slots[i] != slot || keynodes[i] != map->nodes[slot]) errors++;
+        }
+        printf("%d keys: getNodeByKey %.2f us, getNodesByKeys %.2f us "
+               "per request\n", numkeys, (double) single / iterations,
+               (double) batch / iterations);
+    }
+    zfree(buffer);
+    zfree(offsets);
+    zfree(lengths);
+    zfree(keys);
+    zfree(slots);
+    zfree(keynodes);
+    for (i = 0; i < 3; i++) zfree(nodes[i]);
+    freeCluster(cluster);
+    return errors;
+}
+
+/* Check slot ranges against the slots bitmap of a node owning random
+ * slots, plus some full and empty 64 slots blocks. */
+static int clusterTestSlotRanges(void) {
+    redisCluster *cluster = createCluster(1);
+    clusterSlotsMap *map = createClusterSlotsMap(NULL);
+    clusterNode *node = zcalloc(sizeof(*node)),
+                *other = zcalloc(sizeof(*other));
+    int i, errors = 0, *ranges = NULL, count, owned = 0;
+    for (i = 0; i < CLUSTER_SLOTS; i++) {
+        int block = i / 64;
+        int own = (block % 3 == 0 ? 1 : (block % 3 == 1 ? 0 : rand() & 1));
+        if (own) clusterNodeAddSlot(node, i);
+        mapSlot(map, i, (own ? node : other));
+    }
+    clusterNodeAddSlot(node, 0);
+    publishClusterSlotsMap(cluster, map);
+    count = clusterNodeGetSlotRanges(node, &ranges);
+    for (i = 0; i < count; i++) {
+        int start = ranges[i * 2], stop = ranges[(i * 2) + 1], slot;
+        if (searchNodeBySlotRange(cluster, start, stop) != node) errors++;
+        if (start > 0 && clusterNodeOwnsSlot(node, start - 1)) errors++;
+        if (stop < CLUSTER_SLOTS - 1 && clusterNodeOwnsSlot(node, stop + 1))
+            errors++;
+        for (slot = start; slot <= stop; slot++)
+            if (!clusterNodeOwnsSlot(node, slot)) errors++;
+        owned += stop - start + 1;
+    }
+    if (owned != node->slots_count) errors++;
+    if (searchNodeBySlotRange(cluster, 0, CLUSTER_SLOTS - 1) != NULL) errors++;
+    printf("Slot ranges: %s\n", errors ? "FAILED" : "OK");
+    zfree(ranges);
+    zfree(node);
+    zfree(other);
+    freeCluster(cluster);
+    return errors;
+}
+
+/* The original byte by byte implementation of clusterKeyHashSlot. */
+static unsigned int clusterTestKeyHashSlot(char *key, int keylen) {
+    int s, e;
+    for (s = 0; s < keylen; s++)
+        if (key[s] == '{') break;
+    if (s == keylen) return crc16(key,keylen) & 0x3FFF;
+    for (e = s+1; e < keylen; e++)
+        if (key[e] == '}') break;
+    if (e == keylen || e == s+1) return crc16(key,keylen) & 0x3FFF;
+    return crc16(key+s+1,e-s-1) & 0x3FFF;
+}
+
+/* Check clusterKeyHashSlot against the original implementation for every
+ * key up to 8 bytes made of '{', '}' and two other characters, so that
+ * every combination of hash tag positions is covered. */
+static int clusterTestHashSlots(void) {
+    const char alphabet[] = {'{', '}', 'a', '\0'};
+    char key[8];
+    int len, errors = 0;
+    for (len = 0; len <= (int) sizeof(key); len++) {
+        long combinations = 1L << (2 * len), n;
+        for (n = 0; n < combinations; n++) {
+            int i;
+            for (i = 0; i < len; i++) key[i] = alphabet[(n >> (2 * i)) & 3];
+            if (clusterKeyHashSlot(key, len) !=
+                clusterTestKeyHashSlot(key, len)) errors++;
+        }
+    }
+    printf("Key hash slot equivalence: %s\n", errors ? "FAILED" : "OK");
+    return errors;
+}
+
+/* Masters must be reported once, in the order of their first slot, even
+ * when their slots are not contiguous. */
+static int clusterTestMappedNodes(void) {
+    redisCluster *cluster = createCluster(1);
+    clusterSlotsMap *map = createClusterSlotsMap(NULL);
+    clusterNode *nodes[3], **mapped = NULL;
+    int i, count, errors = 0;
+    for (i = 0; i < 3; i++) nodes[i] = zcalloc(sizeof(clusterNode));
+    for (i = 0; i < CLUSTER_SLOTS; i++) {
+        if (i < 100) continue;
+        mapSlot(map, i, nodes[2 - (i / 1000) % 3]);
+    }
+    publishClusterSlotsMap(cluster, map);
+    count = getMappedNodes(cluster, &mapped);
+    if (count != 3) errors++;
+    for (i = 0; i < count && i < 3; i++)
+        if (mapped[i] != nodes[2 - i]) errors++;
+    for (i = 0; i < 6; i++)
+        if (getMappedNodeAt(cluster, i) != nodes[2 - (i % 3)]) errors++;
+    printf("Mapped nodes: %s\n", (errors == 0 ? "OK" : "MISMATCH"));
+    zfree(mapped);
+    for (i = 0; i < 3; i++) zfree(nodes[i]);
+    freeCluster(cluster);
+    return errors;
+}
+
+int clusterTest(int argc, char *argv[]) {
+    ((void) argc);
+    ((void) argv);
+    int i, errors = 0;
+    crc16Init();
+    errors += clusterTestHashSlots();
+    errors += clusterTestSlotRanges();
+    int *slots = zmalloc(CLUSTER_TEST_LOOKUPS * sizeof(int));
+    for (i = 0; i < CLUSTER_TEST_LOOKUPS; i++) slots[i] = rand() % CLUSTER_SLOTS;
+    errors += clusterTestSlotsLookup(3, slots);
+    errors += clusterTestSlotsLookup(100, slots);
+    zfree(slots);
+    errors += clusterTestNodesByKeys();
+    errors += clusterTestMappedNodes();
+    return errors != 0;
+}
+#endif
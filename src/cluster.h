@@ -20,21 +20,58 @@
 
 #include "sds.h"
 #include "adlist.h"
-#include "rax.h"
+#include <stdint.h>
 #include <pthread.h>
 #include <hiredis.h>
 
 #define CLUSTER_SLOTS 16384
+#define CLUSTER_KEYS_BATCH_SIZE 16
+#define CLUSTER_NODE_KEEPALIVE_INTERVAL 15
+#define CLUSTER_NODE_CONNECT_TIMEOUT 1000 /* ms */
+
+#define CLUSTER_NODE_FAIL   (1 << 0) /* Node flagged as failing (or possibly
+                                      * failing) by the cluster. */
 
 struct redisCluster;
+struct clusterNode;
+struct client;
 
+/* Every thread has a connection to every node, shared by all of its
+ * clients, and can open private connections to the node, that are used by
+ * a single client at a time (see the transactions in proxy.c). */
 typedef struct redisClusterConnection {
     redisContext *context;
     list *requests_to_send;
     list *requests_pending;
     int has_read_handler;
+    struct clusterNode *node;
+    int is_private;
+    struct client *owner;       /* Client using the private connection, NULL
+                                 * if it's idle. */
+    list *private_connections;  /* Private connections of the thread to the
+                                 * node (shared connections only). */
+    redisContext *connecting;   /* Connection being established without
+                                 * blocking the thread (see the standby
+                                 * connections in proxy.c). */
+    int handshake_pending;      /* Replies to AUTH/READONLY still to be read
+                                 * from 'connecting'. */
+    long long connect_time;     /* Deadline (ms) of 'connecting' or, after a
+                                 * failed connection, time (ms) before which
+                                 * the node is not connected again. */
 } redisClusterConnection;
 
+/* Replicas of a master that can serve reads. The array is never modified
+ * once assigned to the master: it's replaced atomically and retired when
+ * the replicas change, like the other topology objects. */
+typedef struct clusterReplicas {
+    int count;
+    struct clusterNode *nodes[];
+} clusterReplicas;
+
+/* Nodes are read by the threads without locks, so the address and the role
+ * (is_replica) of a published node never change: a node whose role changes
+ * is replaced by a new one. The other fields, excepted the connections of
+ * every thread and the replicas array, are only used by the main thread. */
 typedef struct clusterNode {
     redisClusterConnection **connections;
     struct redisCluster *cluster;
@@ -44,9 +81,12 @@ typedef struct clusterNode {
     int flags;
     sds replicate;  /* Master ID if node is a replica */
     int is_replica;
-    int *slots;
+    uint64_t config_epoch;
+    unsigned char slots[CLUSTER_SLOTS/8]; /* Bitmap of the slots owned by
+                                           * the node. */
     int slots_count;
     int replicas_count;
+    clusterReplicas *_Atomic replicas; /* Healthy replicas (masters only) */
     sds *migrating; /* An array of sds where even strings are slots and odd
                      * strings are the destination node IDs. */
     sds *importing; /* An array of sds where even strings are slots and odd
@@ -54,24 +94,91 @@ typedef struct clusterNode {
     int migrating_count; /* Length of the migrating array (migrating slots*2) */
     int importing_count; /* Length of the importing array (importing slots*2) */
     pthread_mutex_t connection_mutex;
+    _Atomic int retired; /* Node has been removed from the topology. */
 } clusterNode;
 
+/* Dense slot -> master node table. Threads read it without any lock.
+ * Topology changes build a new map (usually starting from a copy of the
+ * current one) and publish it atomically, while replaced maps are retired
+ * and freed later, when they cannot be used anymore. The only in-place
+ * changes allowed on a published map are the atomic replacement of a
+ * single slot's node (see remapSlot), used to follow MOVED redirections,
+ * and of a single slot's importing node (see setSlotImportingNode), used
+ * to follow ASK redirections. Such changes don't update the masters
+ * array, that is fixed by the refresh they trigger. */
+typedef struct clusterSlotsMap {
+    uint64_t version;
+    clusterNode *nodes[CLUSTER_SLOTS];
+    clusterNode *importing[CLUSTER_SLOTS]; /* Node the slot is being migrated
+                                            * to, NULL if not migrating. */
+    clusterNode **masters;  /* Masters owning slots, sorted by their first
+                             * slot. Set when the map is published. */
+    int masters_count;
+} clusterSlotsMap;
+
+/* The topology of the cluster (the nodes list and the slots map) is only
+ * changed by the main thread, that publishes new lists and maps atomically.
+ * Replaced objects are retired and freed only when every thread has gone
+ * through a quiescent state (see clusterThreadQuiescentState) after their
+ * retirement, so threads never need to lock anything in order to read the
+ * topology. Threads must not keep pointers to topology objects across
+ * quiescent states, excepted for the nodes referenced by queued requests:
+ * retired nodes are detached by every thread before being freed. */
 typedef struct redisCluster {
-    list *nodes;
-    rax  *slots_map;
+    list *_Atomic nodes;
+    clusterSlotsMap *_Atomic slots_map;
     int numthreads;
+    list *retired;                  /* Retired topology objects. */
+    pthread_mutex_t retired_lock;
+    _Atomic int retired_nodes_count;
+    _Atomic uint64_t epoch;         /* Incremented at every retirement. */
+    _Atomic uint64_t *thread_epochs;/* Last epoch seen by every thread. */
+    _Atomic int refresh_requested;  /* Ask the main thread to refresh the
+                                     * topology as soon as possible. */
 } redisCluster;
 
 redisCluster *createCluster(int numthreads);
 void freeCluster(redisCluster *cluster);
+clusterSlotsMap *createClusterSlotsMap(clusterSlotsMap *from);
+void publishClusterSlotsMap(redisCluster *cluster, clusterSlotsMap *map);
 int fetchClusterConfiguration(redisCluster *cluster, char *ip, int port,
                               char *hostsocket);
+int updateClusterConfiguration(redisCluster *cluster, char *nodes_reply,
+                               char *from_ip, int *changed);
+int saveClusterSnapshot(redisCluster *cluster, char *filename);
+int loadClusterSnapshot(redisCluster *cluster, char *filename);
+void retireClusterObject(redisCluster *cluster, void *ptr,
+                         void (*free_method)(void *ptr));
+void clusterThreadQuiescentState(redisCluster *cluster, int thread_id);
+void freeRetiredClusterObjects(redisCluster *cluster);
+int getRetiredClusterNodes(redisCluster *cluster, clusterNode ***nodes);
 redisContext *getClusterNodeContext(clusterNode *node, int thread_id);
 redisContext *clusterNodeConnect(clusterNode *node, int thread_id);
 redisContext *clusterNodeConnectAtomic(clusterNode *node, int thread_id);
 void clusterNodeDisconnect(clusterNode *node, int thread_id);
+redisClusterConnection *clusterNodeConnectPrivate(clusterNode *node,
+                                                  int thread_id);
+void clusterNodeDisconnectPrivate(redisClusterConnection *conn,
+                                  int thread_id);
+unsigned int clusterKeyHashSlot(char *key, int keylen);
 clusterNode *searchNodeBySlot(redisCluster *cluster, int slot);
 clusterNode *getNodeByKey(redisCluster *cluster, char *key, int keylen,
                           int *getslot);
+void clusterNodeAddSlot(clusterNode *node, int slot);
+int clusterNodeOwnsSlot(clusterNode *node, int slot);
+int clusterNodeGetSlotRanges(clusterNode *node, int **ranges);
+clusterNode *searchNodeBySlotRange(redisCluster *cluster, int start, int stop);
+clusterNode *searchNodeByAddress(redisCluster *cluster, char *ip, int port);
+void remapSlot(redisCluster *cluster, int slot, clusterNode *node);
+clusterNode *getSlotImportingNode(redisCluster *cluster, int slot);
+void setSlotImportingNode(redisCluster *cluster, int slot, clusterNode *node);
+int getNodesByKeys(redisCluster *cluster, char *buffer, int *offsets,
+                   int *lengths, int *keys, int numkeys, int *slots,
+                   clusterNode **nodes);
 clusterNode *getFirstMappedNode(redisCluster *cluster);
+clusterNode *getMappedNodeAt(redisCluster *cluster, unsigned int index);
+int getMappedNodes(redisCluster *cluster, clusterNode ***nodes);
+#ifdef REDIS_TEST
+int clusterTest(int argc, char *argv[]);
+#endif
 #endif /* __REDIS_CLUSTER_PROXY_CLUSTER_H__ */
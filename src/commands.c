@@ -17,213 +17,895 @@
 
 
 #include "commands.h"
+#include "zmalloc.h"
+#include <string.h>
+#include <strings.h>
+
+/* Attempts to find the seed of a bucket before growing the index. */
+#define COMMAND_INDEX_MAX_SEED 100000
 
 /* Command Handlers */
 int proxyCommand(void *req);
+int readonlyCommand(void *req);
+int readwriteCommand(void *req);
+int pingCommand(void *req);
+int echoCommand(void *req);
+int selectCommand(void *req);
+int commandCommand(void *req);
+int quitCommand(void *req);
+int scanCommand(void *req);
+int multiCommand(void *req);
+int execCommand(void *req);
+int discardCommand(void *req);
+
+/* Key Extraction */
+static redisCommandGetKeysProc evalGetKeys;
+static redisCommandGetKeysProc zunionInterGetKeys;
+static redisCommandGetKeysProc xreadGetKeys;
+static redisCommandGetKeysProc georadiusGetKeys;
+static redisCommandGetKeysProc sortGetKeys;
+static redisCommandGetKeysProc migrateGetKeys;
 
-struct redisCommandDef redisCommandTable[203] = {
-    {"sinterstore", -3, 1, -1, 1, 0, NULL},
-    {"cluster", -2, 0, 0, 0, 0, NULL},
-    {"rename", 3, 1, 2, 1, 0, NULL},
-    {"scan", -2, 0, 0, 0, 0, NULL},
-    {"hsetnx", 4, 1, 1, 1, 0, NULL},
-    {"echo", 2, 0, 0, 0, 0, NULL},
-    {"getset", 3, 1, 1, 1, 0, NULL},
-    {"sdiffstore", -3, 1, -1, 1, 0, NULL},
-    {"lpushx", -3, 1, 1, 1, 0, NULL},
-    {"hincrbyfloat", 4, 1, 1, 1, 0, NULL},
-    {"bitfield", -2, 1, 1, 1, 0, NULL},
-    {"lastsave", 1, 0, 0, 0, 0, NULL},
-    {"zunionstore", -4, 0, 0, 0, 0, NULL},
-    {"strlen", 2, 1, 1, 1, 0, NULL},
-    {"xtrim", -2, 1, 1, 1, 0, NULL},
-    {"hdel", -3, 1, 1, 1, 0, NULL},
-    {"zcard", 2, 1, 1, 1, 0, NULL},
-    {"swapdb", 3, 0, 0, 0, 0, NULL},
-    {"sinter", -2, 1, -1, 1, 0, NULL},
-    {"move", 3, 1, 1, 1, 0, NULL},
-    {"bitcount", -2, 1, 1, 1, 0, NULL},
-    {"smove", 4, 1, 2, 1, 0, NULL},
-    {"zrevrangebyscore", -4, 1, 1, 1, 0, NULL},
-    {"psetex", 4, 1, 1, 1, 0, NULL},
-    {"lset", 4, 1, 1, 1, 0, NULL},
-    {"xgroup", -2, 2, 2, 1, 0, NULL},
-    {"hmget", -3, 1, 1, 1, 0, NULL},
-    {"xrevrange", -4, 1, 1, 1, 0, NULL},
-    {"pfselftest", 1, 0, 0, 0, 0, NULL},
-    {"lolwut", -1, 0, 0, 0, 0, NULL},
-    {"object", -2, 2, 2, 1, 0, NULL},
-    {"blpop", -3, 1, -2, 1, 0, NULL},
-    {"restore-asking", -4, 1, 1, 1, 0, NULL},
-    {"zrevrank", 3, 1, 1, 1, 0, NULL},
-    {"unlink", -2, 1, -1, 1, 0, NULL},
-    {"script", -2, 0, 0, 0, 0, NULL},
-    {"psubscribe", -2, 0, 0, 0, 0, NULL},
-    {"ttl", 2, 1, 1, 1, 0, NULL},
-    {"srandmember", -2, 1, 1, 1, 0, NULL},
-    {"zadd", -4, 1, 1, 1, 0, NULL},
-    {"setex", 4, 1, 1, 1, 0, NULL},
-    {"zremrangebyrank", 4, 1, 1, 1, 0, NULL},
-    {"slowlog", -2, 0, 0, 0, 0, NULL},
-    {"restore", -4, 1, 1, 1, 0, NULL},
-    {"sunion", -2, 1, -1, 1, 0, NULL},
-    {"scard", 2, 1, 1, 1, 0, NULL},
-    {"hstrlen", 3, 1, 1, 1, 0, NULL},
-    {"bzpopmax", -3, 1, -2, 1, 0, NULL},
-    {"spop", -2, 1, 1, 1, 0, NULL},
-    {"migrate", -6, 0, 0, 0, 0, NULL},
-    {"exec", 1, 0, 0, 0, 1, NULL},
-    {"client", -2, 0, 0, 0, 0, NULL},
-    {"acl", -2, 0, 0, 0, 0, NULL},
-    {"rpush", -3, 1, 1, 1, 0, NULL},
-    {"xadd", -5, 1, 1, 1, 0, NULL},
-    {"brpoplpush", 4, 1, 2, 1, 0, NULL},
-    {"incr", 2, 1, 1, 1, 0, NULL},
-    {"getbit", 3, 1, 1, 1, 0, NULL},
-    {"time", 1, 0, 0, 0, 0, NULL},
-    {"sdiff", -2, 1, -1, 1, 0, NULL},
-    {"memory", -2, 0, 0, 0, 0, NULL},
-    {"exists", -2, 1, -1, 1, 0, NULL},
-    {"setnx", 3, 1, 1, 1, 0, NULL},
-    {"slaveof", 3, 0, 0, 0, 0, NULL},
-    {"hgetall", 2, 1, 1, 1, 0, NULL},
-    {"flushdb", -1, 0, 0, 0, 0, NULL},
-    {"rpop", 2, 1, 1, 1, 0, NULL},
-    {"append", 3, 1, 1, 1, 0, NULL},
-    {"hscan", -3, 1, 1, 1, 0, NULL},
-    {"sync", 1, 0, 0, 0, 0, NULL},
-    {"punsubscribe", -1, 0, 0, 0, 0, NULL},
-    {"brpop", -3, 1, -2, 1, 0, NULL},
-    {"xrange", -4, 1, 1, 1, 0, NULL},
-    {"wait", 3, 0, 0, 0, 0, NULL},
-    {"georadius", -6, 1, 1, 1, 0, NULL},
-    {"georadius_ro", -6, 1, 1, 1, 0, NULL},
-    {"zrevrange", -4, 1, 1, 1, 0, NULL},
-    {"unwatch", 1, 0, 0, 0, 0, NULL},
-    {"llen", 2, 1, 1, 1, 0, NULL},
-    {"lindex", 3, 1, 1, 1, 0, NULL},
-    {"pfmerge", -2, 1, -1, 1, 0, NULL},
-    {"publish", 3, 0, 0, 0, 0, NULL},
-    {"randomkey", 1, 0, 0, 0, 0, NULL},
-    {"keys", 2, 0, 0, 0, 0, NULL},
-    {"geohash", -2, 1, 1, 1, 0, NULL},
-    {"hset", -4, 1, 1, 1, 0, NULL},
-    {"expireat", 3, 1, 1, 1, 0, NULL},
-    {"xinfo", -2, 2, 2, 1, 0, NULL},
-    {"lrange", 4, 1, 1, 1, 0, NULL},
-    {"geopos", -2, 1, 1, 1, 0, NULL},
-    {"save", 1, 0, 0, 0, 0, NULL},
-    {"hkeys", 2, 1, 1, 1, 0, NULL},
-    {"zremrangebylex", 4, 1, 1, 1, 0, NULL},
-    {"rpushx", -3, 1, 1, 1, 0, NULL},
-    {"sscan", -3, 1, 1, 1, 0, NULL},
-    {"host:", -1, 0, 0, 0, 0, NULL},
-    {"zrank", 3, 1, 1, 1, 0, NULL},
-    {"pfcount", -2, 1, -1, 1, 0, NULL},
-    {"readwrite", 1, 0, 0, 0, 0, NULL},
-    {"incrbyfloat", 3, 1, 1, 1, 0, NULL},
-    {"dump", 2, 1, 1, 1, 0, NULL},
-    {"lrem", 4, 1, 1, 1, 0, NULL},
-    {"readonly", 1, 0, 0, 0, 0, NULL},
-    {"getrange", 4, 1, 1, 1, 0, NULL},
-    {"xack", -4, 1, 1, 1, 0, NULL},
-    {"zcount", 4, 1, 1, 1, 0, NULL},
-    {"zrangebyscore", -4, 1, 1, 1, 0, NULL},
-    {"zrem", -3, 1, 1, 1, 0, NULL},
-    {"srem", -3, 1, 1, 1, 0, NULL},
-    {"bgsave", -1, 0, 0, 0, 0, NULL},
-    {"replicaof", 3, 0, 0, 0, 0, NULL},
-    {"psync", 3, 0, 0, 0, 0, NULL},
-    {"geoadd", -5, 1, 1, 1, 0, NULL},
-    {"post", -1, 0, 0, 0, 0, NULL},
-    {"sismember", 3, 1, 1, 1, 0, NULL},
-    {"ping", -1, 0, 0, 0, 0, NULL},
-    {"xsetid", 3, 1, 1, 1, 0, NULL},
-    {"pubsub", -2, 0, 0, 0, 0, NULL},
-    {"role", 1, 0, 0, 0, 0, NULL},
-    {"hvals", 2, 1, 1, 1, 0, NULL},
-    {"pfdebug", -3, 0, 0, 0, 0, NULL},
-    {"config", -2, 0, 0, 0, 0, NULL},
-    {"expire", 3, 1, 1, 1, 0, NULL},
-    {"sort", -2, 1, 1, 1, 0, NULL},
-    {"dbsize", 1, 0, 0, 0, 0, NULL},
-    {"substr", 4, 1, 1, 1, 0, NULL},
-    {"lpop", 2, 1, 1, 1, 0, NULL},
-    {"zscore", 3, 1, 1, 1, 0, NULL},
-    {"pttl", 2, 1, 1, 1, 0, NULL},
-    {"zpopmax", -2, 1, 1, 1, 0, NULL},
-    {"zremrangebyscore", 4, 1, 1, 1, 0, NULL},
-    {"zinterstore", -4, 0, 0, 0, 0, NULL},
-    {"sunionstore", -3, 1, -1, 1, 0, NULL},
-    {"pexpireat", 3, 1, 1, 1, 0, NULL},
-    {"hlen", 2, 1, 1, 1, 0, NULL},
-    {"zrangebylex", -4, 1, 1, 1, 0, NULL},
-    {"subscribe", -2, 0, 0, 0, 0, NULL},
-    {"smembers", 2, 1, 1, 1, 0, NULL},
-    {"bitop", -4, 2, -1, 1, 0, NULL},
-    {"lpush", -3, 1, 1, 1, 0, NULL},
-    {"touch", -2, 1, -1, 1, 0, NULL},
-    {"mset", -3, 1, -1, 2, 0, NULL},
-    {"pexpire", 3, 1, 1, 1, 0, NULL},
-    {"zscan", -3, 1, 1, 1, 0, NULL},
-    {"sadd", -3, 1, 1, 1, 0, NULL},
-    {"xpending", -3, 1, 1, 1, 0, NULL},
-    {"bzpopmin", -3, 1, -2, 1, 0, NULL},
-    {"zpopmin", -2, 1, 1, 1, 0, NULL},
-    {"decr", 2, 1, 1, 1, 0, NULL},
-    {"type", 2, 1, 1, 1, 0, NULL},
-    {"unsubscribe", -1, 0, 0, 0, 0, NULL},
-    {"persist", 2, 1, 1, 1, 0, NULL},
-    {"incrby", 3, 1, 1, 1, 0, NULL},
-    {"get", 2, 1, 1, 1, 0, NULL},
-    {"renamenx", 3, 1, 2, 1, 0, NULL},
-    {"replconf", -1, 0, 0, 0, 0, NULL},
-    {"hmset", -4, 1, 1, 1, 0, NULL},
-    {"xreadgroup", -7, 1, 1, 1, 0, NULL},
-    {"module", -2, 0, 0, 0, 0, NULL},
-    {"asking", 1, 0, 0, 0, 0, NULL},
-    {"hello", -2, 0, 0, 0, 0, NULL},
-    {"info", -1, 0, 0, 0, 0, NULL},
-    {"hexists", 3, 1, 1, 1, 0, NULL},
-    {"select", 2, 0, 0, 0, 0, NULL},
-    {"auth", -2, 0, 0, 0, 0, NULL},
-    {"shutdown", -1, 0, 0, 0, 0, NULL},
-    {"ltrim", 4, 1, 1, 1, 0, NULL},
-    {"set", -3, 1, 1, 1, 0, NULL},
-    {"linsert", 5, 1, 1, 1, 0, NULL},
-    {"command", -1, 0, 0, 0, 0, NULL},
-    {"latency", -2, 0, 0, 0, 0, NULL},
-    {"rpoplpush", 3, 1, 2, 1, 0, NULL},
-    {"hget", 3, 1, 1, 1, 0, NULL},
-    {"xread", -4, 1, 1, 1, 0, NULL},
-    {"georadiusbymember", -5, 1, 1, 1, 0, NULL},
-    {"xclaim", -6, 1, 1, 1, 0, NULL},
-    {"pfadd", -2, 1, 1, 1, 0, NULL},
-    {"zrange", -4, 1, 1, 1, 0, NULL},
-    {"evalsha", -3, 0, 0, 0, 0, NULL},
-    {"flushall", -1, 0, 0, 0, 0, NULL},
-    {"eval", -3, 0, 0, 0, 0, NULL},
-    {"zlexcount", 4, 1, 1, 1, 0, NULL},
-    {"del", -2, 1, -1, 1, 0, NULL},
-    {"bitpos", -3, 1, 1, 1, 0, NULL},
-    {"zincrby", 4, 1, 1, 1, 0, NULL},
-    {"setbit", 4, 1, 1, 1, 0, NULL},
-    {"bgrewriteaof", 1, 0, 0, 0, 0, NULL},
-    {"discard", 1, 0, 0, 0, 1, NULL},
-    {"hincrby", 4, 1, 1, 1, 0, NULL},
-    {"mget", -2, 1, -1, 1, 0, NULL},
-    {"geodist", -4, 1, 1, 1, 0, NULL},
-    {"xlen", 2, 1, 1, 1, 0, NULL},
-    {"msetnx", -3, 1, -1, 2, 0, NULL},
-    {"monitor", 1, 0, 0, 0, 0, NULL},
-    {"decrby", 3, 1, 1, 1, 0, NULL},
-    {"debug", -2, 0, 0, 0, 0, NULL},
-    {"xdel", -3, 1, 1, 1, 0, NULL},
-    {"setrange", 4, 1, 1, 1, 0, NULL},
-    {"multi", 1, 0, 0, 0, 1, NULL},
-    {"zrevrangebylex", -4, 1, 1, 1, 0, NULL},
-    {"georadiusbymember_ro", -5, 1, 1, 1, 0, NULL},
-    {"watch", -2, 1, -1, 1, 0, NULL},
+struct redisCommandDef redisCommandTable[204] = {
+    {"sinterstore", -3, "wm", 1, -1, 1, 0, NULL},
+    {"cluster", -2, "a", 0, 0, 0, 0, NULL},
+    {"rename", 3, "w", 1, 2, 1, 0, NULL},
+    {"scan", -2, "rR", 0, 0, 0, 0, scanCommand},
+    {"hsetnx", 4, "wmF", 1, 1, 1, 0, NULL},
+    {"echo", 2, "F", 0, 0, 0, 0, echoCommand},
+    {"getset", 3, "wm", 1, 1, 1, 0, NULL},
+    {"sdiffstore", -3, "wm", 1, -1, 1, 0, NULL},
+    {"lpushx", -3, "wmF", 1, 1, 1, 0, NULL},
+    {"hincrbyfloat", 4, "wmF", 1, 1, 1, 0, NULL},
+    {"bitfield", -2, "wm", 1, 1, 1, 0, NULL},
+    {"lastsave", 1, "RF", 0, 0, 0, 0, NULL},
+    {"zunionstore", -4, "wmK", 0, 0, 0, 0, NULL, zunionInterGetKeys},
+    {"strlen", 2, "rF", 1, 1, 1, 0, NULL},
+    {"xtrim", -2, "wFR", 1, 1, 1, 0, NULL},
+    {"hdel", -3, "wF", 1, 1, 1, 0, NULL},
+    {"zcard", 2, "rF", 1, 1, 1, 0, NULL},
+    {"swapdb", 3, "wF", 0, 0, 0, 0, NULL},
+    {"sinter", -2, "rS", 1, -1, 1, 0, NULL},
+    {"move", 3, "wF", 1, 1, 1, 0, NULL},
+    {"bitcount", -2, "r", 1, 1, 1, 0, NULL},
+    {"smove", 4, "wF", 1, 2, 1, 0, NULL},
+    {"zrevrangebyscore", -4, "r", 1, 1, 1, 0, NULL},
+    {"psetex", 4, "wm", 1, 1, 1, 0, NULL},
+    {"lset", 4, "wm", 1, 1, 1, 0, NULL},
+    {"xgroup", -2, "wm", 2, 2, 1, 0, NULL},
+    {"hmget", -3, "rF", 1, 1, 1, 0, NULL},
+    {"xrevrange", -4, "r", 1, 1, 1, 0, NULL},
+    {"pfselftest", 1, "a", 0, 0, 0, 0, NULL},
+    {"lolwut", -1, "r", 0, 0, 0, 0, NULL},
+    {"object", -2, "rR", 2, 2, 1, 0, NULL},
+    {"blpop", -3, "wsB", 1, -2, 1, 0, NULL},
+    {"restore-asking", -4, "wmk", 1, 1, 1, 0, NULL},
+    {"zrevrank", 3, "rF", 1, 1, 1, 0, NULL},
+    {"unlink", -2, "wF", 1, -1, 1, 0, NULL},
+    {"script", -2, "sP", 0, 0, 0, 0, NULL},
+    {"psubscribe", -2, "pslt", 0, 0, 0, 0, NULL},
+    {"ttl", 2, "rFR", 1, 1, 1, 0, NULL},
+    {"srandmember", -2, "rR", 1, 1, 1, 0, NULL},
+    {"zadd", -4, "wmF", 1, 1, 1, 0, NULL},
+    {"setex", 4, "wm", 1, 1, 1, 0, NULL},
+    {"zremrangebyrank", 4, "w", 1, 1, 1, 0, NULL},
+    {"slowlog", -2, "aR", 0, 0, 0, 0, NULL},
+    {"restore", -4, "wm", 1, 1, 1, 0, NULL},
+    {"sunion", -2, "rS", 1, -1, 1, 0, NULL},
+    {"scard", 2, "rF", 1, 1, 1, 0, NULL},
+    {"hstrlen", 3, "rF", 1, 1, 1, 0, NULL},
+    {"bzpopmax", -3, "wsFB", 1, -2, 1, 0, NULL},
+    {"spop", -2, "wRF", 1, 1, 1, 0, NULL},
+    {"migrate", -6, "wRK", 0, 0, 0, 0, NULL, migrateGetKeys},
+    {"exec", 1, "sM", 0, 0, 0, 0, execCommand},
+    {"client", -2, "as", 0, 0, 0, 0, NULL},
+    {"acl", -2, "aslt", 0, 0, 0, 0, NULL},
+    {"rpush", -3, "wmF", 1, 1, 1, 0, NULL},
+    {"xadd", -5, "wmFR", 1, 1, 1, 0, NULL},
+    {"brpoplpush", 4, "wmsB", 1, 2, 1, 0, NULL},
+    {"incr", 2, "wmF", 1, 1, 1, 0, NULL},
+    {"getbit", 3, "rF", 1, 1, 1, 0, NULL},
+    {"time", 1, "RF", 0, 0, 0, 0, NULL},
+    {"sdiff", -2, "rS", 1, -1, 1, 0, NULL},
+    {"memory", -2, "rR", 0, 0, 0, 0, NULL},
+    {"exists", -2, "rF", 1, -1, 1, 0, NULL},
+    {"setnx", 3, "wmF", 1, 1, 1, 0, NULL},
+    {"slaveof", 3, "ast", 0, 0, 0, 0, NULL},
+    {"hgetall", 2, "rR", 1, 1, 1, 0, NULL},
+    {"flushdb", -1, "w", 0, 0, 0, 0, NULL},
+    {"rpop", 2, "wF", 1, 1, 1, 0, NULL},
+    {"append", 3, "wm", 1, 1, 1, 0, NULL},
+    {"hscan", -3, "rR", 1, 1, 1, 0, NULL},
+    {"sync", 1, "ars", 0, 0, 0, 0, NULL},
+    {"punsubscribe", -1, "pslt", 0, 0, 0, 0, NULL},
+    {"brpop", -3, "wsB", 1, -2, 1, 0, NULL},
+    {"xrange", -4, "r", 1, 1, 1, 0, NULL},
+    {"wait", 3, "sB", 0, 0, 0, 0, NULL},
+    {"georadius", -6, "wK", 1, 1, 1, 0, NULL, georadiusGetKeys},
+    {"georadius_ro", -6, "r", 1, 1, 1, 0, NULL},
+    {"zrevrange", -4, "r", 1, 1, 1, 0, NULL},
+    {"unwatch", 1, "sF", 0, 0, 0, 1, NULL},
+    {"llen", 2, "rF", 1, 1, 1, 0, NULL},
+    {"lindex", 3, "r", 1, 1, 1, 0, NULL},
+    {"pfmerge", -2, "wm", 1, -1, 1, 0, NULL},
+    {"publish", 3, "pltFP", 0, 0, 0, 0, NULL},
+    {"randomkey", 1, "rR", 0, 0, 0, 0, NULL},
+    {"keys", 2, "rS", 0, 0, 0, 0, NULL},
+    {"geohash", -2, "r", 1, 1, 1, 0, NULL},
+    {"hset", -4, "wmF", 1, 1, 1, 0, NULL},
+    {"expireat", 3, "wF", 1, 1, 1, 0, NULL},
+    {"xinfo", -2, "rR", 2, 2, 1, 0, NULL},
+    {"lrange", 4, "r", 1, 1, 1, 0, NULL},
+    {"geopos", -2, "r", 1, 1, 1, 0, NULL},
+    {"save", 1, "as", 0, 0, 0, 0, NULL},
+    {"hkeys", 2, "rS", 1, 1, 1, 0, NULL},
+    {"zremrangebylex", 4, "w", 1, 1, 1, 0, NULL},
+    {"rpushx", -3, "wmF", 1, 1, 1, 0, NULL},
+    {"sscan", -3, "rR", 1, 1, 1, 0, NULL},
+    {"host:", -1, "lt", 0, 0, 0, 0, NULL},
+    {"zrank", 3, "rF", 1, 1, 1, 0, NULL},
+    {"pfcount", -2, "rP", 1, -1, 1, 0, NULL},
+    {"readwrite", 1, "F", 0, 0, 0, 0, readwriteCommand},
+    {"incrbyfloat", 3, "wmF", 1, 1, 1, 0, NULL},
+    {"dump", 2, "rR", 1, 1, 1, 0, NULL},
+    {"lrem", 4, "w", 1, 1, 1, 0, NULL},
+    {"readonly", 1, "F", 0, 0, 0, 0, readonlyCommand},
+    {"getrange", 4, "r", 1, 1, 1, 0, NULL},
+    {"xack", -4, "wF", 1, 1, 1, 0, NULL},
+    {"zcount", 4, "rF", 1, 1, 1, 0, NULL},
+    {"zrangebyscore", -4, "r", 1, 1, 1, 0, NULL},
+    {"zrem", -3, "wF", 1, 1, 1, 0, NULL},
+    {"srem", -3, "wF", 1, 1, 1, 0, NULL},
+    {"bgsave", -1, "a", 0, 0, 0, 0, NULL},
+    {"replicaof", 3, "ast", 0, 0, 0, 0, NULL},
+    {"psync", 3, "ars", 0, 0, 0, 0, NULL},
+    {"geoadd", -5, "wm", 1, 1, 1, 0, NULL},
+    {"post", -1, "lt", 0, 0, 0, 0, NULL},
+    {"sismember", 3, "rF", 1, 1, 1, 0, NULL},
+    {"ping", -1, "tF", 0, 0, 0, 0, pingCommand},
+    {"xsetid", 3, "wmF", 1, 1, 1, 0, NULL},
+    {"pubsub", -2, "pltR", 0, 0, 0, 0, NULL},
+    {"role", 1, "lst", 0, 0, 0, 0, NULL},
+    {"hvals", 2, "rS", 1, 1, 1, 0, NULL},
+    {"pfdebug", -3, "w", 0, 0, 0, 0, NULL},
+    {"config", -2, "lat", 0, 0, 0, 0, NULL},
+    {"expire", 3, "wF", 1, 1, 1, 0, NULL},
+    {"sort", -2, "wmK", 1, 1, 1, 0, NULL, sortGetKeys},
+    {"dbsize", 1, "rF", 0, 0, 0, 0, NULL},
+    {"substr", 4, "r", 1, 1, 1, 0, NULL},
+    {"lpop", 2, "wF", 1, 1, 1, 0, NULL},
+    {"zscore", 3, "rF", 1, 1, 1, 0, NULL},
+    {"pttl", 2, "rFR", 1, 1, 1, 0, NULL},
+    {"zpopmax", -2, "wF", 1, 1, 1, 0, NULL},
+    {"zremrangebyscore", 4, "w", 1, 1, 1, 0, NULL},
+    {"zinterstore", -4, "wmK", 0, 0, 0, 0, NULL, zunionInterGetKeys},
+    {"sunionstore", -3, "wm", 1, -1, 1, 0, NULL},
+    {"pexpireat", 3, "wF", 1, 1, 1, 0, NULL},
+    {"hlen", 2, "rF", 1, 1, 1, 0, NULL},
+    {"zrangebylex", -4, "r", 1, 1, 1, 0, NULL},
+    {"subscribe", -2, "pslt", 0, 0, 0, 0, NULL},
+    {"smembers", 2, "rS", 1, 1, 1, 0, NULL},
+    {"bitop", -4, "wm", 2, -1, 1, 0, NULL},
+    {"lpush", -3, "wmF", 1, 1, 1, 0, NULL},
+    {"touch", -2, "rF", 1, -1, 1, 0, NULL},
+    {"mset", -3, "wm", 1, -1, 2, 0, NULL},
+    {"pexpire", 3, "wF", 1, 1, 1, 0, NULL},
+    {"zscan", -3, "rR", 1, 1, 1, 0, NULL},
+    {"sadd", -3, "wmF", 1, 1, 1, 0, NULL},
+    {"xpending", -3, "rR", 1, 1, 1, 0, NULL},
+    {"bzpopmin", -3, "wsFB", 1, -2, 1, 0, NULL},
+    {"zpopmin", -2, "wF", 1, 1, 1, 0, NULL},
+    {"decr", 2, "wmF", 1, 1, 1, 0, NULL},
+    {"type", 2, "rF", 1, 1, 1, 0, NULL},
+    {"unsubscribe", -1, "pslt", 0, 0, 0, 0, NULL},
+    {"persist", 2, "wF", 1, 1, 1, 0, NULL},
+    {"incrby", 3, "wmF", 1, 1, 1, 0, NULL},
+    {"get", 2, "rF", 1, 1, 1, 0, NULL},
+    {"renamenx", 3, "wF", 1, 2, 1, 0, NULL},
+    {"replconf", -1, "aslt", 0, 0, 0, 0, NULL},
+    {"hmset", -4, "wmF", 1, 1, 1, 0, NULL},
+    {"xreadgroup", -7, "wsBK", 1, 1, 1, 0, NULL, xreadGetKeys},
+    {"module", -2, "as", 0, 0, 0, 0, NULL},
+    {"asking", 1, "F", 0, 0, 0, 0, NULL},
+    {"hello", -2, "sF", 0, 0, 0, 0, NULL},
+    {"info", -1, "lt", 0, 0, 0, 0, NULL},
+    {"hexists", 3, "rF", 1, 1, 1, 0, NULL},
+    {"select", 2, "lF", 0, 0, 0, 0, selectCommand},
+    {"auth", -2, "sltF", 0, 0, 0, 0, NULL},
+    {"shutdown", -1, "alt", 0, 0, 0, 0, NULL},
+    {"ltrim", 4, "w", 1, 1, 1, 0, NULL},
+    {"set", -3, "wm", 1, 1, 1, 0, NULL},
+    {"linsert", 5, "wm", 1, 1, 1, 0, NULL},
+    {"command", -1, "lt", 0, 0, 0, 0, commandCommand},
+    {"latency", -2, "aslt", 0, 0, 0, 0, NULL},
+    {"rpoplpush", 3, "wm", 1, 2, 1, 0, NULL},
+    {"hget", 3, "rF", 1, 1, 1, 0, NULL},
+    {"xread", -4, "rsBK", 1, 1, 1, 0, NULL, xreadGetKeys},
+    {"georadiusbymember", -5, "wK", 1, 1, 1, 0, NULL, georadiusGetKeys},
+    {"xclaim", -6, "wRF", 1, 1, 1, 0, NULL},
+    {"pfadd", -2, "wmF", 1, 1, 1, 0, NULL},
+    {"zrange", -4, "r", 1, 1, 1, 0, NULL},
+    {"evalsha", -3, "sKP", 0, 0, 0, 0, NULL, evalGetKeys},
+    {"flushall", -1, "w", 0, 0, 0, 0, NULL},
+    {"eval", -3, "sKP", 0, 0, 0, 0, NULL, evalGetKeys},
+    {"zlexcount", 4, "rF", 1, 1, 1, 0, NULL},
+    {"del", -2, "w", 1, -1, 1, 0, NULL},
+    {"bitpos", -3, "r", 1, 1, 1, 0, NULL},
+    {"zincrby", 4, "wmF", 1, 1, 1, 0, NULL},
+    {"setbit", 4, "wm", 1, 1, 1, 0, NULL},
+    {"bgrewriteaof", 1, "a", 0, 0, 0, 0, NULL},
+    {"discard", 1, "sF", 0, 0, 0, 0, discardCommand},
+    {"hincrby", 4, "wmF", 1, 1, 1, 0, NULL},
+    {"mget", -2, "rF", 1, -1, 1, 0, NULL},
+    {"geodist", -4, "r", 1, 1, 1, 0, NULL},
+    {"xlen", 2, "rF", 1, 1, 1, 0, NULL},
+    {"msetnx", -3, "wm", 1, -1, 2, 0, NULL},
+    {"monitor", 1, "as", 0, 0, 0, 0, NULL},
+    {"decrby", 3, "wmF", 1, 1, 1, 0, NULL},
+    {"debug", -2, "as", 0, 0, 0, 0, NULL},
+    {"xdel", -3, "wF", 1, 1, 1, 0, NULL},
+    {"setrange", 4, "wm", 1, 1, 1, 0, NULL},
+    {"multi", 1, "sF", 0, 0, 0, 0, multiCommand},
+    {"zrevrangebylex", -4, "r", 1, 1, 1, 0, NULL},
+    {"georadiusbymember_ro", -5, "r", 1, 1, 1, 0, NULL},
+    {"watch", -2, "sF", 1, -1, 1, 1, NULL},
+    {"quit", -1, "ltF", 0, 0, 0, 0, quitCommand},
     /* Custom Commands */
-    {"proxy", -2, 0, 0, 0, 0, proxyCommand}
+    {"proxy", -2, "lt", 0, 0, 0, 0, proxyCommand}
 };
+
+/* Letter (in the 'sflags' strings) and name (in the COMMAND replies) of
+ * every flag. */
+static struct {
+    char letter;
+    char *name;
+    int flag;
+} commandFlagsTable[] = {
+    {'w', "write", CMD_WRITE},
+    {'r', "readonly", CMD_READONLY},
+    {'m', "denyoom", CMD_DENYOOM},
+    {'a', "admin", CMD_ADMIN},
+    {'p', "pubsub", CMD_PUBSUB},
+    {'s', "noscript", CMD_NOSCRIPT},
+    {'R', "random", CMD_RANDOM},
+    {'S', "sort_for_script", CMD_SORT_FOR_SCRIPT},
+    {'l', "loading", CMD_LOADING},
+    {'t', "stale", CMD_STALE},
+    {'M', "skip_monitor", CMD_SKIP_MONITOR},
+    {'k', "asking", CMD_ASKING},
+    {'F', "fast", CMD_FAST},
+    {'B', "blocking", CMD_BLOCKING},
+    {'K', "movablekeys", CMD_MOVABLE_KEYS},
+    {'P', "may_replicate", CMD_MAY_REPLICATE},
+    {0, NULL, 0}
+};
+
+/* Turn the 'sflags' string of the command into the actual flags. Unknown
+ * letters are just ignored. */
+void populateCommandFlags(redisCommandDef *cmd) {
+    char *f = cmd->sflags;
+    int i;
+    cmd->flags = 0;
+    while (f != NULL && *f != '\0') {
+        for (i = 0; commandFlagsTable[i].letter != 0; i++) {
+            if (commandFlagsTable[i].letter != *f) continue;
+            cmd->flags |= commandFlagsTable[i].flag;
+            break;
+        }
+        f++;
+    }
+}
+
+/* Return the flag with the given name (as reported by COMMAND), or 0 for
+ * the flags unknown to the proxy. */
+int getCommandFlagByName(const char *name) {
+    int i;
+    for (i = 0; commandFlagsTable[i].letter != 0; i++) {
+        if (!strcasecmp(commandFlagsTable[i].name, name))
+            return commandFlagsTable[i].flag;
+    }
+    return 0;
+}
+
+/* Append the description of the command, as found in the reply of
+ * COMMAND, to 'reply'. */
+sds catCommandInfo(sds reply, redisCommandDef *cmd) {
+    int count = 0, i;
+    sds flags = sdsempty();
+    for (i = 0; commandFlagsTable[i].letter != 0; i++) {
+        if (!(cmd->flags & commandFlagsTable[i].flag)) continue;
+        flags = sdscatfmt(flags, "+%s\r\n", commandFlagsTable[i].name);
+        count++;
+    }
+    reply = sdscatfmt(reply, "*6\r\n$%u\r\n%s\r\n:%i\r\n*%i\r\n%S",
+                      (unsigned int) strlen(cmd->name), cmd->name,
+                      cmd->arity, count, flags);
+    reply = sdscatfmt(reply, ":%i\r\n:%i\r\n:%i\r\n", cmd->first_key,
+                      cmd->last_key, cmd->key_step);
+    sdsfree(flags);
+    return reply;
+}
+
+static inline unsigned char foldCommandChar(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? (c | 0x20) : c;
+}
+
+/* Return the value of the field 'name' of a map, that is replied as a flat
+ * array of names and values, or NULL if there's no such field. */
+static redisReply *getReplyMapField(redisReply *map, const char *name) {
+    size_t i;
+    if (map == NULL || map->type != REDIS_REPLY_ARRAY) return NULL;
+    for (i = 0; i + 1 < map->elements; i += 2) {
+        redisReply *field = map->element[i];
+        if ((field->type == REDIS_REPLY_STRING ||
+             field->type == REDIS_REPLY_STATUS) &&
+            !strcasecmp(field->str, name)) return map->element[i + 1];
+    }
+    return NULL;
+}
+
+static long long getReplyMapInteger(redisReply *map, const char *name,
+                                    long long defval)
+{
+    redisReply *value = getReplyMapField(map, name);
+    if (value == NULL || value->type != REDIS_REPLY_INTEGER) return defval;
+    return value->integer;
+}
+
+/* Get the keys of the command from its key specifications (replied by Redis
+ * 7 and later), when the legacy first/last/step triple doesn't have them:
+ * only a single spec of a range of keys at a fixed index can be used. */
+static void parseCommandKeySpecs(redisCommandDef *cmd, redisReply *specs) {
+    if (specs == NULL || specs->type != REDIS_REPLY_ARRAY ||
+        specs->elements != 1) return;
+    redisReply *begin = getReplyMapField(specs->element[0], "begin_search");
+    redisReply *find = getReplyMapField(specs->element[0], "find_keys");
+    redisReply *type = getReplyMapField(begin, "type");
+    if (type == NULL || type->type != REDIS_REPLY_STRING ||
+        strcasecmp(type->str, "index")) return;
+    long long index = getReplyMapInteger(getReplyMapField(begin, "spec"),
+                                         "index", 0);
+    type = getReplyMapField(find, "type");
+    if (type == NULL || type->type != REDIS_REPLY_STRING ||
+        strcasecmp(type->str, "range")) return;
+    redisReply *spec = getReplyMapField(find, "spec");
+    long long lastkey = getReplyMapInteger(spec, "lastkey", 0),
+              keystep = getReplyMapInteger(spec, "keystep", 1),
+              limit = getReplyMapInteger(spec, "limit", 0);
+    if (index <= 0 || keystep <= 0 || limit > 1) return;
+    cmd->first_key = index;
+    cmd->last_key = (lastkey >= 0 ? index + lastkey : lastkey);
+    cmd->key_step = keystep;
+}
+
+/* Create a command from an entry of the COMMAND reply, that is:
+ * [name, arity, [flags...], first key, last key, key step, ...] followed,
+ * since Redis 7, by ACL categories, tips, key specs and subcommands.
+ * Commands whose keys cannot be found at fixed positions are marked as
+ * unsupported. Returns NULL if the entry is malformed. */
+redisCommandDef *createCommandFromReply(redisReply *reply) {
+    if (reply == NULL || reply->type != REDIS_REPLY_ARRAY ||
+        reply->elements < 6) return NULL;
+    redisReply **e = reply->element;
+    if (e[0]->type != REDIS_REPLY_STRING || e[1]->type != REDIS_REPLY_INTEGER ||
+        e[2]->type != REDIS_REPLY_ARRAY || e[3]->type != REDIS_REPLY_INTEGER ||
+        e[4]->type != REDIS_REPLY_INTEGER || e[5]->type != REDIS_REPLY_INTEGER)
+        return NULL;
+    redisCommandDef *cmd = zcalloc(sizeof(*cmd));
+    size_t i;
+    cmd->loaded = 1;
+    cmd->name = zstrdup(e[0]->str);
+    for (i = 0; cmd->name[i] != '\0'; i++)
+        cmd->name[i] = foldCommandChar((unsigned char) cmd->name[i]);
+    cmd->arity = e[1]->integer;
+    cmd->first_key = e[3]->integer;
+    cmd->last_key = e[4]->integer;
+    cmd->key_step = e[5]->integer;
+    for (i = 0; i < e[2]->elements; i++) {
+        redisReply *flag = e[2]->element[i];
+        if (flag->type != REDIS_REPLY_STATUS &&
+            flag->type != REDIS_REPLY_STRING) continue;
+        cmd->flags |= getCommandFlagByName(flag->str);
+    }
+    if (cmd->first_key == 0 && reply->elements > 8)
+        parseCommandKeySpecs(cmd, e[8]);
+    if (cmd->flags & CMD_MOVABLE_KEYS) cmd->unsupported = 1;
+    return cmd;
+}
+
+/* Return 1 if the argument at 'idx' is 'str', ignoring the case. */
+static int argEquals(char *buffer, int *offsets, int *lengths, int idx,
+                     const char *str)
+{
+    size_t len = strlen(str);
+    return ((size_t) lengths[idx] == len &&
+            !strncasecmp(buffer + offsets[idx], str, len));
+}
+
+/* Parse the argument at 'idx' as a non negative integer, returning -1 if
+ * it isn't one. */
+static long long argToCount(char *buffer, int *offsets, int *lengths,
+                            int idx)
+{
+    char *p = buffer + offsets[idx];
+    long long value = 0;
+    int i;
+    if (lengths[idx] == 0 || lengths[idx] > 18) return -1;
+    for (i = 0; i < lengths[idx]; i++) {
+        if (p[i] < '0' || p[i] > '9') return -1;
+        value = (value * 10) + (p[i] - '0');
+    }
+    return value;
+}
+
+/* EVAL script numkeys key [key ...] arg [arg ...]
+ * EVALSHA sha1 numkeys key [key ...] arg [arg ...] */
+static int evalGetKeys(char *buffer, int *offsets, int *lengths, int argc,
+                       int *keys)
+{
+    if (argc < 3) return -1;
+    long long numkeys = argToCount(buffer, offsets, lengths, 2), i;
+    if (numkeys < 0 || numkeys > argc - 3) return -1;
+    for (i = 0; i < numkeys; i++) keys[i] = 3 + i;
+    return numkeys;
+}
+
+/* ZUNIONSTORE destination numkeys key [key ...] [WEIGHTS ...] ...
+ * ZINTERSTORE destination numkeys key [key ...] [WEIGHTS ...] ... */
+static int zunionInterGetKeys(char *buffer, int *offsets, int *lengths,
+                              int argc, int *keys)
+{
+    if (argc < 4) return -1;
+    long long numkeys = argToCount(buffer, offsets, lengths, 2), i;
+    if (numkeys < 1 || numkeys > argc - 3) return -1;
+    keys[0] = 1;
+    for (i = 0; i < numkeys; i++) keys[i + 1] = 3 + i;
+    return numkeys + 1;
+}
+
+/* XREAD [COUNT count] [BLOCK ms] STREAMS key [key ...] id [id ...]
+ * XREADGROUP GROUP group consumer [COUNT count] [BLOCK ms] [NOACK]
+ *     STREAMS key [key ...] id [id ...] */
+static int xreadGetKeys(char *buffer, int *offsets, int *lengths, int argc,
+                        int *keys)
+{
+    int streams = 0, i;
+    for (i = 1; i < argc; i++) {
+        if (argEquals(buffer, offsets, lengths, i, "block") ||
+            argEquals(buffer, offsets, lengths, i, "count")) i++;
+        else if (argEquals(buffer, offsets, lengths, i, "group")) i += 2;
+        else if (argEquals(buffer, offsets, lengths, i, "noack")) continue;
+        else if (argEquals(buffer, offsets, lengths, i, "streams")) {
+            streams = i;
+            break;
+        } else break;
+    }
+    /* Every stream must have its ID. */
+    int count = argc - streams - 1;
+    if (streams == 0 || count == 0 || (count % 2) != 0) return -1;
+    count /= 2;
+    for (i = 0; i < count; i++) keys[i] = streams + 1 + i;
+    return count;
+}
+
+/* GEORADIUS key longitude latitude radius unit [...] [STORE key]
+ *     [STOREDIST key]
+ * GEORADIUSBYMEMBER key member radius unit [...] [STORE key]
+ *     [STOREDIST key]
+ * Like Redis, only the last STORE or STOREDIST option counts. */
+static int georadiusGetKeys(char *buffer, int *offsets, int *lengths,
+                            int argc, int *keys)
+{
+    int stored = 0, i;
+    if (argc < 2) return -1;
+    for (i = 5; i < argc - 1; i++) {
+        if (argEquals(buffer, offsets, lengths, i, "store") ||
+            argEquals(buffer, offsets, lengths, i, "storedist"))
+        {
+            stored = ++i;
+        }
+    }
+    keys[0] = 1;
+    if (stored == 0) return 1;
+    keys[1] = stored;
+    return 2;
+}
+
+/* SORT key [BY pattern] [LIMIT offset count] [GET pattern [GET pattern ...]]
+ *     [ASC|DESC] [ALPHA] [STORE destination] */
+static int sortGetKeys(char *buffer, int *offsets, int *lengths, int argc,
+                       int *keys)
+{
+    int stored = 0, i;
+    if (argc < 2) return -1;
+    for (i = 2; i < argc; i++) {
+        if (argEquals(buffer, offsets, lengths, i, "limit")) i += 2;
+        else if (argEquals(buffer, offsets, lengths, i, "get") ||
+                 argEquals(buffer, offsets, lengths, i, "by")) i++;
+        else if (argEquals(buffer, offsets, lengths, i, "store") &&
+                 i + 1 < argc) stored = ++i;
+    }
+    keys[0] = 1;
+    if (stored == 0) return 1;
+    keys[1] = stored;
+    return 2;
+}
+
+/* MIGRATE host port key|"" destination-db timeout [COPY] [REPLACE]
+ *     [AUTH password] [AUTH2 username password] [KEYS key [key ...]] */
+static int migrateGetKeys(char *buffer, int *offsets, int *lengths, int argc,
+                          int *keys)
+{
+    int first = 3, count = 1, i;
+    if (argc < 6) return -1;
+    for (i = 6; i < argc; i++) {
+        if (argEquals(buffer, offsets, lengths, i, "auth")) i++;
+        else if (argEquals(buffer, offsets, lengths, i, "auth2")) i += 2;
+        else if (argEquals(buffer, offsets, lengths, i, "keys")) {
+            /* The key argument must be empty when using KEYS. */
+            if (lengths[3] != 0) return -1;
+            first = i + 1;
+            count = argc - first;
+            break;
+        }
+    }
+    for (i = 0; i < count; i++) keys[i] = first + i;
+    return count;
+}
+
+void freeCommand(redisCommandDef *cmd) {
+    zfree(cmd->name);
+    zfree(cmd);
+}
+
+int commandsAreEqual(redisCommandDef *a, redisCommandDef *b) {
+    return (!strcmp(a->name, b->name) && a->arity == b->arity &&
+            a->first_key == b->first_key && a->last_key == b->last_key &&
+            a->key_step == b->key_step && a->unsupported == b->unsupported &&
+            a->handle == b->handle && a->getkeys == b->getkeys &&
+            a->flags == b->flags);
+}
+
+/* Case insensitive FNV-1a of the name, followed by the splitmix64
+ * finalizer, so that every bit of the result depends on every byte. */
+static uint64_t commandNameHash(const char *name, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= foldCommandChar((unsigned char) name[i]);
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+/* The high 32 bits of the hash select the bucket, both halves are combined
+ * with the seed of the bucket to get the slot. */
+static inline uint32_t commandIndexBucket(redisCommandIndex *index,
+                                          uint64_t h)
+{
+    if (index->bucket_bits == 0) return 0;
+    return (uint32_t) (h >> 32) >> (32 - index->bucket_bits);
+}
+
+static inline uint32_t commandIndexSlot(redisCommandIndex *index, uint64_t h,
+                                        uint32_t seed)
+{
+    uint32_t h1 = (uint32_t) h, h2 = (uint32_t) (h >> 32) | 1;
+    return (h1 + seed * h2) & (index->size - 1);
+}
+
+static int commandNameEquals(const char *a, size_t alen, const char *b,
+                             size_t blen)
+{
+    size_t i;
+    if (alen != blen) return 0;
+    for (i = 0; i < alen; i++) {
+        if (foldCommandChar((unsigned char) a[i]) !=
+            foldCommandChar((unsigned char) b[i])) return 0;
+    }
+    return 1;
+}
+
+void freeCommandIndex(redisCommandIndex *index) {
+    if (index == NULL) return;
+    zfree(index->seeds);
+    zfree(index->commands);
+    zfree(index->lengths);
+    zfree(index);
+}
+
+/* Try to place every bucket, starting from the largest ones, into an index
+ * of the given size. Returns 0 if some bucket could not be placed. */
+static int fillCommandIndex(redisCommandIndex *index,
+                            redisCommandDef **commands, uint64_t *hashes,
+                            uint32_t *buckets, int count)
+{
+    uint32_t numbuckets = 1 << index->bucket_bits, b, seed, *slots;
+    int *order = zmalloc(count * sizeof(int)), i, j, n, ok = 1;
+    slots = zmalloc(count * sizeof(uint32_t));
+    int *sizes = zcalloc(numbuckets * sizeof(int));
+    for (i = 0; i < count; i++) {
+        if (commands[i] != NULL) sizes[buckets[i]]++;
+    }
+    /* Commands sorted by bucket, largest buckets first (counting sort on
+     * the size of the buckets). */
+    int maxsize = 0;
+    for (b = 0; b < numbuckets; b++)
+        if (sizes[b] > maxsize) maxsize = sizes[b];
+    n = 0;
+    for (j = maxsize; j > 0; j--) {
+        for (b = 0; b < numbuckets; b++) {
+            if (sizes[b] != j) continue;
+            for (i = 0; i < count; i++)
+                if (commands[i] != NULL && buckets[i] == b) order[n++] = i;
+        }
+    }
+    i = 0;
+    while (i < n) {
+        int bucket_size = sizes[buckets[order[i]]];
+        for (seed = 1; seed <= COMMAND_INDEX_MAX_SEED; seed++) {
+            for (j = 0; j < bucket_size; j++) {
+                int k;
+                slots[j] = commandIndexSlot(index, hashes[order[i + j]],
+                                            seed);
+                if (index->commands[slots[j]] != NULL) break;
+                for (k = 0; k < j; k++) if (slots[k] == slots[j]) break;
+                if (k < j) break;
+            }
+            if (j == bucket_size) break;
+        }
+        if (seed > COMMAND_INDEX_MAX_SEED) {
+            ok = 0;
+            break;
+        }
+        index->seeds[buckets[order[i]]] = seed;
+        for (j = 0; j < bucket_size; j++) {
+            redisCommandDef *cmd = commands[order[i + j]];
+            index->commands[slots[j]] = cmd;
+            index->lengths[slots[j]] = strlen(cmd->name);
+        }
+        i += bucket_size;
+    }
+    zfree(order);
+    zfree(slots);
+    zfree(sizes);
+    return ok;
+}
+
+/* Build the perfect hash of the given commands. When more commands have the
+ * same name, the last one wins. Returns NULL on failure. */
+redisCommandIndex *createCommandIndex(redisCommandDef **commands, int count) {
+    redisCommandDef **cmds = zmalloc(count * sizeof(*cmds));
+    uint64_t *hashes = zmalloc(count * sizeof(uint64_t));
+    uint32_t *buckets = zmalloc(count * sizeof(uint32_t));
+    redisCommandIndex *index = NULL;
+    int i, j, bucket_bits = 0;
+    while ((1 << bucket_bits) < count) bucket_bits++;
+    uint32_t size = 1 << (bucket_bits + 1);
+    for (i = 0; i < count; i++) {
+        cmds[i] = commands[i];
+        hashes[i] = commandNameHash(cmds[i]->name, strlen(cmds[i]->name));
+    }
+    /* Drop the duplicates, they would never fit in different slots. */
+    for (i = 0; i < count; i++) {
+        for (j = i + 1; j < count && cmds[i] != NULL; j++) {
+            if (cmds[j] != NULL && hashes[i] == hashes[j] &&
+                !strcasecmp(cmds[i]->name, cmds[j]->name)) cmds[i] = NULL;
+        }
+    }
+    while (size <= (1 << 24)) {
+        index = zcalloc(sizeof(*index));
+        index->size = size;
+        index->bucket_bits = bucket_bits;
+        index->seeds = zcalloc(((size_t) 1 << bucket_bits) * sizeof(uint32_t));
+        index->commands = zcalloc(size * sizeof(redisCommandDef *));
+        index->lengths = zcalloc(size * sizeof(size_t));
+        for (i = 0; i < count; i++)
+            buckets[i] = commandIndexBucket(index, hashes[i]);
+        if (fillCommandIndex(index, cmds, hashes, buckets, count)) break;
+        freeCommandIndex(index);
+        index = NULL;
+        size <<= 1;
+    }
+    zfree(cmds);
+    zfree(hashes);
+    zfree(buckets);
+    return index;
+}
+
+/* Look up the command with the given name (case insensitive), that doesn't
+ * need to be null terminated. Returns NULL if there's no such command. */
+redisCommandDef *lookupCommandIndex(redisCommandIndex *index,
+                                    const char *name, size_t len)
+{
+    uint64_t h = commandNameHash(name, len);
+    uint32_t seed = index->seeds[commandIndexBucket(index, h)];
+    if (seed == 0) return NULL;
+    uint32_t slot = commandIndexSlot(index, h, seed);
+    redisCommandDef *cmd = index->commands[slot];
+    if (cmd == NULL ||
+        !commandNameEquals(name, len, cmd->name, index->lengths[slot]))
+        return NULL;
+    return cmd;
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <ctype.h>
+#include <sys/time.h>
+#include "rax.h"
+#include "sds.h"
+
+#define COMMANDS_TEST_LOOKUPS 10000000
+
+static long long commandsTestUstime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long) tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+/* Lookup through a radix tree of the lowercase names, like the proxy used
+ * to do for every request. */
+static redisCommandDef *commandsTestRaxLookup(rax *commands, const char *name,
+                                              size_t len)
+{
+    redisCommandDef *cmd = NULL;
+    sds lname = sdsnewlen(name, len);
+    sdstolower(lname);
+    raxIterator iter;
+    raxStart(&iter, commands);
+    if (raxSeek(&iter, "=", (unsigned char*) lname, sdslen(lname)))
+        if (raxNext(&iter)) cmd = (redisCommandDef *) iter.data;
+    raxStop(&iter);
+    sdsfree(lname);
+    return cmd;
+}
+
+/* Run the key extraction of the command on the space separated arguments,
+ * checking that it finds the expected keys (space separated too, "" if
+ * there are no keys, NULL if the arguments are invalid). */
+static int commandsTestGetKeys(redisCommandIndex *index, char *args,
+                               char *expected)
+{
+    int offsets[32], lengths[32], keys[32], argc = 0, numkeys, i;
+    char *p = args;
+    while (*p != '\0' && argc < 32) {
+        char *sep = strchr(p, ' ');
+        if (sep == NULL) sep = p + strlen(p);
+        offsets[argc] = p - args;
+        lengths[argc++] = sep - p;
+        p = (*sep != '\0' ? sep + 1 : sep);
+    }
+    redisCommandDef *cmd = lookupCommandIndex(index, args, lengths[0]);
+    if (cmd == NULL || cmd->getkeys == NULL) return 0;
+    numkeys = cmd->getkeys(args, offsets, lengths, argc, keys);
+    sds found = sdsempty();
+    for (i = 0; i < numkeys; i++) {
+        if (i > 0) found = sdscat(found, " ");
+        found = sdscatlen(found, args + offsets[keys[i]], lengths[keys[i]]);
+    }
+    int ok = (expected == NULL ? numkeys < 0 :
+              (numkeys >= 0 && !strcmp(found, expected)));
+    if (!ok) {
+        printf("Keys of '%s': got '%s', expected '%s'\n", args,
+               (numkeys < 0 ? "(invalid)" : found),
+               (expected ? expected : "(invalid)"));
+    }
+    sdsfree(found);
+    return ok;
+}
+
+int commandsTest(int argc, char *argv[]) {
+    ((void) argc);
+    ((void) argv);
+    int count = sizeof(redisCommandTable) / sizeof(redisCommandDef);
+    int errors = 0, i;
+    redisCommandDef **commands = zmalloc(count * sizeof(*commands));
+    rax *tree = raxNew();
+    for (i = 0; i < count; i++) {
+        commands[i] = redisCommandTable + i;
+        populateCommandFlags(commands[i]);
+        raxInsert(tree, (unsigned char*) commands[i]->name,
+                  strlen(commands[i]->name), commands[i], NULL);
+    }
+    redisCommandIndex *index = createCommandIndex(commands, count);
+    if (index == NULL) {
+        printf("command index: FAILED to build\n");
+        return 1;
+    }
+    /* Every command is found with any case, and only with its own name. */
+    char **names = zmalloc(count * sizeof(char *));
+    for (i = 0; i < count; i++) {
+        const char *name = commands[i]->name;
+        size_t j, len = strlen(name);
+        names[i] = zmalloc(len + 1);
+        for (j = 0; j <= len; j++)
+            names[i][j] = (j % 2) ? toupper(name[j]) : name[j];
+        if (lookupCommandIndex(index, name, len) != commands[i]) errors++;
+        if (lookupCommandIndex(index, names[i], len) != commands[i]) errors++;
+        if (len > 1 &&
+            lookupCommandIndex(index, name, len - 1) == commands[i]) errors++;
+    }
+    const char *unknown[] = {"foo", "gett", "ge", "", "get ", "x-get", NULL};
+    for (i = 0; unknown[i] != NULL; i++) {
+        if (lookupCommandIndex(index, unknown[i], strlen(unknown[i])) != NULL)
+            errors++;
+    }
+    /* Duplicated names: the last command wins. */
+    redisCommandDef dup = {"GET", 2, "r", 1, 1, 1, 0, NULL, NULL, 0};
+    redisCommandDef **withdup = zmalloc((count + 1) * sizeof(*withdup));
+    memcpy(withdup, commands, count * sizeof(*withdup));
+    withdup[count] = &dup;
+    redisCommandIndex *dupindex = createCommandIndex(withdup, count + 1);
+    if (dupindex == NULL || lookupCommandIndex(dupindex, "get", 3) != &dup)
+        errors++;
+    freeCommandIndex(dupindex);
+    zfree(withdup);
+    /* Flags from the command table and from the COMMAND replies. */
+    redisCommandDef *xread = lookupCommandIndex(index, "xread", 5);
+    if (xread == NULL || xread->flags != (CMD_READONLY | CMD_NOSCRIPT |
+                                          CMD_BLOCKING | CMD_MOVABLE_KEYS))
+        errors++;
+    if (getCommandFlagByName("MAY_REPLICATE") != CMD_MAY_REPLICATE ||
+        getCommandFlagByName("no_such_flag") != 0) errors++;
+    /* Key extraction of the commands with movable keys. */
+    char *getkeys_tests[] = {
+        "EVAL s 2 k1 k2 a1", "k1 k2",
+        "evalsha s 0 a1", "",
+        "EVAL s 3 k1", NULL,
+        "EVAL s -1 k1", NULL,
+        "ZUNIONSTORE d 2 k1 k2 WEIGHTS 1 2", "d k1 k2",
+        "zinterstore d 0 k1", NULL,
+        "XREAD COUNT 2 BLOCK 0 STREAMS k1 k2 0 0", "k1 k2",
+        "XREADGROUP GROUP g c NOACK STREAMS k1 >", "k1",
+        "XREAD STREAMS k1 k2 0", NULL,
+        "XREAD COUNT 2 k1 0", NULL,
+        "GEORADIUS k 0 0 1 km STORE d1 STOREDIST d2", "k d2",
+        "GEORADIUSBYMEMBER k m 1 km WITHDIST", "k",
+        "SORT k BY store LIMIT 0 1 GET store STORE d", "k d",
+        "SORT k", "k",
+        "MIGRATE h 1 k 0 100 COPY", "k",
+        "MIGRATE h 1  0 100 AUTH keys KEYS k1 k2", "k1 k2",
+        "MIGRATE h 1 k 0 100 KEYS k1", NULL,
+        NULL
+    };
+    for (i = 0; getkeys_tests[i] != NULL; i += 2) {
+        if (!commandsTestGetKeys(index, getkeys_tests[i],
+                                 getkeys_tests[i + 1])) errors++;
+    }
+    printf("command index of %d commands, %u slots: %s\n", count,
+           index->size, errors ? "FAILED" : "OK");
+    /* Benchmark, looking up mixed case names. */
+    size_t *lens = zmalloc(count * sizeof(size_t));
+    for (i = 0; i < count; i++) lens[i] = strlen(names[i]);
+    long long start = commandsTestUstime(), found = 0;
+    for (i = 0; i < COMMANDS_TEST_LOOKUPS; i++) {
+        int n = i % count;
+        found += (commandsTestRaxLookup(tree, names[n], lens[n]) != NULL);
+    }
+    long long rax_time = commandsTestUstime() - start;
+    start = commandsTestUstime();
+    for (i = 0; i < COMMANDS_TEST_LOOKUPS; i++) {
+        int n = i % count;
+        found += (lookupCommandIndex(index, names[n], lens[n]) != NULL);
+    }
+    long long index_time = commandsTestUstime() - start;
+    if (found != 2LL * COMMANDS_TEST_LOOKUPS) errors++;
+    printf("%d lookups: rax %.1f ns, perfect hash %.1f ns per lookup\n",
+           COMMANDS_TEST_LOOKUPS,
+           (rax_time * 1000.0) / COMMANDS_TEST_LOOKUPS,
+           (index_time * 1000.0) / COMMANDS_TEST_LOOKUPS);
+    for (i = 0; i < count; i++) zfree(names[i]);
+    zfree(names);
+    zfree(lens);
+    zfree(commands);
+    freeCommandIndex(index);
+    raxFree(tree);
+    return errors ? 1 : 0;
+}
+#endif
@@ -20,23 +20,92 @@
 #define __REDIS_CLUSTER_PROXY_COMMANDS_H__
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <hiredis.h>
+#include "sds.h"
 
 #define PROXY_COMMAND_HANDLED      1
 #define PROXY_COMMAND_UNHANDLED    0
 
+/* Command flags, parsed from the 'sflags' string of every command (that
+ * uses the same letters of the Redis command table) at startup, or from
+ * the flags reported by COMMAND. They're copied into every request, so
+ * that routing and scheduling decisions never need to compare strings. */
+#define CMD_WRITE           (1<<0)  /* "w" flag */
+#define CMD_READONLY        (1<<1)  /* "r" flag */
+#define CMD_DENYOOM         (1<<2)  /* "m" flag */
+#define CMD_ADMIN           (1<<3)  /* "a" flag */
+#define CMD_PUBSUB          (1<<4)  /* "p" flag */
+#define CMD_NOSCRIPT        (1<<5)  /* "s" flag */
+#define CMD_RANDOM          (1<<6)  /* "R" flag */
+#define CMD_SORT_FOR_SCRIPT (1<<7)  /* "S" flag */
+#define CMD_LOADING         (1<<8)  /* "l" flag */
+#define CMD_STALE           (1<<9)  /* "t" flag */
+#define CMD_SKIP_MONITOR    (1<<10) /* "M" flag */
+#define CMD_ASKING          (1<<11) /* "k" flag */
+#define CMD_FAST            (1<<12) /* "F" flag */
+/* Letters used by the proxy only, for flags that the Redis command table
+ * doesn't have (COMMAND reports them since Redis 7, excepted movablekeys
+ * that is always reported). */
+#define CMD_BLOCKING        (1<<13) /* "B" flag */
+#define CMD_MOVABLE_KEYS    (1<<14) /* "K" flag */
+#define CMD_MAY_REPLICATE   (1<<15) /* "P" flag */
+
 typedef int redisClusterProxyCommandHandler(void *);
 
+/* Find the keys of a command whose keys cannot be described by first_key,
+ * last_key and key_step, working on the arguments as they are in the query
+ * buffer. The positions of the keys are stored into 'keys', that has room
+ * for 'argc' positions. Returns the number of keys, or -1 if the arguments
+ * are invalid. */
+typedef int redisCommandGetKeysProc(char *buffer, int *offsets, int *lengths,
+                                    int argc, int *keys);
+
 typedef struct redisCommandDef {
     char *name;
     int arity;
+    char *sflags;   /* Flags as string representation, one char per flag. */
     int first_key;
     int last_key;
     int key_step;
     int unsupported;
     redisClusterProxyCommandHandler* handle;
+    redisCommandGetKeysProc *getkeys;
+    int flags;      /* The actual flags, obtained from the 'sflags' field. */
+    int loaded;     /* Created by createCommandFromReply, not in the table. */
+    _Atomic int refcount; /* Requests using a loaded command. */
 } redisCommandDef;
 
 
-extern struct redisCommandDef redisCommandTable[203];
+extern struct redisCommandDef redisCommandTable[204];
+
+/* Perfect hash of the commands, using the "hash and displace" scheme: the
+ * hash of a name selects a bucket, and the seed of the bucket (chosen when
+ * the index is built so that the names of the bucket never collide with
+ * the others) selects the only slot where the command may be. Names are
+ * case insensitive, so that they can be looked up directly on the query
+ * buffers of the requests. */
+typedef struct redisCommandIndex {
+    uint32_t size;              /* Slots of 'commands', a power of two. */
+    int bucket_bits;            /* Log2 of the number of buckets. */
+    uint32_t *seeds;            /* Seed of every bucket, 0 if empty. */
+    redisCommandDef **commands; /* Commands by slot, NULL if empty. */
+    size_t *lengths;            /* Name lengths of the commands. */
+} redisCommandIndex;
+
+void populateCommandFlags(redisCommandDef *cmd);
+int getCommandFlagByName(const char *name);
+sds catCommandInfo(sds reply, redisCommandDef *cmd);
+redisCommandDef *createCommandFromReply(redisReply *reply);
+void freeCommand(redisCommandDef *cmd);
+int commandsAreEqual(redisCommandDef *a, redisCommandDef *b);
+redisCommandIndex *createCommandIndex(redisCommandDef **commands, int count);
+void freeCommandIndex(redisCommandIndex *index);
+redisCommandDef *lookupCommandIndex(redisCommandIndex *index,
+                                    const char *name, size_t len);
+
+#ifdef REDIS_TEST
+int commandsTest(int argc, char *argv[]);
+#endif
 
 #endif /* __REDIS_CLUSTER_PROXY_COMMANDS_H__  */
@@ -20,6 +20,9 @@
 
 #include "redis_config.h"
 
+#define REPLICA_POLICY_ROUND_ROBIN          0
+#define REPLICA_POLICY_LEAST_OUTSTANDING    1
+
 typedef struct {
     int port;
     char *cluster_address;
@@ -36,6 +39,17 @@ typedef struct {
     int dump_queries;
     int dump_buffer;
     int dump_queues;
+    int cluster_refresh_interval;
+    char *cluster_snapshot;
+    int read_from_replicas;
+    int replica_policy;
+    double hedge_reads_percentile;
+    int hedge_reads_min_delay;
+    int failover_hold_time;
+    int hot_slot_threshold;
+    int broadcast_timeout;
+    int scan_prefetch;
+    int private_connections;
     char *auth;
 } redisClusterProxyConfig;
 
@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "latency.h"
+#include <string.h>
+
+void latencyHistogramInit(latencyHistogram *h, uint64_t window) {
+    h->window = window;
+    latencyHistogramReset(h);
+}
+
+void latencyHistogramReset(latencyHistogram *h) {
+    h->count = 0;
+    memset(h->buckets, 0, sizeof(h->buckets));
+}
+
+static int latencyBucketIndex(uint64_t usec) {
+    if (usec < LATENCY_HISTOGRAM_SUB_BUCKETS) return (int) usec;
+    if (usec >= (1ULL << LATENCY_HISTOGRAM_MAX_BITS))
+        return LATENCY_HISTOGRAM_BUCKETS - 1;
+    int msb = 63 - __builtin_clzll(usec);
+    int shift = msb - LATENCY_HISTOGRAM_SUB_BITS;
+    return (shift + 1) * LATENCY_HISTOGRAM_SUB_BUCKETS +
+           (int) ((usec >> shift) & (LATENCY_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* Return the highest latency that falls into the bucket. */
+static long long latencyBucketMax(int idx) {
+    if (idx < LATENCY_HISTOGRAM_SUB_BUCKETS) return idx;
+    int shift = (idx / LATENCY_HISTOGRAM_SUB_BUCKETS) - 1;
+    long long sub = LATENCY_HISTOGRAM_SUB_BUCKETS +
+                    (idx % LATENCY_HISTOGRAM_SUB_BUCKETS);
+    return ((sub + 1) << shift) - 1;
+}
+
+void latencyHistogramAdd(latencyHistogram *h, long long usec) {
+    int i;
+    if (usec < 0) usec = 0;
+    h->buckets[latencyBucketIndex(usec)]++;
+    if (++h->count < h->window || h->window == 0) return;
+    h->count = 0;
+    for (i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+        h->buckets[i] >>= 1;
+        h->count += h->buckets[i];
+    }
+}
+
+/* Return the latency (an upper bound of it, given the buckets resolution)
+ * below which 'percentile' percent of the samples fall, or 0 if the
+ * histogram is empty. */
+long long latencyHistogramPercentile(latencyHistogram *h, double percentile) {
+    uint64_t seen = 0, rank;
+    int i;
+    if (h->count == 0) return 0;
+    double r = (percentile / 100) * h->count;
+    rank = (uint64_t) r;
+    if ((double) rank < r) rank++;
+    if (rank < 1) rank = 1;
+    if (rank > h->count) rank = h->count;
+    for (i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) return latencyBucketMax(i);
+    }
+    return latencyBucketMax(LATENCY_HISTOGRAM_BUCKETS - 1);
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LATENCY_TEST_REQUESTS       500000
+#define LATENCY_TEST_INTERVAL       20      /* us between requests */
+#define LATENCY_TEST_STALL_PERIOD   500000  /* us */
+#define LATENCY_TEST_STALL          30000   /* us */
+#define LATENCY_TEST_MIN_SAMPLES    100
+
+static int latencyTestCheck(long long value, long long expected) {
+    long long error = expected / LATENCY_HISTOGRAM_SUB_BUCKETS + 1;
+    if (value >= expected - error && value <= expected + error) return 1;
+    fprintf(stderr, "Got %lld, expected %lld\n", value, expected);
+    return 0;
+}
+
+/* Service time of a healthy node: 100-300us, 5% of 300-1500us and a 0.2%
+ * tail of 2-5ms. */
+static long long latencyTestServiceTime(void) {
+    int r = rand() % 1000;
+    if (r < 2) return 2000 + rand() % 3000;
+    if (r < 50) return 300 + rand() % 1200;
+    return 100 + rand() % 200;
+}
+
+/* Simulate a read load against a master that periodically stalls (ie.
+ * because of a slow fork), hedging the reads to a replica after the
+ * given percentile of the latencies seen so far (0 disables hedging). The
+ * hedging delay is computed exactly like the proxy does. */
+static void latencyTestHedging(double percentile, long long min_delay) {
+    latencyHistogram seen, results;
+    long long i, hedged = 0;
+    srand(1234);
+    latencyHistogramInit(&seen, 10000);
+    latencyHistogramInit(&results, 0);
+    for (i = 0; i < LATENCY_TEST_REQUESTS; i++) {
+        /* Start right after a stall, so that hedging has enough samples
+         * to compute the delay before the next one. */
+        long long now = LATENCY_TEST_STALL + i * LATENCY_TEST_INTERVAL;
+        long long stall = now % LATENCY_TEST_STALL_PERIOD;
+        long long latency = latencyTestServiceTime();
+        if (stall < LATENCY_TEST_STALL) latency += LATENCY_TEST_STALL - stall;
+        long long replica_latency = latencyTestServiceTime();
+        long long attempt_latency = latency;
+        if (percentile > 0 && seen.count >= LATENCY_TEST_MIN_SAMPLES) {
+            long long delay = latencyHistogramPercentile(&seen, percentile);
+            if (delay < min_delay) delay = min_delay;
+            if (latency > delay) {
+                hedged++;
+                if (delay + replica_latency < latency) {
+                    latency = delay + replica_latency;
+                    attempt_latency = replica_latency;
+                }
+            }
+        }
+        /* Like the proxy, track the latency of the attempt that won,
+         * measured from the time it was sent: the latency of the hedged
+         * requests would otherwise raise the delay while the master is
+         * stalled, making hedging less and less effective. */
+        latencyHistogramAdd(&seen, attempt_latency);
+        latencyHistogramAdd(&results, latency);
+    }
+    char name[32];
+    if (percentile > 0) snprintf(name, sizeof(name), "p%g", percentile);
+    else snprintf(name, sizeof(name), "none");
+    printf("hedging %-6s p50 %6lld us, p99 %6lld us, p99.9 %6lld us, "
+           "hedged %.2f%%\n", name,
+           latencyHistogramPercentile(&results, 50),
+           latencyHistogramPercentile(&results, 99),
+           latencyHistogramPercentile(&results, 99.9),
+           (hedged * 100.0) / LATENCY_TEST_REQUESTS);
+}
+
+int latencyTest(int argc, char *argv[]) {
+    ((void) argc);
+    ((void) argv);
+    latencyHistogram h;
+    int errors = 0, i;
+    latencyHistogramInit(&h, 0);
+    if (latencyHistogramPercentile(&h, 99) != 0) errors++;
+    for (i = 1; i <= 100000; i++) latencyHistogramAdd(&h, i);
+    if (!latencyTestCheck(latencyHistogramPercentile(&h, 50), 50000)) errors++;
+    if (!latencyTestCheck(latencyHistogramPercentile(&h, 99), 99000)) errors++;
+    if (!latencyTestCheck(latencyHistogramPercentile(&h, 99.9), 99900))
+        errors++;
+    if (!latencyTestCheck(latencyHistogramPercentile(&h, 100), 100000))
+        errors++;
+    /* Small values are exact. */
+    latencyHistogramReset(&h);
+    for (i = 0; i < 8; i++) latencyHistogramAdd(&h, i);
+    if (latencyHistogramPercentile(&h, 50) != 3) errors++;
+    /* With a window, old samples fade away. */
+    latencyHistogramInit(&h, 1000);
+    for (i = 0; i < 1000; i++) latencyHistogramAdd(&h, 10000);
+    for (i = 0; i < 5000; i++) latencyHistogramAdd(&h, 100);
+    if (!latencyTestCheck(latencyHistogramPercentile(&h, 99), 100)) errors++;
+    if (h.count >= 1000) errors++;
+    printf("latency histogram: %s\n", errors ? "FAILED" : "OK");
+    printf("Simulated reads every %dus, master stalled for %dms every %dms:\n",
+           LATENCY_TEST_INTERVAL, LATENCY_TEST_STALL / 1000,
+           LATENCY_TEST_STALL_PERIOD / 1000);
+    latencyTestHedging(0, 0);
+    latencyTestHedging(90, 200);
+    latencyTestHedging(95, 200);
+    latencyTestHedging(99, 200);
+    latencyTestHedging(99.9, 200);
+    return errors ? 1 : 0;
+}
+#endif
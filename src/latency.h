@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REDIS_CLUSTER_PROXY_LATENCY_H__
+#define __REDIS_CLUSTER_PROXY_LATENCY_H__
+
+#include <stdint.h>
+
+/* Log-linear histogram of latencies in microseconds: every power of two is
+ * split into LATENCY_HISTOGRAM_SUB_BUCKETS buckets, so that the error on
+ * the reported percentiles is always less than 1/LATENCY_HISTOGRAM_SUB_BUCKETS
+ * while the histogram stays small enough to be kept by every thread. */
+#define LATENCY_HISTOGRAM_SUB_BITS      3
+#define LATENCY_HISTOGRAM_SUB_BUCKETS   (1 << LATENCY_HISTOGRAM_SUB_BITS)
+#define LATENCY_HISTOGRAM_MAX_BITS      40 /* Up to ~12 days */
+#define LATENCY_HISTOGRAM_BUCKETS \
+    ((LATENCY_HISTOGRAM_MAX_BITS - LATENCY_HISTOGRAM_SUB_BITS + 1) * \
+     LATENCY_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct latencyHistogram {
+    uint64_t count;
+    uint64_t window;    /* When count reaches window, all the buckets are
+                         * halved, so that old samples fade away. 0 means
+                         * that samples are never discarded. */
+    uint64_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+} latencyHistogram;
+
+void latencyHistogramInit(latencyHistogram *h, uint64_t window);
+void latencyHistogramReset(latencyHistogram *h);
+void latencyHistogramAdd(latencyHistogram *h, long long usec);
+long long latencyHistogramPercentile(latencyHistogram *h, double percentile);
+
+#ifdef REDIS_TEST
+int latencyTest(int argc, char *argv[]);
+#endif
+
+#endif /* __REDIS_CLUSTER_PROXY_LATENCY_H__ */
@@ -60,6 +60,20 @@ void addReplyString(client *c, const char *str, uint64_t req_id) {
     addReplyStringLen(c, str, strlen(str), req_id);
 }
 
+void addReplyBulkStringLen(client *c, const char *str, int len,
+                           uint64_t req_id)
+{
+    sds r = sdscatfmt(sdsempty(), "$%i\r\n", len);
+    r = sdscatlen(r, str, len);
+    r = sdscat(r, "\r\n");
+    if (c->reply_array != NULL) {
+        listAddNodeTail(c->reply_array, r);
+        return;
+    }
+    addReplyRaw(c, (const char*) r, sdslen(r), req_id);
+    sdsfree(r);
+}
+
 void addReplyInt(client *c, int64_t integer, uint64_t req_id) {
     sds r = sdsnew(":");
     r = sdscatfmt(r, "%I\r\n", integer);
@@ -102,3 +116,34 @@ void addReplyRaw(client *c, const char *buf, size_t len, uint64_t req_id) {
     c->min_reply_id = req_id + 1;
     appendUnorderedRepliesToBuffer(c);
 }
+
+/* Append the RESP representation of a reply read from a node to 's'.
+ * RESP3 types get their closest RESP2 representation. */
+sds catReplyObject(sds s, redisReply *reply) {
+    size_t i;
+    switch (reply->type) {
+    case REDIS_REPLY_STRING:
+    case REDIS_REPLY_DOUBLE:
+        s = sdscatfmt(s, "$%U\r\n", (unsigned long long) reply->len);
+        s = sdscatlen(s, reply->str, reply->len);
+        return sdscatlen(s, "\r\n", 2);
+    case REDIS_REPLY_STATUS:
+    case REDIS_REPLY_ERROR:
+        s = sdscatlen(s, (reply->type == REDIS_REPLY_STATUS ? "+" : "-"), 1);
+        s = sdscatlen(s, reply->str, reply->len);
+        return sdscatlen(s, "\r\n", 2);
+    case REDIS_REPLY_INTEGER:
+    case REDIS_REPLY_BOOL:
+        return sdscatfmt(s, ":%I\r\n", reply->integer);
+    case REDIS_REPLY_ARRAY:
+    case REDIS_REPLY_MAP:
+    case REDIS_REPLY_SET:
+    case REDIS_REPLY_PUSH:
+        s = sdscatfmt(s, "*%U\r\n", (unsigned long long) reply->elements);
+        for (i = 0; i < reply->elements; i++)
+            s = catReplyObject(s, reply->element[i]);
+        return s;
+    default:
+        return sdscatlen(s, "$-1\r\n", 5);
+    }
+}
@@ -25,9 +25,12 @@ int initReplyArray(client *c);
 void addReplyArray(client *c, uint64_t req_id);
 void addReplyStringLen(client *c, const char *str, int len, uint64_t req_id);
 void addReplyString(client *c, const char *str, uint64_t req_id);
+void addReplyBulkStringLen(client *c, const char *str, int len,
+                           uint64_t req_id);
 void addReplyInt(client *c, int64_t integer, uint64_t req_id);
 void addReplyErrorLen(client *c, const char *err, int len, uint64_t req_id);
 void addReplyError(client *c, const char *err, uint64_t req_id);
 void addReplyRaw(client *c, const char *buf, size_t len, uint64_t req_id);
+sds catReplyObject(sds s, redisReply *reply);
 
 #endif /* __REDIS_CLUSTER_PROXY_PROTOCOL_H__ */
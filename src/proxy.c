@@ -20,14 +20,18 @@
 #include "logger.h"
 #include "zmalloc.h"
 #include "protocol.h"
+#include "crc16.h"
+#include "latency.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #define DEFAULT_PORT            7777
 #define DEFAULT_MAX_CLIENTS     10000
@@ -35,7 +39,27 @@
 #define DEFAULT_THREADS         8
 #define DEFAULT_TCP_KEEPALIVE   300
 #define DEFAULT_TCP_BACKLOG     511
+#define DEFAULT_CLUSTER_REFRESH_INTERVAL 10
+#define CLUSTER_REFRESH_MIN_INTERVAL     1000 /* ms */
+#define CLUSTER_REFRESH_TIMEOUT          5000 /* ms */
+#define COMMANDS_REFRESH_MIN_INTERVAL    10000 /* ms */
+#define PROXY_CRON_PERIOD       100 /* ms */
+#define THREAD_CRON_PERIOD      100 /* ms */
 #define QUERY_OFFSETS_MIN_SIZE  10
+#define REQUEST_KEYS_STACK_SIZE 32
+#define MAX_REDIRECTIONS        5
+#define MAX_MOVED_KEYS          10000 /* Per thread */
+#define DEFAULT_HEDGE_READS_MIN_DELAY   1000  /* us */
+#define HEDGE_READS_MIN_SAMPLES         100
+#define HEDGE_READS_LATENCY_WINDOW      10000 /* samples */
+#define DEFAULT_FAILOVER_HOLD_TIME      2000  /* ms */
+#define HELD_REQUESTS_RETRY_PERIOD      500   /* ms */
+#define STANDBY_CONNECT_PERIOD          1000  /* ms */
+#define CLUSTER_NODE_CONNECT_BACKOFF    2000  /* ms */
+#define HOT_SLOTS_CHECK_PERIOD          1000  /* ms */
+#define DEFAULT_BROADCAST_TIMEOUT       5000  /* ms */
+#define DEFAULT_PRIVATE_CONNECTIONS     16    /* Per node and thread */
+#define ASKING_COMMAND          "*1\r\n$6\r\nASKING\r\n"
 #define EL_INSTALL_HANDLER_FAIL 9999
 #define REQ_STATUS_UNKNOWN      -1
 #define PARSE_STATUS_INCOMPLETE -1
@@ -55,16 +79,26 @@
 #define UNUSED(V) ((void) V)
 
 #define getClusterConnection(node, thread_id) (node->connections[thread_id])
+#define clientReadsFromReplicas(c) \
+    ((c)->replica_reads == CLIENT_REPLICA_READS_DEFAULT ? \
+     config.read_from_replicas : (c)->replica_reads)
+/* Reads of hot slots go to the replicas, unless the client used READWRITE. */
+#define isReplicaRead(c, slot) \
+    (clientReadsFromReplicas(c) || \
+     ((c)->replica_reads != 0 && proxy.hot_slots[slot]))
+#define requestClusterRefresh() (proxy.cluster->refresh_requested = 1)
 #define enqueueRequestToSend(req) (enqueueRequest(req, QUEUE_TYPE_SENDING))
 #define dequeueRequestToSend(req) (dequeueRequest(req, QUEUE_TYPE_SENDING))
 #define enqueuePendingRequest(req) (enqueueRequest(req, QUEUE_TYPE_PENDING))
 #define dequeuePendingRequest(req) (dequeueRequest(req, QUEUE_TYPE_PENDING))
-#define getFirstRequestToSend(node, t, isempty) \
-    (getFirstQueuedRequest(getClusterConnection(node, t)->requests_to_send,\
-     isempty))
-#define getFirstRequestPending(node, t, isempty) \
-    (getFirstQueuedRequest(getClusterConnection(node, t)->requests_pending,\
-     isempty))
+
+/* Traffic of a single slot, as seen by a single thread. */
+typedef struct slotStats {
+    uint64_t ops;
+    uint64_t bytes_in;          /* Bytes of the requests. */
+    uint64_t bytes_out;         /* Bytes of the replies. */
+    uint64_t latency;           /* Sum of the upstream latencies (us). */
+} slotStats;
 
 typedef struct proxyThread {
     int thread_id;
@@ -74,12 +108,36 @@ typedef struct proxyThread {
     list *clients;
     list *pending_messages;
     uint64_t next_client_id;
+    unsigned int next_replica;  /* Used to rotate the replicas for reads. */
+    unsigned int next_master;   /* Used to spread the keyless requests. */
     sds msgbuffer;
+    latencyHistogram read_latency; /* Latency of the hedgeable reads. */
+    long long hedge_delay;      /* Reads are hedged after this delay (us),
+                                 * -1 if hedging is disabled. */
+    list *hedge_candidates;     /* Hedgeable reads, oldest first. */
+    long long hedge_timer_id;   /* -1 if the hedging timer is not set. */
+    rax *moved_keys;            /* Keys of migrating slots that have been
+                                 * already moved to the importing node. */
+    list *held_requests;        /* Requests waiting for a failover. */
+    uint64_t held_map_version;  /* Slots map version seen by the held
+                                 * requests. */
+    long long held_retry_time;  /* Next retry (ms) of the held requests. */
+    long long standby_connect_time; /* Next connection (ms) to the standby
+                                     * replicas. */
+    _Atomic uint64_t rescued_requests; /* Held requests that got a reply. */
+    _Atomic uint64_t failed_requests;  /* Requests failed because of an
+                                        * unreachable node. */
+    slotStats *slot_stats;      /* Per-slot traffic, only updated by the
+                                 * thread itself (see PROXY SLOTSTATS). */
+    list *broadcasts;           /* Broadcast requests waiting for the
+                                 * replies of the nodes, oldest first. */
 } proxyThread;
 
 redisClusterProxy proxy;
 redisClusterProxyConfig config;
 
+static char *replicaPolicyNames[] = {"round-robin", "least-outstanding"};
+
 /* Forward declarations. */
 
 static proxyThread *createProxyThread(int index);
@@ -97,12 +155,36 @@ static void readClusterReply(aeEventLoop *el, int fd, void *privdata, int mask);
 static clusterNode *getRequestNode(clientRequest *req, sds *err);
 static clientRequest *handleNextRequestToCluster(clusterNode *node,
                                                  int thread_id);
+static clientRequest *handleNextRequestOnConnection(
+    redisClusterConnection *conn);
+static redisClusterConnection *getRequestConnection(clientRequest *req);
 static clientRequest *getFirstQueuedRequest(list *queue, int *is_empty);
 static int enqueueRequest(clientRequest *req, int queue_type);
 static void dequeueRequest(clientRequest *req, int queue_type);
 static int sendMessageToThread(proxyThread *thread, sds buf);
 static int installIOHandler(aeEventLoop *el, int fd, int mask, aeFileProc *proc,
                             void *data, int retried);
+static void setRequestAsking(clientRequest *req, int asking);
+static void setRequestCommand(clientRequest *req, redisCommandDef *cmd);
+static long long mstime(void);
+static long long ustime(void);
+static void addRequestErrorReply(clientRequest *req, const char *err);
+static void removeHedgeCandidate(clientRequest *req);
+static void purgeMovedKeys(proxyThread *thread);
+static void retryHeldRequests(proxyThread *thread);
+static void connectStandbyReplicas(proxyThread *thread);
+static void expireBroadcasts(proxyThread *thread);
+static void initFastCommands(void);
+static void initFanoutCommands(void);
+static void setSubRequestReply(clientRequest *req, redisReply *reply,
+                               const char *err);
+static void freeRequestFanout(clientRequest *req);
+static void prefetchScanPage(clientRequest *req);
+static void discardScanPrefetch(client *c);
+static void closePrivateConnection(redisClusterConnection *conn,
+                                   int thread_id, const char *err);
+static void releasePrivateConnection(redisClusterConnection *conn);
+redisCommandDef *getRedisCommand(const char *name, size_t len);
 
 /* Hiredis helpers */
 
@@ -157,6 +239,64 @@ static int __hiredisReadReplyFromBuffer(redisReader *r, void **reply) {
 
 /* Custom Commands */
 
+static int parseReplicaPolicy(char *name) {
+    int i, count = sizeof(replicaPolicyNames) / sizeof(char *);
+    for (i = 0; i < count; i++) {
+        if (!strcasecmp(name, replicaPolicyNames[i])) return i;
+    }
+    return -1;
+}
+
+/* Valid range of the numeric options that can be changed at runtime. */
+typedef struct numericOption {
+    char *name;
+    double min;
+    double max;
+} numericOption;
+
+static numericOption numericOptions[] = {
+    {"dump-queries", 0, 1},
+    {"dump-buffer", 0, 1},
+    {"dump-replies", 0, 1},
+    {"cluster-refresh-interval", 0, INT_MAX},
+    {"read-from-replicas", 0, 1},
+    {"hedge-reads-percentile", 0, 100},
+    {"hedge-reads-min-delay", 0, INT_MAX},
+    {"failover-hold-time", 0, INT_MAX},
+    {"hot-slot-threshold", 0, INT_MAX},
+    {"broadcast-timeout", 0, INT_MAX},
+    {"scan-prefetch", 0, 1},
+    {"private-connections", 1, INT_MAX}
+};
+
+/* Parse 'value' as the value of the numeric option 'name' and store it into
+ * 'opt', that is a double if 'is_float' is 1, an int otherwise. Return 0,
+ * leaving 'opt' untouched, if 'value' is not a number or it's out of the
+ * range of the option. */
+static int parseNumericOption(char *name, char *value, int is_float,
+                              void *opt)
+{
+    char *end = NULL;
+    double val;
+    errno = 0;
+    if (is_float) val = strtod(value, &end);
+    else val = (double) strtoll(value, &end, 10);
+    if (end == value || *end != '\0' || errno == ERANGE) return 0;
+    double min = INT_MIN, max = INT_MAX;
+    int i, count = sizeof(numericOptions) / sizeof(numericOption);
+    for (i = 0; i < count; i++) {
+        if (!strcmp(name, numericOptions[i].name)) {
+            min = numericOptions[i].min;
+            max = numericOptions[i].max;
+            break;
+        }
+    }
+    if (val < min || val > max) return 0;
+    if (is_float) *((double *) opt) = val;
+    else *((int *) opt) = (int) val;
+    return 1;
+}
+
 static sds proxySubCommandConfig(clientRequest *r, sds option, sds value,
                                  sds *err)
 {
@@ -164,7 +304,6 @@ static sds proxySubCommandConfig(clientRequest *r, sds option, sds value,
     sds reply = NULL;
     int ok = 0;
     int is_int = 0, is_float = 0, is_string = 0, read_only = 0;
-    UNUSED(is_float);
     UNUSED(is_string);
     if (strcmp("log-level", option) == 0) {
         opt = &(config.loglevel);
@@ -197,6 +336,35 @@ static sds proxySubCommandConfig(clientRequest *r, sds option, sds value,
     } else if (strcmp("dump-replies", option) == 0) {
         is_int = 1;
         opt = &(config.dump_queues);
+    } else if (strcmp("cluster-refresh-interval", option) == 0) {
+        is_int = 1;
+        opt = &(config.cluster_refresh_interval);
+    } else if (strcmp("read-from-replicas", option) == 0) {
+        is_int = 1;
+        opt = &(config.read_from_replicas);
+    } else if (strcmp("replica-read-policy", option) == 0) {
+        opt = &(config.replica_policy);
+    } else if (strcmp("hedge-reads-percentile", option) == 0) {
+        is_float = 1;
+        opt = &(config.hedge_reads_percentile);
+    } else if (strcmp("hedge-reads-min-delay", option) == 0) {
+        is_int = 1;
+        opt = &(config.hedge_reads_min_delay);
+    } else if (strcmp("failover-hold-time", option) == 0) {
+        is_int = 1;
+        opt = &(config.failover_hold_time);
+    } else if (strcmp("hot-slot-threshold", option) == 0) {
+        is_int = 1;
+        opt = &(config.hot_slot_threshold);
+    } else if (strcmp("broadcast-timeout", option) == 0) {
+        is_int = 1;
+        opt = &(config.broadcast_timeout);
+    } else if (strcmp("scan-prefetch", option) == 0) {
+        is_int = 1;
+        opt = &(config.scan_prefetch);
+    } else if (strcmp("private-connections", option) == 0) {
+        is_int = 1;
+        opt = &(config.private_connections);
     }
     if (opt == NULL) {
         if (err) *err = sdsnew("Invalid config option");
@@ -220,6 +388,18 @@ static sds proxySubCommandConfig(clientRequest *r, sds option, sds value,
         } else {
             reply = sdsnew(redisProxyLogLevels[config.loglevel]);
         }
+    } else if (opt == &(config.replica_policy)) {
+        if (value != NULL) {
+            int policy = parseReplicaPolicy(value);
+            if (policy == -1) {
+                *err = sdsnew("Invalid replica-read-policy");
+                return NULL;
+            }
+            config.replica_policy = policy;
+            ok = 1;
+        } else {
+            reply = sdsnew(replicaPolicyNames[config.replica_policy]);
+        }
     } else {
         if (value == NULL) {
             if (!initReplyArray(r->client)) {
@@ -228,14 +408,21 @@ static sds proxySubCommandConfig(clientRequest *r, sds option, sds value,
             }
             addReplyString(r->client, option, r->id);
             if (is_int) addReplyInt(r->client, *((int *) opt), r->id);
+            else if (is_float) {
+                char buf[32];
+                snprintf(buf, sizeof(buf), "%g", *((double *) opt));
+                addReplyString(r->client, buf, r->id);
+            }
             addReplyArray(r->client, r->id);
         } else {
             if (read_only) *err = sdsnew("This config option is read-only");
             else {
-                if (is_int) {
-                    *((int *) opt) = atoi(value);
-                    ok = 1;
-                }
+                if ((is_int || is_float) &&
+                    !parseNumericOption(option, value, is_float, opt))
+                {
+                    *err = sdscatfmt(sdsempty(), "Invalid value for %s",
+                                     option);
+                } else if (is_int || is_float) ok = 1;
             }
         }
     }
@@ -243,6 +430,98 @@ static sds proxySubCommandConfig(clientRequest *r, sds option, sds value,
     return reply;
 }
 
+#define SLOT_STATS_OPS          0
+#define SLOT_STATS_BYTES_IN     1
+#define SLOT_STATS_BYTES_OUT    2
+#define SLOT_STATS_LATENCY      3
+
+static char *slotStatsMetricNames[] = {"ops", "bytes-in", "bytes-out",
+                                       "latency"};
+
+typedef struct slotStatsEntry {
+    int slot;
+    uint64_t key;               /* Value of the metric used for sorting. */
+    uint64_t metrics[4];
+} slotStatsEntry;
+
+static int compareSlotStatsEntries(const void *a, const void *b) {
+    const slotStatsEntry *ea = a, *eb = b;
+    if (ea->key != eb->key) return (ea->key > eb->key ? -1 : 1);
+    return ea->slot - eb->slot;
+}
+
+/* PROXY SLOTSTATS [TOP <count> [ops|bytes-in|bytes-out|latency]]
+ *
+ * Merge the per-slot counters of all the threads and reply with an entry
+ * for every slot that got some traffic, sorted by slot, or just with the
+ * 'count' busiest slots (by number of operations by default). Every entry
+ * is an array containing the slot and an array of metric/value pairs,
+ * where the latency is the sum of the upstream latencies in microseconds.
+ * Counters are read while the other threads update them, so they can be
+ * slightly behind. */
+static void proxySubCommandSlotStats(clientRequest *req, sds *err) {
+    int top = -1, metric = SLOT_STATS_OPS, count = 0, slot, i;
+    if (req->argc > 2) {
+        sds arg = sdsnewlen(req->buffer + req->offsets[2], req->lengths[2]);
+        int ok = (strcasecmp(arg, "top") == 0 && req->argc >= 4 &&
+                  req->argc <= 5);
+        sdsfree(arg);
+        if (ok) {
+            arg = sdsnewlen(req->buffer + req->offsets[3], req->lengths[3]);
+            top = atoi(arg);
+            ok = (top > 0);
+            sdsfree(arg);
+        }
+        if (ok && req->argc == 5) {
+            arg = sdsnewlen(req->buffer + req->offsets[4], req->lengths[4]);
+            metric = -1;
+            for (i = 0; i < 4; i++) {
+                if (!strcasecmp(arg, slotStatsMetricNames[i])) metric = i;
+            }
+            ok = (metric != -1);
+            sdsfree(arg);
+        }
+        if (!ok) {
+            *err = sdsnew("Syntax error, try PROXY SLOTSTATS [TOP <count> "
+                          "[ops|bytes-in|bytes-out|latency]]");
+            return;
+        }
+    }
+    slotStatsEntry *entries = zcalloc(CLUSTER_SLOTS * sizeof(*entries));
+    for (slot = 0; slot < CLUSTER_SLOTS; slot++) {
+        slotStatsEntry *entry = entries + count;
+        for (i = 0; i < config.num_threads; i++) {
+            slotStats *stats = proxy.threads[i]->slot_stats + slot;
+            entry->metrics[SLOT_STATS_OPS] += stats->ops;
+            entry->metrics[SLOT_STATS_BYTES_IN] += stats->bytes_in;
+            entry->metrics[SLOT_STATS_BYTES_OUT] += stats->bytes_out;
+            entry->metrics[SLOT_STATS_LATENCY] += stats->latency;
+        }
+        if (entry->metrics[SLOT_STATS_OPS] == 0) continue;
+        entry->slot = slot;
+        entry->key = entry->metrics[metric];
+        count++;
+    }
+    if (top > 0) {
+        qsort(entries, count, sizeof(*entries), compareSlotStatsEntries);
+        if (count > top) count = top;
+    }
+    sds reply = sdscatfmt(sdsempty(), "*%i\r\n", count);
+    for (i = 0; i < count; i++) {
+        slotStatsEntry *entry = entries + i;
+        int j;
+        reply = sdscatfmt(reply, "*2\r\n:%i\r\n*8\r\n", entry->slot);
+        for (j = 0; j < 4; j++) {
+            reply = sdscatfmt(reply, "+%s\r\n:%U\r\n",
+                              slotStatsMetricNames[j],
+                              (unsigned long long) entry->metrics[j]);
+        }
+    }
+    addReplyRaw(req->client, reply, sdslen(reply), req->id);
+    sdsfree(reply);
+    zfree(entries);
+}
+
 int proxyCommand(void *r) {
     clientRequest *req = r;
     sds subcmd = NULL, err = NULL;
@@ -310,6 +589,40 @@ int proxyCommand(void *r) {
         if (value != NULL) sdsfree(value);
     } else if (strcasecmp("ping", subcmd) == 0) {
         addReplyString(req->client, "PONG", req->id);
+    } else if (strcasecmp("hotslots", subcmd) == 0) {
+        /* Reply with the slot and the request rate of every hot slot. */
+        sds entries = sdsempty();
+        int count = 0, slot;
+        for (slot = 0; slot < CLUSTER_SLOTS; slot++) {
+            if (!proxy.hot_slots[slot]) continue;
+            entries = sdscatfmt(entries, "*2\r\n:%i\r\n:%U\r\n", slot,
+                                (unsigned long long)
+                                proxy.hot_slots_rate[slot]);
+            count++;
+        }
+        sds reply = sdscatfmt(sdsempty(), "*%i\r\n", count);
+        reply = sdscatsds(reply, entries);
+        addReplyRaw(req->client, reply, sdslen(reply), req->id);
+        sdsfree(entries);
+        sdsfree(reply);
+    } else if (strcasecmp("slotstats", subcmd) == 0) {
+        proxySubCommandSlotStats(req, &err);
+    } else if (strcasecmp("stats", subcmd) == 0) {
+        uint64_t rescued = 0, failed = 0;
+        int i;
+        for (i = 0; i < config.num_threads; i++) {
+            rescued += proxy.threads[i]->rescued_requests;
+            failed += proxy.threads[i]->failed_requests;
+        }
+        if (!initReplyArray(req->client)) {
+            err = sdsnew("Out of memory");
+            goto final;
+        }
+        addReplyString(req->client, "rescued_requests", req->id);
+        addReplyInt(req->client, rescued, req->id);
+        addReplyString(req->client, "failed_requests", req->id);
+        addReplyInt(req->client, failed, req->id);
+        addReplyArray(req->client, req->id);
     } else {
         err = sdsnew("Unsupported subcommand ");
         err = sdscatfmt(err, "'%S' for command PROXY", subcmd);
@@ -324,18 +637,157 @@ final:
     return PROXY_COMMAND_HANDLED;
 }
 
+/* READONLY and READWRITE are handled by the proxy itself, since the
+ * connections to the cluster are shared by all the clients: they just
+ * enable or disable the routing of the client's reads to the replicas. */
+static int setClientReplicaReads(clientRequest *req, int enabled) {
+    req->client->replica_reads = enabled;
+    addReplyString(req->client, "OK", req->id);
+    freeRequest(req, 1);
+    return PROXY_COMMAND_HANDLED;
+}
+
+int readonlyCommand(void *r) {
+    return setClientReplicaReads(r, 1);
+}
+
+int readwriteCommand(void *r) {
+    return setClientReplicaReads(r, 0);
+}
+
+/* The following commands are answered by the proxy itself: sending them
+ * to a node would be useless (they don't depend on the data), and the
+ * health checks of every client would end up on the same node. */
+
+static int replyWrongArity(clientRequest *req) {
+    sds err = sdsnew("wrong number of arguments for '");
+    err = sdscatlen(err, req->buffer + req->offsets[0], req->lengths[0]);
+    err = sdscat(err, "' command");
+    sdstolower(err);
+    addReplyError(req->client, err, req->id);
+    sdsfree(err);
+    freeRequest(req, 1);
+    return PROXY_COMMAND_HANDLED;
+}
+
+int pingCommand(void *r) {
+    clientRequest *req = r;
+    if (req->argc > 2) return replyWrongArity(req);
+    if (req->argc == 2) {
+        addReplyBulkStringLen(req->client, req->buffer + req->offsets[1],
+                              req->lengths[1], req->id);
+    } else addReplyString(req->client, "PONG", req->id);
+    freeRequest(req, 1);
+    return PROXY_COMMAND_HANDLED;
+}
+
+int echoCommand(void *r) {
+    clientRequest *req = r;
+    if (req->argc != 2) return replyWrongArity(req);
+    addReplyBulkStringLen(req->client, req->buffer + req->offsets[1],
+                          req->lengths[1], req->id);
+    freeRequest(req, 1);
+    return PROXY_COMMAND_HANDLED;
+}
+
+/* Redis Cluster only has the database 0. */
+int selectCommand(void *r) {
+    clientRequest *req = r;
+    if (req->argc != 2) return replyWrongArity(req);
+    char *p = req->buffer + req->offsets[1], *end = p + req->lengths[1];
+    if (p == end) {
+        addReplyError(req->client, "invalid DB index", req->id);
+        freeRequest(req, 1);
+        return PROXY_COMMAND_HANDLED;
+    }
+    if (*p == '-') p++;
+    while (p < end && *p == '0') p++;
+    if (p < end && (*p < '0' || *p > '9'))
+        addReplyError(req->client, "invalid DB index", req->id);
+    else if (p < end)
+        addReplyError(req->client, "SELECT is not allowed in cluster mode",
+                      req->id);
+    else addReplyString(req->client, "OK", req->id);
+    freeRequest(req, 1);
+    return PROXY_COMMAND_HANDLED;
+}
+
+/* COMMAND, COMMAND COUNT and COMMAND INFO describe the commands known to
+ * the proxy (the ones of the cluster included), excepted for the ones
+ * that the proxy doesn't support. */
+int commandCommand(void *r) {
+    clientRequest *req = r;
+    redisCommandIndex *index = proxy.commands;
+    sds reply = NULL, subcmd = NULL;
+    uint32_t i;
+    int count = 0;
+    if (req->argc > 1) {
+        subcmd = sdsnewlen(req->buffer + req->offsets[1], req->lengths[1]);
+    }
+    if (subcmd == NULL || !strcasecmp(subcmd, "count")) {
+        sds entries = sdsempty();
+        for (i = 0; i < index->size; i++) {
+            redisCommandDef *cmd = index->commands[i];
+            if (cmd == NULL || cmd->unsupported) continue;
+            if (subcmd == NULL) entries = catCommandInfo(entries, cmd);
+            count++;
+        }
+        if (subcmd == NULL) {
+            reply = sdscatfmt(sdsempty(), "*%i\r\n", count);
+            reply = sdscatsds(reply, entries);
+        } else reply = sdscatfmt(sdsempty(), ":%i\r\n", count);
+        sdsfree(entries);
+    } else if (!strcasecmp(subcmd, "info")) {
+        int j;
+        reply = sdscatfmt(sdsempty(), "*%i\r\n", req->argc - 2);
+        for (j = 2; j < req->argc; j++) {
+            redisCommandDef *cmd =
+                getRedisCommand(req->buffer + req->offsets[j],
+                                req->lengths[j]);
+            if (cmd == NULL || cmd->unsupported)
+                reply = sdscat(reply, "*-1\r\n");
+            else reply = catCommandInfo(reply, cmd);
+        }
+    }
+    if (reply != NULL) {
+        addReplyRaw(req->client, reply, sdslen(reply), req->id);
+        sdsfree(reply);
+    } else {
+        sds err = sdsnew("Unsupported subcommand ");
+        err = sdscatfmt(err, "'%S' for command COMMAND", subcmd);
+        addReplyError(req->client, err, req->id);
+        sdsfree(err);
+    }
+    if (subcmd != NULL) sdsfree(subcmd);
+    freeRequest(req, 1);
+    return PROXY_COMMAND_HANDLED;
+}
+
+/* The connection is closed as soon as the reply has been written, while
+ * the requests following QUIT are just ignored. */
+int quitCommand(void *r) {
+    clientRequest *req = r;
+    req->client->close_after_reply = req->id + 1;
+    addReplyString(req->client, "OK", req->id);
+    freeRequest(req, 1);
+    return PROXY_COMMAND_HANDLED;
+}
+
 /* Proxy functions */
 
-static void dumpQueue(clusterNode *node, int thread_id, int type) {
-    redisClusterConnection *conn = getClusterConnection(node, thread_id);
+static void dumpQueue(redisClusterConnection *conn, int thread_id,
+                      int type)
+{
     if (conn == NULL) return;
+    clusterNode *node = conn->node;
     list *queue = NULL;
     if (type == QUEUE_TYPE_PENDING) queue = conn->requests_pending;
     else if (type == QUEUE_TYPE_SENDING) queue = conn->requests_to_send;
     if (queue == NULL) return;
     sds msg = sdsnew("Node ");
-    msg = sdscatprintf(msg, "%s:%d[thread %d] -> %s",
+    msg = sdscatprintf(msg, "%s:%d[thread %d%s] -> %s",
                        node->ip, node->port, thread_id,
+                       (conn->is_private ? ", private" : ""),
                        (type == QUEUE_TYPE_PENDING ? "requests pending: [" :
                                                      "requests to send: ["));
     listIter li;
@@ -353,14 +805,138 @@ static void dumpQueue(clusterNode *node, int thread_id, int type) {
     sdsfree(msg);
 }
 
-redisCommandDef *getRedisCommand(sds name) {
-    redisCommandDef *cmd = NULL;
+static void freeRetiredCommandIndex(void *index) {
+    freeCommandIndex(index);
+}
+
+/* Build the index of the commands, merging the command table with the
+ * commands reported by the cluster (see updateClusterCommands), and
+ * publish it. The replaced index is retired, since the threads could still
+ * be using it. Returns 0 on failure. */
+static int updateCommandIndex(void) {
+    int table_count = sizeof(redisCommandTable) / sizeof(redisCommandDef);
+    int count = table_count, i;
+    if (proxy.cluster_commands != NULL)
+        count += raxSize(proxy.cluster_commands);
+    redisCommandDef **commands = zmalloc(count * sizeof(*commands));
+    for (i = 0; i < table_count; i++) commands[i] = redisCommandTable + i;
+    if (proxy.cluster_commands != NULL) {
+        raxIterator iter;
+        raxStart(&iter, proxy.cluster_commands);
+        raxSeek(&iter, "^", NULL, 0);
+        while (raxNext(&iter)) commands[i++] = iter.data;
+        raxStop(&iter);
+    }
+    redisCommandIndex *index = createCommandIndex(commands, count);
+    zfree(commands);
+    if (index == NULL) return 0;
+    redisCommandIndex *old = proxy.commands;
+    proxy.commands = index;
+    if (old != NULL)
+        retireClusterObject(proxy.cluster, old, freeRetiredCommandIndex);
+    return 1;
+}
+
+/* Called once no thread can look up the replaced command anymore: it's
+ * freed by freeUnusedCommands when no request uses it. */
+static void retireReplacedCommand(void *cmd) {
+    listAddNodeTail(proxy.replaced_commands, cmd);
+}
+
+/* Release the commands of 'commands' that are not in 'keep'. The ones
+ * that the threads could still find in a published index are retired,
+ * the others are just freed. */
+static void releaseCommands(rax *commands, rax *keep, int retire) {
     raxIterator iter;
-    raxStart(&iter, proxy.commands);
-    if (raxSeek(&iter, "=", (unsigned char*) name, sdslen(name)))
-        if (raxNext(&iter)) cmd = (redisCommandDef *) iter.data;
+    raxStart(&iter, commands);
+    raxSeek(&iter, "^", NULL, 0);
+    while (raxNext(&iter)) {
+        if (keep != NULL &&
+            raxFind(keep, iter.key, iter.key_len) == iter.data) continue;
+        if (retire)
+            retireClusterObject(proxy.cluster, iter.data,
+                                retireReplacedCommand);
+        else freeCommand(iter.data);
+    }
     raxStop(&iter);
-    return cmd;
+}
+
+/* Free the replaced commands that are not used by any request. */
+static void freeUnusedCommands(void) {
+    listIter li;
+    listNode *ln;
+    listRewind(proxy.replaced_commands, &li);
+    while ((ln = listNext(&li))) {
+        redisCommandDef *cmd = ln->value;
+        if (cmd->refcount > 0) continue;
+        freeCommand(cmd);
+        listDelNode(proxy.replaced_commands, ln);
+    }
+}
+
+/* Merge the commands in the reply of COMMAND with the command table, that
+ * always has the precedence since it's tuned for the proxy (ie. custom
+ * commands, and commands explicitly unsupported). Commands that didn't
+ * change keep being the same objects. */
+static void updateClusterCommands(redisReply *reply) {
+    if (reply->type != REDIS_REPLY_ARRAY) {
+        proxyLogWarn("Failed to load the commands from the cluster: %s\n",
+                     (reply->type == REDIS_REPLY_ERROR ? reply->str :
+                      "invalid reply"));
+        return;
+    }
+    rax *commands = raxNew(), *old = proxy.cluster_commands;
+    int added = 0;
+    size_t i;
+    for (i = 0; i < reply->elements; i++) {
+        redisCommandDef *cmd = createCommandFromReply(reply->element[i]),
+                        *local = NULL;
+        if (cmd == NULL) continue;
+        size_t len = strlen(cmd->name);
+        local = lookupCommandIndex(proxy.commands, cmd->name, len);
+        if (local >= redisCommandTable &&
+            local < redisCommandTable + (sizeof(redisCommandTable) /
+                                         sizeof(redisCommandDef)))
+        {
+            freeCommand(cmd);
+            continue;
+        }
+        redisCommandDef *current = NULL;
+        if (old != NULL) {
+            current = raxFind(old, (unsigned char*) cmd->name, len);
+            if (current == raxNotFound) current = NULL;
+        }
+        if (current != NULL && commandsAreEqual(current, cmd)) {
+            freeCommand(cmd);
+            cmd = current;
+        } else added++;
+        if (!raxTryInsert(commands, (unsigned char*) cmd->name, len, cmd,
+                          NULL) && cmd != current) freeCommand(cmd);
+    }
+    proxy.cluster_commands = commands;
+    if (!updateCommandIndex()) {
+        proxyLogWarn("Failed to build the commands index\n");
+        /* Keep the commands of the published index. */
+        proxy.cluster_commands = old;
+        releaseCommands(commands, old, 0);
+        raxFree(commands);
+        return;
+    }
+    /* Commands replaced or not reported anymore: the threads could still
+     * find them in the previous index, so they get retired with it. */
+    if (old != NULL) {
+        releaseCommands(old, commands, 1);
+        raxFree(old);
+    }
+    proxyLogInfo("Loaded %llu command(s) not in the command table from the "
+                 "cluster (%d new or changed)\n",
+                 (unsigned long long) raxSize(commands), added);
+}
+
+/* Case insensitive lookup of the command, the name doesn't need to be
+ * null terminated. */
+redisCommandDef *getRedisCommand(const char *name, size_t len) {
+    return lookupCommandIndex(proxy.commands, name, len);
 }
 
 static int parseAddress(char *address, char **ip, int *port, char **hostsocket)
@@ -391,6 +967,48 @@ static void printHelp(void) {
             "  --threads <n>        Thread number (default: %d, max: %d)\n"
             "  --tcpkeepalive       TCP Keep Alive (default: %d)\n"
             "  --tcp-backlog        TCP Backlog (default: %d)\n"
+            "  --cluster-refresh-interval <sec>\n"
+            "                       Interval between the periodic refreshes\n"
+            "                       of the cluster's topology, 0 to disable\n"
+            "                       them (default: %d)\n"
+            "  --cluster-snapshot <file>\n"
+            "                       Save the cluster's topology into <file>\n"
+            "                       and load it at startup, in order to\n"
+            "                       start serving immediately\n"
+            "  --read-from-replicas Route read-only commands to the replicas\n"
+            "                       of the masters (clients can also enable\n"
+            "                       it with READONLY)\n"
+            "  --replica-read-policy <policy>\n"
+            "                       How to choose the replica serving a read:\n"
+            "                       (round-robin|least-outstanding)\n"
+            "                       (default: round-robin)\n"
+            "  --hedge-reads-percentile <p>\n"
+            "                       Send a copy of the reads that didn't get\n"
+            "                       a reply within the p-th percentile of\n"
+            "                       the latency to a replica, 0 to disable\n"
+            "                       (default: 0)\n"
+            "  --hedge-reads-min-delay <us>\n"
+            "                       Minimum delay before hedging a read\n"
+            "                       (default: %d)\n"
+            "  --failover-hold-time <ms>\n"
+            "                       Hold the requests that could not be sent\n"
+            "                       to an unreachable node, waiting for a\n"
+            "                       failover, 0 to disable (default: %d)\n"
+            "  --hot-slot-threshold <ops>\n"
+            "                       Route the reads of the slots getting more\n"
+            "                       than <ops> requests per second to the\n"
+            "                       replicas, 0 to disable (default: 0)\n"
+            "  --broadcast-timeout <ms>\n"
+            "                       Reply with an error to the commands sent\n"
+            "                       to all the masters (ie. DBSIZE) if some\n"
+            "                       of them did not reply in time, 0 to\n"
+            "                       disable (default: %d)\n"
+            "  --scan-prefetch      Request the next page of a SCAN while\n"
+            "                       the client reads the current one\n"
+            "  --private-connections <n>\n"
+            "                       Maximum number of connections to every\n"
+            "                       node that every thread can open for the\n"
+            "                       transactions (default: %d)\n"
             "  --daemonize          Execute the proxy in background\n"
             "  -a, --auth <passw>   Authentication password\n"
             "  --disable-colors     Disable colorized output\n"
@@ -404,7 +1022,20 @@ static void printHelp(void) {
                                     "'debug') \n"
             "  -h, --help         Print this help\n",
             DEFAULT_PORT, DEFAULT_MAX_CLIENTS, DEFAULT_THREADS, MAX_THREADS,
-            DEFAULT_TCP_KEEPALIVE, DEFAULT_TCP_BACKLOG);
+            DEFAULT_TCP_KEEPALIVE, DEFAULT_TCP_BACKLOG,
+            DEFAULT_CLUSTER_REFRESH_INTERVAL, DEFAULT_HEDGE_READS_MIN_DELAY,
+            DEFAULT_FAILOVER_HOLD_TIME, DEFAULT_BROADCAST_TIMEOUT,
+            DEFAULT_PRIVATE_CONNECTIONS);
+}
+
+/* Parse the value of a numeric command line option ('arg' is the option
+ * itself, ie. "--broadcast-timeout"), exiting if it's not valid. */
+static void parseNumericArgument(char *arg, char *value, int is_float,
+                                 void *opt)
+{
+    if (parseNumericOption(arg + 2, value, is_float, opt)) return;
+    fprintf(stderr, "Invalid value '%s' for option '%s'\n", value, arg);
+    exit(1);
 }
 
 static int parseOptions(int argc, char **argv) {
@@ -426,6 +1057,42 @@ static int parseOptions(int argc, char **argv) {
             config.tcpkeepalive = atoi(argv[++i]);
         else if (!strcmp("--tcp-backlog", arg) && !lastarg)
             config.tcp_backlog = atoi(argv[++i]);
+        else if (!strcmp("--cluster-refresh-interval", arg) && !lastarg)
+            parseNumericArgument(arg, argv[++i], 0,
+                                 &(config.cluster_refresh_interval));
+        else if (!strcmp("--cluster-snapshot", arg) && !lastarg)
+            config.cluster_snapshot = argv[++i];
+        else if (!strcmp("--hedge-reads-percentile", arg) && !lastarg)
+            parseNumericArgument(arg, argv[++i], 1,
+                                 &(config.hedge_reads_percentile));
+        else if (!strcmp("--hedge-reads-min-delay", arg) && !lastarg)
+            parseNumericArgument(arg, argv[++i], 0,
+                                 &(config.hedge_reads_min_delay));
+        else if (!strcmp("--failover-hold-time", arg) && !lastarg)
+            parseNumericArgument(arg, argv[++i], 0,
+                                 &(config.failover_hold_time));
+        else if (!strcmp("--hot-slot-threshold", arg) && !lastarg)
+            parseNumericArgument(arg, argv[++i], 0,
+                                 &(config.hot_slot_threshold));
+        else if (!strcmp("--broadcast-timeout", arg) && !lastarg)
+            parseNumericArgument(arg, argv[++i], 0,
+                                 &(config.broadcast_timeout));
+        else if (!strcmp("--scan-prefetch", arg))
+            config.scan_prefetch = 1;
+        else if (!strcmp("--private-connections", arg) && !lastarg)
+            parseNumericArgument(arg, argv[++i], 0,
+                                 &(config.private_connections));
+        else if (!strcmp("--read-from-replicas", arg))
+            config.read_from_replicas = 1;
+        else if (!strcmp("--replica-read-policy", arg) && !lastarg) {
+            config.replica_policy = parseReplicaPolicy(argv[++i]);
+            if (config.replica_policy == -1) {
+                fprintf(stderr, "Invalid replica read policy '%s', valid "
+                                "policies: round-robin, least-outstanding\n",
+                                argv[i]);
+                exit(1);
+            }
+        }
         else if (!strcmp("--dump-queries", arg))
             config.dump_queries = 1;
         else if (!strcmp("--dump-buffer", arg))
@@ -589,6 +1256,17 @@ static void initConfig(void) {
     config.dump_queries = 0;
     config.dump_buffer = 0;
     config.dump_queues = 0;
+    config.cluster_refresh_interval = DEFAULT_CLUSTER_REFRESH_INTERVAL;
+    config.cluster_snapshot = NULL;
+    config.read_from_replicas = 0;
+    config.replica_policy = REPLICA_POLICY_ROUND_ROBIN;
+    config.hedge_reads_percentile = 0;
+    config.hedge_reads_min_delay = DEFAULT_HEDGE_READS_MIN_DELAY;
+    config.failover_hold_time = DEFAULT_FAILOVER_HOLD_TIME;
+    config.hot_slot_threshold = 0;
+    config.broadcast_timeout = DEFAULT_BROADCAST_TIMEOUT;
+    config.scan_prefetch = 0;
+    config.private_connections = DEFAULT_PRIVATE_CONNECTIONS;
     config.auth = NULL;
 }
 
@@ -599,14 +1277,37 @@ static void initProxy(void) {
                              (proxy.fd_count * 2);
     adjustOpenFilesLimit();
     /* Populate commands table. */
-    proxy.commands = raxNew();
     int command_count = sizeof(redisCommandTable) / sizeof(redisCommandDef);
-    for (i = 0; i < command_count; i++) {
-        redisCommandDef *cmd = redisCommandTable + i;
-        raxInsert(proxy.commands, (unsigned char*) cmd->name,
-                  strlen(cmd->name), cmd, NULL);
+    for (i = 0; i < command_count; i++)
+        populateCommandFlags(redisCommandTable + i);
+    proxy.commands = NULL;
+    proxy.cluster_commands = NULL;
+    proxy.replaced_commands = listCreate();
+    if (!updateCommandIndex()) {
+        fprintf(stderr, "Failed to build the commands index\n");
+        exit(1);
     }
-    proxy.main_loop = aeCreateEventLoop(proxy.min_reserved_fds);
+    initFastCommands();
+    initFanoutCommands();
+    /* The commands of the cluster are loaded by the first refresh. */
+    proxy.commands_refresh_requested = 1;
+    proxy.refresh_commands_pending = 0;
+    proxy.refresh_nodes_done = 0;
+    proxy.commands_refresh_time = 0;
+    proxy.refresh_ctx = NULL;
+    proxy.refresh_auth_pending = 0;
+    proxy.refresh_node_index = 0;
+    proxy.refresh_start = 0;
+    proxy.last_refresh = mstime();
+    proxy.hot_slots = zcalloc(CLUSTER_SLOTS);
+    proxy.hot_slots_rate = zcalloc(CLUSTER_SLOTS * sizeof(uint64_t));
+    proxy.hot_slots_ops = zcalloc(CLUSTER_SLOTS * sizeof(uint64_t));
+    proxy.hot_slots_time = 0;
+    /* The main loop also handles the connection used to refresh the
+     * cluster's configuration, whose descriptor can be greater than the
+     * ones of the clients. */
+    proxy.main_loop = aeCreateEventLoop(proxy.min_reserved_fds +
+                                        config.maxclients);
     proxy.threads = zmalloc(config.num_threads *
                             sizeof(proxyThread *));
     if (proxy.threads == NULL) {
@@ -646,7 +1347,22 @@ static void releaseProxy(void) {
     }
     freeCluster(proxy.cluster);
     if (proxy.commands)
-        raxFree(proxy.commands);
+        freeCommandIndex(proxy.commands);
+    if (proxy.cluster_commands != NULL) {
+        raxIterator iter;
+        raxStart(&iter, proxy.cluster_commands);
+        raxSeek(&iter, "^", NULL, 0);
+        while (raxNext(&iter)) freeCommand(iter.data);
+        raxStop(&iter);
+        raxFree(proxy.cluster_commands);
+    }
+    if (proxy.replaced_commands != NULL) {
+        listIter li;
+        listNode *ln;
+        listRewind(proxy.replaced_commands, &li);
+        while ((ln = listNext(&li))) freeCommand(ln->value);
+        listRelease(proxy.replaced_commands);
+    }
 }
 
 void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -685,6 +1401,9 @@ static void writeRepliesToClients(struct aeEventLoop *el) {
  * for ready file descriptors. */
 void beforeThreadSleep(struct aeEventLoop *eventLoop) {
     proxyThread *thread = eventLoop->privdata;
+    /* The thread is not using any node or slots map here, so it's the
+     * right place to let the retired ones be freed. */
+    clusterThreadQuiescentState(proxy.cluster, thread->thread_id);
     writeRepliesToClients(eventLoop);
     listIter li;
     listNode *ln;
@@ -695,6 +1414,42 @@ void beforeThreadSleep(struct aeEventLoop *eventLoop) {
     }
 }
 
+/* Update the delay after which the thread's reads get hedged, using the
+ * configured percentile of the latencies seen by the thread. */
+static void updateHedgeDelay(proxyThread *thread) {
+    latencyHistogram *latency = &(thread->read_latency);
+    if (config.hedge_reads_percentile <= 0) {
+        thread->hedge_delay = -1;
+        latencyHistogramReset(latency);
+        return;
+    }
+    if (latency->count < HEDGE_READS_MIN_SAMPLES) {
+        thread->hedge_delay = -1;
+        return;
+    }
+    long long delay =
+        latencyHistogramPercentile(latency, config.hedge_reads_percentile);
+    if (delay < config.hedge_reads_min_delay)
+        delay = config.hedge_reads_min_delay;
+    thread->hedge_delay = delay;
+}
+
+/* The thread's cron wakes up the loop periodically, so that even idle
+ * threads go through beforeThreadSleep and don't delay the release of the
+ * retired cluster's nodes. */
+static int proxyThreadCron(struct aeEventLoop *eventLoop, long long id,
+                           void *clientData)
+{
+    UNUSED(id);
+    UNUSED(clientData);
+    updateHedgeDelay(eventLoop->privdata);
+    purgeMovedKeys(eventLoop->privdata);
+    retryHeldRequests(eventLoop->privdata);
+    connectStandbyReplicas(eventLoop->privdata);
+    expireBroadcasts(eventLoop->privdata);
+    return THREAD_CRON_PERIOD;
+}
+
 static int processThreadPipeBufferForNewClients(proxyThread *thread) {
     client *c = NULL;
     int buflen = sdslen(thread->msgbuffer);
@@ -755,6 +1510,21 @@ static proxyThread *createProxyThread(int index) {
     }
     thread->thread_id = index;
     thread->next_client_id = 0;
+    thread->next_replica = 0;
+    thread->next_master = 0;
+    latencyHistogramInit(&(thread->read_latency), HEDGE_READS_LATENCY_WINDOW);
+    thread->hedge_delay = -1;
+    thread->hedge_timer_id = -1;
+    thread->hedge_candidates = listCreate();
+    thread->moved_keys = raxNew();
+    thread->held_requests = listCreate();
+    thread->broadcasts = listCreate();
+    thread->held_map_version = 0;
+    thread->held_retry_time = 0;
+    thread->standby_connect_time = 0;
+    thread->rescued_requests = 0;
+    thread->failed_requests = 0;
+    thread->slot_stats = zcalloc(CLUSTER_SLOTS * sizeof(slotStats));
     thread->clients = listCreate();
     if (thread->clients == NULL) {
         freeProxyThread(thread);
@@ -776,7 +1546,7 @@ static proxyThread *createProxyThread(int index) {
     }
     thread->loop->privdata = thread;
     aeSetBeforeSleepProc(thread->loop, beforeThreadSleep);
-    /*aeCreateTimeEvent(thread->loop, 1, proxyThreadCron, NULL,NULL);*/
+    aeCreateTimeEvent(thread->loop, 1, proxyThreadCron, NULL,NULL);
     if (aeCreateFileEvent(thread->loop, thread->io[THREAD_IO_READ],
                           AE_READABLE, readThreadPipe, thread) == AE_ERR) {
         freeProxyThread(thread);
@@ -862,6 +1632,12 @@ static void freeProxyThread(proxyThread *thread) {
     if (thread->pending_messages != NULL) {
         listRelease(thread->pending_messages);
     }
+    if (thread->hedge_candidates != NULL)
+        listRelease(thread->hedge_candidates);
+    if (thread->moved_keys != NULL) raxFree(thread->moved_keys);
+    if (thread->held_requests != NULL) listRelease(thread->held_requests);
+    if (thread->broadcasts != NULL) listRelease(thread->broadcasts);
+    if (thread->slot_stats != NULL) zfree(thread->slot_stats);
     if (thread->io[0]) close(thread->io[0]);
     if (thread->io[1]) close(thread->io[1]);
     zfree(thread);
@@ -903,6 +1679,13 @@ static client *createClient(int fd, char *ip) {
     c->next_request_id = 0;
     c->min_reply_id = 0;
     c->requests_with_write_handler = 0;
+    c->replica_reads = CLIENT_REPLICA_READS_DEFAULT;
+    c->close_after_reply = 0;
+    c->scan_prefetch = NULL;
+    c->multi = 0;
+    c->multi_slot = UNDEFINED_SLOT;
+    c->multi_error = 0;
+    c->multi_connection = NULL;
     return c;
 }
 
@@ -918,43 +1701,68 @@ static void unlinkClient(client *c) {
     c->status = CLIENT_STATUS_UNLINKED;
 }
 
+static void freeClientRequestsOnNode(client *c, clusterNode *node) {
+    redisClusterConnection *conn = getClusterConnection(node, c->thread_id);
+    if (!conn) return;
+    listIter nli;
+    listNode *nln;
+    listRewind(conn->requests_to_send, &nli);
+    while ((nln = listNext(&nli))) {
+        clientRequest *req = nln->value;
+        if (req == NULL) {
+            /*listDelNode(conn->requests_to_send, nln);*/
+            continue;
+        }
+        if (req->client != c) continue;
+        if (c->status == CLIENT_STATUS_UNLINKED && req->has_write_handler)
+            continue;
+        listDelNode(conn->requests_to_send, nln);
+        freeRequest(req, 0);
+    }
+    listRewind(conn->requests_pending, &nli);
+    while ((nln = listNext(&nli))) {
+        clientRequest *req = nln->value;
+        if (req == NULL) continue;
+        if (req->client != c) continue;
+        /* We cannot delete the request's list node from the queue, since
+         * this would break the processing order of the replies, so we
+         * we create a NULL placeholder (a 'ghost request') by simply
+         * setting the list node's value to NULL. */
+        nln->value = NULL;
+        /* The reply of a pending ASKING command needs a ghost too. */
+        if (req->skip_next_reply)
+            listInsertNode(conn->requests_pending, nln, NULL, 0);
+        freeRequest(req, 0);
+    }
+    if (config.dump_queues)
+        dumpQueue(conn, c->thread_id, QUEUE_TYPE_PENDING);
+    /* Private connections left in the middle of a transaction cannot be
+     * used by other clients. */
+    listRewind(conn->private_connections, &nli);
+    while ((nln = listNext(&nli))) {
+        redisClusterConnection *private_conn = nln->value;
+        if (private_conn->owner == c)
+            closePrivateConnection(private_conn, c->thread_id, NULL);
+    }
+}
+
 static void freeAllClientRequests(client *c) {
     listIter li;
     listNode *ln;
     listRewind(proxy.cluster->nodes, &li);
+    while ((ln = listNext(&li)))
+        freeClientRequestsOnNode(c, ln->value);
+    /* Nodes removed from the cluster can still have requests of the client
+     * in their queues until the thread detaches them. */
+    clusterNode **retired = NULL;
+    int count = getRetiredClusterNodes(proxy.cluster, &retired), i;
+    for (i = 0; i < count; i++) freeClientRequestsOnNode(c, retired[i]);
+    zfree(retired);
+    proxyThread *thread = proxy.threads[c->thread_id];
+    listRewind(thread->held_requests, &li);
     while ((ln = listNext(&li))) {
-        clusterNode *node = ln->value;
-        redisClusterConnection *conn = getClusterConnection(node, c->thread_id);
-        if (!conn) continue;
-        listIter nli;
-        listNode *nln;
-        listRewind(conn->requests_to_send, &nli);
-        while ((nln = listNext(&nli))) {
-            clientRequest *req = nln->value;
-            if (req == NULL) {
-                /*listDelNode(conn->requests_to_send, nln);*/
-                continue;
-            }
-            if (req->client != c) continue;
-            if (c->status == CLIENT_STATUS_UNLINKED && req->has_write_handler)
-                continue;
-            listDelNode(conn->requests_to_send, nln);
-            freeRequest(req, 0);
-        }
-        listRewind(conn->requests_pending, &nli);
-        while ((nln = listNext(&nli))) {
-            clientRequest *req = nln->value;
-            if (req == NULL) continue;
-            if (req->client != c) continue;
-            /* We cannot delete the request's list node from the queue, since
-             * this would break the processing order of the replies, so we
-             * we create a NULL placeholder (a 'ghost request') by simply
-             * setting the list node's value to NULL. */
-            nln->value = NULL;
-            freeRequest(req, 0);
-        }
-        if (config.dump_queues)
-            dumpQueue(node, c->thread_id, QUEUE_TYPE_PENDING);
+        clientRequest *req = ln->value;
+        if (req->client == c) freeRequest(req, 0);
     }
 }
 
@@ -983,6 +1791,7 @@ static void freeClient(client *c) {
     }
     listRelease(c->requests_to_process);
     freeAllClientRequests(c);
+    discardScanPrefetch(c);
     if (c->unordered_replies)
         raxFreeWithCallback(c->unordered_replies, (void (*)(void*))sdsfree);
     zfree(c);
@@ -992,6 +1801,10 @@ static void freeClient(client *c) {
 static int writeToClient(client *c) {
     int success = 1, buflen = sdslen(c->obuf), nwritten = 0;
     if (buflen == 0) return 1;
+    /* The descriptor of an unlinked client (still waiting for its requests
+     * to be written before being freed) may already belong to another
+     * connection, ie. a private connection to a node. */
+    if (c->status == CLIENT_STATUS_UNLINKED) return 0;
     while (c->written < (size_t) buflen) {
         nwritten = write(c->fd, c->obuf + c->written, buflen - c->written);
         if (nwritten <= 0) break;
@@ -1010,6 +1823,12 @@ static int writeToClient(client *c) {
     if (c->written == (size_t) buflen) {
         sdsclear(c->obuf);
         c->written = 0;
+        if (c->close_after_reply &&
+            c->min_reply_id >= c->close_after_reply)
+        {
+            freeClient(c);
+            return 0;
+        }
         if (c->has_write_handler) {
             proxyThread *thread = proxy.threads[c->thread_id];
             assert(thread != NULL);
@@ -1026,9 +1845,8 @@ static void writeToClusterHandler(aeEventLoop *el, int fd, void *privdata,
                                   int mask)
 {
     UNUSED(mask);
-    clusterNode *node = privdata;
-    proxyThread *thread = el->privdata;
-    clientRequest *req = getFirstRequestToSend(node, thread->thread_id, NULL);
+    redisClusterConnection *conn = privdata;
+    clientRequest *req = getFirstQueuedRequest(conn->requests_to_send, NULL);
     if (req == NULL) return;
     writeToCluster(el, fd, req);
 }
@@ -1047,7 +1865,12 @@ static int writeToCluster(aeEventLoop *el, int fd, clientRequest *req) {
             nwritten = 0;
         } else {
             proxyLogDebug("Error writing to cluster: %s", strerror(errno));
-            addReplyError(req->client, "Error writing to cluster", req->id);
+            /* The node could miss a command of the transaction. */
+            client *c = req->client;
+            if (req->pinned && c->multi &&
+                req->private_connection == c->multi_connection)
+                c->multi_error = 1;
+            addRequestErrorReply(req, "Error writing to cluster");
             freeRequest(req, 1);
             return 0;
         }
@@ -1058,6 +1881,7 @@ static int writeToCluster(aeEventLoop *el, int fd, clientRequest *req) {
     if (req->written == buflen) {
         client *c = req->client;
         clusterNode *node = req->node;
+        redisClusterConnection *conn = getRequestConnection(req);
         int thread_id = c->thread_id;
         proxyLogDebug("Request %llu:%llu written to node %s:%d, adding it to "
                       "pending requests\n", c->id, req->id,
@@ -1076,24 +1900,26 @@ static int writeToCluster(aeEventLoop *el, int fd, clientRequest *req) {
              * be broken. After enqueuing the ghost request, we can finally
              * free and the request itself and try to free the client
              * completely. */
-            list *pending_queue =
-                getClusterConnection(node, thread_id)->requests_pending;
+            list *pending_queue = conn->requests_pending;
+            int is_private = conn->is_private;
             listAddNodeTail(pending_queue, NULL);
+            if (req->skip_next_reply) listAddNodeTail(pending_queue, NULL);
             freeRequest(req, 1);
             freeClient(c);
+            /* Private connections get closed together with their client. */
+            if (is_private) return success;
         } else if (!enqueuePendingRequest(req)) {
             proxyLogDebug("Could not enqueue pending request %llu:%llu\n",
                           req->client->id, req->id);
-            addReplyError(req->client, "Could not enqueue request", req->id);
+            addRequestErrorReply(req, "Could not enqueue request");
             freeRequest(req, 1);
             return 0;
         }
-        if (config.dump_queues) dumpQueue(node, thread_id, QUEUE_TYPE_PENDING);
+        if (config.dump_queues) dumpQueue(conn, thread_id, QUEUE_TYPE_PENDING);
         proxyLogDebug("Still have %d request(s) to send\n",
-                      listLength(getClusterConnection(node,
-                                 thread_id)->requests_to_send));
+                      listLength(conn->requests_to_send));
         /* Try to send the next available request to send, if one. */
-        handleNextRequestToCluster(node, thread_id);
+        handleNextRequestOnConnection(conn);
     }
     return success;
 }
@@ -1108,57 +1934,419 @@ static int writeToCluster(aeEventLoop *el, int fd, clientRequest *req) {
  *   - Check for requests that were still waiting to read replies from the
  *     node's socket, dequeue and free them (after repying with an error to
  *     their client). */
-void onClusterNodeDisconnection(clusterNode *node, int thread_id) {
-    redisClusterConnection *connection = getClusterConnection(node, thread_id);
-    if (connection == NULL) return;
-    redisContext *ctx = connection->context;
-    if (ctx != NULL && ctx->fd >= 0) {
-        aeEventLoop *el = proxy.threads[thread_id]->loop;
-        aeDeleteFileEvent(el, ctx->fd, AE_WRITABLE | AE_READABLE);
-        sds err = sdsnew("Cluster node disconnected: ");
-        err = sdscatprintf(err, "%s:%d", node->ip, node->port);
-        listIter li;
-        listNode *ln;
-        /* If there are requests currently writing to the node, we must reply
-         * to their client with a "node disconnected" error, free them and then
-         * dequeue them. */
-        listRewind(connection->requests_to_send, &li);
-        while ((ln = listNext(&li))) {
-            clientRequest *req = ln->value;
-            if (req == NULL) continue;
-            assert(req->node == node);
-            /* If the request has a write handler installed, it means that
-             * it could not have completely written its buffer to the node.
-             * In this case, the client shpuld receive the reply error and
-             * the request itself should be dequeued and freed. */
-            if (req->has_write_handler) {
-                if (req->written > 0) {
-                    req->has_write_handler = 0;
-                    req->client->requests_with_write_handler--;
-                    addReplyError(req->client, err, req->id);
-                    dequeueRequestToSend(req);
-                    freeRequest(req, 0);
-                }
-            }
-        }
-        /* If there are pending requests that are reading or waiting to read
-         * from the node, we must reply to their client with a
-         * "node disconnected" error, free them and dequeue them. */
-        listRewind(connection->requests_pending, &li);
-        while ((ln = listNext(&li))) {
-            clientRequest *req = ln->value;
-            if (req == NULL) continue;
-            assert(req->node == node);
-            addReplyError(req->client, err, req->id);
-            dequeuePendingRequest(req);
-            freeRequest(req, 0);
+/* Failover handling.
+ *
+ * Requests that cannot be sent to their node because it's unreachable (ie.
+ * a master that just failed) don't get an error immediately: they're held
+ * by their thread for up to failover_hold_time milliseconds, waiting for the
+ * topology refresh to detect the promotion of a replica, and then they're
+ * routed again. Requests already written to the node could have been
+ * executed, so they cannot be sent again and they still get an error.
+ * Every thread also keeps a connection open to the replicas, so that the
+ * requests can be sent right away to the promoted one. Connections to a
+ * node are not retried for CLUSTER_NODE_CONNECT_BACKOFF milliseconds after
+ * a failure, so that an unreachable node doesn't keep stalling the thread. */
+
+static void addNodeFailureReply(clientRequest *req, const char *err) {
+    proxyThread *thread = proxy.threads[req->client->thread_id];
+    thread->failed_requests++;
+    addRequestErrorReply(req, err);
+}
+
+static void removeHeldRequest(clientRequest *req) {
+    if (req->held_node == NULL) return;
+    proxyThread *thread = proxy.threads[req->client->thread_id];
+    listDelNode(thread->held_requests, req->held_node);
+    req->held_node = NULL;
+}
+
+/* Add a request, not queued to any node, to the thread's held requests.
+ * Return 1 on success, 0 otherwise. */
+static int holdRequest(proxyThread *thread, clientRequest *req) {
+    if (listAddNodeTail(thread->held_requests, req) == NULL) return 0;
+    req->held_node = listLast(thread->held_requests);
+    req->node = NULL;
+    if (req->held_until == 0)
+        req->held_until = mstime() + config.failover_hold_time;
+    return 1;
+}
+
+/* Hold the requests queued to the node that have not been written yet.
+ * Hedged requests are not held, since their twin can still reply, and
+ * neither are the requests bound to the node and the requests that have
+ * been already held for too long.
+ * Return the number of held requests. */
+static int holdNodeRequests(clusterNode *node, int thread_id) {
+    if (config.failover_hold_time <= 0) return 0;
+    proxyThread *thread = proxy.threads[thread_id];
+    redisClusterConnection *conn = getClusterConnection(node, thread_id);
+    clusterSlotsMap *map = proxy.cluster->slots_map;
+    long long now = mstime();
+    int held = 0;
+    listIter li;
+    listNode *ln;
+    listRewind(conn->requests_to_send, &li);
+    while ((ln = listNext(&li))) {
+        clientRequest *req = ln->value;
+        if (req == NULL || req->written > 0 || req->hedge != NULL ||
+            req->is_hedge || req->pinned) continue;
+        if (req->held_until != 0 && now >= req->held_until) continue;
+        if (!holdRequest(thread, req)) continue;
+        listDelNode(conn->requests_to_send, ln);
+        if (req->has_write_handler) {
+            req->has_write_handler = 0;
+            req->client->requests_with_write_handler--;
         }
-        sdsfree(err);
+        removeHedgeCandidate(req);
+        setRequestAsking(req, 0);
+        req->skip_next_reply = 0;
+        held++;
+    }
+    if (held > 0) {
+        proxyLogDebug("Holding %d requests for unreachable node %s:%d\n",
+                      held, node->ip, node->port);
+        thread->held_map_version = (map != NULL ? map->version : 0);
+        thread->held_retry_time = now + HELD_REQUESTS_RETRY_PERIOD;
     }
+    return held;
 }
 
-/* TODO: implement also UNIX socket listener */
-static int listen(void) {
+/* Whether the connection of the thread to the node failed recently, so
+ * that the node must not be connected again yet. */
+static int isConnectionBackingOff(redisClusterConnection *conn,
+                                  long long now)
+{
+    return (conn->context == NULL && conn->connecting == NULL &&
+            now < conn->connect_time);
+}
+
+/* Called by the thread's cron: held requests are routed again as soon as
+ * the slots map changes (or periodically, in case the node comes back),
+ * while the requests held for too long get an error. */
+static void retryHeldRequests(proxyThread *thread) {
+    if (listLength(thread->held_requests) == 0) return;
+    clusterSlotsMap *map = proxy.cluster->slots_map;
+    uint64_t version = (map != NULL ? map->version : 0);
+    long long now = mstime();
+    int map_changed = (version != thread->held_map_version);
+    int retry = (map_changed || now >= thread->held_retry_time);
+    if (retry) {
+        thread->held_map_version = version;
+        thread->held_retry_time = now + HELD_REQUESTS_RETRY_PERIOD;
+    }
+    /* Requests that get held again are appended to the list, so only the
+     * requests that were already held are processed. */
+    unsigned long count = listLength(thread->held_requests);
+    listNode *ln = listFirst(thread->held_requests);
+    while (count-- > 0 && ln != NULL) {
+        clientRequest *req = ln->value;
+        ln = ln->next;
+        int expired = (now >= req->held_until);
+        if (!retry && !expired) continue;
+        removeHeldRequest(req);
+        if (expired) {
+            addNodeFailureReply(req, "Cluster node unreachable and no "
+                                     "failover detected");
+            freeRequest(req, 0);
+            continue;
+        }
+        /* The slot may be not served by any node until the failover, and
+         * a node whose connection just failed is not tried again until the
+         * topology changes: keep refreshing it in the meantime. */
+        clusterNode *node = getRequestNode(req, NULL);
+        if ((node == NULL || (!map_changed && isConnectionBackingOff(
+                getClusterConnection(node, thread->thread_id), now))) &&
+            holdRequest(thread, req))
+        {
+            requestClusterRefresh();
+            continue;
+        }
+        if (req->node == NULL || !enqueueRequestToSend(req)) {
+            req->node = NULL;
+            addNodeFailureReply(req, "Failed to route request after "
+                                     "node failure");
+            freeRequest(req, 0);
+            continue;
+        }
+        proxyLogDebug("Held request %llu:%llu routed to %s:%d\n",
+                      req->client->id, req->id, req->node->ip,
+                      req->node->port);
+        handleNextRequestToCluster(req->node, thread->thread_id);
+    }
+}
+
+/* Standby connections.
+ *
+ * The connections to the replicas are opened in background, so that an
+ * unreachable replica cannot stall the thread: the connection is
+ * established without blocking, then AUTH and READONLY are sent and their
+ * replies are read by the event loop. Once the handshake is done the
+ * connection becomes the thread's connection to the node, and the requests
+ * queued to the node in the meantime are sent. Connections that fail, or
+ * that are not ready within CLUSTER_NODE_CONNECT_TIMEOUT milliseconds, are
+ * retried after CLUSTER_NODE_CONNECT_BACKOFF milliseconds. */
+
+static void abortStandbyConnection(redisClusterConnection *conn,
+                                   aeEventLoop *el)
+{
+    redisContext *ctx = conn->connecting;
+    if (ctx == NULL) return;
+    if (ctx->fd >= 0) aeDeleteFileEvent(el, ctx->fd, AE_WRITABLE | AE_READABLE);
+    redisFree(ctx);
+    conn->connecting = NULL;
+    conn->handshake_pending = 0;
+}
+
+static void failStandbyConnection(redisClusterConnection *conn,
+                                  aeEventLoop *el, const char *err)
+{
+    clusterNode *node = conn->node;
+    proxyLogDebug("Could not connect to replica %s:%d: %s\n", node->ip,
+                  node->port, err);
+    abortStandbyConnection(conn, el);
+    conn->connect_time = mstime() + CLUSTER_NODE_CONNECT_BACKOFF;
+}
+
+static void finishStandbyConnection(redisClusterConnection *conn,
+                                    aeEventLoop *el)
+{
+    redisContext *ctx = conn->connecting;
+    aeDeleteFileEvent(el, ctx->fd, AE_WRITABLE | AE_READABLE);
+    conn->connecting = NULL;
+    /* The proxy reads replies straight from the reader's buffer, so drop
+     * the replies already consumed by the handshake. */
+    sdsrange(ctx->reader->buf, ctx->reader->pos, -1);
+    ctx->reader->pos = 0;
+    ctx->reader->len = sdslen(ctx->reader->buf);
+    conn->context = ctx;
+    /* Install the read handler right away, so that the connection gets
+     * closed if the replica goes down. */
+    if (installIOHandler(el, ctx->fd, AE_READABLE, readClusterReply, conn, 0))
+        conn->has_read_handler = 1;
+    proxyLogDebug("Connected to replica %s:%d\n", conn->node->ip,
+                  conn->node->port);
+    handleNextRequestOnConnection(conn);
+}
+
+static void readStandbyHandshake(aeEventLoop *el, int fd, void *privdata,
+                                 int mask)
+{
+    UNUSED(fd);
+    UNUSED(mask);
+    redisClusterConnection *conn = privdata;
+    redisContext *ctx = conn->connecting;
+    if (redisBufferRead(ctx) != REDIS_OK) {
+        failStandbyConnection(conn, el, ctx->errstr);
+        return;
+    }
+    while (conn->handshake_pending > 0) {
+        redisReply *reply = NULL;
+        if (redisGetReplyFromReader(ctx, (void **) &reply) != REDIS_OK) {
+            failStandbyConnection(conn, el, ctx->errstr);
+            return;
+        }
+        if (reply == NULL) return;
+        int ok = (reply->type != REDIS_REPLY_ERROR);
+        if (!ok) failStandbyConnection(conn, el, reply->str);
+        freeReplyObject(reply);
+        if (!ok) return;
+        conn->handshake_pending--;
+    }
+    finishStandbyConnection(conn, el);
+}
+
+static void writeStandbyHandshake(aeEventLoop *el, int fd, void *privdata,
+                                  int mask)
+{
+    UNUSED(mask);
+    redisClusterConnection *conn = privdata;
+    redisContext *ctx = conn->connecting;
+    int done = 0;
+    if (redisBufferWrite(ctx, &done) != REDIS_OK) {
+        failStandbyConnection(conn, el, ctx->errstr);
+        return;
+    }
+    if (!done) return;
+    if (conn->handshake_pending == 0) {
+        finishStandbyConnection(conn, el);
+        return;
+    }
+    aeDeleteFileEvent(el, fd, AE_WRITABLE);
+    if (!installIOHandler(el, fd, AE_READABLE, readStandbyHandshake, conn, 0))
+        failStandbyConnection(conn, el, "failed to install the read handler");
+}
+
+static void startStandbyConnection(proxyThread *thread, clusterNode *node) {
+    redisClusterConnection *conn = getClusterConnection(node,
+                                                        thread->thread_id);
+    long long now = mstime();
+    redisContext *ctx = redisConnectNonBlock(node->ip, node->port);
+    if (ctx == NULL || ctx->err) {
+        proxyLogDebug("Could not connect to replica %s:%d: %s\n", node->ip,
+                      node->port, (ctx ? ctx->errstr : "out of memory"));
+        if (ctx) redisFree(ctx);
+        conn->connect_time = now + CLUSTER_NODE_CONNECT_BACKOFF;
+        return;
+    }
+    anetKeepAlive(NULL, ctx->fd, CLUSTER_NODE_KEEPALIVE_INTERVAL);
+    conn->connecting = ctx;
+    conn->handshake_pending = 0;
+    conn->connect_time = now + CLUSTER_NODE_CONNECT_TIMEOUT;
+    if (config.auth) {
+        redisAppendCommand(ctx, "AUTH %s", config.auth);
+        conn->handshake_pending++;
+    }
+    /* Replicas only serve the reads routed to them by the proxy if the
+     * connection is in READONLY mode. */
+    if (node->is_replica) {
+        redisAppendCommand(ctx, "READONLY");
+        conn->handshake_pending++;
+    }
+    if (!installIOHandler(thread->loop, ctx->fd, AE_WRITABLE,
+                          writeStandbyHandshake, conn, 0))
+        failStandbyConnection(conn, thread->loop,
+                              "failed to install the write handler");
+}
+
+/* Connect to the replicas the thread is not connected to yet. */
+static void connectStandbyReplicas(proxyThread *thread) {
+    long long now = mstime();
+    if (config.failover_hold_time <= 0 ||
+        now < thread->standby_connect_time) return;
+    thread->standby_connect_time = now + STANDBY_CONNECT_PERIOD;
+    listIter li;
+    listNode *ln;
+    listRewind(proxy.cluster->nodes, &li);
+    while ((ln = listNext(&li))) {
+        clusterNode *master = ln->value;
+        if (master->is_replica) continue;
+        /* Only the healthy replicas are listed. */
+        clusterReplicas *replicas = master->replicas;
+        int i;
+        for (i = 0; replicas != NULL && i < replicas->count; i++) {
+            clusterNode *node = replicas->nodes[i];
+            redisClusterConnection *conn =
+                getClusterConnection(node, thread->thread_id);
+            if (conn->context != NULL) continue;
+            if (conn->connecting != NULL) {
+                if (now >= conn->connect_time)
+                    failStandbyConnection(conn, thread->loop, "timed out");
+                continue;
+            }
+            if (now < conn->connect_time) continue;
+            startStandbyConnection(thread, node);
+        }
+    }
+}
+
+void onClusterNodeDisconnection(clusterNode *node, int thread_id) {
+    redisClusterConnection *connection = getClusterConnection(node, thread_id);
+    if (connection == NULL) return;
+    abortStandbyConnection(connection, proxy.threads[thread_id]->loop);
+    redisContext *ctx = connection->context;
+    if (ctx != NULL && ctx->fd >= 0) {
+        aeEventLoop *el = proxy.threads[thread_id]->loop;
+        aeDeleteFileEvent(el, ctx->fd, AE_WRITABLE | AE_READABLE);
+        sds err = sdsnew("Cluster node disconnected: ");
+        err = sdscatprintf(err, "%s:%d", node->ip, node->port);
+        listIter li;
+        listNode *ln;
+        /* If there are requests currently writing to the node, we must reply
+         * to their client with a "node disconnected" error, free them and then
+         * dequeue them. */
+        listRewind(connection->requests_to_send, &li);
+        while ((ln = listNext(&li))) {
+            clientRequest *req = ln->value;
+            if (req == NULL) continue;
+            assert(req->node == node);
+            /* If the request has a write handler installed, it means that
+             * it could not have completely written its buffer to the node.
+             * In this case, the client shpuld receive the reply error and
+             * the request itself should be dequeued and freed. */
+            if (req->has_write_handler) {
+                if (req->written > 0) {
+                    req->has_write_handler = 0;
+                    req->client->requests_with_write_handler--;
+                    addNodeFailureReply(req, err);
+                    dequeueRequestToSend(req);
+                    freeRequest(req, 0);
+                }
+            }
+        }
+        /* If there are pending requests that are reading or waiting to read
+         * from the node, we must reply to their client with a
+         * "node disconnected" error, free them and dequeue them. */
+        listRewind(connection->requests_pending, &li);
+        while ((ln = listNext(&li))) {
+            clientRequest *req = ln->value;
+            if (req == NULL) continue;
+            assert(req->node == node);
+            addNodeFailureReply(req, err);
+            dequeuePendingRequest(req);
+            freeRequest(req, 0);
+        }
+        /* Replies for ghost requests will never come, so drop them, or
+         * they would be matched with the replies of a new connection. */
+        while (listLength(connection->requests_pending) > 0)
+            listDelNode(connection->requests_pending,
+                        listFirst(connection->requests_pending));
+        sdsfree(err);
+    }
+}
+
+/* This gets called by every thread, during a quiescent state, for every
+ * node that has been removed from the cluster's topology (see
+ * clusterThreadQuiescentState). Requests that have not been written to the
+ * node yet are routed again using the current slots map, while the ones
+ * already written get an error when the connection is closed. */
+void onClusterNodeRetired(clusterNode *node, int thread_id) {
+    redisClusterConnection *conn = getClusterConnection(node, thread_id);
+    if (conn == NULL) return;
+    abortStandbyConnection(conn, proxy.threads[thread_id]->loop);
+    listIter li;
+    listNode *ln;
+    listRewind(conn->requests_to_send, &li);
+    while ((ln = listNext(&li))) {
+        clientRequest *req = ln->value;
+        if (req == NULL || req->written > 0) continue;
+        listDelNode(conn->requests_to_send, ln);
+        if (req->has_write_handler) {
+            req->has_write_handler = 0;
+            req->client->requests_with_write_handler--;
+        }
+        setRequestAsking(req, 0);
+        req->skip_next_reply = 0;
+        if (req->pinned) req->node = NULL;
+        else if (req->slot != UNDEFINED_SLOT)
+            req->node = searchNodeBySlot(proxy.cluster, req->slot);
+        else req->node = getFirstMappedNode(proxy.cluster);
+        if (req->node == NULL || !enqueueRequestToSend(req)) {
+            sds err = sdsnew("Cluster node removed: ");
+            err = sdscatprintf(err, "%s:%d", node->ip, node->port);
+            addRequestErrorReply(req, err);
+            sdsfree(err);
+            req->node = NULL;
+            freeRequest(req, 0);
+            continue;
+        }
+        proxyLogDebug("Request %llu:%llu moved from removed node %s:%d "
+                      "to %s:%d\n", req->client->id, req->id, node->ip,
+                      node->port, req->node->ip, req->node->port);
+    }
+    /* Transactions cannot be moved to another node, so they get an error
+     * as well. */
+    sds err = sdsnew("Cluster node removed: ");
+    err = sdscatprintf(err, "%s:%d", node->ip, node->port);
+    while (listLength(conn->private_connections) > 0) {
+        ln = listFirst(conn->private_connections);
+        closePrivateConnection(ln->value, thread_id, err);
+    }
+    sdsfree(err);
+    clusterNodeDisconnect(node, thread_id);
+}
+
+/* TODO: implement also UNIX socket listener */
+static int listen(void) {
     int fd_idx = 0;
     /* Try to use both IPv6 and IPv4 */
     proxy.fds[fd_idx] = anetTcp6Server(proxy.neterr, config.port, NULL,
@@ -1182,8 +2370,19 @@ static int requestMakeRoomForArgs(clientRequest *req, int argc) {
     if (argc >= req->offsets_size) {
         int new_size = argc + QUERY_OFFSETS_MIN_SIZE;
         size_t sz = new_size * sizeof(int);
-        req->offsets = zrealloc(req->offsets, sz);
-        req->lengths = zrealloc(req->lengths, sz);
+        if (req->offsets == req->inline_offsets) {
+            req->offsets = zmalloc(sz);
+            req->lengths = zmalloc(sz);
+            if (req->offsets != NULL && req->lengths != NULL) {
+                memcpy(req->offsets, req->inline_offsets,
+                       sizeof(req->inline_offsets));
+                memcpy(req->lengths, req->inline_lengths,
+                       sizeof(req->inline_lengths));
+            }
+        } else {
+            req->offsets = zrealloc(req->offsets, sz);
+            req->lengths = zrealloc(req->lengths, sz);
+        }
         if (req->offsets == NULL || req->lengths == NULL) {
             proxyLogErr("Failed to reallocate request "
                         "offsets\n");
@@ -1194,6 +2393,210 @@ static int requestMakeRoomForArgs(clientRequest *req, int argc) {
     return 1;
 }
 
+/* Called by the parser as soon as an argument of a multibulk request has
+ * been read, while it's still hot in the cache: the command is looked up
+ * when its name arrives, then the slot of every following argument that
+ * is a key gets computed, so that getRequestNode doesn't need to read the
+ * keys again. Key positions follow the same rules of getRequestNode. */
+static void parseRequestArgument(clientRequest *req, int idx) {
+    if (idx == 0) {
+        setRequestCommand(req, getRedisCommand(req->buffer + req->offsets[0],
+                                               req->lengths[0]));
+        if (req->command != NULL) req->flags = req->command->flags;
+        return;
+    }
+    redisCommandDef *cmd = req->command;
+    if (cmd == NULL || cmd->getkeys != NULL || cmd->first_key <= 0 ||
+        idx < cmd->first_key) return;
+    if (cmd->last_key >= 0 && idx > cmd->last_key) return;
+    int key_step = (cmd->key_step < 1 ? 1 : cmd->key_step);
+    if ((idx - cmd->first_key) % key_step != 0) return;
+    int slot = clusterKeyHashSlot(req->buffer + req->offsets[idx],
+                                  req->lengths[idx]);
+    if (req->keys_hashed++ == 0) req->keys_slot = slot;
+    else if (slot != req->keys_slot) req->keys_cross_slot = 1;
+}
+
+/* The hottest commands: their requests are recognized by their header and
+ * parsed at once, without going through the state machine of the generic
+ * parser (see matchFastRequest). */
+typedef struct fastCommand {
+    char *name;
+    int argc;
+    redisCommandDef *command;
+    char header[24];    /* "*<argc>\r\n$<len>\r\n<name>\r\n" */
+    int header_len;
+} fastCommand;
+
+static fastCommand fastCommands[] = {
+    {"get", 2, NULL, {0}, 0},
+    {"set", 3, NULL, {0}, 0},
+    {"hget", 3, NULL, {0}, 0},
+    {"incr", 2, NULL, {0}, 0},
+    {"expire", 3, NULL, {0}, 0},
+    {NULL, 0, NULL, {0}, 0}
+};
+
+#define FAST_REQUEST_MAX_ARGS   3
+
+/* Only disabled by the parser's benchmark, in order to compare with the
+ * generic parser alone. */
+static int fast_requests_enabled = 1;
+
+typedef struct fastRequest {
+    fastCommand *fc;
+    int offsets[FAST_REQUEST_MAX_ARGS];
+    int lengths[FAST_REQUEST_MAX_ARGS];
+    int size;
+} fastRequest;
+
+static void initFastCommands(void) {
+    fastCommand *fc;
+    for (fc = fastCommands; fc->name != NULL; fc++) {
+        assert(fc->argc <= FAST_REQUEST_MAX_ARGS);
+        fc->command = getRedisCommand(fc->name, strlen(fc->name));
+        fc->header_len = snprintf(fc->header, sizeof(fc->header),
+                                  "*%d\r\n$%d\r\n%s\r\n", fc->argc,
+                                  (int) strlen(fc->name), fc->name);
+    }
+}
+
+/* Read the complete "<type><digits>\r\n" line at 'pos' of the 'len' bytes at
+ * 'p', storing the number into 'val' and moving 'pos' after the line.
+ * Returns 0 if the line is incomplete or unexpected. */
+static int readLengthLine(char *p, size_t len, size_t *pos, char type,
+                          size_t *val)
+{
+    size_t i = *pos, start, n = 0;
+    if (i >= len || p[i] != type) return 0;
+    start = ++i;
+    while (i < len && i - start < 9 && p[i] >= '0' && p[i] <= '9')
+        n = (n * 10) + (p[i++] - '0');
+    if (i == start || i + 1 >= len || p[i] != '\r' || p[i + 1] != '\n')
+        return 0;
+    *pos = i + 2;
+    *val = n;
+    return 1;
+}
+
+/* Return the size of the complete multibulk request at the start of the
+ * 'len' bytes at 'p', or 0 if it's incomplete or unexpected. */
+static size_t getMultibulkSize(char *p, size_t len) {
+    size_t pos = 0, count, arglen, i;
+    if (!readLengthLine(p, len, &pos, '*', &count)) return 0;
+    for (i = 0; i < count; i++) {
+        if (!readLengthLine(p, len, &pos, '$', &arglen)) return 0;
+        if (pos + arglen + 2 > len || p[pos + arglen] != '\r' ||
+            p[pos + arglen + 1] != '\n') return 0;
+        pos += arglen + 2;
+    }
+    return pos;
+}
+
+/* Check whether the 'len' bytes at 'p' start with a complete request of one
+ * of the hottest commands (the name is case insensitive), storing its
+ * arguments and its size into 'fr'. Every bulk is read by a single bounded
+ * scan of its length, and anything unexpected, like a partial request, is
+ * left to the generic parser by returning 0. */
+static int matchFastRequest(char *p, size_t len, fastRequest *fr) {
+    fastCommand *fc;
+    int i;
+    if (len < 14 || p[0] != '*' || p[4] != '$') return 0;
+    for (fc = fastCommands; fc->name != NULL; fc++) {
+        if (p[1] != fc->header[1] || p[5] != fc->header[5]) continue;
+        if (len < (size_t) fc->header_len) return 0;
+        for (i = 0; i < fc->header_len; i++) {
+            char c = p[i];
+            if (c >= 'A' && c <= 'Z') c |= 0x20;
+            if (c != fc->header[i]) break;
+        }
+        if (i == fc->header_len) break;
+    }
+    if (fc->name == NULL || fc->command == NULL) return 0;
+    size_t pos = fc->header_len, namelen = strlen(fc->name);
+    fr->fc = fc;
+    fr->offsets[0] = pos - namelen - 2;
+    fr->lengths[0] = namelen;
+    for (i = 1; i < fc->argc; i++) {
+        size_t arglen;
+        if (!readLengthLine(p, len, &pos, '$', &arglen)) return 0;
+        if (pos + arglen + 2 > len || p[pos + arglen] != '\r' ||
+            p[pos + arglen + 1] != '\n') return 0;
+        fr->offsets[i] = pos;
+        fr->lengths[i] = arglen;
+        pos += arglen + 2;
+    }
+    fr->size = pos;
+    return 1;
+}
+
+/* Set up a new request whose buffer starts with the request matched by
+ * matchFastRequest, as the generic parser would have done. */
+static void setupFastRequest(clientRequest *req, fastRequest *fr) {
+    fastCommand *fc = fr->fc;
+    int i;
+    for (i = 0; i < fc->argc; i++) {
+        req->offsets[i] = fr->offsets[i];
+        req->lengths[i] = fr->lengths[i];
+    }
+    req->argc = fc->argc;
+    setRequestCommand(req, fc->command);
+    req->flags = fc->command->flags;
+    req->is_multibulk = 1;
+    req->num_commands = 1;
+    req->pending_bulks = 0;
+    req->current_bulk_length = REQ_STATUS_UNKNOWN;
+    req->query_offset = fr->size;
+    req->keys_slot = clusterKeyHashSlot(req->buffer + req->offsets[1],
+                                        req->lengths[1]);
+    req->keys_hashed = 1;
+    req->keys_cross_slot = 0;
+    req->parsing_status = PARSE_STATUS_OK;
+}
+
+/* Move the queries following the first 'offset' bytes of the request's
+ * buffer to new requests, added to the client's requests to process.
+ * Every complete multibulk request gets a buffer of its own, so that the
+ * bytes of a pipeline are copied only once (requests of the hottest
+ * commands are set up right away), while whatever remains is left to the
+ * generic parser in a single request. */
+static void splitRequest(clientRequest *req, int offset) {
+    client *c = req->client;
+    char *p = req->buffer + offset;
+    size_t len = sdslen(req->buffer) - offset, size;
+    clientRequest *new = NULL;
+    fastRequest fr;
+    while (len > 0 && fast_requests_enabled) {
+        int fast = (!config.dump_queries && matchFastRequest(p, len, &fr));
+        size = (fast ? (size_t) fr.size : getMultibulkSize(p, len));
+        if (size == 0) break;
+        new = createRequest(c);
+        if (new == NULL) break;
+        sdsfree(new->buffer);
+        new->buffer = sdsnewlen(p, size);
+        if (fast) setupFastRequest(new, &fr);
+        listAddNodeTail(c->requests_to_process, new);
+        p += size;
+        len -= size;
+        new = NULL;
+    }
+    if (len > 0) {
+        new = createRequest(c);
+        if (new != NULL) {
+            new->buffer = sdscatlen(new->buffer, p, len);
+            listAddNodeTail(c->requests_to_process, new);
+        }
+    }
+    c->current_request = new;
+    /* Truncate current request buffer */
+    sds reqbuf = sdsnewlen(req->buffer, offset);
+    sdsfree(req->buffer);
+    req->buffer = reqbuf;
+    req->query_offset = offset;
+    req->num_commands = 1;
+    req->pending_bulks = 0;
+}
+
 static int parseRequest(clientRequest *req) {
     int status = req->parsing_status, lf_len = 2, len, i;
     if (status != PARSE_STATUS_INCOMPLETE) return status;
@@ -1203,7 +2606,16 @@ static int parseRequest(clientRequest *req) {
     }
     int buflen = sdslen(req->buffer);
     char *p = req->buffer + req->query_offset, *nl = NULL;
-    sds line = NULL;
+    if (req->query_offset == 0 && fast_requests_enabled &&
+        !config.dump_queries)
+    {
+        fastRequest fr;
+        if (matchFastRequest(req->buffer, buflen, &fr)) {
+            setupFastRequest(req, &fr);
+            if (fr.size < buflen) splitRequest(req, fr.size);
+            return req->parsing_status;
+        }
+    }
     /* New request, so request type must be determinded. */
     if (req->is_multibulk == REQ_STATUS_UNKNOWN) {
         if (*p == '*') req->is_multibulk = 1;
@@ -1217,21 +2629,8 @@ static int parseRequest(clientRequest *req) {
                     proxyLogDebug("Multiple commands %d, "
                                   "splitting request...\n",
                                   req->num_commands);
-                    client *c = req->client;
-                    /* Truncate current request buffer */
-                    req->query_offset = p - req->buffer;
-                    sds newbuf = sdsnewlen(p, buflen - req->query_offset);
-                    sds reqbuf = sdsnewlen(req->buffer, req->query_offset);
-                    if (req->buffer) sdsfree(req->buffer);
-                    req->buffer = reqbuf;
-                    req->num_commands = 1;
-                    req->pending_bulks = 0;
-                    clientRequest *new = createRequest(c);
-                    new->buffer = sdscat(new->buffer, newbuf);
-                    sdsfree(newbuf);
-                    c->current_request = new;
+                    splitRequest(req, p - req->buffer);
                     buflen = req->query_offset;
-                    listAddNodeTail(c->requests_to_process, new);
                     break;
                 } else {
                     req->num_commands++;
@@ -1248,14 +2647,15 @@ static int parseRequest(clientRequest *req) {
             long long lc = req->pending_bulks;
             if (lc == REQ_STATUS_UNKNOWN) {
                 nl = strchr(p, '\r');
-                if (nl == NULL) {
+                /* The length line is complete only with its '\n'. */
+                if (nl == NULL || (nl - req->buffer) + 1 >= buflen) {
                     status = PARSE_STATUS_INCOMPLETE;
                     goto cleanup;
                 }
                 int len = nl - p;
-                if (line != NULL) sdsfree(line);
-                line = sdsnewlen(p, len);
-                lc = atoll(line);
+                /* The buffer is null terminated, so the number can be
+                 * parsed in place: it's followed by '\r' anyway. */
+                lc = atoll(p);
                 if (lc < 0) lc = 0;
                 req->query_offset += (len + 2);
                 req->pending_bulks = lc;
@@ -1268,6 +2668,10 @@ static int parseRequest(clientRequest *req) {
             for (i = 0; i < lc; i++) {
                 int arglen = req->current_bulk_length;
                 if (arglen == REQ_STATUS_UNKNOWN) {
+                    if (req->query_offset >= buflen) {
+                        status = PARSE_STATUS_INCOMPLETE;
+                        goto cleanup;
+                    }
                     if (*p != '$') {
                         proxyLogErr("Failed to parse multibulk query: '$' not "
                                     "found!\n");
@@ -1279,14 +2683,12 @@ static int parseRequest(clientRequest *req) {
                         goto cleanup;
                     }
                     nl = strchr(++p, '\r');
-                    if (nl == NULL) {
+                    if (nl == NULL || (nl - req->buffer) + 1 >= buflen) {
                         status = PARSE_STATUS_INCOMPLETE;
                         goto cleanup;
                     }
                     len = nl - p;
-                    if (line != NULL) sdsfree(line);
-                    line = sdsnewlen(p, len);
-                    arglen = atoi(line);
+                    arglen = atoi(p);
                     if (arglen < 0) arglen = 0;
                     req->current_bulk_length = arglen;
                     req->query_offset += (len + 3);
@@ -1296,36 +2698,34 @@ static int parseRequest(clientRequest *req) {
                     }
                     p = req->buffer + req->query_offset;
                 }
-                if (arglen > 0) {
-                    int newargc = req->argc + 1;
-                    if (!requestMakeRoomForArgs(req, newargc)) {
-                        status = PARSE_STATUS_ERROR;
-                        goto cleanup;
-                    }
-                    nl = strchr(p, '\r');
-                    if (nl == NULL) {
-                        status = PARSE_STATUS_INCOMPLETE;
-                        goto cleanup;
-                    }
-                    int endarg = req->query_offset + arglen;
-                    if (endarg >= buflen || *(req->buffer+endarg) != '\r') {
-                        status = PARSE_STATUS_INCOMPLETE;
-                        goto cleanup;
-                    }
-                    int idx = req->argc++;
-                    req->offsets[idx] = p - req->buffer;
-                    req->lengths[idx] = arglen;
-                    if (config.dump_queries) {
-                        sds tk = sdsnewlen(p, arglen);
-                        proxyLogDebug("Req. %llu:%llu ARGV[%d]: '%s'\n",
-                                      req->client->id, req->id, idx, tk);
-                        sdsfree(tk);
-                    }
-                    req->pending_bulks--;
-                    req->current_bulk_length = REQ_STATUS_UNKNOWN;
-                    req->query_offset = endarg + 2;
-                    p = req->buffer + req->query_offset;
+                /* Empty arguments (ie. MIGRATE's empty key) are arguments
+                 * like the others. */
+                int newargc = req->argc + 1;
+                if (!requestMakeRoomForArgs(req, newargc)) {
+                    status = PARSE_STATUS_ERROR;
+                    goto cleanup;
+                }
+                /* Just check the CRLF at the end of the bulk, without
+                 * scanning its content. */
+                int endarg = req->query_offset + arglen;
+                if (endarg + 1 >= buflen || *(req->buffer+endarg) != '\r') {
+                    status = PARSE_STATUS_INCOMPLETE;
+                    goto cleanup;
                 }
+                int idx = req->argc++;
+                req->offsets[idx] = p - req->buffer;
+                req->lengths[idx] = arglen;
+                if (config.dump_queries) {
+                    sds tk = sdsnewlen(p, arglen);
+                    proxyLogDebug("Req. %llu:%llu ARGV[%d]: '%s'\n",
+                                  req->client->id, req->id, idx, tk);
+                    sdsfree(tk);
+                }
+                parseRequestArgument(req, idx);
+                req->pending_bulks--;
+                req->current_bulk_length = REQ_STATUS_UNKNOWN;
+                req->query_offset = endarg + 2;
+                p = req->buffer + req->query_offset;
             }
         }
     } else {
@@ -1360,11 +2760,10 @@ cleanup:
     if (req->query_offset > buflen) req->query_offset = buflen;
     int remaining = buflen - req->query_offset;
     if (status == PARSE_STATUS_INCOMPLETE) {
-        if (req->is_multibulk && req->pending_bulks <= 0 && remaining == 0)
+        if (req->is_multibulk && req->pending_bulks == 0 && remaining == 0)
             status = PARSE_STATUS_OK;
     }
     req->parsing_status = status;
-    if (line != NULL) sdsfree(line);
     return status;
 }
 
@@ -1380,31 +2779,170 @@ static sds getRequestCommand(clientRequest *req) {
     return cmd;
 }
 
-static clusterNode *getRequestNode(clientRequest *req, sds *err) {
-    clusterNode *node = NULL;
-    int slot = UNDEFINED_SLOT;
-    if (req->argc == 1) {
-        /*TODO: temporary behaviour */
-        node = getFirstMappedNode(proxy.cluster);
-        req->node = node;
-        return node;
+/* Choose the replica of 'master' that will serve a read, using the
+ * configured policy. Every thread uses its own counter to rotate the
+ * replicas, and only looks at the queues of its own connections in order
+ * to find the least loaded replica. If the master has no healthy replica,
+ * the master itself is returned. */
+static clusterNode *getReadReplica(clusterNode *master, int thread_id) {
+    clusterReplicas *replicas = master->replicas;
+    if (replicas == NULL || replicas->count == 0) return master;
+    proxyThread *thread = proxy.threads[thread_id];
+    int count = replicas->count, start = thread->next_replica++ % count, i;
+    if (config.replica_policy != REPLICA_POLICY_LEAST_OUTSTANDING)
+        return replicas->nodes[start];
+    clusterNode *replica = NULL;
+    unsigned long min_outstanding = 0;
+    for (i = 0; i < count; i++) {
+        clusterNode *node = replicas->nodes[(start + i) % count];
+        redisClusterConnection *conn = getClusterConnection(node, thread_id);
+        unsigned long outstanding = listLength(conn->requests_to_send) +
+                                    listLength(conn->requests_pending);
+        if (replica == NULL || outstanding < min_outstanding) {
+            replica = node;
+            min_outstanding = outstanding;
+            if (outstanding == 0) break;
+        }
+    }
+    return replica;
+}
+
+/* Keys that got an ASK redirection are stored into the thread's moved_keys
+ * radix tree, prefixed by their slot (two bytes, big endian), so that the
+ * next requests for the same keys can be sent directly to the importing
+ * node, saving the redirection's round trip. */
+static unsigned char *getMovedKeyName(int slot, char *key, int keylen,
+                                      unsigned char *buf, size_t bufsize)
+{
+    unsigned char *name = buf;
+    if ((size_t) keylen + 2 > bufsize) name = zmalloc(keylen + 2);
+    name[0] = (slot >> 8) & 0xFF;
+    name[1] = slot & 0xFF;
+    memcpy(name + 2, key, keylen);
+    return name;
+}
+
+static void addMovedKey(proxyThread *thread, int slot, char *key,
+                        int keylen)
+{
+    unsigned char buf[128];
+    unsigned char *name = getMovedKeyName(slot, key, keylen, buf,
+                                          sizeof(buf));
+    /* Keys are forgotten only when their slot finishes migrating, so just
+     * start again if too many of them have been collected. */
+    if (raxSize(thread->moved_keys) >= MAX_MOVED_KEYS) {
+        raxFree(thread->moved_keys);
+        thread->moved_keys = raxNew();
+    }
+    raxInsert(thread->moved_keys, name, keylen + 2, NULL, NULL);
+    if (name != buf) zfree(name);
+}
+
+static int isMovedKey(proxyThread *thread, int slot, char *key, int keylen) {
+    if (raxSize(thread->moved_keys) == 0) return 0;
+    unsigned char buf[128];
+    unsigned char *name = getMovedKeyName(slot, key, keylen, buf,
+                                          sizeof(buf));
+    int moved = (raxFind(thread->moved_keys, name, keylen + 2) !=
+                 raxNotFound);
+    if (name != buf) zfree(name);
+    return moved;
+}
+
+/* Forget the moved keys of the slots that are not migrating anymore. */
+static void purgeMovedKeys(proxyThread *thread) {
+    if (raxSize(thread->moved_keys) == 0) return;
+    raxIterator iter;
+    raxStart(&iter, thread->moved_keys);
+    raxSeek(&iter, "^", NULL, 0);
+    while (raxNext(&iter)) {
+        int slot = (iter.key[0] << 8) | iter.key[1];
+        if (getSlotImportingNode(proxy.cluster, slot) != NULL) continue;
+        raxRemove(thread->moved_keys, iter.key, iter.key_len, NULL);
+        raxSeek(&iter, ">", iter.key, iter.key_len);
     }
+    raxStop(&iter);
+}
+
+/* Return the key of the request if it has only one key, NULL otherwise.
+ * Commands with movable keys are not considered. */
+static char *getRequestSingleKey(clientRequest *req, int *keylen) {
     int first_key = req->command->first_key,
-        last_key = req->command->last_key,
-        key_step = req->command->key_step, i;
-    if (first_key == 0) return NULL;
+        last_key = req->command->last_key;
+    if (req->command->getkeys != NULL) return NULL;
+    if (first_key <= 0 || first_key >= req->argc) return NULL;
+    if (last_key < 0 || last_key >= req->argc) last_key = req->argc - 1;
+    if (last_key > first_key) return NULL;
+    *keylen = req->lengths[first_key];
+    return req->buffer + req->offsets[first_key];
+}
+
+/* Store into 'keys' (that has room for argc positions) the positions of the
+ * keys of the request, using the key extraction callback of the commands
+ * with movable keys. Returns the number of keys, or -1 if the arguments
+ * are invalid. */
+static int getRequestKeys(clientRequest *req, int *keys) {
+    redisCommandDef *cmd = req->command;
+    if (cmd->getkeys != NULL) {
+        return cmd->getkeys(req->buffer, req->offsets, req->lengths,
+                            req->argc, keys);
+    }
+    int first_key = cmd->first_key, last_key = cmd->last_key,
+        key_step = cmd->key_step, numkeys = 0, i;
+    if (first_key == 0) return 0;
     else if (first_key >= req->argc) first_key = req->argc - 1;
     if (last_key < 0 || last_key >= req->argc) last_key = req->argc - 1;
     if (last_key < first_key) last_key = first_key;
     if (key_step < 1) key_step = 1;
-    for (i = first_key; i <= last_key; i += key_step) {
-        char *key = req->buffer + req->offsets[i];
-        clusterNode *n = getNodeByKey(proxy.cluster, key, req->lengths[i],
-                                      &slot);
-        if (n == NULL) break;
-        if (node == NULL) node = n;
-        else {
-            if (node != n) {
+    for (i = first_key; i <= last_key; i += key_step) keys[numkeys++] = i;
+    return numkeys;
+}
+
+static clusterNode *getRequestNode(clientRequest *req, sds *err) {
+    clusterNode *node = NULL;
+    if (req->argc == 1) {
+        /* Keyless commands (ie. TIME or RANDOMKEY) can be served by any
+         * master, so they are spread across all of them. */
+        proxyThread *thread = proxy.threads[req->client->thread_id];
+        node = getMappedNodeAt(proxy.cluster, thread->next_master++);
+        req->node = node;
+        return node;
+    }
+    /* Hash all the keys at once, using stack buffers for the most common
+     * case of requests with a few keys. */
+    int keys_buf[REQUEST_KEYS_STACK_SIZE], slots_buf[REQUEST_KEYS_STACK_SIZE];
+    clusterNode *nodes_buf[REQUEST_KEYS_STACK_SIZE];
+    int *keys = keys_buf, *slots = slots_buf, numkeys, i;
+    clusterNode **nodes = nodes_buf;
+    if (req->argc > REQUEST_KEYS_STACK_SIZE) {
+        keys = zmalloc(req->argc * sizeof(int));
+        slots = zmalloc(req->argc * sizeof(int));
+        nodes = zmalloc(req->argc * sizeof(clusterNode *));
+    }
+    numkeys = getRequestKeys(req, keys);
+    if (numkeys < 0) {
+        if (err != NULL) {
+            if (*err != NULL) sdsfree(*err);
+            *err = sdsnew("Invalid arguments for command");
+        }
+    } else if (numkeys == 0) {
+        /* Movable keys commands without keys (ie. EVAL with 0 keys) always
+         * go to the same node, so that EVALSHA finds the scripts loaded by
+         * EVAL. */
+        node = getFirstMappedNode(proxy.cluster);
+        req->slot = UNDEFINED_SLOT;
+        req->node = node;
+        goto cleanup;
+    } else if (req->keys_hashed == numkeys && !req->keys_cross_slot) {
+        /* All the keys have already been hashed by the parser. */
+        slots[0] = req->keys_slot;
+        node = searchNodeBySlot(proxy.cluster, req->keys_slot);
+    } else if (getNodesByKeys(proxy.cluster, req->buffer, req->offsets,
+                              req->lengths, keys, numkeys, slots, nodes))
+    {
+        node = nodes[0];
+        for (i = 1; i < numkeys; i++) {
+            if (nodes[i] != node) {
                 if (err != NULL) {
                     if (*err != NULL) sdsfree(*err);
                     *err = sdsnew("Queries with keys belonging to "
@@ -1415,8 +2953,33 @@ static clusterNode *getRequestNode(clientRequest *req, sds *err) {
             }
         }
     }
+    req->slot = (node != NULL ? slots[0] : UNDEFINED_SLOT);
+    clusterNode *importing = NULL;
+    if (node != NULL)
+        importing = getSlotImportingNode(proxy.cluster, req->slot);
+    if (importing != NULL) {
+        /* The slot is being migrated: keys already moved are directly
+         * requested to the importing node. Replicas are not used, since
+         * they would not redirect requests for the moved keys. */
+        proxyThread *thread = proxy.threads[req->client->thread_id];
+        if (numkeys == 1 && !req->asking &&
+            isMovedKey(thread, req->slot, req->buffer + req->offsets[keys[0]],
+                       req->lengths[keys[0]]))
+        {
+            node = importing;
+            setRequestAsking(req, 1);
+            req->skip_next_reply = 1;
+        }
+    } else if (node != NULL && (req->flags & CMD_READONLY) &&
+               isReplicaRead(req->client, req->slot))
+        node = getReadReplica(node, req->client->thread_id);
     req->node = node;
-    req->slot = slot;
+cleanup:
+    if (keys != keys_buf) {
+        zfree(keys);
+        zfree(slots);
+        zfree(nodes);
+    }
     return node;
 }
 
@@ -1428,35 +2991,41 @@ void freeRequest(clientRequest *req, int delete_from_lists) {
                       "it now...\n", req->client->id, req->id);
         return;
     }
+    removeHedgeCandidate(req);
+    removeHeldRequest(req);
+    if (req->hedge != NULL) req->hedge->hedge = NULL;
+    if (req->parent != NULL) setSubRequestReply(req, NULL, NULL);
+    if (req->fanout != NULL) freeRequestFanout(req);
     if (req->buffer != NULL) sdsfree(req->buffer);
-    if (req->offsets != NULL) zfree(req->offsets);
-    if (req->lengths != NULL) zfree(req->lengths);
+    if (req->offsets != req->inline_offsets) {
+        if (req->offsets != NULL) zfree(req->offsets);
+        if (req->lengths != NULL) zfree(req->lengths);
+    }
     if (req->client->current_request == req)
         req->client->current_request = NULL;
-    redisContext *ctx = NULL;
-    if (req->node)
-        ctx = getClusterNodeContext(req->node, req->client->thread_id);
+    redisClusterConnection *conn = getRequestConnection(req);
+    redisContext *ctx = (conn != NULL ? conn->context : NULL);
     aeEventLoop *el = getClientLoop(req->client);
     if (ctx != NULL && req->has_write_handler)
         aeDeleteFileEvent(el, ctx->fd, AE_WRITABLE);
-    if (delete_from_lists && req->node != NULL) {
-        redisClusterConnection *conn =
-            getClusterConnection(req->node, req->client->thread_id);
-        assert(conn != NULL);
-        listNode *ln = listSearchKey(conn->requests_to_send, req);
-        if (ln) listDelNode(conn->requests_to_send, ln);
-        ln = listSearchKey(conn->requests_pending, req);
-        if (ln) listDelNode(conn->requests_pending, ln);
-        ln = listSearchKey(req->client->requests_to_process, req);
+    if (delete_from_lists) {
+        listNode *ln = listSearchKey(req->client->requests_to_process, req);
         /* We cannot delete the request's list node from the requests_pending
          * queue, since this would break the reply processing order. So we just
          * set its value to NULL. The resulting NULL placeholder (we can call
          * it a 'ghost request') will be simply skipped during reply buffer
          * processing. */
         if (ln) ln->value = NULL;
+    }
+    if (delete_from_lists && conn != NULL) {
+        listNode *ln = listSearchKey(conn->requests_to_send, req);
+        if (ln) listDelNode(conn->requests_to_send, ln);
+        ln = listSearchKey(conn->requests_pending, req);
+        if (ln) listDelNode(conn->requests_pending, ln);
         if (config.dump_queues)
-            dumpQueue(req->node, req->client->thread_id, QUEUE_TYPE_PENDING);
+            dumpQueue(conn, req->client->thread_id, QUEUE_TYPE_PENDING);
     }
+    setRequestCommand(req, NULL);
     zfree(req);
 }
 
@@ -1489,6 +3058,7 @@ static clientRequest *getFirstQueuedRequest(list *queue, int *is_empty) {
 }
 
 static redisClusterConnection *getRequestConnection(clientRequest *req) {
+    if (req->private_connection != NULL) return req->private_connection;
     clusterNode *node = req->node;
     if (node == NULL) return NULL;
     return node->connections[req->client->thread_id];
@@ -1519,7 +3089,19 @@ static void dequeueRequest(clientRequest *req, int queue_type) {
         listDelNode(queue, ln);
 }
 
-static clientRequest *createRequest(client *c) {
+/* Set the command of the request. The commands loaded from the cluster
+ * count the requests using them, so that they can be freed once replaced
+ * and unused (see freeUnusedCommands). */
+static void setRequestCommand(clientRequest *req, redisCommandDef *cmd) {
+    if (req->command == cmd) return;
+    if (req->command != NULL && req->command->loaded)
+        req->command->refcount--;
+    if (cmd != NULL && cmd->loaded) cmd->refcount++;
+    req->command = cmd;
+}
+
+/* Allocate a request of the client, without giving it an ID. */
+static clientRequest *allocRequest(client *c) {
     clientRequest *req = zcalloc(sizeof(*req));
     if (req == NULL) goto alloc_failure;
     req->client = c;
@@ -1532,15 +3114,44 @@ static clientRequest *createRequest(client *c) {
     req->parsing_status = PARSE_STATUS_INCOMPLETE;
     req->has_write_handler = 0;
     req->written = 0;
-    size_t offsets_size = sizeof(int) * QUERY_OFFSETS_MIN_SIZE;
-    req->offsets = zmalloc(offsets_size);
-    req->lengths = zmalloc(offsets_size);
-    if (!req->offsets || !req->lengths) goto alloc_failure;
+    req->offsets = req->inline_offsets;
+    req->lengths = req->inline_lengths;
     req->argc = 0;
-    req->offsets_size = QUERY_OFFSETS_MIN_SIZE;
+    req->offsets_size = REQUEST_INLINE_ARGS;
     req->command = NULL;
+    req->flags = 0;
     req->node = NULL;
     req->slot = UNDEFINED_SLOT;
+    req->redirections = 0;
+    req->asking = 0;
+    req->skip_next_reply = 0;
+    req->start_time = 0;
+    req->hedge = NULL;
+    req->is_hedge = 0;
+    req->discard_reply = 0;
+    req->hedge_node = NULL;
+    req->held_until = 0;
+    req->held_node = NULL;
+    req->routed_time = 0;
+    req->keys_slot = UNDEFINED_SLOT;
+    req->keys_hashed = 0;
+    req->keys_cross_slot = 0;
+    req->parent = NULL;
+    req->fanout_index = 0;
+    req->fanout = NULL;
+    req->pinned = 0;
+    req->private_connection = NULL;
+    return req;
+alloc_failure:
+    proxyLogErr("ERROR: Failed to allocate request!\n");
+    if (!req) return NULL;
+    freeRequest(req, 1);
+    return NULL;
+}
+
+static clientRequest *createRequest(client *c) {
+    clientRequest *req = allocRequest(c);
+    if (req == NULL) return NULL;
     c->current_request = req;
     req->id = c->next_request_id++;
     /* Avoid overflow */
@@ -1550,11 +3161,6 @@ static clientRequest *createRequest(client *c) {
 
     proxyLogDebug("Created Request %llu:%llu\n", req->client->id, req->id);
     return req;
-alloc_failure:
-    proxyLogErr("ERROR: Failed to allocate request!\n");
-    if (!req) return NULL;
-    freeRequest(req, 1);
-    return NULL;
 }
 
 /* Try to call aeCreateFileEvent, and if ERANGE error has been issued, try to
@@ -1579,87 +3185,1455 @@ static int installIOHandler(aeEventLoop *el, int fd, int mask, aeFileProc *proc,
     }
 }
 
-/* Fetch the cluster node connection (redisContext *) related to the
- * request and try to connect to it if not already connected.
- * Then install the write handler on the request.
- * Return 1 if the request already has a write handler or if the
- * write handler has been correctly installed.
- * Return 0 if the connection to the cluster node is missing and cannot be
- * established or if the write handler installation fails. */
-static int sendRequestToCluster(clientRequest *req, sds *errmsg)
-{
-    if (errmsg != NULL) *errmsg = NULL;
-    if (req->has_write_handler) return 1;
-    int thread_id = req->client->thread_id;
-    assert(req->node != NULL);
-    aeEventLoop *el = getClientLoop(req->client);
-    redisContext *ctx = getClusterNodeContext(req->node, thread_id);
-    if (ctx == NULL) {
-        if ((ctx = clusterNodeConnect(req->node, thread_id)) == NULL) {
-            sds err = sdsnew("Could not connect to node ");
-            err = sdscatfmt(err, "%s:%u", req->node->ip, req->node->port);
-            addReplyError(req->client, err, req->id);
-            proxyLogDebug("%s\n", err);
-            if (errmsg != NULL) {
-                /* Remember to free the string outside this function*/
-                *errmsg = err;
-            } else sdsfree(err);
-            freeRequest(req, 1);
-            return 0;
+/* Fetch the cluster node connection (redisContext *) related to the
+ * request and try to connect to it if not already connected.
+ * Then install the write handler on the request.
+ * Return 1 if the request already has a write handler or if the
+ * write handler has been correctly installed, or if the connection is still
+ * being established (the request is sent once it's ready).
+ * Return 0 if the connection to the cluster node is missing and cannot be
+ * established or if the write handler installation fails. */
+static int sendRequestToCluster(clientRequest *req, sds *errmsg)
+{
+    if (errmsg != NULL) *errmsg = NULL;
+    if (req->has_write_handler) return 1;
+    int thread_id = req->client->thread_id;
+    assert(req->node != NULL);
+    aeEventLoop *el = getClientLoop(req->client);
+    redisClusterConnection *conn = getRequestConnection(req);
+    assert(conn != NULL);
+    /* Private connections are connected when they're created. */
+    redisContext *ctx = conn->context;
+    if (ctx == NULL) {
+        /* The standby connection sends the queued requests once ready. */
+        if (conn->connecting != NULL) return 1;
+        /* A node whose connection just failed is not connected again for
+         * a while, not to stall the thread again. */
+        long long now = mstime();
+        if (!isConnectionBackingOff(conn, now) &&
+            (ctx = clusterNodeConnect(req->node, thread_id)) == NULL)
+            conn->connect_time = now + CLUSTER_NODE_CONNECT_BACKOFF;
+        if (ctx == NULL) {
+            requestClusterRefresh();
+            /* Wait for a failover, if possible. */
+            holdNodeRequests(req->node, thread_id);
+            if (req->held_node != NULL) return 0;
+            sds err = sdsnew("Could not connect to node ");
+            err = sdscatfmt(err, "%s:%u", req->node->ip, req->node->port);
+            addNodeFailureReply(req, err);
+            proxyLogDebug("%s\n", err);
+            if (errmsg != NULL) {
+                /* Remember to free the string outside this function*/
+                *errmsg = err;
+            } else sdsfree(err);
+            freeRequest(req, 1);
+            return 0;
+        }
+    }
+    if (!conn->has_read_handler) {
+        if (!installIOHandler(el, ctx->fd, AE_READABLE, readClusterReply,
+                              conn, 0))
+        {
+            proxyLogErr("Failed to create read reply handler for node %s:%d\n",
+                          req->node->ip, req->node->port);
+            return 0;
+        } else  {
+            conn->has_read_handler = 1;
+            proxyLogDebug("Read reply handler installed "
+                          "for node %s:%d\n", req->node->ip, req->node->port);
+        }
+    }
+    if (!writeToCluster(el, ctx->fd, req)) return 0;
+    int sent = (req->written == sdslen(req->buffer));
+    if (!sent) {
+        if (aeCreateFileEvent(el, ctx->fd, AE_WRITABLE,
+                              writeToClusterHandler, conn) == AE_ERR) {
+            addRequestErrorReply(req, "Failed to write to cluster\n");
+            proxyLogErr("Failed to create write handler for request\n");
+            freeRequest(req, 1);
+            return 0;
+        }
+        req->has_write_handler = 1;
+        req->client->requests_with_write_handler++;
+        proxyLogDebug("Write handler installed into request %llu:%llu for "
+                      "node %s:%d\n", req->client->id, req->id,
+                      req->node->ip, req->node->port);
+    }
+    return 1;
+}
+
+/* Try to send the next request in requests_to_send list, by calling
+ * sendRequestToCluster. If an error occurs (sendRequestToCluster returns 0)
+ * keep cycling the queue until sendRequestsToCluster returns 1.
+ * Return the handled request, if any. */
+
+static clientRequest *handleNextRequestOnConnection(
+    redisClusterConnection *conn)
+{
+    clientRequest *req = getFirstQueuedRequest(conn->requests_to_send, NULL);
+    if (req == NULL) return NULL;
+    while (!sendRequestToCluster(req, NULL)) {
+        req = getFirstQueuedRequest(conn->requests_to_send, NULL);
+        if (req == NULL) break;
+    }
+    return req;
+}
+
+static clientRequest *handleNextRequestToCluster(clusterNode *node,
+                                                 int thread_id)
+{
+    return handleNextRequestOnConnection(getClusterConnection(node,
+                                                              thread_id));
+}
+
+
+/* Hedged reads.
+ *
+ * When hedging is enabled, read-only requests are tracked by their thread
+ * and, if their reply did not arrive within the hedging delay (computed by
+ * the thread's cron from the configured percentile of the latencies seen
+ * by the thread), a copy of the request is sent to a replica (or to the
+ * master, if the request was already sent to a replica). The two requests
+ * share the same ID and the first reply wins: the other request gets
+ * cancelled and, if it's still waiting for its reply, it's replaced by a
+ * ghost request, so that its reply will be just discarded. */
+
+static void removeHedgeCandidate(clientRequest *req) {
+    if (req->hedge_node == NULL) return;
+    proxyThread *thread = proxy.threads[req->client->thread_id];
+    listDelNode(thread->hedge_candidates, req->hedge_node);
+    req->hedge_node = NULL;
+}
+
+/* Reply with an error to the client of the request, unless the request has
+ * been hedged: in this case the reply will be provided by its twin. */
+static void addRequestErrorReply(clientRequest *req, const char *err) {
+    if (req->discard_reply) return;
+    if (req->hedge != NULL) {
+        req->hedge->hedge = NULL;
+        req->hedge = NULL;
+        return;
+    }
+    if (req->parent != NULL) {
+        setSubRequestReply(req, NULL, err);
+        return;
+    }
+    addReplyError(req->client, err, req->id);
+}
+
+/* Choose the node that will receive the copy of a hedged read: a replica
+ * of the slot's master other than the node the request has already been
+ * sent to, or the master itself. */
+static clusterNode *getHedgeNode(clientRequest *req) {
+    clusterNode *master = searchNodeBySlot(proxy.cluster, req->slot);
+    if (master == NULL) return NULL;
+    clusterReplicas *replicas = master->replicas;
+    if (replicas != NULL && replicas->count > 0) {
+        proxyThread *thread = proxy.threads[req->client->thread_id];
+        int count = replicas->count, start = thread->next_replica++ % count, i;
+        for (i = 0; i < count; i++) {
+            clusterNode *node = replicas->nodes[(start + i) % count];
+            if (node != req->node) return node;
+        }
+    }
+    return (master != req->node ? master : NULL);
+}
+
+static void hedgeRequest(clientRequest *req) {
+    if (req->hedge != NULL || req->redirections > 0 || req->node == NULL ||
+        req->client->status == CLIENT_STATUS_UNLINKED) return;
+    clusterNode *node = getHedgeNode(req);
+    if (node == NULL) return;
+    client *c = req->client;
+    clientRequest *hedge = zcalloc(sizeof(*hedge));
+    if (hedge == NULL) return;
+    hedge->client = c;
+    hedge->id = req->id;
+    hedge->buffer = sdsdup(req->buffer);
+    hedge->offsets = zmalloc(req->offsets_size * sizeof(int));
+    hedge->lengths = zmalloc(req->offsets_size * sizeof(int));
+    memcpy(hedge->offsets, req->offsets, req->argc * sizeof(int));
+    memcpy(hedge->lengths, req->lengths, req->argc * sizeof(int));
+    hedge->offsets_size = req->offsets_size;
+    hedge->argc = req->argc;
+    hedge->num_commands = req->num_commands;
+    hedge->is_multibulk = req->is_multibulk;
+    hedge->parsing_status = PARSE_STATUS_OK;
+    setRequestCommand(hedge, req->command);
+    hedge->flags = req->flags;
+    hedge->slot = req->slot;
+    hedge->keys_slot = req->keys_slot;
+    hedge->keys_hashed = req->keys_hashed;
+    hedge->keys_cross_slot = req->keys_cross_slot;
+    hedge->node = node;
+    hedge->start_time = ustime();
+    hedge->routed_time = req->routed_time;
+    hedge->is_hedge = 1;
+    hedge->hedge = req;
+    req->hedge = hedge;
+    proxyLogDebug("Hedging request %llu:%llu to %s:%d\n", c->id, req->id,
+                  node->ip, node->port);
+    if (!enqueueRequestToSend(hedge)) {
+        freeRequest(hedge, 0);
+        return;
+    }
+    handleNextRequestToCluster(node, c->thread_id);
+}
+
+static int hedgeReadsTimer(aeEventLoop *el, long long id, void *privdata) {
+    UNUSED(id);
+    UNUSED(privdata);
+    proxyThread *thread = el->privdata;
+    long long now = ustime(), delay = thread->hedge_delay;
+    listNode *ln;
+    while ((ln = listFirst(thread->hedge_candidates)) != NULL) {
+        clientRequest *req = ln->value;
+        long long elapsed = now - req->start_time;
+        if (delay >= 0 && elapsed < delay)
+            return (delay - elapsed + 999) / 1000;
+        removeHedgeCandidate(req);
+        if (delay >= 0) hedgeRequest(req);
+    }
+    thread->hedge_timer_id = -1;
+    return AE_NOMORE;
+}
+
+static void trackHedgeableRequest(clientRequest *req) {
+    proxyThread *thread = proxy.threads[req->client->thread_id];
+    req->start_time = ustime();
+    if (thread->hedge_delay < 0) return;
+    if (listAddNodeTail(thread->hedge_candidates, req) == NULL) return;
+    req->hedge_node = listLast(thread->hedge_candidates);
+    if (thread->hedge_timer_id == -1) {
+        thread->hedge_timer_id =
+            aeCreateTimeEvent(thread->loop, (thread->hedge_delay + 999) / 1000,
+                              hedgeReadsTimer, NULL, NULL);
+    }
+}
+
+/* Cancel the twin of a hedged request that got its reply. */
+static void cancelHedgedRequest(clientRequest *req) {
+    clientRequest *twin = req->hedge;
+    if (twin == NULL) return;
+    req->hedge = NULL;
+    twin->hedge = NULL;
+    redisClusterConnection *conn = getRequestConnection(twin);
+    listNode *ln = NULL;
+    if (conn != NULL && (ln = listSearchKey(conn->requests_pending, twin))) {
+        /* The reply is still to come: leave a ghost request in place of
+         * the twin, so that it will be discarded. */
+        ln->value = NULL;
+        if (twin->skip_next_reply)
+            listInsertNode(conn->requests_pending, ln, NULL, 0);
+    } else if (conn != NULL &&
+               (ln = listSearchKey(conn->requests_to_send, twin)))
+    {
+        if (twin->written > 0) {
+            /* A partially written request cannot be dropped. */
+            twin->discard_reply = 1;
+            return;
+        }
+        listDelNode(conn->requests_to_send, ln);
+        if (twin->has_write_handler) {
+            twin->has_write_handler = 0;
+            twin->client->requests_with_write_handler--;
+        }
+    }
+    freeRequest(twin, 0);
+}
+
+/* Fan-out.
+ *
+ * Multi-key commands whose keys belong to different slots (ie. MGET or DEL)
+ * are split into sub-requests, one for every slot, since even a single
+ * node would reject keys of different slots. Sub-requests are routed and
+ * sent like any other request, so the ones directed to different nodes
+ * run concurrently, while the ones directed to the same node get
+ * pipelined. They share the ID of their parent, which is not queued
+ * anywhere: it just collects their replies and, when the last one
+ * arrives, the reducer of the command merges them into the parent's
+ * reply, written to the client at the position of its ID.
+ *
+ * Commands without keys that need the whole keyspace (ie. DBSIZE or KEYS)
+ * are broadcast in the same way, with a sub-request bound to every master.
+ * Since a slow or unreachable master would hold the reply (and the
+ * following ones) of the client forever, broadcasts get an error if some
+ * master did not reply within broadcast_timeout milliseconds: late
+ * replies are just discarded. */
+
+#define FANOUT_REDUCE_KEYS  1   /* Array with the reply of every key */
+#define FANOUT_REDUCE_SUM   2   /* Sum of the integer replies */
+#define FANOUT_REDUCE_OK    3   /* OK if every sub-request replied OK */
+#define FANOUT_REDUCE_CONCAT 4  /* Array with the elements of all the
+                                 * array replies */
+#define FANOUT_REDUCE_INFO  5   /* Merged INFO sections */
+#define FANOUT_REDUCE_SCAN  6   /* SCAN page with the proxy's cursor */
+
+#define SCAN_CURSOR_NODE_BITS   10  /* Bits of the SCAN cursor used for the
+                                     * index of the master. */
+
+typedef struct fanoutCommand {
+    char *name;
+    int reducer;
+    int broadcast;          /* Sent to all the masters. */
+    redisCommandDef *command;
+} fanoutCommand;
+
+static fanoutCommand fanoutCommands[] = {
+    {"mget", FANOUT_REDUCE_KEYS, 0, NULL},
+    {"mset", FANOUT_REDUCE_OK, 0, NULL},
+    {"del", FANOUT_REDUCE_SUM, 0, NULL},
+    {"unlink", FANOUT_REDUCE_SUM, 0, NULL},
+    {"exists", FANOUT_REDUCE_SUM, 0, NULL},
+    {"touch", FANOUT_REDUCE_SUM, 0, NULL},
+    {"dbsize", FANOUT_REDUCE_SUM, 1, NULL},
+    {"keys", FANOUT_REDUCE_CONCAT, 1, NULL},
+    {"flushall", FANOUT_REDUCE_OK, 1, NULL},
+    {"flushdb", FANOUT_REDUCE_OK, 1, NULL},
+    {"info", FANOUT_REDUCE_INFO, 1, NULL},
+    {NULL, 0, 0, NULL}
+};
+
+/* INFO sections whose integer fields are added up when merging the INFO
+ * of the masters, while the other fields keep the value of the first
+ * master reporting them. */
+static char *infoCounterSections[] = {
+    "Clients", "Memory", "Stats", "Keyspace", "Commandstats", "Errorstats",
+    NULL
+};
+
+typedef struct requestFanout {
+    int reducer;
+    int count;              /* Number of sub-requests. */
+    int pending;            /* Sub-requests still waiting for a reply. */
+    clientRequest **requests; /* Sub-requests, NULL once replied. */
+    redisReply **replies;   /* Reply of every sub-request. */
+    sds error;              /* First error, replied in place of the merge. */
+    int numkeys;
+    int *key_requests;      /* Sub-request of every key, so that the
+                             * FANOUT_REDUCE_KEYS reducer can restore the
+                             * order of the keys. */
+    long long deadline;     /* Time (ms) a broadcast must get its replies
+                             * within, 0 if none. */
+    listNode *deadline_node;/* Node in the thread's broadcasts. */
+    int scan_node;          /* Index of the master scanned by a SCAN. */
+    int scan_nodes;         /* Number of masters scanned by a SCAN. */
+    int prefetch;           /* Prefetched SCAN page, not requested by the
+                             * client yet. */
+} requestFanout;
+
+typedef struct slotKey {
+    int slot;
+    int key;                /* Position of the key in the request. */
+} slotKey;
+
+static void initFanoutCommands(void) {
+    fanoutCommand *fc;
+    for (fc = fanoutCommands; fc->name != NULL; fc++)
+        fc->command = getRedisCommand(fc->name, strlen(fc->name));
+}
+
+static fanoutCommand *getFanoutCommand(redisCommandDef *cmd) {
+    fanoutCommand *fc;
+    for (fc = fanoutCommands; fc->name != NULL; fc++)
+        if (fc->command == cmd) return fc;
+    return NULL;
+}
+
+static requestFanout *createRequestFanout(int reducer, int count,
+                                          int numkeys)
+{
+    requestFanout *fanout = zcalloc(sizeof(*fanout));
+    if (fanout == NULL) return NULL;
+    fanout->reducer = reducer;
+    fanout->count = count;
+    fanout->numkeys = numkeys;
+    fanout->requests = zcalloc(count * sizeof(clientRequest *));
+    fanout->replies = zcalloc(count * sizeof(redisReply *));
+    if (numkeys > 0) fanout->key_requests = zmalloc(numkeys * sizeof(int));
+    /* The request creating the sub-requests holds a reference too, so that
+     * sub-requests failing right away cannot complete the fan-out before
+     * all of them have been created. */
+    fanout->pending = count + 1;
+    return fanout;
+}
+
+static void freeRequestFanout(clientRequest *req) {
+    requestFanout *fanout = req->fanout;
+    int i;
+    if (fanout->deadline_node != NULL) {
+        proxyThread *thread = proxy.threads[req->client->thread_id];
+        listDelNode(thread->broadcasts, fanout->deadline_node);
+    }
+    for (i = 0; i < fanout->count; i++) {
+        if (fanout->replies[i] != NULL) freeReplyObject(fanout->replies[i]);
+    }
+    zfree(fanout->requests);
+    zfree(fanout->replies);
+    if (fanout->key_requests != NULL) zfree(fanout->key_requests);
+    if (fanout->error != NULL) sdsfree(fanout->error);
+    zfree(fanout);
+}
+
+typedef struct infoField {
+    sds name;
+    sds value;
+} infoField;
+
+typedef struct infoSection {
+    sds name;
+    int counters;           /* Integer fields are added up. */
+    list *fields;
+} infoSection;
+
+static int parseInfoInteger(const char *p, size_t len, long long *val) {
+    char buf[32], *end;
+    if (len == 0 || len >= sizeof(buf)) return 0;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    errno = 0;
+    *val = strtoll(buf, &end, 10);
+    return (errno == 0 && *end == '\0');
+}
+
+/* Add the value 'add' to the value of an INFO field, that can also be a
+ * list of "<name>=<value>" pairs (ie. "keys=10,expires=0"). Values that are
+ * not integers keep the current value. */
+static sds addInfoFieldValue(sds value, const char *add, size_t len) {
+    long long a, b;
+    if (parseInfoInteger(value, sdslen(value), &a) &&
+        parseInfoInteger(add, len, &b)) {
+        sdsfree(value);
+        return sdsfromlonglong(a + b);
+    }
+    if (strchr(value, '=') == NULL) return value;
+    int count, addcount, i;
+    sds *items = sdssplitlen(value, sdslen(value), ",", 1, &count);
+    sds *additems = sdssplitlen(add, len, ",", 1, &addcount);
+    sds merged = (count == addcount ? sdsempty() : NULL);
+    for (i = 0; merged != NULL && i < count; i++) {
+        char *eq = strchr(items[i], '='), *addeq = strchr(additems[i], '=');
+        size_t namelen = (eq != NULL ? (size_t) (eq - items[i]) : 0);
+        if (eq == NULL || addeq == NULL ||
+            namelen != (size_t) (addeq - additems[i]) ||
+            memcmp(items[i], additems[i], namelen) != 0)
+        {
+            sdsfree(merged);
+            merged = NULL;
+            break;
+        }
+        if (i > 0) merged = sdscatlen(merged, ",", 1);
+        merged = sdscatlen(merged, items[i], namelen + 1);
+        eq++;
+        addeq++;
+        if (parseInfoInteger(eq, strlen(eq), &a) &&
+            parseInfoInteger(addeq, strlen(addeq), &b))
+            merged = sdscatfmt(merged, "%I", a + b);
+        else merged = sdscat(merged, eq);
+    }
+    sdsfreesplitres(items, count);
+    sdsfreesplitres(additems, addcount);
+    if (merged == NULL) return value;
+    sdsfree(value);
+    return merged;
+}
+
+static void freeInfoSection(void *ptr) {
+    infoSection *section = ptr;
+    listIter li;
+    listNode *ln;
+    listRewind(section->fields, &li);
+    while ((ln = listNext(&li))) {
+        infoField *field = ln->value;
+        sdsfree(field->name);
+        sdsfree(field->value);
+        zfree(field);
+    }
+    listRelease(section->fields);
+    sdsfree(section->name);
+    zfree(section);
+}
+
+static infoSection *getInfoSection(list *sections, char *name, size_t len) {
+    listIter li;
+    listNode *ln;
+    listRewind(sections, &li);
+    while ((ln = listNext(&li))) {
+        infoSection *section = ln->value;
+        if (sdslen(section->name) == len &&
+            memcmp(section->name, name, len) == 0) return section;
+    }
+    infoSection *section = zmalloc(sizeof(*section));
+    section->name = sdsnewlen(name, len);
+    section->fields = listCreate();
+    section->counters = 0;
+    char **counter;
+    for (counter = infoCounterSections; *counter != NULL; counter++) {
+        if (strcmp(*counter, section->name) == 0) section->counters = 1;
+    }
+    listAddNodeTail(sections, section);
+    return section;
+}
+
+static void addInfoField(infoSection *section, char *name, size_t len,
+                         char *value, size_t vlen)
+{
+    listIter li;
+    listNode *ln;
+    listRewind(section->fields, &li);
+    while ((ln = listNext(&li))) {
+        infoField *field = ln->value;
+        if (sdslen(field->name) != len || memcmp(field->name, name, len))
+            continue;
+        if (section->counters)
+            field->value = addInfoFieldValue(field->value, value, vlen);
+        return;
+    }
+    infoField *field = zmalloc(sizeof(*field));
+    field->name = sdsnewlen(name, len);
+    field->value = sdsnewlen(value, vlen);
+    listAddNodeTail(section->fields, field);
+}
+
+/* Merge the INFO of the masters into a single one, with the sections (and
+ * their fields) in the order they've been first seen. */
+static sds mergeInfoReplies(redisReply **replies, int count) {
+    list *sections = listCreate();
+    listSetFreeMethod(sections, freeInfoSection);
+    int i, j;
+    for (i = 0; i < count; i++) {
+        redisReply *r = replies[i];
+        infoSection *section = NULL;
+        int numlines;
+        sds *lines = sdssplitlen(r->str, r->len, "\r\n", 2, &numlines);
+        for (j = 0; j < numlines; j++) {
+            sds line = lines[j];
+            char *sep;
+            if (line[0] == '#') {
+                sdsrange(line, 1, -1);
+                sdstrim(line, " ");
+                section = getInfoSection(sections, line, sdslen(line));
+            } else if ((sep = strchr(line, ':')) != NULL) {
+                if (section == NULL) section = getInfoSection(sections, "", 0);
+                addInfoField(section, line, sep - line, sep + 1,
+                             sdslen(line) - (sep - line) - 1);
+            }
+        }
+        sdsfreesplitres(lines, numlines);
+    }
+    sds info = sdsempty();
+    listIter li, fli;
+    listNode *ln, *fln;
+    listRewind(sections, &li);
+    while ((ln = listNext(&li))) {
+        infoSection *section = ln->value;
+        if (sdslen(info) > 0) info = sdscatlen(info, "\r\n", 2);
+        if (sdslen(section->name) > 0)
+            info = sdscatfmt(info, "# %S\r\n", section->name);
+        listRewind(section->fields, &fli);
+        while ((fln = listNext(&fli))) {
+            infoField *field = fln->value;
+            info = sdscatfmt(info, "%S:%S\r\n", field->name, field->value);
+        }
+    }
+    listRelease(sections);
+    return info;
+}
+
+/* Parse the unsigned 64 bit cursor of a SCAN. Returns 0 if invalid. */
+static int parseScanCursor(const char *p, size_t len,
+                           unsigned long long *cursor)
+{
+    char buf[24], *end;
+    if (len == 0 || len >= sizeof(buf) || *p < '0' || *p > '9') return 0;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    errno = 0;
+    *cursor = strtoull(buf, &end, 10);
+    return (errno == 0 && *end == '\0');
+}
+
+/* Store into 'cursor' the cursor to return to the client, given the cursor
+ * returned by the master scanned by the fan-out (see scanCommand). Returns
+ * 0 if the master's cursor is invalid or too large to be encoded. */
+static int getScanCursor(requestFanout *fanout, const char *p, size_t len,
+                         unsigned long long *cursor)
+{
+    unsigned long long node_cursor;
+    if (!parseScanCursor(p, len, &node_cursor) ||
+        node_cursor > (ULLONG_MAX >> SCAN_CURSOR_NODE_BITS)) return 0;
+    if (node_cursor != 0) {
+        *cursor = (node_cursor << SCAN_CURSOR_NODE_BITS) |
+                  (unsigned long long) fanout->scan_node;
+    } else if (fanout->scan_node + 1 < fanout->scan_nodes) {
+        *cursor = fanout->scan_node + 1;
+    } else *cursor = 0;
+    return 1;
+}
+
+/* Merge the replies of the sub-requests with the reducer of the fan-out.
+ * Returns NULL if a reply is not the one expected by the reducer. */
+static sds reduceFanoutReplies(requestFanout *fanout) {
+    sds reply = NULL;
+    int i;
+    if (fanout->reducer == FANOUT_REDUCE_KEYS) {
+        size_t *cursors = zcalloc(fanout->count * sizeof(size_t));
+        reply = sdscatfmt(sdsempty(), "*%i\r\n", fanout->numkeys);
+        for (i = 0; i < fanout->numkeys; i++) {
+            int idx = fanout->key_requests[i];
+            redisReply *r = fanout->replies[idx];
+            if (r == NULL || r->type != REDIS_REPLY_ARRAY ||
+                cursors[idx] >= r->elements)
+            {
+                sdsfree(reply);
+                reply = NULL;
+                break;
+            }
+            reply = catReplyObject(reply, r->element[cursors[idx]++]);
+        }
+        zfree(cursors);
+    } else if (fanout->reducer == FANOUT_REDUCE_SUM) {
+        long long sum = 0;
+        for (i = 0; i < fanout->count; i++) {
+            redisReply *r = fanout->replies[i];
+            if (r == NULL || r->type != REDIS_REPLY_INTEGER) return NULL;
+            sum += r->integer;
+        }
+        reply = sdscatfmt(sdsempty(), ":%I\r\n", sum);
+    } else if (fanout->reducer == FANOUT_REDUCE_OK) {
+        for (i = 0; i < fanout->count; i++) {
+            redisReply *r = fanout->replies[i];
+            if (r == NULL || r->type != REDIS_REPLY_STATUS ||
+                strcmp(r->str, "OK") != 0) return NULL;
+        }
+        reply = sdsnew("+OK\r\n");
+    } else if (fanout->reducer == FANOUT_REDUCE_CONCAT) {
+        size_t count = 0, j;
+        for (i = 0; i < fanout->count; i++) {
+            redisReply *r = fanout->replies[i];
+            if (r == NULL || r->type != REDIS_REPLY_ARRAY) return NULL;
+            count += r->elements;
+        }
+        reply = sdscatfmt(sdsempty(), "*%U\r\n", (unsigned long long) count);
+        for (i = 0; i < fanout->count; i++) {
+            redisReply *r = fanout->replies[i];
+            for (j = 0; j < r->elements; j++)
+                reply = catReplyObject(reply, r->element[j]);
+        }
+    } else if (fanout->reducer == FANOUT_REDUCE_INFO) {
+        for (i = 0; i < fanout->count; i++) {
+            redisReply *r = fanout->replies[i];
+            if (r == NULL || r->type != REDIS_REPLY_STRING) return NULL;
+        }
+        sds info = mergeInfoReplies(fanout->replies, fanout->count);
+        reply = sdscatfmt(sdsempty(), "$%U\r\n",
+                          (unsigned long long) sdslen(info));
+        reply = sdscatsds(reply, info);
+        reply = sdscatlen(reply, "\r\n", 2);
+        sdsfree(info);
+    } else if (fanout->reducer == FANOUT_REDUCE_SCAN) {
+        redisReply *r = fanout->replies[0];
+        unsigned long long cursor;
+        if (r == NULL || r->type != REDIS_REPLY_ARRAY || r->elements != 2 ||
+            r->element[0]->type != REDIS_REPLY_STRING ||
+            !getScanCursor(fanout, r->element[0]->str, r->element[0]->len,
+                           &cursor)) return NULL;
+        sds cstr = sdscatfmt(sdsempty(), "%U", cursor);
+        reply = sdscatfmt(sdsempty(), "*2\r\n$%u\r\n%S\r\n",
+                          (unsigned int) sdslen(cstr), cstr);
+        reply = catReplyObject(reply, r->element[1]);
+        sdsfree(cstr);
+    }
+    return reply;
+}
+
+/* Reply to the client of a request whose sub-requests all got their
+ * reply (if the client is still connected) and free the request. */
+static void replyToFanoutRequest(clientRequest *req) {
+    requestFanout *fanout = req->fanout;
+    client *c = req->client;
+    if (c->status != CLIENT_STATUS_UNLINKED) {
+        sds reply = NULL;
+        if (fanout->error == NULL) reply = reduceFanoutReplies(fanout);
+        if (reply != NULL) {
+            addReplyRaw(c, reply, sdslen(reply), req->id);
+            sdsfree(reply);
+            if (fanout->reducer == FANOUT_REDUCE_SCAN && config.scan_prefetch)
+                prefetchScanPage(req);
+        } else if (fanout->error != NULL) {
+            addReplyRaw(c, fanout->error, sdslen(fanout->error), req->id);
+        } else addReplyError(c, "Unexpected reply from cluster", req->id);
+    }
+    freeRequest(req, 0);
+}
+
+/* Drop a reference to the fan-out of the request: the last one replies,
+ * unless the request is a prefetched SCAN page, that waits for the
+ * client to request it. */
+static void releaseRequestFanout(clientRequest *req) {
+    requestFanout *fanout = req->fanout;
+    if (--fanout->pending > 0 || fanout->prefetch) return;
+    replyToFanoutRequest(req);
+}
+
+/* Detach the sub-requests still waiting for their reply from their parent,
+ * so that their replies will be just discarded. Returns the number of
+ * detached sub-requests. */
+static int detachSubRequests(requestFanout *fanout) {
+    int detached = 0, i;
+    for (i = 0; i < fanout->count; i++) {
+        clientRequest *sub = fanout->requests[i];
+        if (sub == NULL) continue;
+        sub->parent = NULL;
+        sub->discard_reply = 1;
+        fanout->requests[i] = NULL;
+        detached++;
+    }
+    fanout->pending -= detached;
+    return detached;
+}
+
+/* Store the reply of a sub-request into its parent, taking the ownership
+ * of 'reply'. If the sub-request failed, 'reply' is NULL and 'err' is the
+ * error to reply, while if both are NULL the sub-request has been freed
+ * without a reply (ie. its client disconnected). */
+static void setSubRequestReply(clientRequest *req, redisReply *reply,
+                               const char *err)
+{
+    clientRequest *parent = req->parent;
+    requestFanout *fanout = parent->fanout;
+    req->parent = NULL;
+    fanout->requests[req->fanout_index] = NULL;
+    if (reply != NULL) fanout->replies[req->fanout_index] = reply;
+    if (fanout->error == NULL) {
+        if (reply != NULL && reply->type == REDIS_REPLY_ERROR) {
+            fanout->error = sdscatlen(sdsnew("-"), reply->str, reply->len);
+            fanout->error = sdscatlen(fanout->error, "\r\n", 2);
+        } else if (reply == NULL) {
+            if (err == NULL) err = "Request aborted";
+            fanout->error = sdscatfmt(sdsempty(), "-ERR %s\r\n", err);
+        }
+    }
+    releaseRequestFanout(parent);
+}
+
+/* Store into 'argv' and 'argvlen' the arguments of the request at the
+ * positions contained in 'args'. */
+static void getRequestArgv(clientRequest *req, int *args, int argc,
+                           char **argv, int *argvlen)
+{
+    int i;
+    for (i = 0; i < argc; i++) {
+        argv[i] = req->buffer + req->offsets[args[i]];
+        argvlen[i] = req->lengths[args[i]];
+    }
+}
+
+/* Create a request of the client (without an ID) for the command 'cmd',
+ * made of the 'argc' arguments in 'argv' with lengths 'argvlen' (the first
+ * one should be the command's name). */
+static clientRequest *createRequestWithArgv(client *c, redisCommandDef *cmd,
+                                            char **argv, int *argvlen,
+                                            int argc)
+{
+    clientRequest *req = allocRequest(c);
+    if (req == NULL) return NULL;
+    if (!requestMakeRoomForArgs(req, argc)) {
+        freeRequest(req, 0);
+        return NULL;
+    }
+    size_t size = 16;
+    int i;
+    for (i = 0; i < argc; i++) size += argvlen[i] + 16;
+    req->buffer = sdsMakeRoomFor(req->buffer, size);
+    req->buffer = sdscatfmt(req->buffer, "*%i\r\n", argc);
+    for (i = 0; i < argc; i++) {
+        req->buffer = sdscatfmt(req->buffer, "$%i\r\n", argvlen[i]);
+        req->offsets[i] = sdslen(req->buffer);
+        req->lengths[i] = argvlen[i];
+        req->buffer = sdscatlen(req->buffer, argv[i], argvlen[i]);
+        req->buffer = sdscatlen(req->buffer, "\r\n", 2);
+    }
+    req->argc = argc;
+    setRequestCommand(req, cmd);
+    req->flags = cmd->flags;
+    req->is_multibulk = 1;
+    req->num_commands = 1;
+    req->pending_bulks = 0;
+    req->query_offset = sdslen(req->buffer);
+    req->parsing_status = PARSE_STATUS_OK;
+    return req;
+}
+
+/* Create the sub-request at position 'index' of 'parent', made of the
+ * arguments in 'argv'. */
+static clientRequest *createSubRequest(clientRequest *parent, char **argv,
+                                       int *argvlen, int argc, int index)
+{
+    clientRequest *req = createRequestWithArgv(parent->client,
+                                               parent->command, argv,
+                                               argvlen, argc);
+    if (req == NULL) return NULL;
+    req->id = parent->id;
+    req->parent = parent;
+    req->fanout_index = index;
+    parent->fanout->requests[index] = req;
+    return req;
+}
+
+/* Account for a sub-request that could not be created. */
+static void setSubRequestFailure(requestFanout *fanout) {
+    fanout->pending--;
+    if (fanout->error == NULL)
+        fanout->error = sdsnew("-ERR Failed to create sub-request\r\n");
+}
+
+/* Route (unless it's bound to a node) and send a sub-request, replying
+ * with an error on failure. */
+static void sendSubRequest(clientRequest *req) {
+    if ((!req->pinned && getRequestNode(req, NULL) == NULL) ||
+        req->node == NULL || !enqueueRequestToSend(req))
+    {
+        setSubRequestReply(req, NULL, "Failed to get node for query");
+        req->node = NULL;
+        freeRequest(req, 0);
+        return;
+    }
+    proxyLogDebug("Sub-request %d of %llu:%llu routed to %s:%d\n",
+                  req->fanout_index, req->client->id, req->id,
+                  req->node->ip, req->node->port);
+    handleNextRequestToCluster(req->node, req->client->thread_id);
+}
+
+static int compareSlotKeys(const void *a, const void *b) {
+    const slotKey *ka = a, *kb = b;
+    if (ka->slot != kb->slot) return (ka->slot < kb->slot ? -1 : 1);
+    return (ka->key < kb->key ? -1 : (ka->key > kb->key));
+}
+
+/* If the request is a multi-key command supporting the fan-out and its
+ * keys belong to different slots, split it into a sub-request for every
+ * slot. Returns 1 if the request has been split (so it now belongs to its
+ * sub-requests), 0 if the request must be handled as usual, -1 on errors. */
+static int splitCrossSlotRequest(clientRequest *req, sds *err) {
+    fanoutCommand *fc = getFanoutCommand(req->command);
+    if (fc == NULL || fc->broadcast) return 0;
+    redisCommandDef *cmd = req->command;
+    int step = (cmd->key_step > 0 ? cmd->key_step : 1);
+    /* Let the node reply to requests with the wrong number of arguments. */
+    if ((req->argc - cmd->first_key) % step != 0) return 0;
+    int keys_buf[REQUEST_KEYS_STACK_SIZE], *keys = keys_buf, numkeys, i, j;
+    slotKey *slot_keys = NULL;
+    int *args = NULL, *argvlen = NULL, split = 0;
+    char **argv = NULL;
+    if (req->argc > REQUEST_KEYS_STACK_SIZE)
+        keys = zmalloc(req->argc * sizeof(int));
+    numkeys = getRequestKeys(req, keys);
+    if (numkeys < 2 || (req->keys_hashed == numkeys && !req->keys_cross_slot))
+        goto cleanup;
+    slot_keys = zmalloc(numkeys * sizeof(*slot_keys));
+    int count = 1;
+    for (i = 0; i < numkeys; i++) {
+        slot_keys[i].slot = clusterKeyHashSlot(req->buffer +
+                                               req->offsets[keys[i]],
+                                               req->lengths[keys[i]]);
+        slot_keys[i].key = i;
+        if (slot_keys[i].slot != slot_keys[0].slot) split = 1;
+    }
+    if (!split) goto cleanup;
+    qsort(slot_keys, numkeys, sizeof(*slot_keys), compareSlotKeys);
+    for (i = 1; i < numkeys; i++)
+        if (slot_keys[i].slot != slot_keys[i - 1].slot) count++;
+    int track_keys = (fc->reducer == FANOUT_REDUCE_KEYS);
+    req->fanout = createRequestFanout(fc->reducer, count,
+                                      (track_keys ? numkeys : 0));
+    if (req->fanout == NULL) {
+        split = -1;
+        goto cleanup;
+    }
+    proxyLogDebug("Splitting request %llu:%llu into %d sub-requests\n",
+                  req->client->id, req->id, count);
+    args = zmalloc((1 + numkeys * step) * sizeof(int));
+    argv = zmalloc((1 + numkeys * step) * sizeof(char *));
+    argvlen = zmalloc((1 + numkeys * step) * sizeof(int));
+    int first = 0, index = 0;
+    while (first < numkeys) {
+        int last = first, argc = 1, slot = slot_keys[first].slot;
+        while (last < numkeys && slot_keys[last].slot == slot) last++;
+        args[0] = 0;
+        for (i = first; i < last; i++) {
+            int key = slot_keys[i].key;
+            for (j = 0; j < step; j++) args[argc++] = keys[key] + j;
+            if (track_keys) req->fanout->key_requests[key] = index;
+        }
+        getRequestArgv(req, args, argc, argv, argvlen);
+        clientRequest *sub = createSubRequest(req, argv, argvlen, argc,
+                                              index);
+        if (sub == NULL) setSubRequestFailure(req->fanout);
+        else {
+            sub->keys_slot = slot;
+            sub->keys_hashed = last - first;
+            sendSubRequest(sub);
+        }
+        first = last;
+        index++;
+    }
+    releaseRequestFanout(req);
+cleanup:
+    if (split < 0 && err != NULL) {
+        if (*err != NULL) sdsfree(*err);
+        *err = sdsnew("Failed to split request");
+    }
+    if (keys != keys_buf) zfree(keys);
+    if (slot_keys != NULL) zfree(slot_keys);
+    if (args != NULL) zfree(args);
+    if (argv != NULL) zfree(argv);
+    if (argvlen != NULL) zfree(argvlen);
+    return split;
+}
+
+/* Send the request to all the masters, with a sub-request bound to each
+ * one of them. Returns 1 on success, 0 on errors. */
+static int broadcastRequest(clientRequest *req, fanoutCommand *fc,
+                            sds *err)
+{
+    clusterNode **nodes = NULL;
+    int count = getMappedNodes(proxy.cluster, &nodes), *args, *argvlen, i;
+    char **argv;
+    if (count > 0) req->fanout = createRequestFanout(fc->reducer, count, 0);
+    if (req->fanout == NULL) {
+        if (err != NULL) {
+            if (*err != NULL) sdsfree(*err);
+            *err = sdsnew(count > 0 ? "Failed to broadcast request" :
+                                      "No masters available");
+        }
+        if (nodes != NULL) zfree(nodes);
+        return 0;
+    }
+    proxyThread *thread = proxy.threads[req->client->thread_id];
+    if (config.broadcast_timeout > 0 &&
+        listAddNodeTail(thread->broadcasts, req) != NULL)
+    {
+        req->fanout->deadline = mstime() + config.broadcast_timeout;
+        req->fanout->deadline_node = listLast(thread->broadcasts);
+    }
+    proxyLogDebug("Broadcasting request %llu:%llu to %d masters\n",
+                  req->client->id, req->id, count);
+    args = zmalloc(req->argc * sizeof(int));
+    argv = zmalloc(req->argc * sizeof(char *));
+    argvlen = zmalloc(req->argc * sizeof(int));
+    for (i = 0; i < req->argc; i++) args[i] = i;
+    getRequestArgv(req, args, req->argc, argv, argvlen);
+    for (i = 0; i < count; i++) {
+        clientRequest *sub = createSubRequest(req, argv, argvlen, req->argc,
+                                              i);
+        if (sub == NULL) {
+            setSubRequestFailure(req->fanout);
+            continue;
+        }
+        sub->node = nodes[i];
+        sub->pinned = 1;
+        sendSubRequest(sub);
+    }
+    zfree(args);
+    zfree(argv);
+    zfree(argvlen);
+    zfree(nodes);
+    releaseRequestFanout(req);
+    return 1;
+}
+
+/* Called by the thread's cron: broadcasts that did not get the replies of
+ * all the masters in time get an error, while the sub-requests still
+ * waiting for their replies are detached, so that their replies will be
+ * just discarded. */
+static void expireBroadcasts(proxyThread *thread) {
+    long long now = mstime();
+    listNode *ln;
+    while ((ln = listFirst(thread->broadcasts)) != NULL) {
+        clientRequest *req = ln->value;
+        requestFanout *fanout = req->fanout;
+        if (fanout->deadline > now) break;
+        listDelNode(thread->broadcasts, ln);
+        fanout->deadline_node = NULL;
+        int missing = detachSubRequests(fanout);
+        proxyLogDebug("Broadcast %llu:%llu timed out\n", req->client->id,
+                      req->id);
+        if (fanout->error == NULL) {
+            fanout->error = sdscatfmt(sdsempty(), "-ERR Broadcast timed out, "
+                                      "%i of %i masters did not reply\r\n",
+                                      missing, fanout->count);
+        }
+        replyToFanoutRequest(req);
+    }
+}
+
+/* Cluster-wide SCAN.
+ *
+ * The masters are scanned one after the other, in slot order, and the
+ * cursor returned to the client encodes both the index of the master being
+ * scanned (in its lowest SCAN_CURSOR_NODE_BITS bits) and the cursor of the
+ * master: when a master has been completely scanned, the cursor points to
+ * the beginning of the next one. If masters are added or removed during
+ * an iteration, some keys could be missed.
+ * With scan_prefetch enabled, after a page is replied the next page of the
+ * same master is requested right away, with the same arguments: if the
+ * next SCAN of the client has the same arguments and the cursor of that
+ * page, it gets the prefetched page (or waits for it), otherwise the page
+ * is discarded. */
+
+/* Send the SCAN (or the prefetch of its next page, if 'prefetch' is 1) to
+ * the master at position 'index' among the 'count' masters, with the
+ * cursor of the master in place of the cursor of the client. Returns 1 on
+ * success, 0 on errors. */
+static int sendScanRequest(clientRequest *req, clusterNode *node, int index,
+                           int count, unsigned long long node_cursor,
+                           int prefetch)
+{
+    char **argv = zmalloc(req->argc * sizeof(char *));
+    int *argvlen = zmalloc(req->argc * sizeof(int)), *args, i;
+    args = zmalloc(req->argc * sizeof(int));
+    for (i = 0; i < req->argc; i++) args[i] = i;
+    getRequestArgv(req, args, req->argc, argv, argvlen);
+    sds cursor = sdscatfmt(sdsempty(), "%U", node_cursor);
+    argv[1] = cursor;
+    argvlen[1] = sdslen(cursor);
+    req->fanout = createRequestFanout(FANOUT_REDUCE_SCAN, 1, 0);
+    clientRequest *sub = NULL;
+    if (req->fanout != NULL) {
+        req->fanout->scan_node = index;
+        req->fanout->scan_nodes = count;
+        req->fanout->prefetch = prefetch;
+        sub = createSubRequest(req, argv, argvlen, req->argc, 0);
+    }
+    sdsfree(cursor);
+    zfree(args);
+    zfree(argv);
+    zfree(argvlen);
+    if (sub == NULL) return 0;
+    sub->node = node;
+    sub->pinned = 1;
+    sendSubRequest(sub);
+    releaseRequestFanout(req);
+    return 1;
+}
+
+/* Request the page following the one replied to 'req', if the master has
+ * more keys, as if the client sent the same SCAN with the returned
+ * cursor. */
+static void prefetchScanPage(clientRequest *req) {
+    client *c = req->client;
+    requestFanout *fanout = req->fanout;
+    redisReply *r = fanout->replies[0], *next = r->element[0];
+    unsigned long long cursor, node_cursor;
+    if (c->scan_prefetch != NULL || c->close_after_reply) return;
+    if (!parseScanCursor(next->str, next->len, &node_cursor) ||
+        node_cursor == 0 ||
+        !getScanCursor(fanout, next->str, next->len, &cursor)) return;
+    clusterNode **nodes = NULL;
+    int count = getMappedNodes(proxy.cluster, &nodes), *args, *argvlen, i;
+    char **argv;
+    if (count != fanout->scan_nodes) {
+        if (nodes != NULL) zfree(nodes);
+        return;
+    }
+    args = zmalloc(req->argc * sizeof(int));
+    argv = zmalloc(req->argc * sizeof(char *));
+    argvlen = zmalloc(req->argc * sizeof(int));
+    for (i = 0; i < req->argc; i++) args[i] = i;
+    getRequestArgv(req, args, req->argc, argv, argvlen);
+    sds cstr = sdscatfmt(sdsempty(), "%U", cursor);
+    argv[1] = cstr;
+    argvlen[1] = sdslen(cstr);
+    /* The request of the prefetched page looks like the one the client is
+     * expected to send, so that they can be easily compared. */
+    clientRequest *prefetch = createRequestWithArgv(c, req->command, argv,
+                                                    argvlen, req->argc);
+    sdsfree(cstr);
+    zfree(args);
+    zfree(argv);
+    zfree(argvlen);
+    if (prefetch == NULL) {
+        zfree(nodes);
+        return;
+    }
+    proxyLogDebug("Prefetching SCAN page %llu of client %llu\n", cursor,
+                  c->id);
+    c->scan_prefetch = prefetch;
+    if (!sendScanRequest(prefetch, nodes[fanout->scan_node],
+                         fanout->scan_node, count, node_cursor, 1))
+    {
+        c->scan_prefetch = NULL;
+        freeRequest(prefetch, 0);
+    }
+    zfree(nodes);
+}
+
+static void discardScanPrefetch(client *c) {
+    clientRequest *prefetch = c->scan_prefetch;
+    if (prefetch == NULL) return;
+    c->scan_prefetch = NULL;
+    if (prefetch->fanout != NULL) detachSubRequests(prefetch->fanout);
+    freeRequest(prefetch, 0);
+}
+
+static int requestArgsEqual(clientRequest *a, clientRequest *b) {
+    int i;
+    if (a->argc != b->argc) return 0;
+    for (i = 1; i < a->argc; i++) {
+        if (a->lengths[i] != b->lengths[i] ||
+            memcmp(a->buffer + a->offsets[i], b->buffer + b->offsets[i],
+                   a->lengths[i]) != 0) return 0;
+    }
+    return 1;
+}
+
+int scanCommand(void *r) {
+    clientRequest *req = r, *prefetch;
+    client *c = req->client;
+    unsigned long long cursor;
+    if (req->argc < 2) return replyWrongArity(req);
+    if (!parseScanCursor(req->buffer + req->offsets[1], req->lengths[1],
+                         &cursor))
+    {
+        addReplyError(c, "invalid cursor", req->id);
+        freeRequest(req, 1);
+        return PROXY_COMMAND_HANDLED;
+    }
+    prefetch = c->scan_prefetch;
+    if (prefetch != NULL && prefetch->fanout->error == NULL &&
+        requestArgsEqual(prefetch, req))
+    {
+        c->scan_prefetch = NULL;
+        prefetch->id = req->id;
+        prefetch->fanout->prefetch = 0;
+        if (prefetch->fanout->requests[0] != NULL)
+            prefetch->fanout->requests[0]->id = req->id;
+        freeRequest(req, 1);
+        if (prefetch->fanout->pending == 0) replyToFanoutRequest(prefetch);
+        return PROXY_COMMAND_HANDLED;
+    }
+    discardScanPrefetch(c);
+    clusterNode **nodes = NULL;
+    int count = getMappedNodes(proxy.cluster, &nodes),
+        index = (int) (cursor & ((1 << SCAN_CURSOR_NODE_BITS) - 1));
+    char *err = NULL;
+    if (count > (1 << SCAN_CURSOR_NODE_BITS))
+        err = "Too many masters to SCAN the cluster";
+    else if (index >= count) err = "invalid cursor";
+    else if (!sendScanRequest(req, nodes[index], index, count,
+                              cursor >> SCAN_CURSOR_NODE_BITS, 0))
+        err = "Failed to send SCAN";
+    if (nodes != NULL) zfree(nodes);
+    if (err != NULL) {
+        addReplyError(c, err, req->id);
+        freeRequest(req, 1);
+    }
+    return PROXY_COMMAND_HANDLED;
+}
+
+/* Transactions.
+ *
+ * The connections to the nodes are shared by all the clients of a thread,
+ * so they cannot be used by MULTI. A client in a transaction gets instead
+ * a private connection to the master of the slot of the first command with
+ * keys, taken from a pool of the thread that has up to
+ * config.private_connections connections to every node. MULTI is answered
+ * by the proxy and sent to the node just before that command, then all the
+ * following commands, EXEC and DISCARD go through the private connection,
+ * that goes back to the pool as soon as the reply of EXEC (or DISCARD) has
+ * been read: until then, the other requests of the client to the same node
+ * are sent through it as well, so that they see the writes of the
+ * transaction. The other clients keep using the shared connections.
+ * All the keys of the transaction must belong to the same slot, and the
+ * commands rejected by the proxy make EXEC fail, just like the ones
+ * rejected by Redis. */
+
+#define EXECABORT_REPLY \
+    "-EXECABORT Transaction discarded because of previous errors.\r\n"
+
+/* Close a private connection, replying with 'err' (if not NULL) to the
+ * requests still queued to it. The transaction using it, if any, will
+ * fail. */
+static void closePrivateConnection(redisClusterConnection *conn,
+                                   int thread_id, const char *err)
+{
+    aeEventLoop *el = proxy.threads[thread_id]->loop;
+    client *owner = conn->owner;
+    clusterNode *node = conn->node;
+    list *queues[2] = {conn->requests_to_send, conn->requests_pending};
+    int i;
+    proxyLogDebug("Closing private connection to %s:%d\n", node->ip,
+                  node->port);
+    if (conn->context != NULL && conn->context->fd >= 0)
+        aeDeleteFileEvent(el, conn->context->fd, AE_READABLE | AE_WRITABLE);
+    for (i = 0; i < 2; i++) {
+        while (listLength(queues[i]) > 0) {
+            listNode *ln = listFirst(queues[i]);
+            clientRequest *req = ln->value;
+            listDelNode(queues[i], ln);
+            if (req == NULL) continue;
+            if (req->has_write_handler) {
+                req->has_write_handler = 0;
+                req->client->requests_with_write_handler--;
+            }
+            if (err != NULL) addNodeFailureReply(req, err);
+            freeRequest(req, 0);
+        }
+    }
+    if (owner != NULL && owner->multi_connection == conn) {
+        owner->multi_connection = NULL;
+        if (owner->multi && owner->multi_slot != UNDEFINED_SLOT)
+            owner->multi_error = 1;
+    }
+    clusterNodeDisconnectPrivate(conn, thread_id);
+}
+
+/* Give the private connection back to the pool, if its client is done
+ * with it (the replies of its EXEC or DISCARD have been read). */
+static void releasePrivateConnection(redisClusterConnection *conn) {
+    client *c = conn->owner;
+    if (c == NULL || listLength(conn->requests_to_send) > 0 ||
+        listLength(conn->requests_pending) > 0) return;
+    if (c->multi_connection == conn) {
+        if (c->multi) return;
+        c->multi_connection = NULL;
+    }
+    proxyLogDebug("Private connection to %s:%d released by client %llu\n",
+                  conn->node->ip, conn->node->port, c->id);
+    conn->owner = NULL;
+}
+
+/* Get a private connection to the node for the client, reusing an idle
+ * one of the pool if possible. Return NULL on errors, setting 'err'. */
+static redisClusterConnection *getPrivateConnection(client *c,
+                                                    clusterNode *node,
+                                                    sds *err)
+{
+    redisClusterConnection *shared = getClusterConnection(node, c->thread_id),
+                           *conn = NULL;
+    listIter li;
+    listNode *ln;
+    listRewind(shared->private_connections, &li);
+    while ((ln = listNext(&li))) {
+        redisClusterConnection *idle = ln->value;
+        if (idle->owner == NULL) {
+            conn = idle;
+            break;
+        }
+    }
+    if (conn == NULL) {
+        if (listLength(shared->private_connections) >=
+            (unsigned long) config.private_connections)
+        {
+            *err = sdscatprintf(sdsempty(), "Too many transactions in "
+                                "progress on node %s:%d", node->ip,
+                                node->port);
+            return NULL;
+        }
+        conn = clusterNodeConnectPrivate(node, c->thread_id);
+        if (conn == NULL) {
+            *err = sdscatprintf(sdsempty(), "Could not connect to node "
+                                "%s:%d", node->ip, node->port);
+            return NULL;
+        }
+        /* The read handler stays installed while the connection is idle,
+         * so that it gets closed if the node closes it. */
+        if (!installIOHandler(getClientLoop(c), conn->context->fd,
+                              AE_READABLE, readClusterReply, conn, 0))
+        {
+            clusterNodeDisconnectPrivate(conn, c->thread_id);
+            *err = sdsnew("Failed to create read reply handler");
+            return NULL;
+        }
+        conn->has_read_handler = 1;
+        proxyLogDebug("Private connection to %s:%d opened\n", node->ip,
+                      node->port);
+    }
+    conn->owner = c;
+    return conn;
+}
+
+/* Queue a request of a transaction to its private connection and send
+ * it. The request is bound to the connection's node. */
+static int sendPrivateRequest(clientRequest *req,
+                              redisClusterConnection *conn)
+{
+    req->private_connection = conn;
+    req->node = conn->node;
+    req->pinned = 1;
+    if (!enqueueRequestToSend(req)) {
+        req->private_connection = NULL;
+        req->node = NULL;
+        return 0;
+    }
+    handleNextRequestOnConnection(conn);
+    return 1;
+}
+
+/* Send a request that doesn't need a reply ('cmd' without arguments) to
+ * a private connection. */
+static int sendPrivateCommand(client *c, redisClusterConnection *conn,
+                              char *cmd)
+{
+    int len = strlen(cmd);
+    clientRequest *req =
+        createRequestWithArgv(c, getRedisCommand(cmd, len), &cmd, &len, 1);
+    if (req == NULL) return 0;
+    req->discard_reply = 1;
+    if (!sendPrivateRequest(req, conn)) {
+        freeRequest(req, 0);
+        return 0;
+    }
+    return 1;
+}
+
+/* Send a command of the client's transaction to its private connection,
+ * opening it if it's the first command with keys. Return 1 on success,
+ * 0 on errors, setting 'err'. */
+static int sendTransactionRequest(clientRequest *req, sds *err) {
+    client *c = req->client;
+    /* EXEC is going to fail anyway. */
+    if (c->multi_error) {
+        addReplyString(c, "QUEUED", req->id);
+        freeRequest(req, 1);
+        return 1;
+    }
+    if (req->command->handle != NULL || getFanoutCommand(req->command)) {
+        *err = sdsnew("Command not allowed inside a transaction");
+        return 0;
+    }
+    int keys_buf[REQUEST_KEYS_STACK_SIZE], *keys = keys_buf, numkeys, i,
+        slot = UNDEFINED_SLOT, cross_slot = 0;
+    if (req->argc > REQUEST_KEYS_STACK_SIZE)
+        keys = zmalloc(req->argc * sizeof(int));
+    numkeys = getRequestKeys(req, keys);
+    if (numkeys > 0 && req->keys_hashed == numkeys) {
+        /* All the keys have already been hashed by the parser. */
+        cross_slot = req->keys_cross_slot;
+        slot = req->keys_slot;
+    } else {
+        for (i = 0; i < numkeys && !cross_slot; i++) {
+            int keyslot =
+                clusterKeyHashSlot(req->buffer + req->offsets[keys[i]],
+                                   req->lengths[keys[i]]);
+            if (slot == UNDEFINED_SLOT) slot = keyslot;
+            else cross_slot = (keyslot != slot);
         }
     }
-    redisClusterConnection *conn =
-        getClusterConnection(req->node, thread_id);
-    assert(conn != NULL);
-    if (!conn->has_read_handler) {
-        if (!installIOHandler(el, ctx->fd, AE_READABLE, readClusterReply,
-                              req->node, 0))
-        {
-            proxyLogErr("Failed to create read reply handler for node %s:%d\n",
-                          req->node->ip, req->node->port);
+    if (keys != keys_buf) zfree(keys);
+    if (numkeys < 0) {
+        *err = sdsnew("Invalid arguments for command");
+        return 0;
+    }
+    if (cross_slot || (slot != UNDEFINED_SLOT &&
+                       c->multi_slot != UNDEFINED_SLOT &&
+                       slot != c->multi_slot))
+    {
+        *err = sdsnew("Transactions with keys belonging to different "
+                      "slots are not supported");
+        return 0;
+    }
+    if (c->multi_slot == UNDEFINED_SLOT) {
+        if (slot == UNDEFINED_SLOT) {
+            *err = sdsnew("Commands without keys cannot start a "
+                          "transaction");
             return 0;
-        } else  {
-            conn->has_read_handler = 1;
-            proxyLogDebug("Read reply handler installed "
-                          "for node %s:%d\n", req->node->ip, req->node->port);
         }
-    }
-    if (!writeToCluster(el, ctx->fd, req)) return 0;
-    int sent = (req->written == sdslen(req->buffer));
-    if (!sent) {
-        if (aeCreateFileEvent(el, ctx->fd, AE_WRITABLE,
-                              writeToClusterHandler, req->node) == AE_ERR) {
-            addReplyError(req->client, "Failed to write to cluster\n", req->id);
-            proxyLogErr("Failed to create write handler for request\n");
-            freeRequest(req, 1);
+        clusterNode *node = searchNodeBySlot(proxy.cluster, slot);
+        if (node == NULL) {
+            *err = sdsnew("Failed to get node for query");
             return 0;
         }
-        req->has_write_handler = 1;
-        req->client->requests_with_write_handler++;
-        proxyLogDebug("Write handler installed into request %llu:%llu for "
-                      "node %s:%d\n", req->client->id, req->id,
-                      req->node->ip, req->node->port);
+        /* The connection of the previous transaction, if still waiting
+         * for its EXEC, can be used if it's connected to the same node. */
+        redisClusterConnection *conn = c->multi_connection;
+        if (conn != NULL && conn->node != node) {
+            c->multi_connection = NULL;
+            releasePrivateConnection(conn);
+            conn = NULL;
+        }
+        if (conn == NULL) conn = getPrivateConnection(c, node, err);
+        if (conn == NULL) return 0;
+        c->multi_connection = conn;
+        c->multi_slot = slot;
+        if (!sendPrivateCommand(c, conn, "MULTI")) {
+            closePrivateConnection(conn, c->thread_id, NULL);
+            *err = sdsnew("Could not enqueue request");
+            return 0;
+        }
+    }
+    req->slot = c->multi_slot;
+    if (!sendPrivateRequest(req, c->multi_connection)) {
+        *err = sdsnew("Could not enqueue request");
+        return 0;
     }
     return 1;
 }
 
-/* Try to send the next request in requests_to_send list, by calling
- * sendRequestToCluster. If an error occurs (sendRequestToCluster returns 0)
- * keep cycling the queue until sendRequestsToCluster returns 1.
- * Return the handled request, if any. */
+int multiCommand(void *r) {
+    clientRequest *req = r;
+    client *c = req->client;
+    if (req->argc != 1) return replyWrongArity(req);
+    if (c->multi) addReplyError(c, "MULTI calls can not be nested", req->id);
+    else {
+        c->multi = 1;
+        c->multi_slot = UNDEFINED_SLOT;
+        c->multi_error = 0;
+        addReplyString(c, "OK", req->id);
+    }
+    freeRequest(req, 1);
+    return PROXY_COMMAND_HANDLED;
+}
 
-static clientRequest *handleNextRequestToCluster(clusterNode *node,
-                                                 int thread_id)
-{
-    clientRequest *req = getFirstRequestToSend(node, thread_id, NULL);
-    if (req == NULL) return NULL;
-    while (!sendRequestToCluster(req, NULL)) {
-        req = getFirstRequestToSend(node, thread_id, NULL);
-        if (req == NULL) break;
+/* End the client's transaction with EXEC (if 'exec' is 1) or DISCARD: the
+ * request is sent to the private connection, if the transaction has one,
+ * otherwise it's answered by the proxy. */
+static int endTransaction(clientRequest *req, int exec) {
+    client *c = req->client;
+    if (req->argc != 1) return replyWrongArity(req);
+    if (!c->multi) {
+        addReplyError(c, (exec ? "EXEC without MULTI" :
+                                 "DISCARD without MULTI"), req->id);
+        freeRequest(req, 1);
+        return PROXY_COMMAND_HANDLED;
     }
-    return req;
+    redisClusterConnection *conn = c->multi_connection;
+    int aborted = (exec && c->multi_error);
+    if (c->multi_slot == UNDEFINED_SLOT) conn = NULL;
+    c->multi = 0;
+    c->multi_slot = UNDEFINED_SLOT;
+    c->multi_error = 0;
+    if (conn != NULL) {
+        /* The transaction of an aborted EXEC is discarded on the node. */
+        int sent = (aborted ? sendPrivateCommand(c, conn, "DISCARD") :
+                              sendPrivateRequest(req, conn));
+        if (sent && !aborted) return PROXY_COMMAND_HANDLED;
+        /* The node would be still in the transaction. */
+        if (!sent) {
+            closePrivateConnection(conn, c->thread_id, NULL);
+            if (!aborted) {
+                addReplyError(c, "Could not enqueue request", req->id);
+                freeRequest(req, 1);
+                return PROXY_COMMAND_HANDLED;
+            }
+        }
+    }
+    if (aborted)
+        addReplyRaw(c, EXECABORT_REPLY, strlen(EXECABORT_REPLY), req->id);
+    else if (exec) addReplyRaw(c, "*0\r\n", 4, req->id);
+    else addReplyString(c, "OK", req->id);
+    freeRequest(req, 1);
+    return PROXY_COMMAND_HANDLED;
 }
 
+int execCommand(void *r) {
+    return endTransaction(r, 1);
+}
+
+int discardCommand(void *r) {
+    return endTransaction(r, 0);
+}
 
 static int processRequest(clientRequest *req) {
     int status = parseRequest(req);
@@ -1667,6 +4641,10 @@ static int processRequest(clientRequest *req) {
     else if (status == PARSE_STATUS_INCOMPLETE) return 1;
     client *c = req->client;
     if (req == c->current_request) c->current_request = NULL;
+    if (c->close_after_reply) {
+        freeRequest(req, 1);
+        return 1;
+    }
     if (req->id < c->min_reply_id) c->min_reply_id = req->id;
     proxyLogDebug("Processing request %llu:%llu\n", c->id, req->id);
     sds command_name = NULL;
@@ -1682,29 +4660,62 @@ static int processRequest(clientRequest *req) {
         proxyLogDebug("Multi-command requests are not currently supported\n");
         goto invalid_request;
     }
-    command_name = getRequestCommand(req);
-    if (command_name == NULL) {
-        proxyLogDebug("Missing command name\n");
-        errmsg = sdsnew("Invalid request");
-        goto invalid_request;
+    /* Multibulk requests get their command looked up by the parser. */
+    redisCommandDef *cmd = req->command;
+    if (cmd == NULL)
+        cmd = getRedisCommand(req->buffer + req->offsets[0], req->lengths[0]);
+    /* The command could have been added to the cluster after the last
+     * time the commands have been loaded. */
+    if (cmd == NULL && !proxy.commands_refresh_requested)
+        proxy.commands_refresh_requested = 1;
+    /* Commands without keys needing the whole keyspace are broadcast. */
+    fanoutCommand *broadcast = NULL;
+    if (cmd != NULL && !cmd->handle && !cmd->getkeys && !cmd->first_key) {
+        broadcast = getFanoutCommand(cmd);
+        if (broadcast != NULL && !broadcast->broadcast) broadcast = NULL;
     }
-    redisCommandDef *cmd = getRedisCommand(command_name);
     /* Unsupported commands:
      * - Commands not defined in redisCommandTable
      * - Commands explictly having unsupported to 1
-     * - Commands without explicit first_key offset */
+     * - Commands without explicit first_key offset, nor a key extraction
+     *   callback */
     if (cmd == NULL || cmd->unsupported ||
-        (!cmd->handle && cmd->arity != 1 && !cmd->first_key)){
+        (!cmd->handle && !cmd->getkeys && cmd->arity != 1 &&
+         !cmd->first_key && broadcast == NULL)){
+        if (command_name == NULL) command_name = getRequestCommand(req);
         errmsg = sdsnew("Unsupported command: ");
         errmsg = sdscatfmt(errmsg, "'%s'", command_name);
         proxyLogDebug("%s\n", errmsg);
         goto invalid_request;
     }
-    req->command = cmd;
+    setRequestCommand(req, cmd);
+    req->flags = cmd->flags;
+    /* The commands of a transaction go through its private connection. */
+    if (c->multi && cmd->handle != multiCommand &&
+        cmd->handle != execCommand && cmd->handle != discardCommand &&
+        cmd->handle != quitCommand)
+    {
+        if (!sendTransactionRequest(req, &errmsg)) goto invalid_request;
+        if (command_name) sdsfree(command_name);
+        return 1;
+    }
     if (cmd->handle && cmd->handle(req) == PROXY_COMMAND_HANDLED) {
         if (command_name) sdsfree(command_name);
         return 1;
     }
+    if (broadcast != NULL) {
+        if (!broadcastRequest(req, broadcast, &errmsg)) goto invalid_request;
+        if (command_name) sdsfree(command_name);
+        return 1;
+    }
+    if (req->argc > 2) {
+        int split = splitCrossSlotRequest(req, &errmsg);
+        if (split < 0) goto invalid_request;
+        else if (split) {
+            if (command_name) sdsfree(command_name);
+            return 1;
+        }
+    }
     clusterNode *node = getRequestNode(req, &errmsg);
     if (node == NULL) {
         if (errmsg == NULL)
@@ -1712,12 +4723,33 @@ static int processRequest(clientRequest *req) {
         proxyLogDebug("%s %llu:%llu\n", errmsg, c->id, req->id);
         goto invalid_request;
     }
+    if (req->slot != UNDEFINED_SLOT) {
+        proxyThread *thread = proxy.threads[c->thread_id];
+        slotStats *stats = thread->slot_stats + req->slot;
+        stats->ops++;
+        stats->bytes_in += sdslen(req->buffer) -
+                           (req->asking ? strlen(ASKING_COMMAND) : 0);
+        req->routed_time = ustime();
+    }
+    /* Requests following a transaction that is still waiting for the
+     * reply of its EXEC go through the same connection, so that they see
+     * its writes. Blocking reads (ie. XREAD with BLOCK) are slow by design,
+     * so they're never hedged. */
+    if (c->multi_connection != NULL && req->node == c->multi_connection->node)
+        req->private_connection = c->multi_connection;
+    else if (config.hedge_reads_percentile > 0 &&
+             (req->flags & (CMD_READONLY | CMD_BLOCKING)) == CMD_READONLY &&
+             req->slot != UNDEFINED_SLOT &&
+             getSlotImportingNode(proxy.cluster, req->slot) == NULL)
+        trackHedgeableRequest(req);
     if (!enqueueRequestToSend(req)) goto invalid_request;
-    handleNextRequestToCluster(req->node, req->client->thread_id);
+    handleNextRequestOnConnection(getRequestConnection(req));
     if (command_name) sdsfree(command_name);
     return 1;
 invalid_request:
     if (command_name) sdsfree(command_name);
+    /* Like Redis, EXEC fails if a command of the transaction is rejected. */
+    if (c->multi) c->multi_error = 1;
     if (errmsg != NULL) {
         addReplyError(c, (char *) errmsg, req->id);
         sdsfree(errmsg);
@@ -1751,7 +4783,7 @@ void readQuery(aeEventLoop *el, int fd, void *privdata, int mask){
         } else {
             proxyLogDebug("Error reading from client %s: %s\n", c->ip,
                           strerror(errno));
-            unlinkClient(c); /* TODO: Free? */
+            freeClient(c);
             return;
         }
     } else if (nread == 0) {
@@ -1768,7 +4800,10 @@ void readQuery(aeEventLoop *el, int fd, void *privdata, int mask){
             req = ln->value;
             if (!processRequest(req)) freeClient(c);
             else {
-                if (req->parsing_status == PARSE_STATUS_INCOMPLETE) break;
+                /* Requests already answered have been freed, leaving a
+                 * NULL in their place. */
+                if (ln->value != NULL &&
+                    req->parsing_status == PARSE_STATUS_INCOMPLETE) break;
                 else {
                     listDelNode(c->requests_to_process, ln);
                 }
@@ -1789,6 +4824,232 @@ static void acceptHandler(int fd, char *ip) {
     }
 }
 
+static long long ustime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (((long long) tv.tv_sec) * 1000000) + tv.tv_usec;
+}
+
+static long long mstime(void) {
+    return ustime() / 1000;
+}
+
+static void endClusterRefresh(int success) {
+    redisContext *ctx = proxy.refresh_ctx;
+    if (ctx != NULL) {
+        aeDeleteFileEvent(proxy.main_loop, ctx->fd, AE_READABLE | AE_WRITABLE);
+        redisFree(ctx);
+        proxy.refresh_ctx = NULL;
+    }
+    proxy.last_refresh = mstime();
+    /* Load the commands again at the next refresh if they have not been
+     * received. */
+    if (proxy.refresh_commands_pending && !proxy.refresh_nodes_done)
+        proxy.commands_refresh_requested = 1;
+    proxy.refresh_commands_pending = 0;
+    proxy.refresh_nodes_done = 0;
+    /* Retry as soon as possible, querying another node. */
+    if (!success) requestClusterRefresh();
+}
+
+static void readClusterRefreshReply(aeEventLoop *el, int fd, void *privdata,
+                                    int mask)
+{
+    UNUSED(el);
+    UNUSED(fd);
+    UNUSED(privdata);
+    UNUSED(mask);
+    redisContext *ctx = proxy.refresh_ctx;
+    void *_reply = NULL;
+    if (redisBufferRead(ctx) != REDIS_OK) {
+        proxyLogWarn("Failed to refresh cluster configuration: %s\n",
+                     ctx->errstr);
+        endClusterRefresh(0);
+        return;
+    }
+    while (redisReaderGetReply(ctx->reader, &_reply) == REDIS_OK) {
+        redisReply *reply = _reply;
+        if (reply == NULL) return;
+        if (proxy.refresh_nodes_done) {
+            /* Reply to COMMAND: failures don't affect the topology. */
+            updateClusterCommands(reply);
+            freeReplyObject(reply);
+            endClusterRefresh(1);
+            return;
+        }
+        if (reply->type == REDIS_REPLY_ERROR) {
+            proxyLogWarn("Failed to refresh cluster configuration: %s\n",
+                         reply->str);
+            freeReplyObject(reply);
+            endClusterRefresh(0);
+            return;
+        }
+        if (proxy.refresh_auth_pending) {
+            proxy.refresh_auth_pending = 0;
+            freeReplyObject(reply);
+            continue;
+        }
+        int changed = 0, ok = (reply->type == REDIS_REPLY_STRING);
+        if (ok) {
+            ok = updateClusterConfiguration(proxy.cluster, reply->str,
+                                            ctx->tcp.host, &changed);
+        }
+        if (!ok) proxyLogWarn("Failed to refresh cluster configuration\n");
+        else if (changed) {
+            proxyLogInfo("Cluster configuration updated\n");
+            if (config.cluster_snapshot)
+                saveClusterSnapshot(proxy.cluster, config.cluster_snapshot);
+        }
+        freeReplyObject(reply);
+        if (ok && proxy.refresh_commands_pending) {
+            proxy.refresh_nodes_done = 1;
+            continue;
+        }
+        endClusterRefresh(ok);
+        return;
+    }
+    proxyLogWarn("Failed to refresh cluster configuration: %s\n",
+                 ctx->reader->errstr);
+    endClusterRefresh(0);
+}
+
+static void writeClusterRefreshQuery(aeEventLoop *el, int fd, void *privdata,
+                                     int mask)
+{
+    UNUSED(privdata);
+    UNUSED(mask);
+    redisContext *ctx = proxy.refresh_ctx;
+    int done = 0;
+    if (redisBufferWrite(ctx, &done) != REDIS_OK) {
+        proxyLogWarn("Failed to refresh cluster configuration: %s\n",
+                     ctx->errstr);
+        endClusterRefresh(0);
+        return;
+    }
+    if (!done) return;
+    aeDeleteFileEvent(el, fd, AE_WRITABLE);
+    if (aeCreateFileEvent(el, fd, AE_READABLE, readClusterRefreshReply,
+                          NULL) == AE_ERR) endClusterRefresh(0);
+}
+
+/* Start an asynchronous refresh of the cluster's topology: CLUSTER NODES is
+ * sent to one of the known nodes (a different one at every refresh) using
+ * a non-blocking connection handled by the main thread's loop, so that
+ * the threads never stop processing requests. When requested, COMMAND is
+ * sent too, in order to load the commands of the cluster. */
+static void startClusterRefresh(void) {
+    list *nodes = proxy.cluster->nodes;
+    char *ip = config.entry_node_host;
+    int port = config.entry_node_port, count = listLength(nodes);
+    if (count > 0) {
+        int idx = proxy.refresh_node_index++ % count;
+        clusterNode *node = listIndex(nodes, idx)->value;
+        ip = node->ip;
+        port = node->port;
+    }
+    if (ip == NULL) return;
+    proxy.refresh_start = mstime();
+    proxyLogDebug("Refreshing cluster configuration from %s:%d\n", ip, port);
+    redisContext *ctx = redisConnectNonBlock(ip, port);
+    if (ctx == NULL || ctx->err) {
+        proxyLogWarn("Could not connect to Redis at %s:%d: %s\n", ip, port,
+                     (ctx ? ctx->errstr : "out of memory"));
+        if (ctx) redisFree(ctx);
+        endClusterRefresh(0);
+        return;
+    }
+    proxy.refresh_ctx = ctx;
+    proxy.refresh_auth_pending = (config.auth != NULL);
+    if (config.auth) redisAppendCommand(ctx, "AUTH %s", config.auth);
+    redisAppendCommand(ctx, "CLUSTER NODES");
+    if (proxy.commands_refresh_requested &&
+        proxy.refresh_start - proxy.commands_refresh_time >=
+        COMMANDS_REFRESH_MIN_INTERVAL)
+    {
+        proxy.commands_refresh_requested = 0;
+        proxy.refresh_commands_pending = 1;
+        proxy.commands_refresh_time = proxy.refresh_start;
+        redisAppendCommand(ctx, "COMMAND");
+    }
+    if (aeCreateFileEvent(proxy.main_loop, ctx->fd, AE_WRITABLE,
+                          writeClusterRefreshQuery, NULL) == AE_ERR)
+        endClusterRefresh(0);
+}
+
+/* Compute the request rate of every slot from the threads' slot stats and
+ * offload the reads of the slots whose rate exceeds hot_slot_threshold to
+ * their replicas. A slot stops being hot when its rate falls below half
+ * the threshold, so that it doesn't flap around it. */
+static void updateHotSlots(long long now) {
+    long long elapsed = now - proxy.hot_slots_time;
+    if (elapsed < HOT_SLOTS_CHECK_PERIOD) return;
+    int first = (proxy.hot_slots_time == 0), slot, i;
+    uint64_t threshold = (config.hot_slot_threshold > 0 ?
+                          (uint64_t) config.hot_slot_threshold : 0);
+    proxy.hot_slots_time = now;
+    for (slot = 0; slot < CLUSTER_SLOTS; slot++) {
+        uint64_t ops = 0, rate;
+        for (i = 0; i < config.num_threads; i++)
+            ops += proxy.threads[i]->slot_stats[slot].ops;
+        rate = (ops - proxy.hot_slots_ops[slot]) * 1000 / elapsed;
+        proxy.hot_slots_ops[slot] = ops;
+        if (first) continue;
+        if (!proxy.hot_slots[slot]) {
+            if (threshold == 0 || rate < threshold) continue;
+            clusterNode *master = searchNodeBySlot(proxy.cluster, slot);
+            if (master == NULL || master->replicas == NULL) continue;
+            proxy.hot_slots_rate[slot] = rate;
+            proxy.hot_slots[slot] = 1;
+            proxyLogInfo("Slot %d is hot (%llu ops/sec): offloading its "
+                         "reads to the replicas\n", slot,
+                         (unsigned long long) rate);
+        } else {
+            proxy.hot_slots_rate[slot] = rate;
+            if (threshold > 0 && rate >= threshold / 2) continue;
+            proxy.hot_slots[slot] = 0;
+            proxyLogInfo("Slot %d is not hot anymore (%llu ops/sec): its "
+                         "reads go to the master again\n", slot,
+                         (unsigned long long) rate);
+        }
+    }
+}
+
+/* Main thread's cron: it frees the retired cluster's objects and starts a
+ * refresh of the topology either periodically or when a thread requested
+ * it (ie. after a MOVED redirection or a node disconnection). */
+static int proxyCron(struct aeEventLoop *eventLoop, long long id,
+                     void *clientData)
+{
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+    long long now = mstime();
+    freeRetiredClusterObjects(proxy.cluster);
+    freeUnusedCommands();
+    updateHotSlots(now);
+    if (proxy.refresh_ctx != NULL) {
+        if (now - proxy.refresh_start > CLUSTER_REFRESH_TIMEOUT) {
+            proxyLogWarn("Cluster configuration refresh timed out\n");
+            endClusterRefresh(0);
+        }
+        return PROXY_CRON_PERIOD;
+    }
+    long long elapsed = now - proxy.last_refresh;
+    int load_commands = (proxy.commands_refresh_requested &&
+                         now - proxy.commands_refresh_time >=
+                         COMMANDS_REFRESH_MIN_INTERVAL);
+    if (proxy.cluster->refresh_requested) {
+        if (elapsed < CLUSTER_REFRESH_MIN_INTERVAL) return PROXY_CRON_PERIOD;
+    } else if (!load_commands &&
+               (config.cluster_refresh_interval <= 0 ||
+                elapsed < config.cluster_refresh_interval * 1000LL)) {
+        return PROXY_CRON_PERIOD;
+    }
+    proxy.cluster->refresh_requested = 0;
+    startClusterRefresh();
+    return PROXY_CRON_PERIOD;
+}
+
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask)
 {
     UNUSED(el);
@@ -1811,9 +5072,107 @@ void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask)
     }
 }
 
-static int processClusterReplyBuffer(redisContext *ctx, clusterNode *node,
+/* Add or remove the ASKING command in front of the request's buffer,
+ * shifting the arguments' offsets accordingly. */
+static void setRequestAsking(clientRequest *req, int asking) {
+    int shift = strlen(ASKING_COMMAND), i;
+    if (asking == req->asking) return;
+    if (asking) {
+        sds buf = sdsnewlen(ASKING_COMMAND, shift);
+        buf = sdscatsds(buf, req->buffer);
+        sdsfree(req->buffer);
+        req->buffer = buf;
+    } else {
+        sdsrange(req->buffer, shift, -1);
+        shift = -shift;
+    }
+    for (i = 0; i < req->argc; i++) req->offsets[i] += shift;
+    req->asking = asking;
+}
+
+/* Check whether the reply contained in 'buf' is a MOVED or ASK redirection
+ * by just looking at its first bytes, and in that case send the request
+ * again to the node specified by the redirection. After a MOVED
+ * redirection, the slot gets also remapped to the new node, so that the
+ * next requests will directly go to the right node. The request keeps
+ * its ID, so the reply will be still written to the client in the right
+ * order.
+ * Return 1 if the request has been redirected, 0 otherwise (ie. unknown
+ * node or too many redirections): in the latter case the reply should be
+ * forwarded to the client as it is. */
+static int handleClusterRedirection(clientRequest *req, char *buf, size_t len) {
+    int ask = 0;
+    char *end = buf + len;
+    if (len < 6 || buf[0] != '-') return 0;
+    if (len > 7 && memcmp(buf + 1, "MOVED ", 6) == 0) buf += 7;
+    else if (memcmp(buf + 1, "ASK ", 4) == 0) {
+        ask = 1;
+        buf += 5;
+    } else return 0;
+    client *c = req->client;
+    /* Requests bound to their node (ie. the commands of a transaction,
+     * that will be aborted by the node itself) cannot be moved. */
+    if (req->pinned) {
+        if (!ask) requestClusterRefresh();
+        return 0;
+    }
+    if (req->redirections >= MAX_REDIRECTIONS) {
+        proxyLogDebug("Too many redirections for request %llu:%llu\n",
+                      c->id, req->id);
+        return 0;
+    }
+    char *nl = memchr(buf, '\r', end - buf), *sep;
+    if (nl == NULL) return 0;
+    sds target = sdsnewlen(buf, nl - buf);
+    int slot = atoi(target), port = 0;
+    char *addr = strchr(target, ' ');
+    clusterNode *node = NULL;
+    if (addr != NULL && (sep = strrchr(++addr, ':')) != NULL) {
+        *sep = '\0';
+        port = atoi(sep + 1);
+        node = searchNodeByAddress(proxy.cluster, addr, port);
+    }
+    /* Something changed in the cluster, so refresh the topology. */
+    if (!ask) requestClusterRefresh();
+    if (node == NULL) {
+        proxyLogDebug("Could not follow redirection to unknown node: %s\n",
+                      target);
+        sdsfree(target);
+        return 0;
+    }
+    proxyLogDebug("%s redirection for request %llu:%llu to %s:%d\n",
+                  (ask ? "ASK" : "MOVED"), c->id, req->id, node->ip,
+                  node->port);
+    sdsfree(target);
+    if (!ask) remapSlot(proxy.cluster, slot, node);
+    else {
+        int keylen;
+        char *key = getRequestSingleKey(req, &keylen);
+        setSlotImportingNode(proxy.cluster, slot, node);
+        if (key != NULL)
+            addMovedKey(proxy.threads[c->thread_id], slot, key, keylen);
+    }
+    removeHedgeCandidate(req);
+    setRequestAsking(req, ask);
+    req->skip_next_reply = ask;
+    req->redirections++;
+    req->written = 0;
+    req->node = node;
+    req->private_connection = NULL;
+    req->slot = slot;
+    if (!enqueueRequestToSend(req)) {
+        addRequestErrorReply(req, "Could not enqueue request");
+        freeRequest(req, 1);
+        return 1;
+    }
+    handleNextRequestToCluster(node, c->thread_id);
+    return 1;
+}
+
+static int processClusterReplyBuffer(redisClusterConnection *conn,
                                      int thread_id)
 {
+    redisContext *ctx = conn->context;
     char *errmsg = NULL;
     void *_reply = NULL;
     redisReply *reply = NULL;
@@ -1829,15 +5188,15 @@ static int processClusterReplyBuffer(redisContext *ctx, clusterNode *node,
         /* Reply not yet available, just return */
         if (ok && reply == NULL) break;
         replies++;
-        clientRequest *req = getFirstRequestPending(node, thread_id, NULL);
+        clientRequest *req =
+            getFirstQueuedRequest(conn->requests_pending, NULL);
         /* If request is NULL, it's a ghost request that is a NULL
          * placeholder in place of a request created by a freed client
          * (ie. a disconnected client). In this case, just dequeue the list
          * node containing the NULL placeholder and directly skip to
          * 'consume_buffer' in order to process the remaining reply buffer. */
         if (req == NULL) {
-            list *queue =
-                getClusterConnection(node, thread_id)->requests_pending;
+            list *queue = conn->requests_pending;
             /* It should never happen that the request is NULL because of an
              * empty queue while we still have reply buffer to process */
             assert(listLength(queue) > 0);
@@ -1848,25 +5207,61 @@ static int processClusterReplyBuffer(redisContext *ctx, clusterNode *node,
         proxyLogDebug("Reply read complete for request %llu:%llu, %s%s\n",
                       req->client->id, req->id, errmsg ? " ERR: " : "OK!",
                       errmsg ? errmsg : "");
+        /* The reply to the ASKING command sent before the actual request
+         * must be skipped, keeping the request in the queue. */
+        if (req->skip_next_reply && errmsg == NULL) {
+            req->skip_next_reply = 0;
+            req = NULL;
+            goto consume_buffer;
+        }
         dequeuePendingRequest(req);
-        if (errmsg != NULL) addReplyError(req->client, errmsg, req->id);
+        /* The request lost the race against its hedged twin. */
+        if (req->discard_reply) goto consume_buffer;
+        if (errmsg != NULL) addRequestErrorReply(req, errmsg);
         else {
-            proxyLogDebug("Writing reply for request %llu:%llu to client "
-                          "buffer...\n", req->client->id, req->id);
             char *obuf = ctx->reader->buf;
             /*size_t len = ctx->reader->len;*/
             size_t len = ctx->reader->pos;
             if (len > ctx->reader->len) len = ctx->reader->len;
+            /* Errors (ie. redirections) received by the copy of a hedged
+             * request are ignored, the original request will reply. */
+            if (req->is_hedge && req->hedge != NULL && obuf[0] == '-') {
+                req->hedge->hedge = NULL;
+                req->hedge = NULL;
+                goto consume_buffer;
+            }
+            if (req->hedge != NULL) cancelHedgedRequest(req);
+            if (handleClusterRedirection(req, obuf, len)) {
+                req = NULL;
+                goto consume_buffer;
+            }
+            proxyLogDebug("Writing reply for request %llu:%llu to client "
+                          "buffer...\n", req->client->id, req->id);
             if (config.dump_buffer) {
                 sds rstr = sdsnewlen(obuf, len);
                 proxyLogDebug("\nReply for request %llu:%llu:\n%s\n",
                               req->client->id, req->id, rstr);
                 sdsfree(rstr);
             }
-            addReplyRaw(req->client, obuf, len, req->id);
+            proxyThread *thread = proxy.threads[thread_id];
+            if (req->start_time) {
+                latencyHistogramAdd(&(thread->read_latency),
+                                    ustime() - req->start_time);
+            }
+            if (req->held_until) thread->rescued_requests++;
+            if (req->slot != UNDEFINED_SLOT && req->routed_time) {
+                slotStats *stats = thread->slot_stats + req->slot;
+                stats->bytes_out += len;
+                stats->latency += ustime() - req->routed_time;
+            }
+            if (req->parent != NULL) {
+                /* The sub-request takes the ownership of the reply. */
+                setSubRequestReply(req, reply, NULL);
+                reply = NULL;
+            } else addReplyRaw(req->client, obuf, len, req->id);
         }
 consume_buffer:
-        if (config.dump_queues) dumpQueue(node, thread_id, QUEUE_TYPE_PENDING);
+        if (config.dump_queues) dumpQueue(conn, thread_id, QUEUE_TYPE_PENDING);
         /* Consume reader buffer */
         sdsrange(ctx->reader->buf, ctx->reader->pos, -1);
         ctx->reader->pos = 0;
@@ -1875,6 +5270,7 @@ consume_buffer:
         if (req) freeRequest(req, 1);
         if (!ok) break;
     }
+    if (conn->is_private) releasePrivateConnection(conn);
     return replies;
 }
 
@@ -1885,11 +5281,11 @@ static void readClusterReply(aeEventLoop *el, int fd,
     UNUSED(fd);
     proxyThread *thread = el->privdata;
     int thread_id = thread->thread_id;
-    clusterNode *node = privdata;
-    clientRequest *req = getFirstRequestPending(node, thread_id, NULL);
-    redisContext *ctx = getClusterNodeContext(node, thread_id);
-    list *queue =
-        getClusterConnection(node, thread_id)->requests_pending;
+    redisClusterConnection *conn = privdata;
+    clusterNode *node = conn->node;
+    clientRequest *req = getFirstQueuedRequest(conn->requests_pending, NULL);
+    redisContext *ctx = conn->context;
+    list *queue = conn->requests_pending;
     sds errmsg = NULL;
     proxyLogDebug("Reading reply from %s:%d on thread %d...\n",
                   node->ip, node->port, thread_id);
@@ -1907,6 +5303,13 @@ static void readClusterReply(aeEventLoop *el, int fd,
             errmsg = sdsnew("Failed to read reply from ");
         }
         errmsg = sdscatfmt(errmsg, "%s:%u", node->ip, node->port);
+        /* Private connections are just closed, failing their transaction
+         * (idle ones could have been closed by the node's timeout). */
+        if (conn->is_private) {
+            closePrivateConnection(conn, thread_id, errmsg);
+            sdsfree(errmsg);
+            return;
+        }
         /* An error occurred, so dequeue the request. If the request is not
          * NULL, send an error reply to the client and then free the requests
          * itself. If the node is down (node_disconnected), call
@@ -1915,7 +5318,8 @@ static void readClusterReply(aeEventLoop *el, int fd,
          * reply on the same node's socket. */
         if (req != NULL) {
             dequeuePendingRequest(req);
-            addReplyError(req->client, errmsg, req->id);
+            if (node_disconnected) addNodeFailureReply(req, errmsg);
+            else addRequestErrorReply(req, errmsg);
             freeRequest(req, 1);
         } else {
             listNode *first = listFirst(queue);
@@ -1924,11 +5328,12 @@ static void readClusterReply(aeEventLoop *el, int fd,
         if (node_disconnected) {
             proxyLogDebug(errmsg);
             clusterNodeDisconnect(node, thread_id);
+            requestClusterRefresh();
         }
         sdsfree(errmsg);
         /* Exit, since an error occurred. */
         return;
-    } else replies = processClusterReplyBuffer(ctx, node, thread_id);
+    } else replies = processClusterReplyBuffer(conn, thread_id);
     if (errmsg != NULL) sdsfree(errmsg);
 }
 
@@ -1956,9 +5361,186 @@ void daemonize(void) {
     }
 }
 
+#ifdef REDIS_TEST
+#define PARSER_TEST_REQUESTS    1000000
+#define PARSER_TEST_READLEN     (1024*16)
+
+typedef struct parserTestResult {
+    int verify;         /* Checksum the requests, or just count them. */
+    long long requests;
+    uint64_t checksum;
+} parserTestResult;
+
+static uint64_t parserTestHash(uint64_t h, const void *p, size_t len) {
+    const unsigned char *s = p;
+    while (len--) h = (h ^ *(s++)) * 1099511628211ULL;
+    return h;
+}
+
+/* Account a parsed request and free it: freeRequest needs the threads. */
+static void parserTestConsume(clientRequest *req, parserTestResult *res) {
+    uint64_t h = res->checksum;
+    int i;
+    if (!res->verify) goto free_request;
+    h = parserTestHash(h, &req->argc, sizeof(req->argc));
+    h = parserTestHash(h, &req->command, sizeof(req->command));
+    h = parserTestHash(h, &req->keys_slot, sizeof(req->keys_slot));
+    for (i = 0; i < req->argc; i++) {
+        h = parserTestHash(h, &req->lengths[i], sizeof(int));
+        h = parserTestHash(h, req->buffer + req->offsets[i],
+                           req->lengths[i]);
+    }
+    res->checksum = h;
+free_request:
+    res->requests++;
+    if (req->client->current_request == req)
+        req->client->current_request = NULL;
+    if (req->offsets != req->inline_offsets) {
+        zfree(req->offsets);
+        zfree(req->lengths);
+    }
+    sdsfree(req->buffer);
+    setRequestCommand(req, NULL);
+    zfree(req);
+}
+
+/* Feed the pipeline to the parser in chunks, as readQuery does. */
+static int parserTestRun(client *c, sds pipeline, parserTestResult *res) {
+    size_t pos = 0, len = sdslen(pipeline);
+    res->requests = 0;
+    res->checksum = 14695981039346656037ULL;
+    while (pos < len) {
+        size_t readlen = len - pos;
+        if (readlen > PARSER_TEST_READLEN) readlen = PARSER_TEST_READLEN;
+        clientRequest *req = c->current_request;
+        if (req == NULL) req = createRequest(c);
+        req->buffer = sdscatlen(req->buffer, pipeline + pos, readlen);
+        pos += readlen;
+        int status = parseRequest(req);
+        if (status == PARSE_STATUS_ERROR) return 0;
+        /* Requests split from the previous chunk are consumed below. */
+        if (status == PARSE_STATUS_OK &&
+            listSearchKey(c->requests_to_process, req) == NULL)
+            parserTestConsume(req, res);
+        while (listLength(c->requests_to_process) > 0) {
+            listNode *ln = listFirst(c->requests_to_process);
+            req = ln->value;
+            status = parseRequest(req);
+            if (status == PARSE_STATUS_ERROR) return 0;
+            if (status == PARSE_STATUS_INCOMPLETE) break;
+            listDelNode(c->requests_to_process, ln);
+            parserTestConsume(req, res);
+        }
+    }
+    return c->current_request == NULL;
+}
+
+/* Parse a pipeline of the hottest commands with and without the fast
+ * path: both must produce the same requests. */
+static int parserTest(int argc, char **argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+    int i, errors = 0;
+    crc16Init();
+    initConfig();
+    int command_count = sizeof(redisCommandTable) / sizeof(redisCommandDef);
+    for (i = 0; i < command_count; i++)
+        populateCommandFlags(redisCommandTable + i);
+    proxy.commands = NULL;
+    proxy.cluster_commands = NULL;
+    if (!updateCommandIndex()) {
+        printf("parser: FAILED to build the commands index\n");
+        return 1;
+    }
+    initFastCommands();
+    client *c = zcalloc(sizeof(*c));
+    c->requests_to_process = listCreate();
+    sds pipeline = sdsempty();
+    for (i = 0; i < PARSER_TEST_REQUESTS; i++) {
+        char key[32], field[32];
+        int keylen = snprintf(key, sizeof(key), "key:%d", i % 100000);
+        int fieldlen = snprintf(field, sizeof(field), "%d", i);
+        switch (i % 6) {
+        case 0:
+            pipeline = sdscatprintf(pipeline, "*2\r\n$3\r\nGET\r\n"
+                                    "$%d\r\n%s\r\n", keylen, key);
+            break;
+        case 1:
+            pipeline = sdscatprintf(pipeline, "*3\r\n$3\r\nset\r\n"
+                                    "$%d\r\n%s\r\n$%d\r\n%s\r\n",
+                                    keylen, key, fieldlen, field);
+            break;
+        case 2:
+            pipeline = sdscatprintf(pipeline, "*3\r\n$4\r\nhget\r\n"
+                                    "$%d\r\n%s\r\n$%d\r\n%s\r\n",
+                                    keylen, key, fieldlen, field);
+            break;
+        case 3:
+            pipeline = sdscatprintf(pipeline, "*2\r\n$4\r\nIncr\r\n"
+                                    "$%d\r\n%s\r\n", keylen, key);
+            break;
+        case 4:
+            pipeline = sdscatprintf(pipeline, "*3\r\n$6\r\nexpire\r\n"
+                                    "$%d\r\n%s\r\n$2\r\n60\r\n",
+                                    keylen, key);
+            break;
+        default:
+            /* Not a fast command, nor an empty argument. */
+            pipeline = sdscatprintf(pipeline, "*3\r\n$4\r\nHSET\r\n"
+                                    "$%d\r\n%s\r\n$0\r\n\r\n",
+                                    keylen, key);
+            break;
+        }
+    }
+    parserTestResult generic = {1, 0, 0}, fast = {1, 0, 0};
+    fast_requests_enabled = 0;
+    if (!parserTestRun(c, pipeline, &generic)) errors++;
+    fast_requests_enabled = 1;
+    if (!parserTestRun(c, pipeline, &fast)) errors++;
+    if (generic.requests != PARSER_TEST_REQUESTS ||
+        fast.requests != PARSER_TEST_REQUESTS ||
+        generic.checksum != fast.checksum) errors++;
+    /* Benchmark. */
+    generic.verify = fast.verify = 0;
+    fast_requests_enabled = 0;
+    long long start = ustime();
+    if (!parserTestRun(c, pipeline, &generic)) errors++;
+    long long generic_time = ustime() - start;
+    fast_requests_enabled = 1;
+    start = ustime();
+    if (!parserTestRun(c, pipeline, &fast)) errors++;
+    long long fast_time = ustime() - start;
+    printf("parser: %s\n", errors ? "FAILED" : "OK");
+    printf("%d requests (%zu bytes): generic parser %.0f req/s, "
+           "fast path %.0f req/s\n", PARSER_TEST_REQUESTS, sdslen(pipeline),
+           PARSER_TEST_REQUESTS * 1000000.0 / (generic_time ? generic_time : 1),
+           PARSER_TEST_REQUESTS * 1000000.0 / (fast_time ? fast_time : 1));
+    sdsfree(pipeline);
+    listRelease(c->requests_to_process);
+    zfree(c);
+    freeCommandIndex(proxy.commands);
+    return errors ? 1 : 0;
+}
+#endif
+
 int main(int argc, char **argv) {
     int exit_status = 0, i;
+#ifdef REDIS_TEST
+    if (argc >= 3 && !strcasecmp(argv[1], "test")) {
+        if (!strcasecmp(argv[2], "cluster")) return clusterTest(argc, argv);
+        else if (!strcasecmp(argv[2], "crc16")) return crc16Test(argc, argv);
+        else if (!strcasecmp(argv[2], "commands"))
+            return commandsTest(argc, argv);
+        else if (!strcasecmp(argv[2], "latency"))
+            return latencyTest(argc, argv);
+        else if (!strcasecmp(argv[2], "parser"))
+            return parserTest(argc, argv);
+        fprintf(stderr, "Unknown test '%s'\n", argv[2]);
+        return 1;
+    }
+#endif
     printf("Redis Cluster Proxy v%s\n", REDIS_CLUSTER_PROXY_VERSION);
+    crc16Init();
     initConfig();
     int parsed_opts = parseOptions(argc, argv);
     if (parsed_opts >= argc) {
@@ -1980,24 +5562,48 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Failed to allocate memory!\n");
         return 1;
     }
-    if (!fetchClusterConfiguration(proxy.cluster, config.entry_node_host,
-                                   config.entry_node_port,
-                                   config.entry_node_socket)) {
-        fprintf(stderr, "Failed to fetch cluster configuration!\n");
-        return 1;
+    /* Start from the saved snapshot, if any: the configuration will be
+     * verified by a refresh as soon as the proxy starts. */
+    int snapshot_loaded = 0;
+    if (config.cluster_snapshot) {
+        snapshot_loaded = loadClusterSnapshot(proxy.cluster,
+                                              config.cluster_snapshot);
+        if (snapshot_loaded)
+            printf("Cluster configuration loaded from %s\n",
+                   config.cluster_snapshot);
+    }
+    if (!snapshot_loaded) {
+        if (!fetchClusterConfiguration(proxy.cluster, config.entry_node_host,
+                                       config.entry_node_port,
+                                       config.entry_node_socket)) {
+            fprintf(stderr, "Failed to fetch cluster configuration!\n");
+            return 1;
+        }
+        if (config.cluster_snapshot)
+            saveClusterSnapshot(proxy.cluster, config.cluster_snapshot);
     }
     if (config.loglevel == LOGLEVEL_DEBUG) {
-        int j;
-        clusterNode *last_n = NULL;
-        for (j = 0; j < CLUSTER_SLOTS; j++) {
-            clusterNode *n = searchNodeBySlot(proxy.cluster, j);
-            if (n == NULL) {
-                proxyLogErr("NULL node for slot %d\n", j);
-                break;
+        listIter li;
+        listNode *ln;
+        listRewind(proxy.cluster->nodes, &li);
+        while ((ln = listNext(&li)) != NULL) {
+            clusterNode *n = ln->value;
+            int *ranges = NULL, j;
+            int count = clusterNodeGetSlotRanges(n, &ranges);
+            sds msg = sdscatprintf(sdsempty(), "Node %s:%d -> %d slot(s)",
+                                   n->ip, n->port, n->slots_count);
+            for (j = 0; j < count; j++) {
+                msg = sdscatprintf(msg, "%s %d-%d", (j ? "," : ":"),
+                                   ranges[j * 2], ranges[(j * 2) + 1]);
             }
-            if (n != last_n) {
-                last_n = n;
-                proxyLogDebug("Slot %d -> node %d\n", j, n->port);
+            proxyLogDebug("%s\n", msg);
+            sdsfree(msg);
+            zfree(ranges);
+        }
+        for (i = 0; i < CLUSTER_SLOTS; i++) {
+            if (searchNodeBySlot(proxy.cluster, i) == NULL) {
+                proxyLogErr("NULL node for slot %d\n", i);
+                break;
             }
         }
     }
@@ -2020,6 +5626,10 @@ int main(int argc, char **argv) {
     printf("Listening on port %d\n", config.port);
     if (config.daemonize) daemonize();
     initProxy();
+    if (snapshot_loaded) {
+        proxy.cluster->refresh_requested = 1;
+        proxy.last_refresh = 0;
+    }
     for (i = 0; i < proxy.fd_count; i++) {
         if (aeCreateFileEvent(proxy.main_loop, proxy.fds[i], AE_READABLE,
                               acceptTcpHandler, NULL) == AE_ERR) {
@@ -2029,6 +5639,12 @@ int main(int argc, char **argv) {
             goto cleanup;
         }
     }
+    if (aeCreateTimeEvent(proxy.main_loop, 1, proxyCron, NULL, NULL) ==
+        AE_ERR) {
+        proxyLogErr("FATAL: Failed to create the proxy's cron, aborting...\n");
+        exit_status = 1;
+        goto cleanup;
+    }
     aeMain(proxy.main_loop);
 cleanup:
     releaseProxy();
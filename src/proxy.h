@@ -33,11 +33,15 @@
 #define CLIENT_STATUS_NONE          0
 #define CLIENT_STATUS_LINKED        1
 #define CLIENT_STATUS_UNLINKED      2
+#define CLIENT_REPLICA_READS_DEFAULT -1
+#define REQUEST_INLINE_ARGS         4 /* Arguments of a request that don't
+                                       * need offsets/lengths allocations. */
 
 #define getClientLoop(c) (proxy.threads[c->thread_id]->loop)
 
 struct client;
 struct proxyThread;
+struct requestFanout;
 
 typedef struct clientRequest{
     struct client *client;
@@ -52,12 +56,53 @@ typedef struct clientRequest{
     int *offsets;
     int *lengths;
     int offsets_size;
+    int inline_offsets[REQUEST_INLINE_ARGS]; /* Initial storage of offsets */
+    int inline_lengths[REQUEST_INLINE_ARGS]; /* and lengths. */
     int slot;
     clusterNode *node;
     struct redisCommandDef *command;
+    int flags;                   /* Flags of the command (CMD_*), so that
+                                  * they can be checked by every subsystem
+                                  * without looking at the command. */
     size_t written;
     int parsing_status;
     int has_write_handler;
+    int redirections;    /* Number of MOVED/ASK redirections followed. */
+    int asking;          /* Buffer is prefixed by an ASKING command. */
+    int skip_next_reply; /* Next reply is the one of the ASKING prefix. */
+    long long start_time;        /* Time (us) the request has been sent to
+                                  * its node, only tracked for hedgeable
+                                  * requests. */
+    struct clientRequest *hedge; /* Twin of a hedged request: the first one
+                                  * getting a reply wins. */
+    int is_hedge;                /* Request is the copy sent to a replica. */
+    int discard_reply;           /* Reply must be discarded (request lost
+                                  * the race while still writing). */
+    listNode *hedge_node;        /* Node in the thread's hedge candidates. */
+    long long held_until;        /* Time (ms) a request that could not be
+                                 * sent to its unreachable node is held
+                                 * until, waiting for a failover. It's 0 if
+                                 * the request has never been held. */
+    listNode *held_node;         /* Node in the thread's held requests. */
+    long long routed_time;       /* Time (us) the request has been routed to
+                                  * the cluster, used by the slot stats. */
+    int keys_slot;               /* Slot of the keys hashed while parsing
+                                  * the request. */
+    int keys_hashed;             /* Number of keys hashed while parsing. */
+    int keys_cross_slot;         /* Keys hashed while parsing belong to
+                                  * different slots. */
+    struct clientRequest *parent;/* Request this sub-request is part of,
+                                  * until it gets its reply (see the
+                                  * fan-out in proxy.c). */
+    int fanout_index;            /* Index among the parent's sub-requests */
+    struct requestFanout *fanout;/* Sub-requests of a split request. */
+    int pinned;                  /* Request bound to its node, that cannot
+                                  * be routed again (ie. the sub-requests of
+                                  * a broadcast). */
+    redisClusterConnection *private_connection; /* Private connection of
+                                                 * the client's transaction
+                                                 * the request is sent to,
+                                                 * NULL for the shared one. */
 } clientRequest;
 
 typedef struct {
@@ -69,8 +114,35 @@ typedef struct {
     char neterr[ANET_ERR_LEN];
     struct proxyThread **threads;
     _Atomic uint64_t numclients;
-    rax *commands;
+    redisCommandIndex *_Atomic commands; /* Replaced by the main thread
+                                          * and retired like the topology
+                                          * objects. */
+    rax *cluster_commands;       /* Commands reported by the cluster that are
+                                  * not in the command table. */
+    list *replaced_commands;     /* Commands reported by the cluster that
+                                  * have been replaced or removed, kept until
+                                  * no request uses them. */
+    _Atomic int commands_refresh_requested; /* Load the commands from the
+                                             * cluster at the next refresh */
+    int refresh_commands_pending;/* COMMAND sent by the current refresh. */
+    int refresh_nodes_done;      /* CLUSTER NODES reply of the current
+                                  * refresh already read. */
+    long long commands_refresh_time; /* Time (ms) of the last COMMAND. */
     int min_reserved_fds;
+    redisContext *refresh_ctx;   /* Connection used to refresh the cluster's
+                                  * topology, if a refresh is in progress. */
+    int refresh_auth_pending;    /* AUTH reply still to be read. */
+    int refresh_node_index;      /* Node to query for the next refresh. */
+    long long refresh_start;     /* Start time (ms) of the current refresh. */
+    long long last_refresh;      /* End time (ms) of the last refresh. */
+    unsigned char *hot_slots;    /* Slots whose reads are offloaded to the
+                                  * replicas because of their request rate.
+                                  * Only changed by the main thread. */
+    uint64_t *hot_slots_rate;    /* Last request rate (ops/sec) of every
+                                  * slot, only tracked for the hot ones. */
+    uint64_t *hot_slots_ops;     /* Operations of every slot at the last
+                                  * check. */
+    long long hot_slots_time;    /* Time (ms) of the last check. */
 } redisClusterProxy;
 
 typedef struct client {
@@ -90,10 +162,26 @@ typedef struct client {
     list *requests_to_process;       /* Requests not completely parsed */
     int requests_with_write_handler; /* Number of request that are still
                                       * being writing to cluster */
+    int replica_reads;               /* Set by READONLY (1) and READWRITE
+                                      * (0), otherwise it's
+                                      * CLIENT_REPLICA_READS_DEFAULT and the
+                                      * global config is used. */
+    uint64_t close_after_reply;      /* Set by QUIT to its request ID + 1:
+                                      * the client is closed as soon as the
+                                      * reply has been written. */
+    struct clientRequest *scan_prefetch; /* Next page of a SCAN, requested
+                                          * in advance. */
+    int multi;                       /* Client is in a transaction. */
+    int multi_slot;                  /* Slot of the transaction's keys. */
+    int multi_error;                 /* A command of the transaction has
+                                      * been rejected: EXEC will fail. */
+    redisClusterConnection *multi_connection; /* Private connection the
+                                               * transaction is sent to. */
 } client;
 
 void freeRequest(clientRequest *req, int delete_from_lists);
 void freeRequestList(list *request_list);
 void onClusterNodeDisconnection(clusterNode *node, int thread_id);
+void onClusterNodeRetired(clusterNode *node, int thread_id);
 
 #endif /* __REDIS_CLUSTER_PROXY_H__ */
@@ -24,7 +24,9 @@ load File.join($redis_proxy_test_dir, 'lib/test.rb')
 $tests = ARGV
 if $tests.length == 0
     $tests = %w(basic basic_commands pipeline client_disconnect node_down
-                proxy_command)
+                proxy_command replica_reads slot_migration movable_keys
+                keyless_commands cross_slot
+                broadcast scan transactions failover)
 end
 
 def final_cleanup
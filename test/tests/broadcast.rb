@@ -0,0 +1,70 @@
+require 'redis'
+require 'hiredis'
+
+setup {
+    @aux_cluster = RedisCluster.new
+    @aux_cluster.restart
+    @aux_proxy = RedisClusterProxy.new @aux_cluster
+    @aux_proxy.start
+}
+
+cleanup {
+    @aux_proxy.stop
+    @aux_proxy = nil
+    @aux_cluster.stop
+    @aux_cluster = nil
+}
+
+$numkeys = 100
+
+def masters(cluster)
+    cluster.nodes.select{|node| !node[:replicate]}
+end
+
+test "SET #{$numkeys} keys" do
+    (0...$numkeys).each{|n|
+        reply = @aux_proxy.redis_command(:set, "broadcast:#{n}", n.to_s)
+        assert_equal(reply, 'OK')
+    }
+end
+
+test "DBSIZE" do
+    reply = @aux_proxy.redis_command(:dbsize)
+    assert_equal(reply, $numkeys)
+end
+
+test "KEYS" do
+    reply = @aux_proxy.redis_command(:keys, 'broadcast:*')
+    assert_not_redis_err(reply)
+    expected = (0...$numkeys).map{|n| "broadcast:#{n}"}
+    assert_equal(reply.sort, expected.sort)
+end
+
+test "INFO" do
+    reply = @aux_proxy.redis_command(:call, 'info', 'keyspace')
+    assert_not_redis_err(reply)
+    keys = reply[/db0:keys=(\d+)/, 1].to_i
+    assert_equal(keys, $numkeys)
+end
+
+test "Slow masters make broadcasts time out" do
+    reply = @aux_proxy.proxy('config', 'set', 'broadcast-timeout', '500')
+    assert_equal(reply, 'OK')
+    node = masters(@aux_cluster).first
+    sleeper = Thread.new{
+        @aux_cluster.redis_command(node, 'debug sleep 2')
+    }
+    sleep 0.2
+    reply = @aux_proxy.redis_command(:dbsize)
+    assert_redis_err(reply)
+    sleeper.join
+    reply = @aux_proxy.redis_command(:dbsize)
+    assert_equal(reply, $numkeys)
+end
+
+test "FLUSHALL" do
+    reply = @aux_proxy.redis_command(:flushall)
+    assert_equal(reply, 'OK')
+    reply = @aux_proxy.redis_command(:dbsize)
+    assert_equal(reply, 0)
+end
@@ -0,0 +1,51 @@
+setup &RedisProxyTestCase::GenericSetup
+
+$numkeys = 100
+$keys = (0...$numkeys).map{|n| "cross_slot:#{n}"}
+
+test "MSET with keys of different slots" do
+    args = $keys.each_with_index.map{|key, n| [key, n.to_s]}.flatten
+    reply = $main_proxy.redis_command(:mset, *args)
+    assert_equal(reply, 'OK')
+end
+
+test "MGET with keys of different slots" do
+    reply = $main_proxy.redis_command(:mget, *$keys, 'cross_slot:missing')
+    assert_not_redis_err(reply)
+    assert_equal(reply.length, $numkeys + 1)
+    (0...$numkeys).each{|n| assert_equal(reply[n], n.to_s)}
+    assert_equal(reply[$numkeys], nil)
+end
+
+test "EXISTS and TOUCH with keys of different slots" do
+    reply = $main_proxy.redis_command(:call, 'exists', *$keys, $keys[0],
+                                      'cross_slot:missing')
+    assert_equal(reply, $numkeys + 1)
+    reply = $main_proxy.redis_command(:call, 'touch', *$keys)
+    assert_equal(reply, $numkeys)
+end
+
+test "Pipelined MGET keeps the order of the replies" do
+    spawn_clients(1){|client, idx|
+        replies = client.pipelined{
+            (0...10).each{|n|
+                client.get($keys[n])
+                client.mget(*$keys[n, 10])
+            }
+        }
+        (0...10).each{|n|
+            assert_equal(replies[n * 2], n.to_s)
+            assert_equal(replies[n * 2 + 1], (n...(n + 10)).map(&:to_s))
+        }
+    }
+end
+
+test "DEL and UNLINK with keys of different slots" do
+    half = $numkeys / 2
+    reply = $main_proxy.redis_command(:call, 'del', *$keys[0, half])
+    assert_equal(reply, half)
+    reply = $main_proxy.redis_command(:call, 'unlink', *$keys)
+    assert_equal(reply, $numkeys - half)
+    reply = $main_proxy.redis_command(:call, 'exists', *$keys)
+    assert_equal(reply, 0)
+end
@@ -0,0 +1,57 @@
+require 'redis'
+require 'hiredis'
+
+setup {
+    @aux_cluster = RedisCluster.new
+    @aux_cluster.restart
+    @aux_proxy = RedisClusterProxy.new @aux_cluster, failover_hold_time: 10000,
+                                       log_level: 'debug'
+    @aux_proxy.start
+}
+
+cleanup {
+    @aux_proxy.stop
+    @aux_proxy = nil
+    @aux_cluster.stop
+    @aux_cluster = nil
+}
+
+$numclients = 5
+$key = 'failover:key'
+
+def rescued_requests(proxy)
+    stats = Hash[*proxy.proxy('stats')]
+    stats['rescued_requests']
+end
+
+test "Requests to a failed master are rescued by the failover" do
+    reply = @aux_proxy.redis_command(:set, $key, 'before')
+    assert_not_redis_err(reply)
+    rescued = rescued_requests(@aux_proxy)
+    master = @aux_cluster.node_for_key($key)
+    replica = @aux_cluster.node_replicas(master).first
+    assert_not_nil(replica, "Master :#{master[:port]} has no replicas")
+    @aux_cluster.stop_instance(master, quiet: true)
+    # Give the proxy the time to notice the disconnection, so that the
+    # requests are held instead of being written to the dead master.
+    sleep 0.5
+    clients = (0...$numclients).map{|idx|
+        Thread.new{
+            client = Redis.new port: @aux_proxy.port
+            redis_command client, :get, $key
+        }
+    }
+    sleep 1
+    reply = @aux_cluster.redis_command(replica, 'cluster failover takeover')
+    assert_match(reply, /ok/i)
+    clients.each{|t|
+        reply = t.value
+        assert_not_redis_err(reply)
+        assert_equal(reply, 'before')
+    }
+    assert(rescued_requests(@aux_proxy) >= rescued + $numclients,
+           "Expected at least #{$numclients} more rescued requests")
+    reply = @aux_proxy.redis_command(:set, $key, 'after')
+    assert_not_redis_err(reply)
+    assert_equal(@aux_proxy.redis_command(:get, $key), 'after')
+end
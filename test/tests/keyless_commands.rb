@@ -0,0 +1,61 @@
+setup &RedisProxyTestCase::GenericSetup
+
+def command_calls(cluster, node, command)
+    stats = cluster.redis_command(node, 'info commandstats')
+    stats[/cmdstat_#{command}:calls=(\d+)/, 1].to_i
+end
+
+def masters(cluster)
+    cluster.nodes.select{|node| !node[:replicate]}
+end
+
+test "PING, ECHO and SELECT are answered by the proxy" do
+    calls = masters($main_cluster).map{|node|
+        command_calls($main_cluster, node, 'ping')
+    }
+    (1..10).each{
+        reply = $main_proxy.redis_command(:ping)
+        assert_equal(reply, 'PONG')
+    }
+    reply = $main_proxy.redis_command(:call, 'ping', 'hello')
+    assert_equal(reply, 'hello')
+    reply = $main_proxy.redis_command(:echo, 'hello world')
+    assert_equal(reply, 'hello world')
+    reply = $main_proxy.redis_command(:select, 0)
+    assert_equal(reply, 'OK')
+    reply = $main_proxy.redis_command(:select, 1)
+    assert_redis_err(reply)
+    masters($main_cluster).each_with_index{|node, idx|
+        assert_equal(command_calls($main_cluster, node, 'ping'), calls[idx])
+    }
+end
+
+test "COMMAND" do
+    reply = $main_proxy.redis_command(:call, 'command', 'count')
+    assert_not_redis_err(reply)
+    assert(reply > 0, "Expected commands, got #{reply}")
+    reply = $main_proxy.redis_command(:call, 'command', 'info', 'get', 'nosuch')
+    assert_not_redis_err(reply)
+    assert_equal(reply[0][0], 'get')
+    assert_equal(reply[0][3], 1)
+    assert_equal(reply[1], nil)
+end
+
+test "TIME is spread across the masters" do
+    calls = masters($main_cluster).map{|node|
+        command_calls($main_cluster, node, 'time')
+    }
+    (1..30).each{
+        reply = $main_proxy.redis_command(:time)
+        assert_not_redis_err(reply)
+    }
+    masters($main_cluster).each_with_index{|node, idx|
+        count = command_calls($main_cluster, node, 'time') - calls[idx]
+        assert(count > 0, "No TIME calls on node #{node[:port]}")
+    }
+end
+
+test "QUIT" do
+    client = Redis.new port: $main_proxy.port
+    assert_equal(client.call('quit'), 'OK')
+end
@@ -0,0 +1,72 @@
+setup &RedisProxyTestCase::GenericSetup
+
+$tag = '{movable}'
+
+def movable_command(*args)
+    $main_proxy.redis_command(:call, *args)
+end
+
+test "EVAL with keys" do
+    reply = movable_command('eval', "redis.call('set', KEYS[1], ARGV[1]) " +
+                            "return redis.call('get', KEYS[2])", 2,
+                            "#{$tag}:a", "#{$tag}:a", 'val')
+    assert_not_redis_err(reply)
+    assert_equal(reply, 'val')
+end
+
+test "EVAL without keys" do
+    reply = movable_command('eval', 'return 1', 0)
+    assert_not_redis_err(reply)
+    assert_equal(reply, 1)
+end
+
+test "EVAL with a wrong number of keys" do
+    reply = movable_command('eval', 'return 1', 3, "#{$tag}:a")
+    assert_redis_err(reply)
+end
+
+test "ZUNIONSTORE and ZINTERSTORE" do
+    movable_command('zadd', "#{$tag}:z1", 1, 'a', 2, 'b')
+    movable_command('zadd', "#{$tag}:z2", 3, 'b', 4, 'c')
+    reply = movable_command('zunionstore', "#{$tag}:u", 2,
+                            "#{$tag}:z1", "#{$tag}:z2")
+    assert_not_redis_err(reply)
+    assert_equal(reply, 3)
+    reply = movable_command('zinterstore', "#{$tag}:i", 2,
+                            "#{$tag}:z1", "#{$tag}:z2", 'weights', 1, 2)
+    assert_not_redis_err(reply)
+    assert_equal(reply, 1)
+end
+
+test "XREAD and XREADGROUP" do
+    movable_command('xadd', "#{$tag}:s1", '1-1', 'f', 'v1')
+    movable_command('xadd', "#{$tag}:s2", '1-1', 'f', 'v2')
+    reply = movable_command('xread', 'count', 10, 'streams',
+                            "#{$tag}:s1", "#{$tag}:s2", 0, 0)
+    assert_not_redis_err(reply)
+    assert_equal(reply.length, 2)
+    reply = movable_command('xgroup', 'create', "#{$tag}:s1", 'g', 0)
+    assert_not_redis_err(reply)
+    reply = movable_command('xreadgroup', 'group', 'g', 'c', 'streams',
+                            "#{$tag}:s1", '>')
+    assert_not_redis_err(reply)
+    assert_equal(reply.length, 1)
+end
+
+test "GEORADIUS with STORE" do
+    movable_command('geoadd', "#{$tag}:geo", 13.361389, 38.115556, 'a')
+    reply = movable_command('georadius', "#{$tag}:geo", 15, 37, 200, 'km',
+                            'store', "#{$tag}:geodst")
+    assert_not_redis_err(reply)
+    assert_equal(reply, 1)
+end
+
+test "SORT with STORE" do
+    movable_command('rpush', "#{$tag}:list", 3, 1, 2)
+    reply = movable_command('sort', "#{$tag}:list", 'limit', 0, 2,
+                            'store', "#{$tag}:sorted")
+    assert_not_redis_err(reply)
+    assert_equal(reply, 2)
+    reply = movable_command('lrange', "#{$tag}:sorted", 0, -1)
+    assert_equal(reply, ['1', '2'])
+end
@@ -27,7 +27,8 @@ def is_down_err(reply)
     reply = reply.to_s
     reply = reply.downcase
     (!reply['cluster node disconnected'].nil? ||
-    !reply['could not connect to node'].nil?)
+    !reply['could not connect to node'].nil? ||
+    !reply['cluster node unreachable'].nil?)
 end
 
 down_node_mutex = Mutex.new
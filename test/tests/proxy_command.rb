@@ -14,3 +14,101 @@ test "PROXY CONFIG GET" do
         assert_equal(reply[1].to_i, val.to_i)
     }
 end
+
+test "PROXY CONFIG SET failover-hold-time" do
+    reply = $main_proxy.proxy('config', 'set', 'failover-hold-time', '500')
+    assert_equal(reply, 'OK')
+    reply = $main_proxy.proxy('config', 'get', 'failover-hold-time')
+    assert_equal(reply[1].to_i, 500)
+    reply = $main_proxy.proxy('config', 'set', 'failover-hold-time', '2000')
+    assert_equal(reply, 'OK')
+end
+
+test "PROXY CONFIG SET rejects invalid values" do
+    invalid = {
+        'private-connections' => ['0', '-1'],
+        'broadcast-timeout' => ['-1', 'abc'],
+        'failover-hold-time' => ['-1'],
+        'hot-slot-threshold' => ['-1', '10x'],
+        'hedge-reads-percentile' => ['-1', '101'],
+        'hedge-reads-min-delay' => ['-1']
+    }
+    invalid.each{|opt, values|
+        before = $main_proxy.proxy('config', 'get', opt)
+        values.each{|val|
+            reply = $main_proxy.redis_command(:proxy, 'config', 'set',
+                                              opt, val)
+            assert_redis_err(reply)
+        }
+        assert_equal($main_proxy.proxy('config', 'get', opt), before)
+    }
+end
+
+test "PROXY STATS" do
+    reply = $main_proxy.proxy('stats')
+    assert_not_redis_err(reply)
+    stats = Hash[*reply]
+    ['rescued_requests', 'failed_requests'].each{|name|
+        assert(stats[name].is_a?(Integer), "Missing '#{name}' in PROXY STATS")
+    }
+end
+
+test "PROXY SLOTSTATS" do
+    key = 'slotstats:key'
+    slot = RedisCluster::slot_for_key(key)
+    (1..10).each{|n|
+        reply = $main_proxy.redis_command(:set, key, n.to_s)
+        assert_not_redis_err(reply)
+    }
+    reply = $main_proxy.proxy('slotstats', 'top', '1')
+    assert_not_redis_err(reply)
+    assert_equal(reply.length, 1)
+    top_slot, metrics = reply[0]
+    metrics = Hash[*metrics]
+    assert_equal(top_slot, slot)
+    assert(metrics['ops'] >= 10, "Expected at least 10 ops on slot #{slot}")
+    ['bytes-in', 'bytes-out', 'latency'].each{|name|
+        assert(metrics[name] > 0, "Expected some '#{name}' on slot #{slot}")
+    }
+end
+
+test "PROXY HOTSLOTS" do
+    reply = $main_proxy.proxy('config', 'get', 'hot-slot-threshold')
+    assert_equal(reply[1].to_i, 0)
+    reply = $main_proxy.proxy('hotslots')
+    assert_not_redis_err(reply)
+    assert_equal(reply, [])
+end
+
+test "PROXY HOTSLOTS reports the slots over the threshold" do
+    key = 'hotslots:key'
+    slot = RedisCluster::slot_for_key(key)
+    reply = $main_proxy.proxy('config', 'set', 'hot-slot-threshold', '100')
+    assert_equal(reply, 'OK')
+    begin
+        assert_not_redis_err($main_proxy.redis_command(:set, key, 'hot'))
+        # The rates are computed every second, drive the reads for a few
+        # periods.
+        hot = nil
+        deadline = Time.now + 5
+        while Time.now < deadline
+            (1..100).each{
+                assert_equal($main_proxy.redis_command(:get, key), 'hot')
+            }
+            hot = $main_proxy.proxy('hotslots').find{|s, rate| s == slot}
+            break if hot
+        end
+        assert(hot != nil, "Expected slot #{slot} in PROXY HOTSLOTS")
+        assert(hot[1] >= 100, "Expected a rate >= 100, got #{hot[1]}")
+        # Without load the slot leaves the list.
+        deadline = Time.now + 5
+        while Time.now < deadline
+            hot = $main_proxy.proxy('hotslots').find{|s, rate| s == slot}
+            break if !hot
+            sleep 0.2
+        end
+        assert(hot == nil, "Expected slot #{slot} to leave PROXY HOTSLOTS")
+    ensure
+        $main_proxy.proxy('config', 'set', 'hot-slot-threshold', '0')
+    end
+end
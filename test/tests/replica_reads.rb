@@ -0,0 +1,76 @@
+require 'redis'
+require 'hiredis'
+
+setup {
+    @aux_cluster = RedisCluster.new
+    @aux_cluster.restart
+    @aux_proxy = RedisClusterProxy.new @aux_cluster, read_from_replicas: true,
+                                       threads: 2
+    @aux_proxy.start
+}
+
+cleanup {
+    @aux_proxy.stop
+    @aux_proxy = nil
+    @aux_cluster.stop
+    @aux_cluster = nil
+}
+
+$numkeys = 100
+
+def replica_reads(cluster)
+    cluster.nodes.select{|node| node[:replicate]}.map{|node|
+        stats = cluster.redis_command(node, 'info commandstats')
+        calls = stats[/cmdstat_get:calls=(\d+)/, 1]
+        calls.to_i
+    }.reduce(0, :+)
+end
+
+test "SET #{$numkeys} keys" do
+    spawn_clients(1, proxy: @aux_proxy){|client, idx|
+        (0...$numkeys).each{|n|
+            reply = redis_command client, :set, "k:#{n}", n.to_s
+            assert_not_redis_err(reply)
+        }
+    }
+end
+
+test "GET #{$numkeys} keys from replicas" do
+    reads = replica_reads(@aux_cluster)
+    spawn_clients(1, proxy: @aux_proxy){|client, idx|
+        (0...$numkeys).each{|n|
+            reply = redis_command client, :get, "k:#{n}"
+            assert_not_redis_err(reply)
+            assert_equal(reply, n.to_s)
+        }
+    }
+    reads = replica_reads(@aux_cluster) - reads
+    assert(reads == $numkeys,
+           "Expected #{$numkeys} reads served by replicas, got #{reads}")
+end
+
+test "GET #{$numkeys} keys from masters after READWRITE" do
+    reads = replica_reads(@aux_cluster)
+    spawn_clients(1, proxy: @aux_proxy){|client, idx|
+        reply = redis_command client, :call, 'readwrite'
+        assert_equal(reply, 'OK')
+        (0...$numkeys).each{|n|
+            reply = redis_command client, :get, "k:#{n}"
+            assert_not_redis_err(reply)
+            assert_equal(reply, n.to_s)
+        }
+    }
+    reads = replica_reads(@aux_cluster) - reads
+    assert(reads == 0, "Expected no reads served by replicas, got #{reads}")
+end
+
+test "PROXY CONFIG SET replica-read-policy" do
+    reply = @aux_proxy.proxy('config', 'set', 'replica-read-policy',
+                             'least-outstanding')
+    assert_equal(reply, 'OK')
+    reply = @aux_proxy.proxy('config', 'get', 'replica-read-policy')
+    assert_equal(reply, 'least-outstanding')
+    reply = @aux_proxy.redis_command(:proxy, 'config', 'set',
+                                     'replica-read-policy', 'random')
+    assert_redis_err(reply)
+end
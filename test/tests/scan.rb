@@ -0,0 +1,44 @@
+setup &RedisProxyTestCase::GenericSetup
+
+$numkeys = 1000
+
+def scan_all(proxy, *args)
+    keys = []
+    cursor = '0'
+    loop {
+        reply = proxy.redis_command(:call, 'scan', cursor, *args)
+        assert_not_redis_err(reply)
+        cursor, page = reply
+        keys += page
+        break if cursor == '0'
+    }
+    keys
+end
+
+test "SET #{$numkeys} keys" do
+    (0...$numkeys).each{|n|
+        reply = $main_proxy.redis_command(:set, "scan:#{n}", n.to_s)
+        assert_equal(reply, 'OK')
+    }
+end
+
+test "SCAN returns the keys of all the masters" do
+    keys = scan_all($main_proxy, 'match', 'scan:*', 'count', '100')
+    expected = (0...$numkeys).map{|n| "scan:#{n}"}
+    assert_equal(keys.uniq.sort, expected.sort)
+end
+
+test "SCAN with prefetching" do
+    reply = $main_proxy.proxy('config', 'set', 'scan-prefetch', '1')
+    assert_equal(reply, 'OK')
+    keys = scan_all($main_proxy, 'match', 'scan:*', 'count', '10')
+    expected = (0...$numkeys).map{|n| "scan:#{n}"}
+    assert_equal(keys.uniq.sort, expected.sort)
+    reply = $main_proxy.proxy('config', 'set', 'scan-prefetch', '0')
+    assert_equal(reply, 'OK')
+end
+
+test "SCAN with an invalid cursor" do
+    reply = $main_proxy.redis_command(:call, 'scan', 'abc')
+    assert_redis_err(reply)
+end
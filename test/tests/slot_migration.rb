@@ -0,0 +1,76 @@
+require 'redis'
+require 'hiredis'
+
+setup {
+    @aux_cluster = RedisCluster.new
+    @aux_cluster.restart
+    @aux_proxy = RedisClusterProxy.new @aux_cluster
+    @aux_proxy.start
+}
+
+cleanup {
+    @aux_proxy.stop
+    @aux_proxy = nil
+    @aux_cluster.stop
+    @aux_cluster = nil
+}
+
+$numkeys = 50
+$tag = '{migrating}'
+
+def get_calls(cluster, node)
+    stats = cluster.redis_command(node, 'info commandstats')
+    stats[/cmdstat_get:calls=(\d+)/, 1].to_i
+end
+
+def get_all_keys(proxy)
+    spawn_clients(1, proxy: proxy){|client, idx|
+        (0...$numkeys).each{|n|
+            reply = redis_command client, :get, "#{$tag}:#{n}"
+            assert_not_redis_err(reply)
+            assert_equal(reply, n.to_s)
+        }
+    }
+end
+
+test "SET #{$numkeys} keys in the same slot" do
+    spawn_clients(1, proxy: @aux_proxy){|client, idx|
+        (0...$numkeys).each{|n|
+            reply = redis_command client, :set, "#{$tag}:#{n}", n.to_s
+            assert_not_redis_err(reply)
+        }
+    }
+end
+
+test "Migrate half of the keys" do
+    slot = RedisCluster::slot_for_key($tag)
+    @src = @aux_cluster.node_for_key($tag)
+    @dst = @aux_cluster.nodes.find{|node|
+        !node[:replicate] && node[:name] != @src[:name]
+    }
+    reply = @aux_cluster.redis_command(@dst, "cluster setslot #{slot} " +
+                                             "importing #{@src[:name]}")
+    assert_equal(reply.strip, 'OK')
+    reply = @aux_cluster.redis_command(@src, "cluster setslot #{slot} " +
+                                             "migrating #{@dst[:name]}")
+    assert_equal(reply.strip, 'OK')
+    keys = (0...($numkeys / 2)).map{|n| "'#{$tag}:#{n}'"}.join(' ')
+    reply = @aux_cluster.redis_command(@src, "migrate 127.0.0.1 " +
+                                             "#{@dst[:port]} '' 0 5000 " +
+                                             "keys #{keys}")
+    assert_equal(reply.strip, 'OK')
+end
+
+test "GET #{$numkeys} keys during the migration" do
+    get_all_keys(@aux_proxy)
+end
+
+test "Moved keys are requested directly to the importing node" do
+    calls = get_calls(@aux_cluster, @src)
+    get_all_keys(@aux_proxy)
+    calls = get_calls(@aux_cluster, @src) - calls
+    expected = $numkeys - ($numkeys / 2)
+    assert(calls == expected,
+           "Expected #{expected} GET calls on the migrating node, " +
+           "got #{calls}")
+end
@@ -0,0 +1,86 @@
+setup &RedisProxyTestCase::GenericSetup
+
+$tag = '{transactions}'
+
+test "MULTI/EXEC with keys of the same slot" do
+    spawn_clients(1){|client, idx|
+        redis_command(client, :del, "#{$tag}:b")
+        replies = client.multi{
+            client.set("#{$tag}:a", '1')
+            client.incr("#{$tag}:b")
+            client.get("#{$tag}:a")
+        }
+        assert_equal(replies, ['OK', 1, '1'])
+    }
+end
+
+test "Pipelined MULTI/EXEC from many clients" do
+    spawn_clients(10){|client, idx|
+        redis_command(client, :del, "{transactions:#{idx}}:counter")
+        (0...50).each{|n|
+            key = "{transactions:#{idx}}:#{n}"
+            replies = client.pipelined{
+                client.multi
+                client.set(key, n.to_s)
+                client.incr("{transactions:#{idx}}:counter")
+                client.exec
+                client.get(key)
+            }
+            assert_equal(replies[0], 'OK')
+            assert_equal(replies[3], ['OK', n + 1])
+            assert_equal(replies[4], n.to_s)
+        }
+    }
+end
+
+test "DISCARD" do
+    spawn_clients(1){|client, idx|
+        assert_equal(redis_command(client, :call, 'multi'), 'OK')
+        reply = redis_command(client, :call, 'set', "#{$tag}:a", '2')
+        assert_equal(reply, 'QUEUED')
+        assert_equal(redis_command(client, :call, 'discard'), 'OK')
+        assert_equal(redis_command(client, :get, "#{$tag}:a"), '1')
+    }
+end
+
+test "EXEC fails with keys of different slots" do
+    spawn_clients(1){|client, idx|
+        assert_equal(redis_command(client, :call, 'multi'), 'OK')
+        reply = redis_command(client, :call, 'set', "#{$tag}:a", '3')
+        assert_equal(reply, 'QUEUED')
+        reply = redis_command(client, :call, 'set', "{other}:a", '3')
+        assert_redis_err(reply)
+        reply = redis_command(client, :call, 'exec')
+        assert_redis_err(reply)
+        assert_equal(redis_command(client, :get, "#{$tag}:a"), '1')
+    }
+end
+
+test "EXEC fails with commands answered by the proxy" do
+    spawn_clients(1){|client, idx|
+        assert_equal(redis_command(client, :call, 'multi'), 'OK')
+        reply = redis_command(client, :call, 'set', "#{$tag}:a", '4')
+        assert_equal(reply, 'QUEUED')
+        assert_redis_err(redis_command(client, :call, 'ping'))
+        assert_redis_err(redis_command(client, :call, 'exec'))
+        assert_equal(redis_command(client, :get, "#{$tag}:a"), '1')
+    }
+end
+
+test "MULTI errors" do
+    spawn_clients(1){|client, idx|
+        assert_redis_err(redis_command(client, :call, 'exec'))
+        assert_redis_err(redis_command(client, :call, 'discard'))
+        assert_equal(redis_command(client, :call, 'multi'), 'OK')
+        assert_redis_err(redis_command(client, :call, 'multi'))
+        assert_equal(redis_command(client, :call, 'exec'), [])
+    }
+end
+
+test "WATCH and UNWATCH are rejected" do
+    spawn_clients(1){|client, idx|
+        reply = redis_command(client, :call, 'watch', "#{$tag}:a")
+        assert_redis_err(reply)
+        assert_redis_err(redis_command(client, :call, 'unwatch'))
+    }
+end